@@ -0,0 +1,469 @@
+#include "async_log.h"
+
+#include <ctype.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define LOG_RING_LEN (256 << 10)
+#define LOG_DEFAULT_RATE 10000
+#define LOG_DRAIN_MS 1
+#define LOG_IDLE_WAIT_MS 1000
+
+// A thread's ring. Only the owner moves head and only the drain moves tail; a record that does
+// not fit before the end is preceded by padding (site 0) up to the end.
+struct Ring {
+    char *buf;
+    std::atomic<uint64_t> head{0};
+    std::atomic<uint64_t> tail{0};
+    uint64_t reserved = 0;           // where the record being written starts
+    std::atomic<uint64_t> lost{0};   // records that did not fit
+    uint64_t lost_reported = 0;      // by the drain
+    std::atomic<bool> orphaned{false}; // the owner has exited
+    uint64_t thread;
+};
+
+// Every ring and call site, and the drain thread's output. Never freed, other threads may log
+// while the process exits.
+struct Logger {
+    std::mutex mtx;
+    std::vector<Ring *> rings;
+    std::vector<LogSite *> sites;
+
+    // the drain waits on `wake` once the rings are empty, see commit
+    std::mutex wake_mtx;
+    std::condition_variable wake;
+    std::atomic<bool> idle{false};
+
+    std::mutex drain_mtx;
+    FILE *out = nullptr;
+    bool binary = false;
+    size_t sites_written = 0;
+    int64_t realtime_offset = 0;
+};
+
+static Logger *logger() {
+    static Logger *l = new Logger();
+    return l;
+}
+
+namespace async_log {
+
+std::atomic<int> level(WLOG_DEBUG);
+static std::atomic<uint32_t> rate(LOG_DEFAULT_RATE);
+
+uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void register_site(LogSite *site) {
+    Logger *l = logger();
+    l->mtx.lock();
+    if (site->id.load(std::memory_order_relaxed) == 0) {
+        l->sites.push_back(site);
+        site->id.store(l->sites.size(), std::memory_order_release);
+    }
+    l->mtx.unlock();
+}
+
+bool admit(LogSite *site, uint64_t now) {
+    if (site->id.load(std::memory_order_acquire) == 0) register_site(site);
+
+    uint32_t limit = rate.load(std::memory_order_relaxed);
+    if (limit == 0) return true;
+    uint64_t second = now / 1000000000;
+    if (site->window.load(std::memory_order_relaxed) != second) {
+        // racing threads may both reset, which only lets a few more through
+        site->window.store(second, std::memory_order_relaxed);
+        site->count.store(0, std::memory_order_relaxed);
+    }
+    // a plain increment, racing threads may lose counts, which only lets a few more through too
+    uint32_t count = site->count.load(std::memory_order_relaxed);
+    site->count.store(count + 1, std::memory_order_relaxed);
+    if (count < limit) return true;
+    site->suppressed.fetch_add(1, std::memory_order_relaxed);
+    return false;
+}
+
+static void start_drain();
+
+// Marks the ring for the drain to free once the thread is gone and it is empty.
+struct RingSlot {
+    Ring *ring = nullptr;
+    ~RingSlot() { if (ring != nullptr) ring->orphaned.store(true, std::memory_order_release); }
+};
+static thread_local RingSlot slot;
+
+static Ring *this_ring() {
+    if (slot.ring != nullptr) return slot.ring;
+
+    Ring *ring = new Ring();
+    ring->buf = new char[LOG_RING_LEN];
+    ring->thread = syscall(SYS_gettid);
+
+    Logger *l = logger();
+    l->mtx.lock();
+    l->rings.push_back(ring);
+    l->mtx.unlock();
+    start_drain();
+
+    slot.ring = ring;
+    return ring;
+}
+
+char *reserve(size_t len) {
+    Ring *ring = this_ring();
+    uint64_t head = ring->head.load(std::memory_order_relaxed);
+    uint64_t tail = ring->tail.load(std::memory_order_acquire);
+
+    size_t room_to_end = LOG_RING_LEN - head % LOG_RING_LEN;
+    size_t pad = room_to_end < len ? room_to_end : 0;
+    if (len > LOG_RING_LEN / 2 || head + pad + len - tail > LOG_RING_LEN) {
+        ring->lost.store(ring->lost.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        return nullptr;
+    }
+    if (pad > 0) {
+        MessageHeader padding = {(uint32_t)pad, 0, 0};
+        memcpy(ring->buf + head % LOG_RING_LEN, &padding, sizeof(uint32_t) * 2);
+        head += pad;
+    }
+    ring->reserved = head;
+    return ring->buf + head % LOG_RING_LEN;
+}
+
+void commit(size_t len) {
+    Ring *ring = slot.ring;
+    ring->head.store(ring->reserved + len, std::memory_order_release);
+
+    // only the first message after the drain went idle pays for the wakeup
+    Logger *l = logger();
+    if (l->idle.load(std::memory_order_relaxed) && l->idle.exchange(false)) {
+        l->wake_mtx.lock();
+        l->wake.notify_one();
+        l->wake_mtx.unlock();
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////
+
+template <class T> static void put(std::string &out, const T &value) {
+    out.append((const char *)&value, sizeof(value));
+}
+
+static void write_text(Logger *l, int level, uint64_t ts, uint64_t thread, LogSite *site,
+                       const char *args, size_t len) {
+    char line[4096];
+    size_t n = logPrefix(line, sizeof(line), ts + l->realtime_offset, level, thread,
+                         site ? site->file : "?", site ? site->line : 0);
+    if (site != nullptr) n += logFormat(line + n, sizeof(line) - n, site->fmt, args, len);
+    // messages often end in a newline of their own
+    while (n > 0 && line[n - 1] == '\n') --n;
+    line[n++] = '\n';
+    fwrite(line, 1, n, l->out);
+}
+
+static void write_lost(Logger *l, uint32_t site_id, LogSite *site, uint64_t thread, uint64_t count) {
+    if (l->binary) {
+        std::string rec(1, (char)LOG_REC_LOST);
+        put(rec, site_id);
+        put(rec, thread);
+        put(rec, count);
+        fwrite(rec.data(), 1, rec.size(), l->out);
+        return;
+    }
+    char line[512];
+    size_t n = logPrefix(line, sizeof(line), now_ns() + l->realtime_offset, WLOG_WARN, thread,
+                         site ? site->file : "log", site ? site->line : 0);
+    snprintf(line + n, sizeof(line) - n, site ? "%lu messages over the rate limit dropped\n"
+                                              : "%lu messages dropped, the ring was full\n", count);
+    fputs(line, l->out);
+}
+
+// Writes out everything in the rings, returns whether there was anything. Holds drain_mtx.
+static bool drain(Logger *l) {
+    l->mtx.lock();
+    std::vector<Ring *> rings = l->rings;
+    std::vector<LogSite *> sites = l->sites;
+    l->mtx.unlock();
+
+    if (l->binary) {
+        for (; l->sites_written < sites.size(); ++l->sites_written) {
+            LogSite *site = sites[l->sites_written];
+            std::string rec(1, (char)LOG_REC_SITE);
+            put(rec, (uint32_t)(l->sites_written + 1));
+            put(rec, (int32_t)site->level);
+            put(rec, (int32_t)site->line);
+            uint16_t file_len = strlen(site->file), fmt_len = strlen(site->fmt);
+            put(rec, file_len);
+            rec.append(site->file, file_len);
+            put(rec, fmt_len);
+            rec.append(site->fmt, fmt_len);
+            fwrite(rec.data(), 1, rec.size(), l->out);
+        }
+    }
+
+    bool any = false;
+    std::vector<Ring *> gone;
+    for (Ring *ring: rings) {
+        // read before head so that a ring seen as orphaned is also seen complete
+        bool orphaned = ring->orphaned.load(std::memory_order_acquire);
+        uint64_t head = ring->head.load(std::memory_order_acquire);
+        uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+        while (tail < head) {
+            const char *p = ring->buf + tail % LOG_RING_LEN;
+            MessageHeader header;
+            memcpy(&header, p, sizeof(uint32_t) * 2);
+            if (header.site != 0) {
+                memcpy(&header, p, sizeof(header));
+                const char *args = p + sizeof(header);
+                size_t len = header.len - sizeof(header);
+                LogSite *site = header.site <= sites.size() ? sites[header.site - 1] : nullptr;
+                if (l->binary) {
+                    std::string rec(1, (char)LOG_REC_MESSAGE);
+                    put(rec, header.site);
+                    put(rec, header.ts);
+                    put(rec, ring->thread);
+                    put(rec, (uint32_t)len);
+                    rec.append(args, len);
+                    fwrite(rec.data(), 1, rec.size(), l->out);
+                } else {
+                    write_text(l, site ? site->level : WLOG_DEBUG, header.ts, ring->thread, site, args, len);
+                }
+            }
+            tail += header.len;
+        }
+        if (ring->tail.load(std::memory_order_relaxed) != tail) any = true;
+        ring->tail.store(tail, std::memory_order_release);
+
+        uint64_t lost = ring->lost.load(std::memory_order_relaxed);
+        if (lost != ring->lost_reported) {
+            write_lost(l, 0, nullptr, ring->thread, lost - ring->lost_reported);
+            ring->lost_reported = lost;
+            any = true;
+        }
+        if (orphaned) gone.push_back(ring);
+    }
+
+    for (size_t i = 0; i < sites.size(); ++i) {
+        uint64_t suppressed = sites[i]->suppressed.exchange(0, std::memory_order_relaxed);
+        if (suppressed > 0) write_lost(l, i + 1, sites[i], 0, suppressed);
+    }
+
+    if (!gone.empty()) {
+        l->mtx.lock();
+        for (Ring *ring: gone) {
+            for (size_t i = 0; i < l->rings.size(); ++i) {
+                if (l->rings[i] == ring) { l->rings.erase(l->rings.begin() + i); break; }
+            }
+            delete []ring->buf;
+            delete ring;
+        }
+        l->mtx.unlock();
+    }
+
+    if (any) fflush(l->out);
+    return any;
+}
+
+static bool rings_empty(Logger *l) {
+    std::lock_guard<std::mutex> lock(l->mtx);
+    for (Ring *ring: l->rings) {
+        if (ring->head.load(std::memory_order_acquire) != ring->tail.load(std::memory_order_relaxed)) return false;
+    }
+    return true;
+}
+
+// Drains every LOG_DRAIN_MS while messages come in, and sleeps until the next one otherwise. A
+// commit racing with going idle may miss the wakeup without a fence on the logging side, so
+// the idle wait still ends after LOG_IDLE_WAIT_MS.
+static void drain_loop() {
+    Logger *l = logger();
+    for (;;) {
+        l->drain_mtx.lock();
+        bool any = drain(l);
+        l->drain_mtx.unlock();
+        if (any) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(LOG_DRAIN_MS));
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(l->wake_mtx);
+        l->idle.store(true);
+        if (!rings_empty(l)) { l->idle.store(false); continue; }
+        l->wake.wait_for(lock, std::chrono::milliseconds(LOG_IDLE_WAIT_MS),
+                         [l]() { return !l->idle.load(); });
+        l->idle.store(false);
+    }
+}
+
+static void start_drain() {
+    static std::once_flag once;
+    std::call_once(once, []() {
+        Logger *l = logger();
+        struct timespec real;
+        clock_gettime(CLOCK_REALTIME, &real);
+        l->realtime_offset = (int64_t)((uint64_t)real.tv_sec * 1000000000 + real.tv_nsec) - (int64_t)now_ns();
+
+        const char *path = getenv("WATDFS_LOG_FILE");
+        if (path != nullptr) l->out = fopen(path, "wb");
+        if (l->out != nullptr) {
+            l->binary = true;
+            fputs(LOG_FILE_MAGIC, l->out);
+            fwrite(&l->realtime_offset, sizeof(l->realtime_offset), 1, l->out);
+        } else {
+            l->out = stderr;
+        }
+
+        std::thread(drain_loop).detach();
+        atexit(logFlush);
+    });
+}
+
+static void more_verbose(int) { if (level.load() > WLOG_DEBUG) --level; }
+static void less_verbose(int) { if (level.load() < WLOG_OFF) ++level; }
+
+// reads the environment before main
+static struct LogSettings {
+    LogSettings() {
+        const char *names[] = {"debug", "info", "warn", "error", "off"};
+        const char *env = getenv("WATDFS_LOG_LEVEL");
+        for (int i = 0; env != nullptr && i <= WLOG_OFF; ++i) {
+            if (strcasecmp(env, names[i]) == 0) level = i;
+        }
+        env = getenv("WATDFS_LOG_RATE");
+        if (env != nullptr) rate = strtoul(env, nullptr, 10);
+    }
+} settings;
+
+} // namespace async_log
+
+////////////////////////////////////////////////////////////////////////////////////////////////
+
+void logSetLevel(int level) { async_log::level = level; }
+
+void logHandleSignals() {
+    signal(SIGUSR1, async_log::more_verbose);
+    signal(SIGUSR2, async_log::less_verbose);
+}
+
+void logFlush() {
+    Logger *l = logger();
+    l->drain_mtx.lock();
+    if (l->out != nullptr) async_log::drain(l);
+    l->drain_mtx.unlock();
+}
+
+size_t logPrefix(char *out, size_t size, uint64_t realtime_ns, int level, uint64_t thread,
+                 const char *file, int line) {
+    static const char *names[] = {"DEBUG", "INFO", "WARN", "ERROR"};
+    time_t seconds = realtime_ns / 1000000000;
+    struct tm tm;
+    localtime_r(&seconds, &tm);
+    int n = snprintf(out, size, "%02d:%02d:%02d.%06lu %s %lu [%s:%d] ", tm.tm_hour, tm.tm_min, tm.tm_sec,
+                     (unsigned long)(realtime_ns % 1000000000 / 1000),
+                     level >= 0 && level < WLOG_OFF ? names[level] : "?", thread, file, line);
+    return n < 0 ? 0 : ((size_t)n < size ? n : size - 1);
+}
+
+// Takes the next argument if it is there, tag 0 when they have run out.
+static const char *next_arg(const char *p, const char *end, uint8_t *tag, uint64_t *bits,
+                            std::string *str) {
+    *tag = 0;
+    if (p >= end) return p;
+    uint8_t t = *p++;
+    if (t == LOG_ARG_STR) {
+        uint16_t len;
+        if (end - p < 2) return end;
+        memcpy(&len, p, 2);
+        p += 2;
+        if (end - p < len) return end;
+        str->assign(p, len);
+        *tag = t;
+        return p + len;
+    }
+    if (end - p < 8) return end;
+    memcpy(bits, p, 8);
+    *tag = t;
+    return p + 8;
+}
+
+size_t logFormat(char *out, size_t size, const char *fmt, const char *args, size_t len) {
+    const char *arg = args, *end = args + len;
+    size_t n = 0;
+    auto emit = [&](const char *s, size_t l) {
+        if (n + 1 >= size) return;
+        if (l > size - 1 - n) l = size - 1 - n;
+        memcpy(out + n, s, l);
+        n += l;
+    };
+
+    char buf[LOG_STR_MAX + 64];
+    for (const char *p = fmt; *p != '\0'; ) {
+        if (*p != '%') {
+            const char *next = strchr(p, '%');
+            size_t l = next ? next - p : strlen(p);
+            emit(p, l);
+            p += l;
+            continue;
+        }
+        if (p[1] == '%') { emit("%", 1); p += 2; continue; }
+
+        // the conversion without its length modifier, which is replaced to fit the stored value
+        std::string spec = "%";
+        const char *q = p + 1;
+        while (*q && strchr("-+ #0", *q)) spec += *q++;
+        while (*q && (isdigit((unsigned char)*q) || *q == '.')) spec += *q++;
+        while (*q && strchr("hlLqjzt", *q)) ++q;
+        char conv = *q;
+        p = *q ? q + 1 : q;
+
+        uint8_t tag;
+        uint64_t bits = 0;
+        std::string str;
+        arg = next_arg(arg, end, &tag, &bits, &str);
+        int64_t sbits;
+        double dbits;
+        memcpy(&sbits, &bits, 8);
+        memcpy(&dbits, &bits, 8);
+
+        int l = -1;
+        if (tag == 0) {
+            l = snprintf(buf, sizeof(buf), "<missing>");
+        } else if (conv == 's') {
+            l = tag == LOG_ARG_STR ? snprintf(buf, sizeof(buf), (spec + "s").c_str(), str.c_str())
+                                   : snprintf(buf, sizeof(buf), "<%#lx>", (unsigned long)bits);
+        } else if (tag == LOG_ARG_STR) {
+            l = snprintf(buf, sizeof(buf), "%s", str.c_str());
+        } else if (strchr("di", conv)) {
+            long long v = tag == LOG_ARG_DOUBLE ? (long long)dbits : (long long)sbits;
+            l = snprintf(buf, sizeof(buf), (spec + "lld").c_str(), v);
+        } else if (strchr("uoxXc", conv)) {
+            unsigned long long v = tag == LOG_ARG_DOUBLE ? (unsigned long long)dbits : bits;
+            if (conv == 'c') l = snprintf(buf, sizeof(buf), (spec + "c").c_str(), (int)v);
+            else l = snprintf(buf, sizeof(buf), (spec + "ll" + conv).c_str(), v);
+        } else if (strchr("feEgGaA", conv)) {
+            double v = tag == LOG_ARG_DOUBLE ? dbits : tag == LOG_ARG_INT ? (double)sbits : (double)bits;
+            l = snprintf(buf, sizeof(buf), (spec + conv).c_str(), v);
+        } else if (conv == 'p') {
+            l = snprintf(buf, sizeof(buf), "%p", (void *)(uintptr_t)bits);
+        } else {
+            l = snprintf(buf, sizeof(buf), "<%%%c?>", conv);
+        }
+        if (l > 0) emit(buf, (size_t)l < sizeof(buf) ? l : sizeof(buf) - 1);
+    }
+    out[n] = '\0';
+    return n;
+}
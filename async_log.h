@@ -0,0 +1,158 @@
+#ifndef ASYNC_LOG_H
+#define ASYNC_LOG_H
+
+// The logger behind DLOG. A log call copies its arguments in binary into a ring buffer owned by
+// the calling thread, without locks or formatting; a background thread drains the rings every
+// millisecond while messages come in, and sleeps until the next one otherwise. It formats the
+// messages to stderr, or with WATDFS_LOG_FILE set writes them as records that watdfs_logdump
+// decodes later. A full ring drops messages and the drop is logged.
+//
+//   WATDFS_LOG_LEVEL  debug, info, warn or error, the lowest level logged (debug)
+//   WATDFS_LOG_RATE   messages per second a call site may log, 0 for no limit (10000)
+//
+// After logHandleSignals, SIGUSR1 makes a running process log one level more and SIGUSR2 one
+// level less.
+
+#include <atomic>
+#include <cstring>
+#include <stddef.h>
+#include <stdint.h>
+#include <type_traits>
+
+enum LogLevel { WLOG_DEBUG, WLOG_INFO, WLOG_WARN, WLOG_ERROR, WLOG_OFF };
+
+// One per log statement.
+struct LogSite {
+    const char *fmt;
+    const char *file;
+    int line;
+    int level;
+    std::atomic<uint32_t> id;         // 0 until registered
+    std::atomic<uint64_t> window;     // the second `count` is for
+    std::atomic<uint32_t> count;
+    std::atomic<uint64_t> suppressed; // by the rate limit, not yet reported
+};
+
+// Argument type tags of a message record.
+enum LogArg : uint8_t { LOG_ARG_INT = 1, LOG_ARG_UINT, LOG_ARG_DOUBLE, LOG_ARG_STR, LOG_ARG_PTR };
+
+// Longer strings are cut.
+#define LOG_STR_MAX 512
+
+void logSetLevel(int level);
+// Installs the SIGUSR1/SIGUSR2 handlers, for a program that wants them.
+void logHandleSignals();
+// Waits until every message logged so far has been written.
+void logFlush();
+
+// WATDFS_LOG_FILE starts with LOG_FILE_MAGIC and the int64 nanoseconds to add to a timestamp for
+// the realtime clock, followed by records that start with their LogRecord byte:
+//   site     u32 id, i32 level, i32 line, u16 length and file, u16 length and fmt
+//   message  u32 site, u64 timestamp, u64 thread, u32 length and arguments
+//   lost     u32 site (0 when a thread's ring was full), u64 thread, u64 count
+#define LOG_FILE_MAGIC "WATDFSLOG1\n"
+enum LogRecord : uint8_t { LOG_REC_SITE = 'S', LOG_REC_MESSAGE = 'M', LOG_REC_LOST = 'L' };
+
+// The start of a text line: time, level, thread and call site.
+size_t logPrefix(char *out, size_t size, uint64_t realtime_ns, int level, uint64_t thread,
+                 const char *file, int line);
+// printf of `fmt` with the `len` bytes of arguments of a message record, returns the length.
+size_t logFormat(char *out, size_t size, const char *fmt, const char *args, size_t len);
+
+namespace async_log {
+
+extern std::atomic<int> level;
+
+// Whether the site may log now, registers it on first use.
+bool admit(LogSite *site, uint64_t now_ns);
+uint64_t now_ns();
+
+// Space for a record of `len` bytes in this thread's ring, null when it is full. The record is
+// published by commit.
+char *reserve(size_t len);
+void commit(size_t len);
+
+template <LogArg K> using kind = std::integral_constant<LogArg, K>;
+
+template <class T> struct arg {
+    typedef typename std::decay<T>::type D;
+    static_assert(std::is_arithmetic<D>::value || std::is_enum<D>::value || std::is_pointer<D>::value ||
+                  std::is_null_pointer<D>::value, "log arguments are numbers, strings or pointers");
+    typedef kind<std::is_same<D, char *>::value || std::is_same<D, const char *>::value ? LOG_ARG_STR
+                 : std::is_pointer<D>::value || std::is_null_pointer<D>::value ? LOG_ARG_PTR
+                 : std::is_floating_point<D>::value ? LOG_ARG_DOUBLE
+                 : std::is_enum<D>::value || std::is_signed<D>::value ? LOG_ARG_INT
+                 : LOG_ARG_UINT> tag;
+};
+
+inline size_t str_len(const char *s) { return s == nullptr ? 0 : strnlen(s, LOG_STR_MAX); }
+
+template <class T> size_t arg_size(T value, kind<LOG_ARG_STR>) { return 1 + 2 + str_len(value); }
+template <class T, class K> size_t arg_size(T, K) { return 1 + 8; }
+
+template <class T> char *put_bits(char *p, LogArg tag, T bits) {
+    *p = tag;
+    memcpy(p + 1, &bits, 8);
+    return p + 1 + 8;
+}
+template <class T> char *put(char *p, T value, kind<LOG_ARG_STR>) {
+    uint16_t len = str_len(value);
+    *p = LOG_ARG_STR;
+    memcpy(p + 1, &len, 2);
+    if (len > 0) memcpy(p + 3, value, len);
+    return p + 3 + len;
+}
+template <class T> char *put(char *p, T value, kind<LOG_ARG_PTR>) {
+    return put_bits(p, LOG_ARG_PTR, (uint64_t)(uintptr_t)(const void *)value);
+}
+template <class T> char *put(char *p, T value, kind<LOG_ARG_DOUBLE>) {
+    return put_bits(p, LOG_ARG_DOUBLE, (double)value);
+}
+template <class T> char *put(char *p, T value, kind<LOG_ARG_INT>) {
+    return put_bits(p, LOG_ARG_INT, (int64_t)value);
+}
+template <class T> char *put(char *p, T value, kind<LOG_ARG_UINT>) {
+    return put_bits(p, LOG_ARG_UINT, (uint64_t)value);
+}
+
+// A message record: site id, timestamp, then a tag and value per argument.
+struct MessageHeader {
+    uint32_t len; // of the whole record
+    uint32_t site;
+    uint64_t ts;
+};
+
+template <class... A> void write(LogSite *site, uint64_t ts, A... args) {
+    size_t sizes[] = {0, arg_size(args, typename arg<A>::tag())...};
+    size_t len = sizeof(MessageHeader);
+    for (size_t size: sizes) len += size;
+    len = (len + 7) & ~(size_t)7;
+
+    char *p = reserve(len);
+    if (p == nullptr) return;
+    MessageHeader header = {(uint32_t)len, site->id.load(std::memory_order_relaxed), ts};
+    memcpy(p, &header, sizeof(header));
+    char *q = p + sizeof(header);
+    char *expand[] = {q, (q = put(q, args, typename arg<A>::tag()))...};
+    (void)expand;
+    commit(len);
+}
+
+// only to have the compiler check the format against the arguments
+inline void check_format(const char *, ...) __attribute__((format(printf, 1, 2)));
+inline void check_format(const char *, ...) {}
+
+} // namespace async_log
+
+#define WLOG(lvl, fmt, ...)                                                    \
+    do {                                                                       \
+        if ((lvl) >= async_log::level.load(std::memory_order_relaxed)) {       \
+            static LogSite _log_site = {fmt, __FILE__, __LINE__, lvl, {0}, {0}, {0}, {0}}; \
+            uint64_t _log_ts = async_log::now_ns();                            \
+            if (async_log::admit(&_log_site, _log_ts))                         \
+                async_log::write(&_log_site, _log_ts, ##__VA_ARGS__);          \
+        }                                                                      \
+        if (0) async_log::check_format(fmt, ##__VA_ARGS__);                    \
+    } while (0)
+
+#endif
@@ -0,0 +1,304 @@
+// End-to-end benchmark that drives the watdfs_cli_* calls of libwatdfs.a directly, without a
+// FUSE mount. It starts ./watdfs_server on a temporary directory (or uses the server named by
+// SERVER_ADDRESS/SERVER_PORT with --external), creates every thread's files through the client
+// and then runs the workload from N threads that share one client. Every thread works on files
+// of its own, since a client opens a path once at a time.
+//
+// Results are printed as one JSON object so runs can be compared between commits.
+//
+// Usage: ./bench [--threads N] [--ops N] [--files N] [--sizes 4K:70,64K:20,1M:10]
+//                [--read-ratio R] [--getattr-ratio R] [--pattern seq|rand] [--io BYTES]
+//                [--skew S] [--cache-interval SEC] [--seed N] [--servers N] [--replicas N]
+//                [--external] [--rtt MS] [--jitter MS] [--bandwidth MBIT] [--stall-prob P]
+//                [--stall-ms MS]
+//
+//   --ops            operations per thread; an operation is open, reads or writes, release
+//   --files          files per thread, their sizes drawn from the --sizes mix (size:weight)
+//   --read-ratio     share of the non-getattr operations that read, the rest write
+//   --getattr-ratio  share of the operations that are a single getattr
+//   --pattern        seq moves the whole file front to back in --io requests, rand does as
+//                    many requests at random offsets
+//   --skew           zipf exponent of the file popularity, 0 for uniform
+//   --servers        split the namespace over N servers, see shard_transport.h; not with
+//                    --external
+//   --replicas       read from N read replicas of the one server, see replication.h; not with
+//                    --servers or --external
+//   --rtt ...        run the client's rpc and bulk connections through ./watdfs_wanproxy with
+//                    these link settings, see wan_proxy.cc; not with --external
+
+#include "watdfs_client.h"
+#include "rpc_stub.h"
+#include "bench_harness.h"
+#include "bench_util.h"
+
+#include <sys/stat.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+////////////////////////////////////////////////////////////////////////////////////////////////
+
+struct Config {
+    int threads = 4;
+    long ops = 200;
+    int files = 16;
+    std::string sizes = "4K:70,64K:20,1M:10";
+    double read_ratio = 0.8;
+    double getattr_ratio = 0.1;
+    bool random = false;
+    size_t io = 64 << 10;
+    double skew = 0.99;
+    time_t cache_interval = 3;
+    unsigned seed = 1;
+    bool external = false;
+    int servers = 1;
+    int replicas = 0;
+    WanLink link;
+};
+
+enum Call { OPEN, READ_CALL, WRITE_CALL, RELEASE, GETATTR, OP, CALLS };
+static const char *call_names[CALLS] = {"open", "read", "write", "release", "getattr", "op"};
+
+struct ThreadResult {
+    std::vector<uint64_t> ns[CALLS];
+    uint64_t bytes_read = 0;
+    uint64_t bytes_written = 0;
+    uint64_t errors = 0;
+};
+
+static size_t parse_size(const char *s) {
+    char *end;
+    double value = strtod(s, &end);
+    switch (*end) {
+        case 'G': case 'g': value *= 1 << 30; break;
+        case 'M': case 'm': value *= 1 << 20; break;
+        case 'K': case 'k': value *= 1 << 10; break;
+    }
+    return (size_t)value;
+}
+
+// "4K:70,64K:20" into sizes and their weights
+static bool parse_mix(const std::string &mix, std::vector<size_t> *sizes, std::vector<double> *weights) {
+    size_t pos = 0;
+    while (pos < mix.size()) {
+        size_t end = mix.find(',', pos);
+        if (end == std::string::npos) end = mix.size();
+        std::string item = mix.substr(pos, end - pos);
+        size_t colon = item.find(':');
+        sizes->push_back(parse_size(item.c_str()));
+        weights->push_back(colon == std::string::npos ? 1 : atof(item.c_str() + colon + 1));
+        pos = end + 1;
+    }
+    return !sizes->empty();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////
+
+static std::string file_path(int thread, int file) {
+    return "/bench_" + std::to_string(thread) + "_" + std::to_string(file);
+}
+
+static int create_file(void *userdata, const std::string &path, size_t size) {
+    struct fuse_file_info fi;
+    memset(&fi, 0, sizeof(fi));
+    fi.flags = O_RDWR;
+    int ret = watdfs_cli_mknod(userdata, path.c_str(), S_IFREG | 0644, 0);
+    if (ret < 0 && ret != -EEXIST) return ret;
+    ret = watdfs_cli_open(userdata, path.c_str(), &fi);
+    if (ret < 0) return ret;
+
+    std::vector<char> data(std::min(size, (size_t)1 << 20), 'x');
+    for (size_t done = 0; done < size && ret >= 0; done += data.size()) {
+        ret = watdfs_cli_write(userdata, path.c_str(), data.data(), std::min(data.size(), size - done), done, &fi);
+    }
+    int release_ret = watdfs_cli_release(userdata, path.c_str(), &fi);
+    return ret < 0 ? ret : release_ret;
+}
+
+// One operation: a getattr, or open, the reads or writes of the pattern, release.
+static void run_op(void *userdata, const Config &config, const std::string &path, size_t size,
+                   std::mt19937_64 &rng, std::vector<char> &buf, ThreadResult &result) {
+    std::uniform_real_distribution<double> coin(0, 1);
+    uint64_t start = now_ns(), t;
+
+    if (coin(rng) < config.getattr_ratio) {
+        struct stat statbuf;
+        if (watdfs_cli_getattr(userdata, path.c_str(), &statbuf) < 0) ++result.errors;
+        result.ns[GETATTR].push_back(now_ns() - start);
+        return;
+    }
+
+    bool reading = coin(rng) < config.read_ratio;
+    struct fuse_file_info fi;
+    memset(&fi, 0, sizeof(fi));
+    fi.flags = reading ? O_RDONLY : O_RDWR;
+
+    t = now_ns();
+    if (watdfs_cli_open(userdata, path.c_str(), &fi) < 0) { ++result.errors; return; }
+    result.ns[OPEN].push_back(now_ns() - t);
+
+    size_t requests = (size + config.io - 1) / config.io;
+    for (size_t i = 0; i < requests; ++i) {
+        size_t offset = config.random ? (rng() % requests) * config.io : i * config.io;
+        size_t len = std::min(config.io, size - offset);
+        t = now_ns();
+        int ret = reading ? watdfs_cli_read(userdata, path.c_str(), buf.data(), len, offset, &fi)
+                          : watdfs_cli_write(userdata, path.c_str(), buf.data(), len, offset, &fi);
+        result.ns[reading ? READ_CALL : WRITE_CALL].push_back(now_ns() - t);
+        if (ret < 0) { ++result.errors; break; }
+        (reading ? result.bytes_read : result.bytes_written) += ret;
+    }
+
+    t = now_ns();
+    if (watdfs_cli_release(userdata, path.c_str(), &fi) < 0) ++result.errors;
+    result.ns[RELEASE].push_back(now_ns() - t);
+    result.ns[OP].push_back(now_ns() - start);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////
+
+static void print_latency(const char *name, std::vector<uint64_t> &ns, bool last) {
+    std::sort(ns.begin(), ns.end());
+    auto at = [&ns](double q) { return ns.empty() ? 0.0 : ns[std::min(ns.size() - 1, (size_t)(q * ns.size()))] / 1e3; };
+    printf("    \"%s\": {\"count\": %zu, \"p50\": %.1f, \"p99\": %.1f, \"p999\": %.1f, \"max\": %.1f}%s\n",
+           name, ns.size(), at(0.5), at(0.99), at(0.999), ns.empty() ? 0.0 : ns.back() / 1e3, last ? "" : ",");
+}
+
+int main(int argc, char *argv[]) {
+    Config config;
+    for (int i = 1; i < argc; ++i) {
+        const char *arg = argv[i];
+        const char *value = (i + 1 < argc) ? argv[i + 1] : "";
+        bool used = true;
+        if (strcmp(arg, "--threads") == 0) config.threads = atoi(value);
+        else if (strcmp(arg, "--ops") == 0) config.ops = atol(value);
+        else if (strcmp(arg, "--files") == 0) config.files = atoi(value);
+        else if (strcmp(arg, "--sizes") == 0) config.sizes = value;
+        else if (strcmp(arg, "--read-ratio") == 0) config.read_ratio = atof(value);
+        else if (strcmp(arg, "--getattr-ratio") == 0) config.getattr_ratio = atof(value);
+        else if (strcmp(arg, "--pattern") == 0) config.random = (strcmp(value, "rand") == 0);
+        else if (strcmp(arg, "--io") == 0) config.io = parse_size(value);
+        else if (strcmp(arg, "--skew") == 0) config.skew = atof(value);
+        else if (strcmp(arg, "--cache-interval") == 0) config.cache_interval = atol(value);
+        else if (strcmp(arg, "--seed") == 0) config.seed = atoi(value);
+        else if (strcmp(arg, "--servers") == 0) config.servers = atoi(value);
+        else if (strcmp(arg, "--replicas") == 0) config.replicas = atoi(value);
+        else if (strcmp(arg, "--external") == 0) { config.external = true; used = false; }
+        else if (parseLinkOption(arg, value, &config.link)) {}
+        else { fprintf(stderr, "unknown option %s\n", arg); return 1; }
+        if (used) ++i;
+    }
+
+    std::vector<size_t> sizes;
+    std::vector<double> weights;
+    if (config.threads < 1 || config.files < 1 || config.io == 0 || config.servers < 1 ||
+        config.replicas < 0 || (config.replicas > 0 && config.servers > 1) ||
+        !parse_mix(config.sizes, &sizes, &weights) ||
+        ((config.link.enabled() || config.servers > 1 || config.replicas > 0) && config.external)) {
+        fprintf(stderr, "invalid configuration\n");
+        return 1;
+    }
+
+    char server_dir[] = "/tmp/watdfs_bench_server.XXXXXX";
+    char cache_dir[] = "/tmp/watdfs_bench_cache.XXXXXX";
+    if (mkdtemp(cache_dir) == nullptr) { perror("mkdtemp"); return 1; }
+    BenchServer server;
+    if (!config.external) {
+        if (mkdtemp(server_dir) == nullptr) { perror("mkdtemp"); return 1; }
+        if (!startServer(server_dir, config.link, &server, config.servers, config.replicas)) return 1;
+    }
+
+    int ret = 0;
+    void *userdata = watdfs_cli_init(nullptr, cache_dir, config.cache_interval, &ret);
+    if (ret < 0) { fprintf(stderr, "watdfs_cli_init failed: %d\n", ret); return 1; }
+
+    // every thread's files, with sizes drawn from the mix
+    std::mt19937_64 rng(config.seed);
+    std::discrete_distribution<int> pick_size(weights.begin(), weights.end());
+    std::vector<std::vector<size_t>> file_sizes(config.threads);
+    for (int t = 0; t < config.threads; ++t) {
+        for (int f = 0; f < config.files; ++f) {
+            file_sizes[t].push_back(sizes[pick_size(rng)]);
+            ret = create_file(userdata, file_path(t, f), file_sizes[t].back());
+            if (ret < 0) { fprintf(stderr, "unable to create %s: %d\n", file_path(t, f).c_str(), ret); return 1; }
+        }
+    }
+
+    std::unordered_map<std::string, uint64_t> rpcs_before = rpc_stub::call_count_snapshot();
+    Transfers transfers_before = transfers();
+    std::vector<ThreadResult> results(config.threads);
+    std::vector<std::thread> workers;
+    uint64_t start = now_ns();
+    for (int t = 0; t < config.threads; ++t) {
+        workers.emplace_back([&, t]() {
+            std::mt19937_64 thread_rng(config.seed * 7919 + t);
+            Zipf zipf(config.files, config.skew);
+            std::vector<char> buf(config.io, 'y');
+            for (long i = 0; i < config.ops; ++i) {
+                int f = zipf(thread_rng);
+                run_op(userdata, config, file_path(t, f), file_sizes[t][f], thread_rng, buf, results[t]);
+            }
+        });
+    }
+    for (std::thread &worker: workers) worker.join();
+    double seconds = (now_ns() - start) / 1e9;
+    std::unordered_map<std::string, uint64_t> rpcs = rpc_stub::call_count_snapshot();
+    Transfers transfers_after = transfers();
+
+    ThreadResult total;
+    for (ThreadResult &result: results) {
+        for (int c = 0; c < CALLS; ++c) total.ns[c].insert(total.ns[c].end(), result.ns[c].begin(), result.ns[c].end());
+        total.bytes_read += result.bytes_read;
+        total.bytes_written += result.bytes_written;
+        total.errors += result.errors;
+    }
+    uint64_t ops = total.ns[OP].size() + total.ns[GETATTR].size();
+
+    printf("{\n");
+    printf("  \"config\": {\"threads\": %d, \"ops\": %ld, \"files\": %d, \"sizes\": \"%s\", \"read_ratio\": %.2f, "
+           "\"getattr_ratio\": %.2f, \"pattern\": \"%s\", \"io\": %zu, \"skew\": %.2f, \"cache_interval\": %ld, "
+           "\"servers\": %d, \"replicas\": %d},\n",
+           config.threads, config.ops, config.files, config.sizes.c_str(), config.read_ratio, config.getattr_ratio,
+           config.random ? "rand" : "seq", config.io, config.skew, (long)config.cache_interval, config.servers,
+           config.replicas);
+    if (config.link.enabled()) printf("  \"link\": %s,\n", linkJson(config.link).c_str());
+    printf("  \"seconds\": %.3f,\n", seconds);
+    printf("  \"ops\": %lu,\n", ops);
+    printf("  \"errors\": %lu,\n", total.errors);
+    printf("  \"ops_per_s\": %.1f,\n", ops / seconds);
+    printf("  \"bytes_read\": %lu,\n", total.bytes_read);
+    printf("  \"bytes_written\": %lu,\n", total.bytes_written);
+    printf("  \"mb_per_s\": %.2f,\n", (total.bytes_read + total.bytes_written) / seconds / (1 << 20));
+    printf("  \"latency_us\": {\n");
+    for (int c = 0; c < CALLS; ++c) print_latency(call_names[c], total.ns[c], c == CALLS - 1);
+    printf("  },\n");
+    uint64_t rpc_total = 0;
+    printf("  \"rpcs\": {");
+    bool first = true;
+    for (auto &it: rpcs) {
+        uint64_t count = it.second - rpcs_before[it.first];
+        if (count == 0) continue;
+        printf("%s\"%s\": %lu", first ? "" : ", ", it.first.c_str(), count);
+        rpc_total += count;
+        first = false;
+    }
+    printf("},\n");
+    printf("  \"rpcs_per_op\": %.2f,\n", ops ? (double)rpc_total / ops : 0.0);
+    printf("  \"transfers\": %s\n", transfersJson(transfers_before, transfers_after, config.link).c_str());
+    printf("}\n");
+
+    watdfs_cli_destroy(userdata);
+    if (!config.external) {
+        stopServer(&server);
+        removeTree(server_dir);
+    }
+    removeTree(cache_dir);
+
+    return total.errors ? 2 : 0;
+}
@@ -0,0 +1,290 @@
+#include "bench_harness.h"
+#include "stats.h"
+
+#include <arpa/inet.h>
+#include <ftw.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <cstdarg>
+#include <thread>
+#include <vector>
+
+static std::string format(const char *fmt, ...) {
+    char buf[512];
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(buf, sizeof(buf), fmt, args);
+    va_end(args);
+    return buf;
+}
+
+bool parseLinkOption(const char *arg, const char *value, WanLink *link) {
+    if (strcmp(arg, "--rtt") == 0) link->rtt_ms = atof(value);
+    else if (strcmp(arg, "--jitter") == 0) link->jitter_ms = atof(value);
+    else if (strcmp(arg, "--bandwidth") == 0) link->bandwidth_mbit = atof(value);
+    else if (strcmp(arg, "--stall-prob") == 0) link->stall_prob = atof(value);
+    else if (strcmp(arg, "--stall-ms") == 0) link->stall_ms = atof(value);
+    else return false;
+    return true;
+}
+
+std::string linkJson(const WanLink &link) {
+    return format("{\"rtt_ms\": %.1f, \"jitter_ms\": %.1f, \"bandwidth_mbit\": %.1f, \"stall_prob\": %.4f, "
+                  "\"stall_ms\": %.1f}", link.rtt_ms, link.jitter_ms, link.bandwidth_mbit, link.stall_prob,
+                  link.stall_ms);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////
+
+// A port that is free now.
+static int free_port() {
+    int sock = socket(AF_INET6, SOCK_STREAM, 0);
+    struct sockaddr_in6 addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin6_family = AF_INET6;
+    socklen_t addr_len = sizeof(addr);
+    int port = 0;
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) == 0 &&
+        getsockname(sock, (struct sockaddr *)&addr, &addr_len) == 0) {
+        port = ntohs(addr.sin6_port);
+    }
+    close(sock);
+    return port;
+}
+
+// Where a started server takes calls, as it printed them.
+struct ServerAddress {
+    std::string host;
+    std::string port;       // librpc
+    std::string shard_port; // shard transport
+};
+
+// Runs ./watdfs_server on `dir`, its bulk channel on `bulk_port` if not 0, with `env` set. Any
+// `env` opens the shard port, see server_main.cc.
+static pid_t start_server(const char *dir, int bulk_port, const std::vector<std::string> &env,
+                          ServerAddress *address) {
+    int out[2];
+    if (pipe(out) < 0) return -1;
+    pid_t pid = fork();
+    if (pid == 0) {
+        dup2(out[1], STDOUT_FILENO);
+        freopen("/dev/null", "w", stderr);
+        close(out[0]);
+        if (bulk_port != 0) setenv("WATDFS_BULK_PORT", std::to_string(bulk_port).c_str(), 1);
+        else unsetenv("WATDFS_BULK_PORT");
+        for (const char *name: {"WATDFS_SERVERS", "WATDFS_SHARD_PORT", "WATDFS_PRIMARY", "WATDFS_REPLICA_OF"}) {
+            unsetenv(name);
+        }
+        for (const std::string &var: env) putenv(strdup(var.c_str()));
+        execl("./watdfs_server", "watdfs_server", dir, (char *)nullptr);
+        _exit(127);
+    }
+    close(out[1]);
+
+    FILE *server_out = fdopen(out[0], "r");
+    char line[256];
+    *address = ServerAddress();
+    bool shard = !env.empty();
+    while ((address->host.empty() || address->port.empty() || (shard && address->shard_port.empty())) &&
+           fgets(line, sizeof(line), server_out)) {
+        // export SERVER_ADDRESS=host
+        line[strcspn(line, "\n")] = '\0';
+        char *name = strncmp(line, "export ", 7) == 0 ? line + 7 : line;
+        char *eq = strchr(name, '=');
+        if (eq == nullptr) continue;
+        *eq = '\0';
+        if (strcmp(name, "SERVER_ADDRESS") == 0) address->host = eq + 1;
+        if (strcmp(name, "SERVER_PORT") == 0) address->port = eq + 1;
+        if (strcmp(name, "WATDFS_SHARD_PORT") == 0) address->shard_port = eq + 1;
+    }
+    if (address->host.empty() || address->port.empty() || (shard && address->shard_port.empty())) {
+        kill(pid, SIGKILL);
+        waitpid(pid, nullptr, 0);
+        fclose(server_out);
+        return -1;
+    }
+    // the server keeps writing to its stdout, so the pipe is drained in the background
+    std::thread([server_out]() {
+        char buf[256];
+        while (fgets(buf, sizeof(buf), server_out)) {}
+    }).detach();
+    return pid;
+}
+
+// Runs ./watdfs_wanproxy in front of every host:port of `targets`, returns the ports it listens
+// on for them in `ports`.
+static pid_t start_proxy(const WanLink &link, const std::vector<std::pair<std::string, std::string>> &targets,
+                         std::vector<int> *ports) {
+    std::vector<std::string> args = {"watdfs_wanproxy",
+        "--rtt", std::to_string(link.rtt_ms), "--jitter", std::to_string(link.jitter_ms),
+        "--bandwidth", std::to_string(link.bandwidth_mbit),
+        "--stall-prob", std::to_string(link.stall_prob), "--stall-ms", std::to_string(link.stall_ms)};
+    for (auto &target: targets) {
+        args.push_back("0");
+        args.push_back(target.first);
+        args.push_back(target.second);
+    }
+    int out[2];
+    if (pipe(out) < 0) return -1;
+    pid_t pid = fork();
+    if (pid == 0) {
+        dup2(out[1], STDOUT_FILENO);
+        close(out[0]);
+        std::vector<char *> argv;
+        for (std::string &arg: args) argv.push_back(&arg[0]);
+        argv.push_back(nullptr);
+        execv("./watdfs_wanproxy", argv.data());
+        _exit(127);
+    }
+    close(out[1]);
+
+    // PROXY <listen port> <target>, in the order of the targets
+    FILE *proxy_out = fdopen(out[0], "r");
+    char line[256];
+    ports->clear();
+    while (ports->size() < targets.size() && fgets(line, sizeof(line), proxy_out)) {
+        int port;
+        if (sscanf(line, "PROXY %d", &port) == 1) ports->push_back(port);
+    }
+    fclose(proxy_out);
+    if (ports->size() < targets.size()) {
+        kill(pid, SIGKILL);
+        waitpid(pid, nullptr, 0);
+        return -1;
+    }
+    return pid;
+}
+
+bool startServer(const char *dir, const WanLink &link, BenchServer *bench_server, int count, int replicas) {
+    if (count > 1 && replicas > 0) {
+        fprintf(stderr, "replicas need a single primary server\n");
+        return false;
+    }
+    // the bulk channel is only used through librpc, so with one server
+    bool single = count == 1 && replicas == 0;
+    int bulk_port = (link.enabled() && single) ? free_port() : 0;
+    std::vector<ServerAddress> addresses(count + replicas);
+    for (int i = 0; i < count + replicas; ++i) {
+        std::string server_dir = dir;
+        if (!single) {
+            server_dir += "/" + std::to_string(i);
+            mkdir(server_dir.c_str(), 0755);
+        }
+        std::vector<std::string> env;
+        if (count > 1) {
+            // pinned, a server's place on the ring follows its port
+            env.push_back("WATDFS_SERVERS=" + std::to_string(count));
+            env.push_back("WATDFS_SHARD_PORT=" + std::to_string(free_port()));
+        }
+        if (replicas > 0 && i == 0) env.push_back("WATDFS_PRIMARY=1");
+        if (i > 0 && replicas > 0) env.push_back("WATDFS_REPLICA_OF=" + addresses[0].host + ":" + addresses[0].shard_port);
+        pid_t pid = start_server(server_dir.c_str(), bulk_port, env, &addresses[i]);
+        if (pid < 0) {
+            fprintf(stderr, "unable to start ./watdfs_server\n");
+            stopServer(bench_server);
+            return false;
+        }
+        bench_server->servers.push_back(pid);
+    }
+
+    std::vector<std::pair<std::string, std::string>> targets;
+    for (ServerAddress &address: addresses) {
+        if (single) {
+            targets.emplace_back(address.host, address.port);
+            targets.emplace_back(address.host, std::to_string(bulk_port));
+        } else {
+            targets.emplace_back(address.host, address.shard_port);
+        }
+    }
+    std::vector<int> ports;
+    if (link.enabled()) {
+        bench_server->proxy = start_proxy(link, targets, &ports);
+        if (bench_server->proxy < 0) {
+            fprintf(stderr, "unable to start ./watdfs_wanproxy\n");
+            bench_server->proxy = 0;
+            stopServer(bench_server);
+            return false;
+        }
+        for (size_t i = 0; i < targets.size(); ++i) targets[i].second = std::to_string(ports[i]);
+    }
+
+    unsetenv("WATDFS_REPLICAS");
+    if (single) {
+        setenv("SERVER_ADDRESS", targets[0].first.c_str(), 1);
+        setenv("SERVER_PORT", targets[0].second.c_str(), 1);
+        if (link.enabled()) setenv("WATDFS_BULK_PORT", targets[1].second.c_str(), 1);
+        unsetenv("WATDFS_SERVERS");
+    } else {
+        std::string servers, replica_list;
+        for (int i = 0; i < count + replicas; ++i) {
+            std::string &list = i < count ? servers : replica_list;
+            list += (list.empty() ? "" : ",") + targets[i].first + ":" + targets[i].second;
+        }
+        setenv("WATDFS_SERVERS", servers.c_str(), 1);
+        if (replicas > 0) setenv("WATDFS_REPLICAS", replica_list.c_str(), 1);
+    }
+    return true;
+}
+
+void stopServer(BenchServer *bench_server) {
+    std::vector<pid_t> pids = bench_server->servers;
+    pids.insert(pids.begin(), bench_server->proxy);
+    for (pid_t pid: pids) {
+        if (pid <= 0) continue;
+        kill(pid, SIGTERM);
+        waitpid(pid, nullptr, 0);
+    }
+    bench_server->proxy = 0;
+    bench_server->servers.clear();
+}
+
+static int remove_entry(const char *path, const struct stat *, int, struct FTW *) { return remove(path); }
+
+void removeTree(const char *dir) { nftw(dir, remove_entry, 16, FTW_DEPTH | FTW_PHYS); }
+
+////////////////////////////////////////////////////////////////////////////////////////////////
+
+static const char *transfer_names[2] = {"download", "upload"};
+
+Transfers transfers() {
+    Transfers t;
+    std::string text = statsText();
+    size_t pos = 0;
+    while (pos < text.size()) {
+        size_t end = text.find('\n', pos);
+        if (end == std::string::npos) end = text.size();
+        std::string line = text.substr(pos, end - pos);
+        char name[64];
+        unsigned long calls, errors, bytes, sum_ns;
+        if (sscanf(line.c_str(), "%63s %lu %lu %lu %lu", name, &calls, &errors, &bytes, &sum_ns) == 5) {
+            for (int i = 0; i < 2; ++i) {
+                if (strcmp(name, transfer_names[i]) != 0) continue;
+                t.calls[i] = calls;
+                t.bytes[i] = bytes;
+                t.sum_ns[i] = sum_ns;
+            }
+        }
+        pos = end + 1;
+    }
+    return t;
+}
+
+std::string transfersJson(const Transfers &before, const Transfers &after, const WanLink &link) {
+    std::string out = "{";
+    for (int i = 0; i < 2; ++i) {
+        uint64_t calls = after.calls[i] - before.calls[i];
+        double mean_ms = calls ? (after.sum_ns[i] - before.sum_ns[i]) / 1e6 / calls : 0.0;
+        out += format("%s\"%s\": {\"count\": %lu, \"bytes\": %lu, \"mean_ms\": %.2f", i ? ", " : "",
+                      transfer_names[i], calls, after.bytes[i] - before.bytes[i], mean_ms);
+        if (link.rtt_ms > 0) out += format(", \"rtts\": %.2f", mean_ms / link.rtt_ms);
+        out += "}";
+    }
+    return out + "}";
+}
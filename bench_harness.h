@@ -0,0 +1,56 @@
+#ifndef BENCH_HARNESS_H
+#define BENCH_HARNESS_H
+
+// What bench and watdfs_replay share: a ./watdfs_server of their own, optionally behind a
+// ./watdfs_wanproxy, and the client's transfer counters.
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <string>
+#include <vector>
+
+// The link put between the client and the server, see wan_proxy.cc.
+struct WanLink {
+    double rtt_ms = 0;
+    double jitter_ms = 0;
+    double bandwidth_mbit = 0;
+    double stall_prob = 0;
+    double stall_ms = 100;
+
+    bool enabled() const { return rtt_ms > 0 || jitter_ms > 0 || bandwidth_mbit > 0 || stall_prob > 0; }
+};
+
+// Takes --rtt, --jitter, --bandwidth, --stall-prob and --stall-ms, false for any other option.
+bool parseLinkOption(const char *arg, const char *value, WanLink *link);
+// The link as a JSON object.
+std::string linkJson(const WanLink &link);
+
+struct BenchServer {
+    std::vector<pid_t> servers;
+    pid_t proxy = 0;
+};
+
+// Runs ./watdfs_server on `dir`, behind ./watdfs_wanproxy when the link is enabled, and points
+// the client at it through SERVER_ADDRESS, SERVER_PORT and WATDFS_BULK_PORT. With more than one
+// server each gets a directory `dir`/<n> and the client is pointed at all of them through
+// WATDFS_SERVERS instead, see shard_transport.h. `replicas` more follow the one server as read
+// replicas and are given to the client through WATDFS_REPLICAS, see replication.h.
+bool startServer(const char *dir, const WanLink &link, BenchServer *bench_server, int count = 1,
+                 int replicas = 0);
+void stopServer(BenchServer *bench_server);
+
+void removeTree(const char *dir);
+
+// The client's download and upload counters, from statsText.
+struct Transfers {
+    uint64_t calls[2] = {0, 0};
+    uint64_t bytes[2] = {0, 0};
+    uint64_t sum_ns[2] = {0, 0};
+};
+
+Transfers transfers();
+// Downloads and uploads between two snapshots as a JSON object; with an rtt, their mean time in
+// round trips of the link too.
+std::string transfersJson(const Transfers &before, const Transfers &after, const WanLink &link);
+
+#endif
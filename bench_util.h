@@ -0,0 +1,34 @@
+#ifndef BENCH_UTIL_H
+#define BENCH_UTIL_H
+
+// Helpers of the benchmarks that do not need a server: bench, watdfs_replay and lock_bench.
+
+#include <stdint.h>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <random>
+#include <vector>
+
+// Samples indexes in [0, n) with zipf popularity of exponent s, 0 for uniform.
+class Zipf {
+    std::vector<double> cdf;
+
+  public:
+    Zipf(int n, double s) {
+        double sum = 0;
+        for (int i = 1; i <= n; ++i) cdf.push_back(sum += 1.0 / std::pow(i, s));
+        for (double &c: cdf) c /= sum;
+    }
+    int operator()(std::mt19937_64 &rng) {
+        double u = std::uniform_real_distribution<double>(0, 1)(rng);
+        return std::lower_bound(cdf.begin(), cdf.end(), u) - cdf.begin();
+    }
+};
+
+inline uint64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+#endif
@@ -0,0 +1,408 @@
+#include "bulk_channel.h"
+#include "debug.h"
+#include "stats.h"
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/random.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <atomic>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// Tokens that are not claimed within this many seconds are dropped.
+#define BULK_TOKEN_TTL_SEC 60
+// A client that could not reach the channel leaves it alone for this many seconds.
+#define BULK_RETRY_SEC 30
+#define BULK_SPLICE_LEN (1 << 20)
+
+// Protocol on a bulk connection, repeated for every transfer:
+//   client: uint64_t token
+//   server: int64_t status, the byte count that follows for BULK_READ or -errno
+//   BULK_READ:  server sends `status` bytes
+//   BULK_WRITE: client sends `size` bytes, server answers int64_t bytes written or -errno
+
+////////////////////////////////////////////helper//////////////////////////////////////////////////
+
+static int read_full(int fd, void *buf, size_t len) {
+    char *p = (char *)buf;
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n < 0) { if (errno == EINTR) continue; return -errno; }
+        if (n == 0) return -ECONNRESET;
+        p += n; len -= n;
+    }
+    return 0;
+}
+
+static int write_full(int fd, const void *buf, size_t len) {
+    const char *p = (const char *)buf;
+    while (len > 0) {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n < 0) { if (errno == EINTR) continue; return -errno; }
+        p += n; len -= n;
+    }
+    return 0;
+}
+
+static void set_nodelay(int sock) {
+    int one = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+static time_t now_sec() {
+    struct timespec t; clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec;
+}
+
+///////////////////////////////////////////server///////////////////////////////////////////////////
+
+// `fd` is a dup of the handle the transfer was registered on, so a token cannot reach another
+// file that reuses the descriptor after a release.
+struct BulkTransfer {
+    int fd;
+    BulkDirection direction;
+    off_t offset;
+    size_t size;
+    time_t created;
+};
+
+// Tokens are the only thing guarding a transfer, so they come from the kernel's generator.
+static uint64_t random_token() {
+    uint64_t token = 0;
+    char *p = (char *)&token;
+    size_t len = sizeof(token);
+    while (len > 0) {
+        ssize_t n = getrandom(p, len, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) break;
+        p += n; len -= n;
+    }
+    if (len > 0) { // no getrandom, e.g. an old kernel
+        int fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+        if (fd < 0 || read_full(fd, &token, sizeof(token)) < 0) abort();
+        close(fd);
+    }
+    return token;
+}
+
+class BulkTable {
+    std::mutex mtx;
+    std::unordered_map<uint64_t, BulkTransfer> map;
+
+  public:
+    uint64_t add(const BulkTransfer &transfer) {
+        mtx.lock();
+        for (auto it = map.begin(); it != map.end();) {
+            if (transfer.created - it->second.created > BULK_TOKEN_TTL_SEC) {
+                close(it->second.fd);
+                it = map.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        uint64_t token = 0;
+        while (token == 0 || map.find(token) != map.end()) token = random_token();
+        map[token] = transfer;
+        mtx.unlock();
+        return token;
+    }
+
+    bool take(uint64_t token, BulkTransfer *transfer) {
+        mtx.lock();
+        auto it = map.find(token);
+        bool found = (it != map.end());
+        if (found) { *transfer = it->second; map.erase(it); }
+        mtx.unlock();
+        return found;
+    }
+};
+
+static BulkTable table;
+static int listen_port = -1;
+
+// Moves `len` bytes sitting in the pipe into the file, with a copy when the file system
+// does not support splice.
+static int drain_pipe(int pipe_rd, int fd, off_t *offset, size_t len, bool *can_splice) {
+    while (len > 0) {
+        if (*can_splice) {
+            ssize_t n = splice(pipe_rd, nullptr, fd, offset, len, SPLICE_F_MOVE);
+            if (n > 0) { len -= n; continue; }
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0 && errno != EINVAL) return -errno;
+            *can_splice = false;
+        }
+        char buf[65536];
+        ssize_t n = read(pipe_rd, buf, len < sizeof(buf) ? len : sizeof(buf));
+        if (n <= 0) return n < 0 ? -errno : -EIO;
+        if (pwrite(fd, buf, n, *offset) != n) return -errno;
+        *offset += n; len -= n;
+    }
+    return 0;
+}
+
+static int serve_read(int sock, const BulkTransfer &transfer, size_t *moved) {
+    struct stat statbuf;
+    int64_t status = 0;
+    if (fstat(transfer.fd, &statbuf) < 0) status = -errno;
+    else if (statbuf.st_size > transfer.offset) status = statbuf.st_size - transfer.offset;
+    if (status > (int64_t)transfer.size) status = transfer.size;
+
+    if (write_full(sock, &status, sizeof(status)) < 0) return -1;
+
+    off_t offset = transfer.offset;
+    size_t remaining = status > 0 ? status : 0;
+    while (remaining > 0) {
+        ssize_t n = sendfile(sock, transfer.fd, &offset, remaining);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1; // the stream is out of sync, drop the connection
+        remaining -= n;
+        *moved += n;
+    }
+    return 0;
+}
+
+static int serve_write(int sock, const BulkTransfer &transfer, size_t *moved) {
+    int pipefd[2];
+    int64_t status = 0;
+    if (pipe2(pipefd, O_CLOEXEC) < 0) {
+        status = -errno;
+        return write_full(sock, &status, sizeof(status));
+    }
+
+    off_t offset = transfer.offset;
+    size_t remaining = transfer.size;
+    bool can_splice = true;
+    if (write_full(sock, &status, sizeof(status)) == 0) {
+        while (remaining > 0) {
+            size_t len = remaining < BULK_SPLICE_LEN ? remaining : BULK_SPLICE_LEN;
+            ssize_t n = splice(sock, nullptr, pipefd[1], nullptr, len, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            if (drain_pipe(pipefd[0], transfer.fd, &offset, n, &can_splice) < 0) break;
+            remaining -= n;
+            *moved += n;
+        }
+    }
+    close(pipefd[0]);
+    close(pipefd[1]);
+    // an aborted upload leaves unread data on the socket, so the connection is dropped
+    if (remaining > 0) return -1;
+
+    status = transfer.size;
+    return write_full(sock, &status, sizeof(status));
+}
+
+static void serve_connection(int sock) {
+    uint64_t token = 0;
+    while (read_full(sock, &token, sizeof(token)) == 0) {
+        BulkTransfer transfer;
+        if (!table.take(token, &transfer)) {
+            DLOG("bulk: unknown token");
+            int64_t status = -EINVAL;
+            if (write_full(sock, &status, sizeof(status)) < 0) break;
+            continue;
+        }
+
+        // the data moves here rather than in the bulk rpc, so the transfer is an operation of its own
+        static const int transfer_op = statsOp("bulk_transfer");
+        uint64_t start = statsNow();
+        size_t moved = 0;
+        int ret = (transfer.direction == BULK_READ) ? serve_read(sock, transfer, &moved)
+                                                     : serve_write(sock, transfer, &moved);
+        statsRecord(transfer_op, statsNow() - start, moved, ret < 0);
+        close(transfer.fd);
+        if (ret < 0) break;
+    }
+    close(sock);
+}
+
+static int bulk_port_env() {
+    static int port = getenv("WATDFS_BULK_PORT") ? atoi(getenv("WATDFS_BULK_PORT")) : 0;
+    return port;
+}
+
+// Listens on the address the server's host name resolves to, the one clients are given, or on
+// WATDFS_BULK_ADDRESS when set.
+static int bulk_listen() {
+    char host[256];
+    const char *env = getenv("WATDFS_BULK_ADDRESS");
+    if (env == nullptr) {
+        if (gethostname(host, sizeof(host)) < 0) return -errno;
+        host[sizeof(host) - 1] = '\0';
+        env = host;
+    }
+
+    struct addrinfo hints, *res = nullptr;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    std::string service = std::to_string(bulk_port_env());
+    if (getaddrinfo(env, service.c_str(), &hints, &res) != 0) return -EADDRNOTAVAIL;
+
+    int sock = -EADDRNOTAVAIL;
+    for (struct addrinfo *ai = res; ai != nullptr; ai = ai->ai_next) {
+        int fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+        if (fd < 0) continue;
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)); // a pinned port after a restart
+        if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(fd, SOMAXCONN) == 0) { sock = fd; break; }
+        sock = -errno;
+        close(fd);
+    }
+    freeaddrinfo(res);
+    return sock;
+}
+
+int bulkServerInit() {
+    int sock = bulk_listen();
+    if (sock < 0) return sock;
+
+    struct sockaddr_storage addr;
+    socklen_t addr_len = sizeof(addr);
+    if (getsockname(sock, (struct sockaddr *)&addr, &addr_len) < 0) {
+        int ret = -errno;
+        close(sock);
+        return ret;
+    }
+    listen_port = ntohs(addr.ss_family == AF_INET6 ? ((struct sockaddr_in6 *)&addr)->sin6_port
+                                                    : ((struct sockaddr_in *)&addr)->sin_port);
+    DLOG("bulk: listening on port %d", listen_port);
+
+    std::thread([sock]() {
+        while (true) {
+            int conn = accept4(sock, nullptr, nullptr, SOCK_CLOEXEC);
+            if (conn < 0) { if (errno == EINTR || errno == ECONNABORTED) continue; break; }
+            set_nodelay(conn);
+            std::thread(serve_connection, conn).detach();
+        }
+        DLOG("bulk: accept failed: %d", errno);
+    }).detach();
+
+    return 0;
+}
+
+int bulkServerPort() { return listen_port; }
+
+uint64_t bulkServerRegister(int fd, BulkDirection direction, off_t offset, size_t size) {
+    int own_fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    if (own_fd < 0) return 0;
+    return table.add(BulkTransfer{own_fd, direction, offset, size, now_sec()});
+}
+
+///////////////////////////////////////////client///////////////////////////////////////////////////
+
+struct BulkConn {
+    int sock;
+    int port;
+};
+
+class BulkPool {
+    std::mutex mtx;
+    std::vector<BulkConn> idle;
+
+  public:
+    int get(int port) {
+        mtx.lock();
+        for (auto it = idle.begin(); it != idle.end(); ++it) {
+            if (it->port == port) {
+                int sock = it->sock;
+                idle.erase(it);
+                mtx.unlock();
+                return sock;
+            }
+        }
+        mtx.unlock();
+
+        // the channel lives on the same host as the rpc server
+        const char *host = getenv("SERVER_ADDRESS");
+        if (host == nullptr) return -EINVAL;
+
+        struct addrinfo hints, *res = nullptr;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        std::string service = std::to_string(port);
+        if (getaddrinfo(host, service.c_str(), &hints, &res) != 0) return -EHOSTUNREACH;
+
+        int sock = -ECONNREFUSED;
+        for (struct addrinfo *ai = res; ai != nullptr; ai = ai->ai_next) {
+            int fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+            if (fd < 0) continue;
+            if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) { sock = fd; break; }
+            close(fd);
+        }
+        freeaddrinfo(res);
+        if (sock >= 0) set_nodelay(sock);
+        return sock;
+    }
+
+    void put(int sock, int port) {
+        mtx.lock();
+        idle.push_back(BulkConn{sock, port});
+        mtx.unlock();
+    }
+
+    void clear() {
+        mtx.lock();
+        for (BulkConn &conn: idle) close(conn.sock);
+        idle.clear();
+        mtx.unlock();
+    }
+};
+
+static BulkPool pool;
+static std::atomic<time_t> unreachable_until{0};
+
+long bulkClientTransfer(uint64_t token, int port, BulkDirection direction, char *buf, size_t size) {
+    if (now_sec() < unreachable_until) return -ENOTSUP;
+
+    if (bulk_port_env() != 0) port = bulk_port_env();
+    int sock = pool.get(port);
+    if (sock < 0) {
+        DLOG("bulk: unable to connect to port %d: %d", port, -sock);
+        unreachable_until = now_sec() + BULK_RETRY_SEC;
+        return -ENOTSUP;
+    }
+
+    // nothing has moved until the server answers the token, so the caller can still fall back
+    int64_t status = 0;
+    if (write_full(sock, &token, sizeof(token)) < 0 || read_full(sock, &status, sizeof(status)) < 0) {
+        close(sock);
+        return -ENOTSUP;
+    }
+    if (status < 0) { pool.put(sock, port); return status; }
+
+    int ret = 0;
+    if (direction == BULK_READ) {
+        if ((size_t)status > size) ret = -EIO;
+        else ret = read_full(sock, buf, status);
+    } else {
+        ret = write_full(sock, buf, size);
+        if (ret == 0) ret = read_full(sock, &status, sizeof(status));
+    }
+    if (ret < 0) {
+        DLOG("bulk: transfer failed: %d", -ret);
+        close(sock);
+        return -EIO;
+    }
+
+    pool.put(sock, port);
+    return status;
+}
+
+void bulkClientDestroy() { pool.clear(); }
@@ -0,0 +1,31 @@
+#ifndef BULK_CHANNEL_H
+#define BULK_CHANNEL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// A data channel next to the rpc connection for large transfers. The bulk rpc registers a
+// file range on the server and returns a token and the channel's port; the client then sends
+// the token over a plain TCP connection and the range is streamed with sendfile (download)
+// or spliced from the socket into the file (upload), so the server never copies it through
+// user space.
+
+enum BulkDirection { BULK_READ = 0, BULK_WRITE = 1 };
+
+// Server: listen for bulk connections in a background thread, on WATDFS_BULK_PORT or an
+// ephemeral port of the server's own address (WATDFS_BULK_ADDRESS overrides it).
+int bulkServerInit();
+int bulkServerPort();
+// Server: allow one transfer of `size` bytes at `offset` of `fd`, returns its token, or 0 with
+// errno set. The transfer keeps the open file even if `fd` is closed and reused meanwhile.
+uint64_t bulkServerRegister(int fd, BulkDirection direction, off_t offset, size_t size);
+
+// Client: run the transfer registered as `token` with the server's bulk channel on `port`, or
+// on WATDFS_BULK_PORT when set, e.g. to go through a proxy. Returns the number of bytes moved or
+// -errno, and -ENOTSUP before anything moved when the channel cannot be reached, so the caller
+// can use the rpcs instead.
+long bulkClientTransfer(uint64_t token, int port, BulkDirection direction, char *buf, size_t size);
+void bulkClientDestroy();
+
+#endif
@@ -0,0 +1,179 @@
+#include "cache_index.h"
+#include "debug.h"
+
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#define INDEX_MAGIC 0x78646977 // "widx"
+#define INDEX_PUT 0
+#define INDEX_REMOVE 1
+
+// Every record: IndexRecord, path, IndexChunk[nchunks].
+struct IndexRecord {
+    uint32_t magic;
+    uint32_t op;
+    uint32_t path_len;
+    uint32_t nchunks;
+    int64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+};
+
+class CacheIndex {
+    std::mutex mtx;
+    std::unordered_map<std::string, IndexEntry> map;
+    std::string file;
+    int fd = -1;
+
+    static std::string record(uint32_t op, const std::string &path, const IndexEntry &entry) {
+        IndexRecord header = {INDEX_MAGIC, op, (uint32_t)path.size(), (uint32_t)entry.chunks.size(),
+                              (int64_t)entry.size, (int64_t)entry.mtime.tv_sec, (int64_t)entry.mtime.tv_nsec};
+        std::string buf((const char *)&header, sizeof(header));
+        buf += path;
+        buf.append((const char *)entry.chunks.data(), entry.chunks.size() * sizeof(IndexChunk));
+        return buf;
+    }
+
+    static size_t record_len(const std::string &path, const IndexEntry &entry) {
+        return sizeof(IndexRecord) + path.size() + entry.chunks.size() * sizeof(IndexChunk);
+    }
+
+    // a torn record at the end, from a crash during an append, ends the replay
+    size_t replay(const std::string &log) {
+        size_t pos = 0;
+        while (log.size() - pos >= sizeof(IndexRecord)) {
+            IndexRecord header;
+            memcpy(&header, log.data() + pos, sizeof(header));
+            size_t len = sizeof(header) + header.path_len + (size_t)header.nchunks * sizeof(IndexChunk);
+            if (header.magic != INDEX_MAGIC || header.path_len > PATH_MAX || len > log.size() - pos) break;
+
+            std::string path(log.data() + pos + sizeof(header), header.path_len);
+            if (header.op == INDEX_REMOVE) {
+                map.erase(path);
+            } else {
+                IndexEntry &entry = map[path];
+                entry.size = header.size;
+                entry.mtime.tv_sec = header.mtime_sec;
+                entry.mtime.tv_nsec = header.mtime_nsec;
+                entry.chunks.resize(header.nchunks);
+                memcpy((void *)entry.chunks.data(), log.data() + pos + sizeof(header) + header.path_len,
+                       header.nchunks * sizeof(IndexChunk));
+            }
+            pos += len;
+        }
+        return pos;
+    }
+
+    // the live entries in a new log, which replaces the old one and takes its appends from here on
+    int rewrite() {
+        std::string live;
+        for (auto &it: map) live += record(INDEX_PUT, it.first, it.second);
+        std::string tmp = file + ".tmp";
+        int out = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+        if (out < 0) return -errno;
+        bool ok = (write(out, live.data(), live.size()) == (ssize_t)live.size());
+        ok = (fsync(out) == 0) && ok;
+        close(out);
+        if (!ok || rename(tmp.c_str(), file.c_str()) < 0) { unlink(tmp.c_str()); return -EIO; }
+
+        if (fd >= 0) close(fd);
+        fd = open(file.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+        return fd < 0 ? -errno : 0;
+    }
+
+    // `map` already holds the change. A failed or short write would leave a torn record that ends
+    // the replay, and a lost remove would leave a stale entry, so the log is written anew; if that
+    // fails too the log is dropped and a restart starts cold.
+    int append(const std::string &buf) {
+        if (fd < 0) return -EBADF;
+        if (write(fd, buf.data(), buf.size()) == (ssize_t)buf.size()) return 0;
+        int ret = rewrite();
+        if (ret < 0) {
+            if (fd >= 0) close(fd);
+            fd = -1;
+            unlink(file.c_str());
+        }
+        return ret;
+    }
+
+  public:
+    int load(const std::string &index_file) {
+        file = index_file;
+
+        std::string log;
+        int in = open(file.c_str(), O_RDONLY | O_CLOEXEC);
+        if (in >= 0) {
+            char buf[65536];
+            ssize_t n;
+            while ((n = read(in, buf, sizeof(buf))) > 0) log.append(buf, n);
+            close(in);
+        }
+        size_t valid = replay(log);
+
+        // rewrite the log when most of it is stale or torn
+        size_t live = 0;
+        for (auto &it: map) live += record_len(it.first, it.second);
+        if (valid < log.size() || log.size() > 2 * live + (1 << 20)) {
+            int ret = rewrite();
+            if (ret < 0) return ret;
+        } else {
+            fd = open(file.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+            if (fd < 0) return -errno;
+        }
+        DLOG("cache index: %zu entries", map.size());
+        return 0;
+    }
+
+    void unload() {
+        mtx.lock();
+        if (fd >= 0) close(fd);
+        fd = -1;
+        map.clear();
+        mtx.unlock();
+    }
+
+    bool get(const std::string &path, IndexEntry *entry) {
+        mtx.lock();
+        auto it = map.find(path);
+        bool found = (it != map.end());
+        if (found) *entry = it->second;
+        mtx.unlock();
+        return found;
+    }
+
+    void put(const std::string &path, const IndexEntry &entry) {
+        mtx.lock();
+        map[path] = entry;
+        if (append(record(INDEX_PUT, path, entry)) < 0) DLOG("cache index: append failed");
+        mtx.unlock();
+    }
+
+    void remove(const std::string &path) {
+        mtx.lock();
+        if (map.erase(path) > 0 && append(record(INDEX_REMOVE, path, IndexEntry())) < 0) {
+            DLOG("cache index: append failed");
+        }
+        mtx.unlock();
+    }
+};
+
+static CacheIndex cache_index;
+
+int cacheIndexInit(const char *cache_dir) {
+    std::string dir = std::string(cache_dir) + "/.watdfs";
+    if (mkdir(dir.c_str(), 0700) < 0 && errno != EEXIST) return -errno;
+    return cache_index.load(dir + "/index");
+}
+
+void cacheIndexDestroy() { cache_index.unload(); }
+
+bool cacheIndexGet(const char *path, IndexEntry *entry) { return cache_index.get(path, entry); }
+void cacheIndexPut(const char *path, const IndexEntry &entry) { cache_index.put(path, entry); }
+void cacheIndexRemove(const char *path) { cache_index.remove(path); }
@@ -0,0 +1,36 @@
+#ifndef CACHE_INDEX_H
+#define CACHE_INDEX_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+#include <vector>
+
+#include "sha256.h"
+
+// Persistent record of which cached files are valid, kept in <cache>/.watdfs/index so a
+// restarted client can serve its warm working set without downloading it again. Every entry
+// holds the server's size and mtime of the file as cached, and its chunks when the content
+// lives in the chunk store instead of the flat cache file.
+//
+// The index is an append-only log, replayed at init and rewritten when mostly stale.
+
+struct IndexChunk {
+    uint32_t len;
+    uint8_t hash[SHA256_LEN];
+};
+
+struct IndexEntry {
+    off_t size;
+    struct timespec mtime;
+    std::vector<IndexChunk> chunks; // empty when the flat cache file holds the content
+};
+
+int cacheIndexInit(const char *cache_dir);
+void cacheIndexDestroy();
+
+bool cacheIndexGet(const char *path, IndexEntry *entry);
+void cacheIndexPut(const char *path, const IndexEntry &entry);
+void cacheIndexRemove(const char *path);
+
+#endif
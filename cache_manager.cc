@@ -0,0 +1,183 @@
+#include "cache_manager.h"
+#include "debug.h"
+
+#include <ftw.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <algorithm>
+#include <condition_variable>
+#include <cstring>
+#include <list>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// Eviction goes down to this share of the budget so it does not run on every insert.
+#define CACHE_LOW_WATER_PCT 90
+#define CACHE_DEFAULT_MAX_BYTES (1ull << 30)
+#define CACHE_DEFAULT_MAX_FILES 100000
+
+struct CacheEntry {
+    std::string path;
+    size_t size;
+};
+
+class CacheManager {
+    std::mutex mtx;
+    std::condition_variable wake;
+    std::list<CacheEntry> lru; // most recently used at the front
+    std::unordered_map<std::string, std::list<CacheEntry>::iterator> map;
+    std::unordered_map<std::string, int> pinned; // open count, a path can be opened more than once
+    std::thread evictor;
+    bool stop = false;
+
+    CacheStats stats;
+
+    bool over(uint64_t pct) {
+        return (max_bytes > 0 && stats.bytes * 100 > max_bytes * pct) ||
+               (max_files > 0 && stats.files * 100 > max_files * pct);
+    }
+
+    void remove(std::list<CacheEntry>::iterator it) {
+        stats.bytes -= it->size;
+        --stats.files;
+        map.erase(it->path);
+        lru.erase(it);
+    }
+
+    void run() {
+        std::unique_lock<std::mutex> lock(mtx);
+        while (!stop) {
+            wake.wait(lock, [this]() { return stop || over(100); });
+            while (!stop && !lru.empty() && over(CACHE_LOW_WATER_PCT)) {
+                // unlinked under the lock so a concurrent open cannot pin it halfway
+                auto victim = std::prev(lru.end());
+                if (unlink(victim->path.c_str()) < 0 && errno != ENOENT) {
+                    DLOG("cache: unable to evict %s: %d", victim->path.c_str(), errno);
+                }
+                ++stats.evictions;
+                stats.evicted_bytes += victim->size;
+                remove(victim);
+            }
+        }
+    }
+
+  public:
+    uint64_t max_bytes = 0;
+    uint64_t max_files = 0;
+
+    CacheManager() { memset(&stats, 0, sizeof(stats)); }
+
+    void start() {
+        stop = false;
+        evictor = std::thread(&CacheManager::run, this);
+    }
+
+    void shutdown() {
+        mtx.lock();
+        stop = true;
+        mtx.unlock();
+        wake.notify_one();
+        if (evictor.joinable()) evictor.join();
+    }
+
+    void touch(const std::string &path, size_t size) {
+        mtx.lock();
+        if (pinned.find(path) == pinned.end()) {
+            auto it = map.find(path);
+            if (it != map.end()) remove(it->second);
+            lru.push_front(CacheEntry{path, size});
+            map[path] = lru.begin();
+            stats.bytes += size;
+            ++stats.files;
+        }
+        bool evict = over(100);
+        mtx.unlock();
+        if (evict) wake.notify_one();
+    }
+
+    void pin(const std::string &path) {
+        mtx.lock();
+        ++pinned[path];
+        auto it = map.find(path);
+        if (it != map.end()) remove(it->second);
+        mtx.unlock();
+    }
+
+    void unpin(const std::string &path, size_t size) {
+        mtx.lock();
+        auto it = pinned.find(path);
+        bool last = (it != pinned.end() && --it->second == 0);
+        if (last) pinned.erase(it);
+        mtx.unlock();
+        if (last) touch(path, size);
+    }
+
+    void count(bool hit, size_t bytes) {
+        mtx.lock();
+        if (hit) { ++stats.hits; stats.hit_bytes += bytes; }
+        else { ++stats.misses; stats.miss_bytes += bytes; }
+        mtx.unlock();
+    }
+
+    CacheStats snapshot() {
+        mtx.lock();
+        CacheStats copy = stats;
+        mtx.unlock();
+        return copy;
+    }
+};
+
+static CacheManager manager;
+
+static long env_or(const char *name, long value) {
+    const char *env = getenv(name);
+    return env ? atol(env) : value;
+}
+
+// files found by the initial scan, replayed oldest first
+static std::vector<std::pair<struct timespec, CacheEntry>> found;
+
+static int scan_entry(const char *path, const struct stat *statbuf, int type, struct FTW *ftw) {
+    // half written chunks are left out, the store never reads them, and so is the client's own
+    // state next to the chunks
+    bool own_state = strstr(path, "/.watdfs/") != nullptr && strstr(path, "/.watdfs/chunks/") == nullptr;
+    if (type == FTW_F && S_ISREG(statbuf->st_mode) && strstr(path, ".tmp") == nullptr && !own_state) {
+        found.push_back(std::make_pair(statbuf->st_mtim, CacheEntry{path, (size_t)statbuf->st_size}));
+    }
+    return 0;
+}
+
+int cacheManagerInit(const char *cache_dir) {
+    manager.max_bytes = env_or("WATDFS_CACHE_MAX_BYTES", CACHE_DEFAULT_MAX_BYTES);
+    manager.max_files = env_or("WATDFS_CACHE_MAX_FILES", CACHE_DEFAULT_MAX_FILES);
+
+    found.clear();
+    if (nftw(cache_dir, scan_entry, 16, FTW_PHYS) < 0) return -errno;
+    std::sort(found.begin(), found.end(), [](const std::pair<struct timespec, CacheEntry> &a,
+                                             const std::pair<struct timespec, CacheEntry> &b) {
+        return a.first.tv_sec != b.first.tv_sec ? a.first.tv_sec < b.first.tv_sec
+                                                : a.first.tv_nsec < b.first.tv_nsec;
+    });
+    for (auto &entry: found) manager.touch(entry.second.path, entry.second.size);
+    DLOG("cache: %zu files found in %s", found.size(), cache_dir);
+    found.clear();
+
+    manager.start();
+    return 0;
+}
+
+void cacheManagerDestroy() { manager.shutdown(); }
+
+void cacheTouch(const char *path, size_t size) { manager.touch(path, size); }
+void cachePin(const char *path) { manager.pin(path); }
+void cacheUnpin(const char *path, size_t size) { manager.unpin(path, size); }
+
+void cacheHit(size_t bytes) { manager.count(true, bytes); }
+void cacheMiss(size_t bytes) { manager.count(false, bytes); }
+
+CacheStats cacheStats() { return manager.snapshot(); }
@@ -0,0 +1,40 @@
+#ifndef CACHE_MANAGER_H
+#define CACHE_MANAGER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Keeps the client cache directory within a byte and file budget. Every closed cache file and
+// every stored chunk is tracked in least recently used order, and a background thread removes
+// the least recently used ones whenever the cache is over budget. Open files are pinned and are
+// never evicted, the copies of closed files are not needed since every open downloads again.
+//
+// WATDFS_CACHE_MAX_BYTES and WATDFS_CACHE_MAX_FILES set the budget, 0 for no limit.
+
+// Scans what is already in `cache_dir` and starts the eviction thread.
+int cacheManagerInit(const char *cache_dir);
+void cacheManagerDestroy();
+
+// Marks `path` (a file in the cache directory) as just used, with its current size.
+void cacheTouch(const char *path, size_t size);
+// Keeps `path` from being evicted while it is open, until every pin is matched by an unpin.
+void cachePin(const char *path);
+void cacheUnpin(const char *path, size_t size);
+
+// Chunk store lookups, for the statistics.
+void cacheHit(size_t bytes);
+void cacheMiss(size_t bytes);
+
+struct CacheStats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t hit_bytes;
+    uint64_t miss_bytes;
+    uint64_t evictions;
+    uint64_t evicted_bytes;
+    uint64_t bytes; // tracked now, pinned files excluded
+    uint64_t files;
+};
+CacheStats cacheStats();
+
+#endif
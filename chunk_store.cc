@@ -0,0 +1,117 @@
+#include "chunk_store.h"
+#include "cache_manager.h"
+#include "debug.h"
+
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <cstring>
+#include <string>
+#include <thread>
+
+static std::string store_dir;
+
+static std::string chunk_path(const uint8_t hash[SHA256_LEN], bool make_dir) {
+    static const char hex[] = "0123456789abcdef";
+    std::string name;
+    for (int i = 0; i < SHA256_LEN; ++i) {
+        name += hex[hash[i] >> 4];
+        name += hex[hash[i] & 0xf];
+    }
+
+    // fan out over 256 directories on the first byte
+    std::string dir = store_dir + "/" + name.substr(0, 2);
+    if (make_dir) mkdir(dir.c_str(), 0700);
+    return dir + "/" + name;
+}
+
+int chunkStoreInit(const char *cache_dir) {
+    const char *env = getenv("WATDFS_CHUNK_STORE");
+    if (env && strcmp(env, "0") == 0) return 0;
+
+    std::string dir = std::string(cache_dir) + "/.watdfs";
+    if (mkdir(dir.c_str(), 0700) < 0 && errno != EEXIST) return -errno;
+    dir += "/chunks";
+    if (mkdir(dir.c_str(), 0700) < 0 && errno != EEXIST) return -errno;
+
+    store_dir = dir;
+    DLOG("chunk store in %s", store_dir.c_str());
+    return 0;
+}
+
+bool chunkStoreEnabled() { return !store_dir.empty(); }
+
+int chunkStoreCopy(const uint8_t hash[SHA256_LEN], int fd, off_t offset, size_t len) {
+    std::string path = chunk_path(hash, false);
+    int src = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (src < 0) {
+        cacheMiss(len);
+        return -errno;
+    }
+
+    struct stat statbuf;
+    if (fstat(src, &statbuf) < 0 || (size_t)statbuf.st_size != len) {
+        close(src);
+        cacheMiss(len);
+        // chunks are checked against their hash when stored and renamed in whole, so a wrong size
+        // is all that is looked for here; such a chunk is as good as a missing one
+        return -ENOENT;
+    }
+    size_t chunk_len = len;
+
+    // in kernel, and shared extents where the file system can
+    off_t src_offset = 0;
+    int ret = 0;
+    while (len > 0) {
+        ssize_t n = copy_file_range(src, &src_offset, fd, &offset, len, 0);
+        if (n > 0) { len -= n; continue; }
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && errno != EXDEV && errno != ENOSYS && errno != EINVAL && errno != EOPNOTSUPP) {
+            ret = -errno;
+            break;
+        }
+
+        char buf[65536];
+        n = pread(src, buf, len < sizeof(buf) ? len : sizeof(buf), src_offset);
+        if (n <= 0) { ret = n < 0 ? -errno : -EIO; break; }
+        if (pwrite(fd, buf, n, offset) != n) { ret = -EIO; break; }
+        src_offset += n; offset += n; len -= n;
+    }
+
+    // the mtime orders the chunks when the cache is scanned after a restart
+    if (ret == 0) {
+        futimens(src, nullptr);
+        cacheTouch(path.c_str(), chunk_len);
+        cacheHit(chunk_len);
+    } else {
+        cacheMiss(chunk_len); // fetched from the server after all
+    }
+
+    close(src);
+    return ret;
+}
+
+int chunkStorePut(const uint8_t hash[SHA256_LEN], const char *data, size_t len) {
+    uint8_t actual[SHA256_LEN];
+    sha256(data, len, actual);
+    if (memcmp(actual, hash, SHA256_LEN) != 0) return -EBADMSG;
+
+    std::string path = chunk_path(hash, true);
+    if (access(path.c_str(), F_OK) == 0) return 0;
+
+    // written aside and renamed, so a chunk is either complete or absent
+    std::string tmp = path + ".tmp" + std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id()));
+    int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) return -errno;
+
+    int ret = 0;
+    if (write(fd, data, len) != (ssize_t)len) ret = -EIO;
+    if (close(fd) < 0 && ret == 0) ret = -errno;
+    if (ret == 0 && rename(tmp.c_str(), path.c_str()) < 0) ret = -errno;
+    if (ret < 0) unlink(tmp.c_str());
+    else cacheTouch(path.c_str(), len);
+
+    return ret;
+}
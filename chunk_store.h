@@ -0,0 +1,25 @@
+#ifndef CHUNK_STORE_H
+#define CHUNK_STORE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "sha256.h"
+
+// Content-addressed store of file chunks on the client, kept under <cache>/.watdfs/chunks
+// with one file per chunk named by its sha256. Downloads take the chunks they already have
+// from here and only fetch the rest, so content shared between files or versions of a file is
+// transferred and stored once.
+
+// Creates the store under `cache_dir`, returns 0 or -errno. WATDFS_CHUNK_STORE=0 disables it.
+int chunkStoreInit(const char *cache_dir);
+bool chunkStoreEnabled();
+
+// Copies the chunk `hash` of `len` bytes into `fd` at `offset`, -ENOENT if it is not stored.
+int chunkStoreCopy(const uint8_t hash[SHA256_LEN], int fd, off_t offset, size_t len);
+
+// Adds data[0, len) as the chunk `hash`, -EBADMSG if the data does not match it.
+int chunkStorePut(const uint8_t hash[SHA256_LEN], const char *data, size_t len);
+
+#endif
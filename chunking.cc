@@ -0,0 +1,68 @@
+#include "chunking.h"
+
+#include <errno.h>
+#include <unistd.h>
+#include <cstring>
+
+// A boundary is where the top bits of the gear hash are all zero, log2(CDC_AVG) bits of them.
+#define CDC_MASK (~0ull << (64 - 16))
+
+struct GearTable {
+    uint64_t gear[256];
+    GearTable() {
+        // splitmix64, fixed seed so every build chunks the same way
+        uint64_t x = 0x6a09e667f3bcc908ull;
+        for (int i = 0; i < 256; ++i) {
+            uint64_t z = (x += 0x9e3779b97f4a7c15ull);
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+            gear[i] = z ^ (z >> 31);
+        }
+    }
+};
+
+static const GearTable table;
+
+size_t cdcCut(const char *data, size_t len) {
+    if (len <= CDC_MIN) return len;
+    size_t end = (len < CDC_MAX) ? len : CDC_MAX;
+
+    uint64_t hash = 0;
+    for (size_t i = CDC_MIN; i < end; ++i) {
+        hash = (hash << 1) + table.gear[(uint8_t)data[i]];
+        if ((hash & CDC_MASK) == 0) return i + 1;
+    }
+    return end;
+}
+
+int chunkFile(int fd, std::vector<ChunkRef> *refs) {
+    std::vector<char> buf(2 * CDC_MAX);
+    size_t avail = 0;
+    uint64_t offset = 0;
+    bool eof = false;
+
+    while (true) {
+        // keep at least CDC_MAX bytes buffered so every cut sees a full window
+        while (!eof && avail < CDC_MAX) {
+            ssize_t n = pread(fd, buf.data() + avail, buf.size() - avail, offset + avail);
+            if (n < 0) { if (errno == EINTR) continue; return -errno; }
+            if (n == 0) eof = true;
+            avail += n;
+        }
+        if (avail == 0) break;
+
+        size_t len = cdcCut(buf.data(), avail);
+        ChunkRef ref;
+        memset(&ref, 0, sizeof(ref));
+        ref.offset = offset;
+        ref.len = len;
+        sha256(buf.data(), len, ref.hash);
+        refs->push_back(ref);
+
+        memmove(buf.data(), buf.data() + len, avail - len);
+        avail -= len;
+        offset += len;
+    }
+
+    return 0;
+}
@@ -0,0 +1,32 @@
+#ifndef CHUNKING_H
+#define CHUNKING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+#include "sha256.h"
+
+// Content-defined chunking: chunk boundaries are picked by a rolling gear hash over the data,
+// so an insert or delete only changes the chunks around it and identical content in different
+// files (or at different offsets) yields identical chunks.
+#define CDC_MIN (16 << 10)
+#define CDC_AVG (64 << 10)
+#define CDC_MAX (256 << 10)
+
+// One entry of a file's chunk manifest.
+struct ChunkRef {
+    uint64_t offset;
+    uint32_t len;
+    uint32_t pad;
+    uint8_t hash[SHA256_LEN];
+};
+
+// Length of the chunk at the front of data[0, len), `len` is either at least CDC_MAX or the
+// rest of the file.
+size_t cdcCut(const char *data, size_t len);
+
+// Appends the manifest of the whole file to `refs`, returns 0 or -errno.
+int chunkFile(int fd, std::vector<ChunkRef> *refs);
+
+#endif
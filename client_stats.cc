@@ -0,0 +1,176 @@
+#include "client_stats.h"
+#include "stats.h"
+#include "cache_manager.h"
+#include "ram_cache.h"
+#include "compress.h"
+#include "rpc_stub.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstdarg>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+static const char *op_names[CLI_OPS] = {
+    "getattr", "mknod", "open", "release", "read", "write", "truncate", "fsync", "utimens",
+    "fresh_local", "fresh_validated", "fresh_stale",
+    "cache_hit", "cache_miss",
+    "download", "upload",
+};
+
+// the registry index of every ClientOp, taken the first time any of them is used
+static int op_index(ClientOp op) {
+    static std::vector<int> ops = []() {
+        std::vector<int> ops;
+        for (int i = 0; i < CLI_OPS; ++i) ops.push_back(statsOp(op_names[i]));
+        return ops;
+    }();
+    return ops[op];
+}
+
+int clientStatsDone(ClientOp op, uint64_t start, uint64_t bytes, int ret) {
+    statsRecord(op_index(op), statsNow() - start, bytes, ret < 0);
+    return ret;
+}
+
+void clientStatsCount(ClientOp op, uint64_t bytes) { statsRecord(op_index(op), 0, bytes, false); }
+
+const char *clientOpName(ClientOp op) { return op_names[op]; }
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+static void appendf(std::string *out, const char *format, ...) {
+    char line[256];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+    *out += line;
+}
+
+static std::string stats_file_text() {
+    op_index(CLI_GETATTR);
+    std::string out = statsPrometheus(statsText(), "watdfs_client");
+
+    CacheStats cache = cacheStats();
+    appendf(&out, "# TYPE watdfs_client_chunk_store_total counter\n");
+    appendf(&out, "watdfs_client_chunk_store_total{event=\"hit\"} %lu\n", cache.hits);
+    appendf(&out, "watdfs_client_chunk_store_total{event=\"miss\"} %lu\n", cache.misses);
+    appendf(&out, "watdfs_client_chunk_store_total{event=\"eviction\"} %lu\n", cache.evictions);
+    appendf(&out, "# TYPE watdfs_client_chunk_store_bytes_total counter\n");
+    appendf(&out, "watdfs_client_chunk_store_bytes_total{event=\"hit\"} %lu\n", cache.hit_bytes);
+    appendf(&out, "watdfs_client_chunk_store_bytes_total{event=\"miss\"} %lu\n", cache.miss_bytes);
+    appendf(&out, "watdfs_client_chunk_store_bytes_total{event=\"eviction\"} %lu\n", cache.evicted_bytes);
+    appendf(&out, "# TYPE watdfs_client_cache_bytes gauge\nwatdfs_client_cache_bytes %lu\n", cache.bytes);
+    appendf(&out, "# TYPE watdfs_client_cache_files gauge\nwatdfs_client_cache_files %lu\n", cache.files);
+
+    RamCacheStats ram = ramCacheStats();
+    appendf(&out, "# TYPE watdfs_client_ram_cache_total counter\n");
+    appendf(&out, "watdfs_client_ram_cache_total{event=\"hit\"} %lu\n", ram.hits);
+    appendf(&out, "watdfs_client_ram_cache_total{event=\"miss\"} %lu\n", ram.misses);
+    appendf(&out, "watdfs_client_ram_cache_total{event=\"promotion\"} %lu\n", ram.promotions);
+    appendf(&out, "watdfs_client_ram_cache_total{event=\"demotion\"} %lu\n", ram.demotions);
+    appendf(&out, "# TYPE watdfs_client_ram_cache_bytes gauge\nwatdfs_client_ram_cache_bytes %lu\n", ram.bytes);
+    appendf(&out, "# TYPE watdfs_client_ram_cache_files gauge\nwatdfs_client_ram_cache_files %lu\n", ram.files);
+
+    ZStats z = zStats();
+    appendf(&out, "# TYPE watdfs_client_compress_bytes_total counter\n");
+    appendf(&out, "watdfs_client_compress_bytes_total{side=\"raw\"} %lu\n", z.raw_bytes);
+    appendf(&out, "watdfs_client_compress_bytes_total{side=\"wire\"} %lu\n", z.wire_bytes);
+    appendf(&out, "# TYPE watdfs_client_compress_frames_total counter\n");
+    appendf(&out, "watdfs_client_compress_frames_total{stored=\"0\"} %lu\n", z.frames - z.stored_frames);
+    appendf(&out, "watdfs_client_compress_frames_total{stored=\"1\"} %lu\n", z.stored_frames);
+    appendf(&out, "# TYPE watdfs_client_compress_cpu_seconds_total counter\n");
+    appendf(&out, "watdfs_client_compress_cpu_seconds_total %.9f\n", z.cpu_ns / 1e9);
+
+    appendf(&out, "# TYPE watdfs_client_rpc_calls_total counter\n");
+    for (auto &it: rpc_stub::call_count_snapshot()) {
+        appendf(&out, "watdfs_client_rpc_calls_total{rpc=\"%s\"} %lu\n", it.first.c_str(), it.second);
+    }
+    return out;
+}
+
+// The contents of every open handle of the stats file, by fh.
+class StatsFiles {
+    std::mutex mtx;
+    std::unordered_map<uint64_t, std::string> open;
+    uint64_t next = 1;
+
+  public:
+    uint64_t add(const std::string &text) {
+        mtx.lock();
+        uint64_t fh = next++;
+        open[fh] = text;
+        mtx.unlock();
+        return fh;
+    }
+
+    long read(uint64_t fh, char *buf, size_t size, off_t offset) {
+        mtx.lock();
+        auto it = open.find(fh);
+        if (it == open.end()) { mtx.unlock(); return -EBADF; }
+        size_t len = 0;
+        if ((size_t)offset < it->second.size()) {
+            len = std::min(size, it->second.size() - offset);
+            memcpy(buf, it->second.data() + offset, len);
+        }
+        mtx.unlock();
+        return len;
+    }
+
+    void remove(uint64_t fh) {
+        mtx.lock();
+        open.erase(fh);
+        mtx.unlock();
+    }
+};
+
+static StatsFiles stats_files;
+
+bool isStatsPath(const char *path) {
+    return strcmp(path, STATS_FILE_DIR) == 0 || strncmp(path, STATS_FILE_DIR "/", strlen(STATS_FILE_DIR) + 1) == 0;
+}
+
+int statsFileGetattr(const char *path, struct stat *statbuf) {
+    memset(statbuf, 0, sizeof(struct stat));
+    if (strcmp(path, STATS_FILE_DIR) == 0) {
+        statbuf->st_mode = S_IFDIR | 0555;
+        statbuf->st_nlink = 2;
+    } else if (strcmp(path, STATS_FILE) == 0) {
+        statbuf->st_mode = S_IFREG | 0444;
+        statbuf->st_nlink = 1;
+        statbuf->st_size = stats_file_text().size();
+    } else {
+        return -ENOENT;
+    }
+    statbuf->st_uid = getuid();
+    statbuf->st_gid = getgid();
+    clock_gettime(CLOCK_REALTIME, &statbuf->st_mtim);
+    statbuf->st_atim = statbuf->st_ctim = statbuf->st_mtim;
+    return 0;
+}
+
+int statsFileOpen(const char *path, struct fuse_file_info *fi) {
+    if (strcmp(path, STATS_FILE) != 0) return strcmp(path, STATS_FILE_DIR) == 0 ? -EISDIR : -ENOENT;
+    if ((fi->flags & O_ACCMODE) != O_RDONLY) return -EACCES;
+    fi->fh = stats_files.add(stats_file_text());
+    // the size from getattr is stale by the time it is read
+    fi->direct_io = 1;
+    return 0;
+}
+
+int statsFileRead(char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+    return stats_files.read(fi->fh, buf, size, offset);
+}
+
+int statsFileRelease(struct fuse_file_info *fi) {
+    stats_files.remove(fi->fh);
+    return 0;
+}
@@ -0,0 +1,44 @@
+#ifndef CLIENT_STATS_H
+#define CLIENT_STATS_H
+
+#include <fuse.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+// Client metrics, kept in the per-thread registry of stats.h: the latency of every FUSE
+// operation, how freshness checks end, whether opens found the cache current, and the downloads
+// and uploads with their bytes. They are read from the control file STATS_FILE in the mount,
+// without any rpc, together with the chunk store, RAM cache, compression and rpc counters.
+
+enum ClientOp {
+    CLI_GETATTR, CLI_MKNOD, CLI_OPEN, CLI_RELEASE, CLI_READ, CLI_WRITE, CLI_TRUNCATE, CLI_FSYNC, CLI_UTIMENS,
+    // isFresh without a server round trip, after a getattr that found the copy current, or stale
+    CLI_FRESH_LOCAL, CLI_FRESH_VALIDATED, CLI_FRESH_STALE,
+    // a download that found the cached copy current, or had to move it; bytes of the file
+    CLI_CACHE_HIT, CLI_CACHE_MISS,
+    // timed, with the bytes received and sent
+    CLI_DOWNLOAD, CLI_UPLOAD,
+    CLI_OPS
+};
+
+// Records `op` as started at `start` (statsNow) and returns `ret`, an error when negative.
+int clientStatsDone(ClientOp op, uint64_t start, uint64_t bytes, int ret);
+// Records an event that takes no time of its own.
+void clientStatsCount(ClientOp op, uint64_t bytes);
+// The name the op is reported under.
+const char *clientOpName(ClientOp op);
+
+#define STATS_FILE_DIR "/.watdfs"
+#define STATS_FILE STATS_FILE_DIR "/stats"
+
+// Whether the path is the control directory or the file in it, which the FUSE operations hand to
+// the functions below instead of the server. Everything else on them fails with EACCES.
+bool isStatsPath(const char *path);
+
+int statsFileGetattr(const char *path, struct stat *statbuf);
+// The file's contents are fixed when it is opened.
+int statsFileOpen(const char *path, struct fuse_file_info *fi);
+int statsFileRead(char *buf, size_t size, off_t offset, struct fuse_file_info *fi);
+int statsFileRelease(struct fuse_file_info *fi);
+
+#endif
@@ -0,0 +1,99 @@
+#include "compress.h"
+#include "debug.h"
+
+#include <time.h>
+#include <zlib.h>
+#include <atomic>
+#include <cstring>
+
+// Speed over ratio, the codec has to keep up with the link.
+#define ZLEVEL 1
+// Chunks are probed by deflating their first ZSAMPLE_LEN bytes, if the sample saves less than
+// 1/ZSAMPLE_MIN_GAIN of its size the whole chunk is stored without trying.
+#define ZSAMPLE_LEN 4096
+#define ZSAMPLE_MIN_GAIN 16
+
+static std::atomic<uint64_t> raw_bytes(0), wire_bytes(0), frames(0), stored_frames(0), cpu_ns(0);
+
+static uint64_t thread_cpu_ns() {
+    struct timespec t;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t);
+    return (uint64_t)t.tv_sec * 1000000000ull + t.tv_nsec;
+}
+
+static bool worth_compressing(const char *raw, size_t raw_len) {
+    if (raw_len < 4 * ZSAMPLE_LEN) return true;
+    char sample[ZSAMPLE_LEN + ZSAMPLE_LEN / 8];
+    uLongf len = sizeof(sample);
+    if (compress2((Bytef *)sample, &len, (const Bytef *)raw, ZSAMPLE_LEN, ZLEVEL) != Z_OK) return false;
+    return len < ZSAMPLE_LEN - ZSAMPLE_LEN / ZSAMPLE_MIN_GAIN;
+}
+
+size_t zFrameBound(size_t raw_len) {
+    return sizeof(ZFrame) + raw_len;
+}
+
+long zPackFrame(const char *raw, size_t raw_len, char *out, size_t out_cap) {
+    if (raw_len > ZCHUNK_LEN || out_cap < sizeof(ZFrame)) return -1;
+    uint64_t start = thread_cpu_ns();
+
+    ZFrame frame;
+    frame.raw_len = raw_len;
+    char *payload = out + sizeof(ZFrame);
+    uLongf zlen = out_cap - sizeof(ZFrame);
+    if (zlen > raw_len) zlen = raw_len;
+
+    // a chunk that does not shrink is stored as is
+    if (raw_len > 0 && worth_compressing(raw, raw_len) && compress2((Bytef *)payload, &zlen, (const Bytef *)raw, raw_len, ZLEVEL) == Z_OK &&
+        zlen < raw_len) {
+        frame.wire_len = zlen;
+    } else {
+        if (out_cap - sizeof(ZFrame) < raw_len) return -1;
+        memcpy(payload, raw, raw_len);
+        frame.wire_len = raw_len | ZFRAME_STORED;
+        ++stored_frames;
+    }
+    memcpy(out, &frame, sizeof(frame));
+
+    size_t used = sizeof(ZFrame) + (frame.wire_len & ~ZFRAME_STORED);
+    raw_bytes += raw_len;
+    wire_bytes += used;
+    ++frames;
+    cpu_ns += thread_cpu_ns() - start;
+    return used;
+}
+
+long zUnpackFrame(const char *in, size_t in_len, char *raw, size_t raw_cap, size_t *consumed) {
+    ZFrame frame;
+    if (in_len < sizeof(frame)) return -1;
+    memcpy(&frame, in, sizeof(frame));
+
+    size_t payload_len = frame.wire_len & ~ZFRAME_STORED;
+    if (frame.raw_len > raw_cap || payload_len > in_len - sizeof(frame)) return -1;
+    uint64_t start = thread_cpu_ns();
+
+    const char *payload = in + sizeof(frame);
+    if (frame.wire_len & ZFRAME_STORED) {
+        if (payload_len != frame.raw_len) return -1;
+        memcpy(raw, payload, payload_len);
+    } else {
+        uLongf len = frame.raw_len;
+        if (uncompress((Bytef *)raw, &len, (const Bytef *)payload, payload_len) != Z_OK ||
+            len != frame.raw_len) {
+            DLOG("compress: corrupt frame");
+            return -1;
+        }
+    }
+
+    *consumed = sizeof(frame) + payload_len;
+    raw_bytes += frame.raw_len;
+    wire_bytes += *consumed;
+    ++frames;
+    if (frame.wire_len & ZFRAME_STORED) ++stored_frames;
+    cpu_ns += thread_cpu_ns() - start;
+    return frame.raw_len;
+}
+
+ZStats zStats() {
+    return ZStats{raw_bytes, wire_bytes, frames, stored_frames, cpu_ns};
+}
@@ -0,0 +1,44 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Chunked compression for file data on the wire. Data is cut into chunks of at most
+// ZCHUNK_LEN bytes and every chunk becomes one frame: a ZFrame header followed by the
+// deflated chunk, or by the chunk itself when deflating does not make it smaller (media and
+// other already compressed data), so a transfer never grows by more than the headers.
+
+#define ZCHUNK_LEN (64 << 10)
+#define ZFRAME_STORED 0x80000000u
+
+// Feature bits the server reports to the features rpc.
+#define WATDFS_FEATURE_COMPRESS 0x1
+
+struct ZFrame {
+    uint32_t raw_len;
+    uint32_t wire_len; // payload bytes, ZFRAME_STORED set when the payload is the raw chunk
+};
+
+// The most bytes a frame of `raw_len` bytes can take.
+size_t zFrameBound(size_t raw_len);
+
+// Writes the frame for raw[0, raw_len) to `out`, returns its size or -1 if it needs more
+// than `out_cap` bytes.
+long zPackFrame(const char *raw, size_t raw_len, char *out, size_t out_cap);
+
+// Decodes the frame at the front of `in` into `raw`. Returns the raw length and sets
+// `*consumed` to the frame size, or -1 if the frame is truncated or corrupt.
+long zUnpackFrame(const char *in, size_t in_len, char *raw, size_t raw_cap, size_t *consumed);
+
+// Counters for every frame packed or unpacked in this process.
+struct ZStats {
+    uint64_t raw_bytes;
+    uint64_t wire_bytes;
+    uint64_t frames;
+    uint64_t stored_frames;
+    uint64_t cpu_ns;
+};
+ZStats zStats();
+
+#endif
@@ -10,22 +10,13 @@
 
 #else
 
-#include <pthread.h>
-#include <stdio.h>
-
-extern pthread_mutex_t __nfs_debug_lock__;
-
-#define INIT_LOG pthread_mutex_t __nfs_debug_lock__ = PTHREAD_MUTEX_INITIALIZER;
-
-#define DLOG(fmt, ...)                                                         \
-    do {                                                                       \
-        pthread_mutex_lock(&__nfs_debug_lock__);                               \
-        fprintf(stderr, "DEBUG %lu [%s:%d] ", pthread_self(), __FILE__,         \
-                __LINE__);                                                     \
-        fprintf(stderr, fmt, ##__VA_ARGS__);                                   \
-        fprintf(stderr, "\n");                                                 \
-        pthread_mutex_unlock(&__nfs_debug_lock__);                             \
-    } while (0)
+// Debug messages go through the asynchronous logger, see async_log.h.
+#include "async_log.h"
+
+#define INIT_LOG
+
+#define DLOG(fmt, ...) WLOG(WLOG_DEBUG, fmt, ##__VA_ARGS__)
+
 #endif // NDEBUG
 
 #endif
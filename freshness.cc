@@ -0,0 +1,102 @@
+#include "freshness.h"
+#include "debug.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#define FRESHNESS_DEFAULT_MAX 60
+// Intervals are remembered for this many files, past that they all start over at the minimum.
+#define FRESHNESS_TRACK 65536
+
+struct FreshnessRule {
+    std::string prefix;
+    time_t min;
+    time_t max;
+};
+
+class Freshness {
+    std::mutex mtx;
+    std::vector<FreshnessRule> rules; // the defaults with an empty prefix come first
+    std::unordered_map<std::string, time_t> intervals;
+
+    const FreshnessRule &rule(const std::string &path) {
+        const FreshnessRule *best = &rules[0];
+        for (const FreshnessRule &r: rules) {
+            if (r.prefix.size() <= best->prefix.size() || path.compare(0, r.prefix.size(), r.prefix) != 0) continue;
+            // "/static" covers "/static" and "/static/x" but not "/staticx"
+            if (r.prefix.back() == '/' || path.size() == r.prefix.size() || path[r.prefix.size()] == '/') best = &r;
+        }
+        return *best;
+    }
+
+  public:
+    void init(time_t min, time_t max, const char *config) {
+        mtx.lock();
+        rules.clear();
+        intervals.clear();
+        rules.push_back(FreshnessRule{"", min, max > min ? max : min});
+
+        FILE *file = config ? fopen(config, "r") : nullptr;
+        if (config && file == nullptr) DLOG("freshness: unable to open %s", config);
+        char line[4096], prefix[4096];
+        long rule_min, rule_max;
+        while (file && fgets(line, sizeof(line), file)) {
+            if (line[strspn(line, " \t")] == '#') continue;
+            int n = sscanf(line, "%4095s %ld %ld", prefix, &rule_min, &rule_max);
+            if (n <= 0) continue;
+            if (n != 3 || rule_min < 0 || rule_max < rule_min) {
+                DLOG("freshness: ignoring rule '%s'", line);
+                continue;
+            }
+            rules.push_back(FreshnessRule{prefix, rule_min, rule_max});
+        }
+        if (file) fclose(file);
+        mtx.unlock();
+    }
+
+    time_t interval(const std::string &path) {
+        mtx.lock();
+        auto it = intervals.find(path);
+        time_t ret = (it != intervals.end()) ? it->second : rule(path).min;
+        mtx.unlock();
+        return ret;
+    }
+
+    void unchanged(const std::string &path) {
+        mtx.lock();
+        const FreshnessRule &r = rule(path);
+        auto it = intervals.find(path);
+        time_t current = (it != intervals.end()) ? it->second : r.min;
+        time_t next = current * 2 < r.max ? current * 2 : r.max;
+        if (next != r.min) {
+            if (it == intervals.end() && intervals.size() >= FRESHNESS_TRACK) intervals.clear();
+            intervals[path] = next;
+        }
+        mtx.unlock();
+    }
+
+    void changed(const std::string &path) {
+        mtx.lock();
+        intervals.erase(path);
+        mtx.unlock();
+    }
+};
+
+static Freshness freshness;
+
+void freshnessInit(time_t cache_interval) {
+    const char *env = getenv("WATDFS_FRESHNESS_MAX");
+    time_t max = env ? atol(env) : FRESHNESS_DEFAULT_MAX;
+    freshness.init(cache_interval, max, getenv("WATDFS_FRESHNESS_CONFIG"));
+}
+
+time_t freshnessInterval(const char *path) { return freshness.interval(path); }
+
+void freshnessUnchanged(const char *path) { freshness.unchanged(path); }
+
+void freshnessChanged(const char *path) { freshness.changed(path); }
@@ -0,0 +1,27 @@
+#ifndef FRESHNESS_H
+#define FRESHNESS_H
+
+#include <time.h>
+
+// Per file freshness intervals that adapt like the NFS acregmin/acregmax attribute cache. A
+// file starts out at the minimum interval; every validation that finds it unchanged doubles
+// the interval up to the maximum, a change puts it back at the minimum. Files that keep
+// changing are checked as often as before while files that never change are checked rarely.
+//
+// The defaults are CACHE_INTERVAL_SEC and WATDFS_FRESHNESS_MAX (default 60 seconds). The file
+// named by WATDFS_FRESHNESS_CONFIG overrides them below path prefixes, one rule per line:
+//   # prefix   min_sec   max_sec
+//   /static    30        3600
+//   /state     1         1
+// The longest matching prefix wins, a minimum of 0 validates on every access.
+
+void freshnessInit(time_t cache_interval);
+
+// How long the cached copy of `path` is trusted after a validation.
+time_t freshnessInterval(const char *path);
+// A validation against the server found `path` unchanged.
+void freshnessUnchanged(const char *path);
+// `path` changed on the server or was written by this client.
+void freshnessChanged(const char *path);
+
+#endif
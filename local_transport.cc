@@ -0,0 +1,346 @@
+#include "local_transport.h"
+#include "rpc.h"
+#include "rpc_stub.h"
+#include "debug.h"
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <cstring>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Size of the region shared with each connection, enough for a full bulk transfer
+// in both directions.
+#define LOCAL_SHM_SIZE (2 * BULK_MAX_LEN + (1 << 20))
+#define LOCAL_MAX_ARGS (BULK_SEGMENTS + 32)
+#define LOCAL_MAX_NAME 64
+
+// Wire format, one outstanding call per connection:
+//   request:  CallHeader, name, int argTypes[argc], uint64_t words[argc]
+//   response: int rpc_ret, uint64_t words[argc]
+// A word holds a scalar's value, or for an array its offset in the shared region.
+struct CallHeader {
+    uint32_t name_len;
+    uint32_t argc;
+};
+
+////////////////////////////////////////////helper//////////////////////////////////////////////////
+
+static int write_full(int fd, struct iovec *iov, int iovcnt) {
+    while (iovcnt > 0) {
+        ssize_t n = writev(fd, iov, iovcnt);
+        if (n < 0) { if (errno == EINTR) continue; return -errno; }
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len) { n -= iov->iov_len; ++iov; --iovcnt; }
+        if (iovcnt > 0) { iov->iov_base = (char *)iov->iov_base + n; iov->iov_len -= n; }
+    }
+    return 0;
+}
+
+static int read_full(int fd, void *buf, size_t len) {
+    char *p = (char *)buf;
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n < 0) { if (errno == EINTR) continue; return -errno; }
+        if (n == 0) return -ECONNRESET;
+        p += n; len -= n;
+    }
+    return 0;
+}
+
+static bool is_input(int type) { return (type >> ARG_INPUT) & 1; }
+static bool is_output(int type) { return (type >> ARG_OUTPUT) & 1; }
+static bool is_array(int type) { return (type >> ARG_ARRAY) & 1; }
+
+static size_t elem_size(int type) {
+    switch ((type >> 16) & 0xff) {
+        case ARG_CHAR: return 1;
+        case ARG_SHORT: return 2;
+        case ARG_INT: case ARG_FLOAT: return 4;
+        case ARG_LONG: case ARG_DOUBLE: return 8;
+        default: return 0;
+    }
+}
+
+static size_t arg_bytes(int type) {
+    return is_array(type) ? elem_size(type) * (type & 0xffff) : elem_size(type);
+}
+
+///////////////////////////////////////////server///////////////////////////////////////////////////
+
+static void serve_connection(int sock) {
+    int memfd = memfd_create("watdfs-local", MFD_CLOEXEC);
+    char *shm = nullptr;
+    if (memfd >= 0 && ftruncate(memfd, LOCAL_SHM_SIZE) == 0) {
+        shm = (char *)mmap(nullptr, LOCAL_SHM_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+        if (shm == MAP_FAILED) shm = nullptr;
+    }
+    if (shm == nullptr) {
+        DLOG("local: unable to create the shared region: %d", errno);
+        if (memfd >= 0) close(memfd);
+        close(sock);
+        return;
+    }
+
+    // hand the region to the client
+    uint64_t size = LOCAL_SHM_SIZE;
+    struct iovec iov = { &size, sizeof(size) };
+    char control[CMSG_SPACE(sizeof(int))];
+    memset(control, 0, sizeof(control));
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov; msg.msg_iovlen = 1;
+    msg.msg_control = control; msg.msg_controllen = sizeof(control);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET; cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &memfd, sizeof(int));
+    bool ok = (sendmsg(sock, &msg, MSG_NOSIGNAL) == (ssize_t)sizeof(size));
+    close(memfd);
+
+    CallHeader header;
+    char name[LOCAL_MAX_NAME + 1];
+    int types[LOCAL_MAX_ARGS + 1];
+    uint64_t words[LOCAL_MAX_ARGS];
+    void *args[LOCAL_MAX_ARGS];
+
+    while (ok && read_full(sock, &header, sizeof(header)) == 0) {
+        if (header.name_len > LOCAL_MAX_NAME || header.argc > LOCAL_MAX_ARGS) break;
+        if (read_full(sock, name, header.name_len) < 0) break;
+        if (read_full(sock, types, header.argc * sizeof(int)) < 0) break;
+        if (read_full(sock, words, header.argc * sizeof(uint64_t)) < 0) break;
+        name[header.name_len] = '\0';
+        types[header.argc] = 0;
+
+        skeleton fn = nullptr;
+        int rpc_ret = rpc_stub::find_skeleton(name, types, &fn);
+
+        for (uint32_t i = 0; rpc_ret == OK && i < header.argc; ++i) {
+            if (!is_array(types[i])) { args[i] = &words[i]; continue; }
+            if (words[i] > LOCAL_SHM_SIZE || arg_bytes(types[i]) > LOCAL_SHM_SIZE - words[i]) {
+                rpc_ret = ARRAY_LENS_TOO_LONG;
+            }
+            args[i] = shm + words[i];
+        }
+
+        if (rpc_ret == OK && fn(types, args) < 0) rpc_ret = FUNCTION_FAILURE;
+
+        struct iovec reply[2] = {{ &rpc_ret, sizeof(rpc_ret) },
+                                 { words, header.argc * sizeof(uint64_t) }};
+        if (write_full(sock, reply, 2) < 0) break;
+    }
+
+    munmap(shm, LOCAL_SHM_SIZE);
+    close(sock);
+}
+
+int localServerInit(const char *path) {
+    DLOG("local: listening on %s", path);
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) return -ENAMETOOLONG;
+    strcpy(addr.sun_path, path);
+
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0) return -errno;
+
+    unlink(path);
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(sock, SOMAXCONN) < 0) {
+        int ret = -errno;
+        close(sock);
+        return ret;
+    }
+
+    std::thread([sock]() {
+        while (true) {
+            int conn = accept4(sock, nullptr, nullptr, SOCK_CLOEXEC);
+            if (conn < 0) { if (errno == EINTR || errno == ECONNABORTED) continue; break; }
+            std::thread(serve_connection, conn).detach();
+        }
+        DLOG("local: accept failed: %d", errno);
+    }).detach();
+
+    return 0;
+}
+
+///////////////////////////////////////////client///////////////////////////////////////////////////
+
+struct LocalConn {
+    int sock;
+    char *shm;
+    size_t size;
+};
+
+// Connections are created on demand so concurrent callers each get their own region.
+class LocalPool {
+    std::mutex mtx;
+    std::string path;
+    std::vector<LocalConn*> idle;
+    std::vector<LocalConn*> all;
+
+    LocalConn* connect_server() {
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+
+        int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (sock < 0) return nullptr;
+        if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+            DLOG("local: unable to connect to %s: %d", path.c_str(), errno);
+            close(sock);
+            return nullptr;
+        }
+
+        uint64_t size = 0;
+        struct iovec iov = { &size, sizeof(size) };
+        char control[CMSG_SPACE(sizeof(int))];
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov; msg.msg_iovlen = 1;
+        msg.msg_control = control; msg.msg_controllen = sizeof(control);
+
+        int memfd = -1;
+        if (recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) == (ssize_t)sizeof(size)) {
+            struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+            if (cmsg && cmsg->cmsg_type == SCM_RIGHTS) memcpy(&memfd, CMSG_DATA(cmsg), sizeof(int));
+        }
+        if (memfd < 0) { close(sock); return nullptr; }
+
+        char *shm = (char *)mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+        close(memfd);
+        if (shm == MAP_FAILED) { close(sock); return nullptr; }
+
+        return new LocalConn{sock, shm, size};
+    }
+
+  public:
+    void setPath(const char *path) { LocalPool::path = path; }
+
+    LocalConn* get() {
+        mtx.lock();
+        if (!idle.empty()) {
+            LocalConn *conn = idle.back();
+            idle.pop_back();
+            mtx.unlock();
+            return conn;
+        }
+        mtx.unlock();
+
+        LocalConn *conn = connect_server();
+        if (conn == nullptr) return nullptr;
+
+        mtx.lock();
+        all.push_back(conn);
+        mtx.unlock();
+        return conn;
+    }
+
+    void put(LocalConn *conn) {
+        mtx.lock();
+        idle.push_back(conn);
+        mtx.unlock();
+    }
+
+    // a connection that failed mid-call is not reused
+    void drop(LocalConn *conn) {
+        mtx.lock();
+        for (auto it = all.begin(); it != all.end(); ++it) {
+            if (*it == conn) { all.erase(it); break; }
+        }
+        mtx.unlock();
+        munmap(conn->shm, conn->size);
+        close(conn->sock);
+        delete conn;
+    }
+
+    void clear() {
+        mtx.lock();
+        for (LocalConn *conn: all) { munmap(conn->shm, conn->size); close(conn->sock); delete conn; }
+        all.clear();
+        idle.clear();
+        mtx.unlock();
+    }
+};
+
+static LocalPool pool;
+
+int localCall(char *name, int *argTypes, void **args) {
+    CallHeader header;
+    header.name_len = strlen(name);
+    header.argc = 0;
+    while (argTypes[header.argc] != 0) ++header.argc;
+    if (header.name_len > LOCAL_MAX_NAME || header.argc > LOCAL_MAX_ARGS) return BAD_TYPES;
+
+    LocalConn *conn = pool.get();
+    if (conn == nullptr) return FAILED_TO_SEND;
+
+    // lay the arrays out in the shared region
+    uint64_t words[LOCAL_MAX_ARGS];
+    size_t cursor = 0;
+    for (uint32_t i = 0; i < header.argc; ++i) {
+        int type = argTypes[i];
+        size_t len = arg_bytes(type);
+        words[i] = 0;
+        if (!is_array(type)) {
+            if (is_input(type)) memcpy(&words[i], args[i], len);
+            continue;
+        }
+        if (len > conn->size - cursor) { pool.put(conn); return ARRAY_LENS_TOO_LONG; }
+        if (is_input(type)) memcpy(conn->shm + cursor, args[i], len);
+        words[i] = cursor;
+        cursor += (len + 7) & ~(size_t)7;
+    }
+
+    struct iovec request[4] = {{ &header, sizeof(header) },
+                               { name, header.name_len },
+                               { argTypes, header.argc * sizeof(int) },
+                               { words, header.argc * sizeof(uint64_t) }};
+    int rpc_ret = 0;
+    if (write_full(conn->sock, request, 4) < 0 ||
+        read_full(conn->sock, &rpc_ret, sizeof(rpc_ret)) < 0 ||
+        read_full(conn->sock, words, header.argc * sizeof(uint64_t)) < 0) {
+        DLOG("local: %s call failed: %d", name, errno);
+        pool.drop(conn);
+        return FAILED_TO_SEND;
+    }
+
+    if (rpc_ret == OK) {
+        for (uint32_t i = 0; i < header.argc; ++i) {
+            int type = argTypes[i];
+            if (!is_output(type)) continue;
+            if (is_array(type)) memcpy(args[i], conn->shm + words[i], arg_bytes(type));
+            else memcpy(args[i], &words[i], arg_bytes(type));
+        }
+    }
+
+    pool.put(conn);
+    return rpc_ret;
+}
+
+int localClientInit(const char *path) {
+    DLOG("local: using server at %s", path);
+    pool.setPath(path);
+
+    // fail early if the server is not there
+    LocalConn *conn = pool.get();
+    if (conn == nullptr) return NOT_INIT;
+    pool.put(conn);
+
+    rpc_stub::transport() = localCall;
+    return 0;
+}
+
+int localClientDestroy() {
+    pool.clear();
+    rpc_stub::transport() = rpcCall;
+    return 0;
+}
@@ -0,0 +1,17 @@
+#ifndef LOCAL_TRANSPORT_H
+#define LOCAL_TRANSPORT_H
+
+// Transport for a client and server on the same host. Calls travel over a unix domain socket
+// and every array argument is placed in a memfd region the server shares with each connection,
+// so bulk data never goes through the socket: the server preads/pwrites straight into/out of
+// the shared pages and the client copies between them and the caller's buffer once.
+
+// Server: accept local clients on the unix socket `path` in a background thread, dispatching
+// to the skeletons bound through rpc_stub.
+int localServerInit(const char *path);
+
+// Client: route every typed rpc to the server listening on the unix socket `path`.
+int localClientInit(const char *path);
+int localClientDestroy();
+
+#endif
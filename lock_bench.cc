@@ -0,0 +1,210 @@
+// Contention microbenchmark for the server's path locks. Threads repeatedly take and release
+// the lock of a path drawn with zipf popularity, as readers or writers, for a fixed time:
+//
+//   rwlock  rw_lock_t directly, one per path
+//   util    LockUtil::accuqire/release, the per-path map the lock rpcs run on
+//   rpc     the lock/unlock rpcs of a running watdfs_server (SERVER_ADDRESS/SERVER_PORT)
+//
+// The result is printed as one JSON object with the configuration and, under the name of each
+// mode run: acquisitions per second, wait-time percentiles and log2 histograms for readers and
+// writers, the longest writer wait, and Jain's fairness index over the threads' acquisition
+// counts (1 when every thread got as many).
+//
+// Usage: ./lock_bench [--mode rwlock|util|rpc|local] [--threads N] [--paths N] [--skew S]
+//                     [--write-ratio R] [--hold-us US] [--seconds S]
+//
+//   --mode     local (the default) runs rwlock and util
+//   --hold-us  how long the lock is held, spinning
+
+#include "rpc.h"
+#include "bench_util.h"
+#include "lock_server.h"
+#include "rw_lock.h"
+#include "watdfs_rpc.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+INIT_LOG
+
+// wait times are bucketed by powers of two of nanoseconds
+#define WAIT_BUCKETS 40
+
+////////////////////////////////////////////////////////////////////////////////////////////////
+
+struct Config {
+    std::string mode = "local";
+    int threads = 8;
+    int paths = 64;
+    double skew = 0.99;
+    double write_ratio = 0.2;
+    long hold_us = 0;
+    double seconds = 2;
+};
+
+struct WaitStats {
+    std::vector<uint64_t> ns;
+    uint64_t buckets[WAIT_BUCKETS] = {0};
+
+    void add(uint64_t wait) {
+        ns.push_back(wait);
+        int bucket = 0;
+        while (bucket < WAIT_BUCKETS - 1 && (1ull << (bucket + 1)) <= wait) ++bucket;
+        ++buckets[bucket];
+    }
+    void merge(const WaitStats &other) {
+        ns.insert(ns.end(), other.ns.begin(), other.ns.end());
+        for (int i = 0; i < WAIT_BUCKETS; ++i) buckets[i] += other.buckets[i];
+    }
+};
+
+struct ThreadResult {
+    WaitStats waits[2]; // by rw_lock_mode_t
+    uint64_t errors = 0;
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////////
+
+static std::vector<rw_lock_t> rw_locks;
+static LockUtil lock_util;
+static std::vector<std::string> path_names;
+
+static int take(const std::string &mode, int path, rw_lock_mode_t lock_mode) {
+    if (mode == "rwlock") return rw_lock_lock(&rw_locks[path], lock_mode);
+    if (mode == "util") return lock_util.accuqire(path_names[path].c_str(), lock_mode);
+    return watdfs_rpc::lock::call(path_names[path].c_str(), lock_mode);
+}
+
+static int give(const std::string &mode, int path, rw_lock_mode_t lock_mode) {
+    if (mode == "rwlock") return rw_lock_unlock(&rw_locks[path], lock_mode);
+    if (mode == "util") return lock_util.release(path_names[path].c_str(), lock_mode);
+    return watdfs_rpc::unlock::call(path_names[path].c_str(), lock_mode);
+}
+
+static void print_waits(const char *name, WaitStats &waits) {
+    std::sort(waits.ns.begin(), waits.ns.end());
+    auto at = [&waits](double q) {
+        return waits.ns.empty() ? 0.0 : waits.ns[std::min(waits.ns.size() - 1, (size_t)(q * waits.ns.size()))] / 1e3;
+    };
+    printf("      \"%s\": {\"count\": %zu, \"p50\": %.2f, \"p99\": %.2f, \"p999\": %.2f, \"max\": %.2f, \"histogram_ns\": {",
+           name, waits.ns.size(), at(0.5), at(0.99), at(0.999), waits.ns.empty() ? 0.0 : waits.ns.back() / 1e3);
+    bool first = true;
+    for (int i = 0; i < WAIT_BUCKETS; ++i) {
+        if (waits.buckets[i] == 0) continue;
+        printf("%s\"<%llu\": %lu", first ? "" : ", ", 1ull << (i + 1), waits.buckets[i]);
+        first = false;
+    }
+    printf("}}");
+}
+
+static void run(const Config &config, const std::string &mode) {
+    std::vector<ThreadResult> results(config.threads);
+    std::vector<uint64_t> acquisitions(config.threads, 0);
+    std::atomic<bool> stop(false);
+
+    std::vector<std::thread> workers;
+    uint64_t start = now_ns();
+    for (int t = 0; t < config.threads; ++t) {
+        workers.emplace_back([&, t]() {
+            std::mt19937_64 rng(t + 1);
+            std::uniform_real_distribution<double> coin(0, 1);
+            Zipf zipf(config.paths, config.skew);
+            while (!stop.load(std::memory_order_relaxed)) {
+                int path = zipf(rng);
+                rw_lock_mode_t lock_mode = coin(rng) < config.write_ratio ? RW_WRITE_LOCK : RW_READ_LOCK;
+
+                uint64_t asked = now_ns();
+                if (take(mode, path, lock_mode) < 0) { ++results[t].errors; continue; }
+                uint64_t got = now_ns();
+                results[t].waits[lock_mode].add(got - asked);
+
+                while (config.hold_us > 0 && now_ns() - got < (uint64_t)config.hold_us * 1000) {}
+
+                if (give(mode, path, lock_mode) < 0) ++results[t].errors;
+                ++acquisitions[t];
+            }
+        });
+    }
+    std::this_thread::sleep_for(std::chrono::duration<double>(config.seconds));
+    stop = true;
+    for (std::thread &worker: workers) worker.join();
+    double seconds = (now_ns() - start) / 1e9;
+
+    ThreadResult total;
+    for (ThreadResult &result: results) {
+        for (int m = 0; m < 2; ++m) total.waits[m].merge(result.waits[m]);
+        total.errors += result.errors;
+    }
+    double sum = 0, squares = 0;
+    for (uint64_t count: acquisitions) { sum += count; squares += (double)count * count; }
+
+    printf(",\n  \"%s\": {\n", mode.c_str());
+    printf("    \"seconds\": %.3f,\n", seconds);
+    printf("    \"acquisitions\": %.0f,\n", sum);
+    printf("    \"acquisitions_per_s\": %.1f,\n", sum / seconds);
+    printf("    \"errors\": %lu,\n", total.errors);
+    printf("    \"fairness\": %.4f,\n", squares > 0 ? sum * sum / (config.threads * squares) : 1.0);
+    printf("    \"max_writer_wait_us\": %.2f,\n",
+           total.waits[RW_WRITE_LOCK].ns.empty() ? 0.0
+               : *std::max_element(total.waits[RW_WRITE_LOCK].ns.begin(), total.waits[RW_WRITE_LOCK].ns.end()) / 1e3);
+    printf("    \"wait_us\": {\n");
+    print_waits("read", total.waits[RW_READ_LOCK]);
+    printf(",\n");
+    print_waits("write", total.waits[RW_WRITE_LOCK]);
+    printf("\n    }\n  }");
+}
+
+int main(int argc, char *argv[]) {
+    Config config;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        const char *arg = argv[i], *value = argv[i + 1];
+        if (strcmp(arg, "--mode") == 0) config.mode = value;
+        else if (strcmp(arg, "--threads") == 0) config.threads = atoi(value);
+        else if (strcmp(arg, "--paths") == 0) config.paths = atoi(value);
+        else if (strcmp(arg, "--skew") == 0) config.skew = atof(value);
+        else if (strcmp(arg, "--write-ratio") == 0) config.write_ratio = atof(value);
+        else if (strcmp(arg, "--hold-us") == 0) config.hold_us = atol(value);
+        else if (strcmp(arg, "--seconds") == 0) config.seconds = atof(value);
+        else { fprintf(stderr, "unknown option %s\n", arg); return 1; }
+    }
+    if (config.threads < 1 || config.paths < 1) { fprintf(stderr, "invalid configuration\n"); return 1; }
+    if (config.mode != "local" && config.mode != "rwlock" && config.mode != "util" && config.mode != "rpc") {
+        fprintf(stderr, "unknown mode %s\n", config.mode.c_str());
+        return 1;
+    }
+
+    rw_locks.resize(config.paths);
+    for (int i = 0; i < config.paths; ++i) {
+        rw_lock_init(&rw_locks[i]);
+        path_names.push_back("/lock_bench_" + std::to_string(i));
+    }
+
+    if (config.mode == "rpc") {
+        int ret = rpcClientInit();
+        if (ret < 0) { fprintf(stderr, "rpcClientInit failed: %d\n", ret); return 1; }
+    }
+
+    printf("{\n");
+    printf("  \"config\": {\"mode\": \"%s\", \"threads\": %d, \"paths\": %d, \"skew\": %.2f, "
+           "\"write_ratio\": %.2f, \"hold_us\": %ld}", config.mode.c_str(), config.threads, config.paths,
+           config.skew, config.write_ratio, config.hold_us);
+    if (config.mode == "local") {
+        run(config, "rwlock");
+        run(config, "util");
+    } else {
+        run(config, config.mode);
+    }
+    printf("\n}\n");
+
+    if (config.mode == "rpc") rpcClientDestroy();
+    for (rw_lock_t &lock: rw_locks) rw_lock_destroy(&lock);
+    return 0;
+}
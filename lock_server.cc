@@ -1,13 +1,16 @@
 #include "watdfs_server.h"
+#include "lock_server.h"
 #include "rpc.h"
 #include "utility.h"
+#include "watdfs_rpc.h"
 #include "rw_lock.h"
+#include "stats.h"
+#include "trace.h"
 #include "debug.h"
 
+#include <chrono>
 #include <string>
 #include <cstdlib>
-#include <mutex>
-#include <unordered_map>
 
 struct RegisterError { 
     int code;
@@ -16,122 +19,84 @@ struct RegisterError {
 
 ////////////////////////////////////////////helper//////////////////////////////////////////////////
 
-class LockUtil {
-    std::mutex mtx; 
-    std::unordered_map<std::string, rw_lock_t*> map;
-
-  public:
-
-    int accuqire(const char *path, rw_lock_mode_t mode) {
-        DLOG("accuqire lock for %s\n", path);
-        std::string key(path);
-
-        mtx.lock();
-        
-        int ret = 0;
-
-        if (map.find(key) == map.end()) {
-            rw_lock_t* lock = (rw_lock_t*)malloc(sizeof(rw_lock_t));
-            ret = rw_lock_init(lock);
-            if(ret < 0) {
-                DLOG("unable to init the lock for %s\n", path);
-                mtx.unlock();
-                return ret;
-            }
-            map[key] = lock;
-        }
-
-        ret = rw_lock_lock(map.at(key), mode);
-        if(ret < 0) {
-            DLOG("unable to lock the lock for %s\n", path);
-            mtx.unlock();
-            return ret;
-        }
-
-        mtx.unlock();
-        return 0;
-    }
+int LockUtil::accuqire(const char *path, rw_lock_mode_t mode) {
+    DLOG("accuqire lock for %s\n", path);
+    std::string key(path);
 
-    int release(const char *path, rw_lock_mode_t mode) {
-        DLOG("release lock for %s\n", path);
-        std::string key(path);
+    mtx.lock();
 
-        mtx.lock();
-
-        if (map.find(key) == map.end()) {
-            DLOG("lock not found to unlock for %s\n", path);
-            mtx.unlock();
-            return -1;
-        }
+    int ret = 0;
 
-        int ret = rw_lock_unlock(map.at(key), mode);
+    if (map.find(key) == map.end()) {
+        rw_lock_t* lock = (rw_lock_t*)malloc(sizeof(rw_lock_t));
+        ret = rw_lock_init(lock);
         if(ret < 0) {
-            DLOG("unable to unlock the lock for %s\n", path);
+            DLOG("unable to init the lock for %s\n", path);
             mtx.unlock();
             return ret;
         }
-
-        mtx.unlock();
-        return 0;
+        map[key] = lock;
     }
-
-    ~LockUtil() {
-        for (auto& it: map) { rw_lock_destroy(it.second); free(it.second); }
+    rw_lock_t* lock = map.at(key);
+
+    // the lock is waited for without the map mutex, locks are never freed before the destructor
+    mtx.unlock();
+
+    static const int wait_op = statsOp("lock_wait");
+    auto start = std::chrono::steady_clock::now();
+    TraceSpan span = traceBegin("lock_wait", TRACE_LOCK);
+    ret = rw_lock_lock(lock, mode);
+    traceEnd(&span, ret);
+    statsRecord(wait_op, std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                   std::chrono::steady_clock::now() - start).count(), 0, ret < 0);
+    if(ret < 0) {
+        DLOG("unable to lock the lock for %s\n", path);
+        return ret;
     }
-} util;
 
-///////////////////////////////////////////////////////////////////////////////////////////////////
+    return 0;
+}
 
-int lock(int *argTypes, void **args) {
-    const char* path = (const char*)args[0];
+int LockUtil::release(const char *path, rw_lock_mode_t mode) {
+    DLOG("release lock for %s\n", path);
+    std::string key(path);
 
-    rw_lock_mode_t* mode = (rw_lock_mode_t*)args[1];
+    mtx.lock();
 
-    int* ret = (int*)args[2];
+    if (map.find(key) == map.end()) {
+        DLOG("lock not found to unlock for %s\n", path);
+        mtx.unlock();
+        return -1;
+    }
+    rw_lock_t* lock = map.at(key);
 
-    *ret = util.accuqire(path, *mode);
+    mtx.unlock();
+
+    int ret = rw_lock_unlock(lock, mode);
+    if(ret < 0) {
+        DLOG("unable to unlock the lock for %s\n", path);
+        return ret;
+    }
 
-    DLOG("Returning code: %d", *ret);
     return 0;
 }
 
-void lock_register() {
-    int argTypes[4];
-    argTypes[0] = argTypeFrmtr(yes, no, yes, ARG_CHAR, 1); //path
-    argTypes[1] = argTypeFrmtr(yes, no, no, ARG_INT); //mode
-    argTypes[2] = argTypeFrmtr(no, yes, no, ARG_INT); //retcode
-    argTypes[3] = 0; // the null terminator
-
-    int ret = 0;
-    ret = rpcRegister((char *)"lock", argTypes, lock);
-    if (ret < 0) throw RegisterError(ret);
+LockUtil::~LockUtil() {
+    for (auto& it: map) { rw_lock_destroy(it.second); free(it.second); }
 }
 
-///////////////////////////////////////////////////////////////////////////////////////////////////
+static LockUtil util;
 
-int unlock(int *argTypes, void **args) {
-    const char* path = (const char*)args[0];
-
-    rw_lock_mode_t* mode = (rw_lock_mode_t*)args[1];
-
-    int* ret = (int*)args[2];
-
-    *ret = util.release(path, *mode);
+///////////////////////////////////////////////////////////////////////////////////////////////////
 
-    DLOG("Returning code: %d", *ret);
-    return 0;
+int lock(const char *path, rw_lock_mode_t mode) {
+    return util.accuqire(path, mode);
 }
 
-void unlock_register() {
-    int argTypes[4];
-    argTypes[0] = argTypeFrmtr(yes, no, yes, ARG_CHAR, 1); //path
-    argTypes[1] = argTypeFrmtr(yes, no, no, ARG_INT); //mode
-    argTypes[2] = argTypeFrmtr(no, yes, no, ARG_INT); //retcode
-    argTypes[3] = 0; // the null terminator
+///////////////////////////////////////////////////////////////////////////////////////////////////
 
-    int ret = 0;
-    ret = rpcRegister((char *)"unlock", argTypes, unlock);
-    if (ret < 0) throw RegisterError(ret);
+int unlock(const char *path, rw_lock_mode_t mode) {
+    return util.release(path, mode);
 }
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////
@@ -140,8 +105,11 @@ int rpc_lock_server_register() {
     int ret_code = 0;
 
     try {
-        lock_register();
-        unlock_register();
+        int ret = watdfs_rpc::lock::bind<lock>();
+        if (ret < 0) throw RegisterError(ret);
+
+        ret = watdfs_rpc::unlock::bind<unlock>();
+        if (ret < 0) throw RegisterError(ret);
     } 
     catch ( RegisterError& err) { ret_code = err.code; }
 
@@ -1,6 +1,28 @@
 #ifndef LOCK_SERVER_H
 #define LOCK_SERVER_H
 
+#include "rw_lock.h"
+
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+// One rw_lock_t per path, created on first use and kept until the LockUtil goes away.
+class LockUtil {
+    std::mutex mtx; 
+    std::unordered_map<std::string, rw_lock_t*> map;
+
+  public:
+    int accuqire(const char *path, rw_lock_mode_t mode);
+    int release(const char *path, rw_lock_mode_t mode);
+
+    ~LockUtil();
+};
+
 int rpc_lock_server_register();
 
+// The lock/unlock rpc handlers, also run by the batch rpc.
+int lock(const char *path, rw_lock_mode_t mode);
+int unlock(const char *path, rw_lock_mode_t mode);
+
 #endif
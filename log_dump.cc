@@ -0,0 +1,92 @@
+// Prints a binary log written with WATDFS_LOG_FILE (see async_log.h) as text, one line per
+// message in the order they were drained.
+//
+// Usage: ./watdfs_logdump <log file>
+
+#include "async_log.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+struct Site {
+    int level;
+    int line;
+    std::string file;
+    std::string fmt;
+};
+
+template <class T> static bool get(FILE *in, T *value) { return fread(value, sizeof(T), 1, in) == 1; }
+
+static bool get_str(FILE *in, std::string *str) {
+    uint16_t len;
+    if (!get(in, &len)) return false;
+    str->resize(len);
+    return len == 0 || fread(&(*str)[0], 1, len, in) == len;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 2) { fprintf(stderr, "usage: %s <log file>\n", argv[0]); return 1; }
+    FILE *in = fopen(argv[1], "rb");
+    if (in == nullptr) { perror(argv[1]); return 1; }
+
+    char magic[sizeof(LOG_FILE_MAGIC) - 1];
+    int64_t offset;
+    if (fread(magic, 1, sizeof(magic), in) != sizeof(magic) || memcmp(magic, LOG_FILE_MAGIC, sizeof(magic)) != 0 ||
+        !get(in, &offset)) {
+        fprintf(stderr, "%s is not a watdfs log\n", argv[1]);
+        return 1;
+    }
+
+    std::unordered_map<uint32_t, Site> sites;
+    std::vector<char> args;
+    char line[8192];
+    uint64_t last_ts = 0;
+    int type;
+    while ((type = fgetc(in)) != EOF) {
+        uint32_t id;
+        bool ok = get(in, &id);
+        if (type == LOG_REC_SITE) {
+            int32_t level, site_line;
+            Site site;
+            ok = ok && get(in, &level) && get(in, &site_line) && get_str(in, &site.file) && get_str(in, &site.fmt);
+            site.level = level;
+            site.line = site_line;
+            if (ok) sites[id] = site;
+        } else if (type == LOG_REC_MESSAGE) {
+            uint64_t ts, thread;
+            uint32_t len;
+            ok = ok && get(in, &ts) && get(in, &thread) && get(in, &len);
+            args.resize(len);
+            ok = ok && (len == 0 || fread(args.data(), 1, len, in) == len);
+            if (ok) {
+                auto it = sites.find(id);
+                const Site *site = it == sites.end() ? nullptr : &it->second;
+                size_t n = logPrefix(line, sizeof(line), ts + offset, site ? site->level : WLOG_DEBUG, thread,
+                                     site ? site->file.c_str() : "?", site ? site->line : 0);
+                if (site != nullptr) n += logFormat(line + n, sizeof(line) - n, site->fmt.c_str(), args.data(), len);
+                while (n > 0 && line[n - 1] == '\n') --n;
+                line[n] = '\0';
+                puts(line);
+                last_ts = ts;
+            }
+        } else if (type == LOG_REC_LOST) {
+            uint64_t thread, count;
+            ok = ok && get(in, &thread) && get(in, &count);
+            if (ok) {
+                auto it = sites.find(id);
+                const Site *site = id != 0 && it != sites.end() ? &it->second : nullptr;
+                logPrefix(line, sizeof(line), last_ts + offset, WLOG_WARN, thread,
+                          site ? site->file.c_str() : "log", site ? site->line : 0);
+                printf("%s%lu messages %s\n", line, count,
+                       id != 0 ? "over the rate limit dropped" : "dropped, the ring was full");
+            }
+        } else {
+            ok = false;
+        }
+        if (!ok) { fprintf(stderr, "%s: truncated or corrupt record\n", argv[1]); return 1; }
+    }
+    return 0;
+}
@@ -0,0 +1,219 @@
+#include "ram_cache.h"
+#include "debug.h"
+
+#include <sys/stat.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#define RAM_SLAB_LEN (64 << 10)
+#define RAM_DEFAULT_BYTES (64 << 20)
+#define RAM_MAX_FILE (1 << 20)
+#define RAM_PROMOTE_READS 2
+// Read counts are kept for this many files, all counts are halved when it fills up so that
+// files which were hot long ago lose their standing.
+#define RAM_FREQ_TRACK 4096
+
+struct RamFile {
+    off_t size;
+    struct timespec mtime;
+    std::vector<uint32_t> slabs;
+};
+
+class RamCache {
+    std::mutex mtx;
+    std::vector<char *> slabs;
+    std::vector<uint32_t> free_slabs;
+    size_t max_slabs = 0;
+
+    std::unordered_map<std::string, RamFile> files;
+    std::unordered_map<std::string, uint32_t> freq;
+    // promotions whose copy is being taken, set once the file is dropped or validated meanwhile
+    std::unordered_map<std::string, bool> copying;
+
+    RamCacheStats stats;
+
+    uint32_t frequency(const std::string &path) {
+        auto it = freq.find(path);
+        return it == freq.end() ? 0 : it->second;
+    }
+
+    void release(std::unordered_map<std::string, RamFile>::iterator it) {
+        for (uint32_t slab: it->second.slabs) free_slabs.push_back(slab);
+        stats.bytes -= it->second.slabs.size() * RAM_SLAB_LEN;
+        --stats.files;
+        files.erase(it);
+    }
+
+    // frees `count` slabs by demoting files read less often than `floor`
+    bool make_room(size_t count, uint32_t floor) {
+        while (free_slabs.size() + (max_slabs - slabs.size()) < count) {
+            auto victim = files.end();
+            for (auto it = files.begin(); it != files.end(); ++it) {
+                if (victim == files.end() || frequency(it->first) < frequency(victim->first)) victim = it;
+            }
+            if (victim == files.end() || frequency(victim->first) >= floor) return false;
+            release(victim);
+            ++stats.demotions;
+        }
+        return true;
+    }
+
+    void changed(const std::string &path) {
+        auto it = copying.find(path);
+        if (it != copying.end()) it->second = true;
+    }
+
+    uint32_t take_slab() {
+        if (free_slabs.empty()) {
+            slabs.push_back(new char[RAM_SLAB_LEN]);
+            return slabs.size() - 1;
+        }
+        uint32_t slab = free_slabs.back();
+        free_slabs.pop_back();
+        return slab;
+    }
+
+  public:
+    RamCache() { memset(&stats, 0, sizeof(stats)); }
+    ~RamCache() { for (char *slab: slabs) delete []slab; }
+
+    void init(size_t bytes) {
+        mtx.lock();
+        max_slabs = bytes / RAM_SLAB_LEN;
+        mtx.unlock();
+    }
+
+    long read(const std::string &path, char *buf, size_t size, off_t offset) {
+        mtx.lock();
+        auto it = files.find(path);
+        if (it == files.end()) {
+            mtx.unlock();
+            return -1;
+        }
+
+        size_t done = 0;
+        if (offset < it->second.size) {
+            size_t len = it->second.size - offset;
+            if (len > size) len = size;
+            while (done < len) {
+                size_t pos = offset + done;
+                size_t n = RAM_SLAB_LEN - pos % RAM_SLAB_LEN;
+                if (n > len - done) n = len - done;
+                memcpy(buf + done, slabs[it->second.slabs[pos / RAM_SLAB_LEN]] + pos % RAM_SLAB_LEN, n);
+                done += n;
+            }
+        }
+        ++freq[path];
+        ++stats.hits;
+        mtx.unlock();
+        return done;
+    }
+
+    void note_read(const std::string &path, int fd) {
+        mtx.lock();
+        ++stats.misses;
+        if (max_slabs == 0) { mtx.unlock(); return; }
+        if (freq.size() >= RAM_FREQ_TRACK && freq.find(path) == freq.end()) {
+            for (auto it = freq.begin(); it != freq.end();) {
+                it->second /= 2;
+                if (it->second == 0 && files.find(it->first) == files.end()) it = freq.erase(it);
+                else ++it;
+            }
+        }
+        uint32_t count = ++freq[path];
+        if (count < RAM_PROMOTE_READS || files.count(path) || !copying.emplace(path, false).second) {
+            mtx.unlock();
+            return;
+        }
+        mtx.unlock();
+
+        // the copy is taken outside the lock; a download in between drops or validates the file,
+        // a local write changes its mtime
+        struct stat statbuf;
+        std::vector<char> data;
+        bool copied = fstat(fd, &statbuf) == 0 && statbuf.st_size <= RAM_MAX_FILE;
+        if (copied) {
+            data.resize(statbuf.st_size);
+            copied = pread(fd, data.data(), data.size(), 0) == (ssize_t)data.size();
+        }
+
+        size_t needed = (data.size() + RAM_SLAB_LEN - 1) / RAM_SLAB_LEN;
+        mtx.lock();
+        auto it = copying.find(path);
+        bool stale = it->second;
+        copying.erase(it);
+        struct stat after;
+        if (!copied || stale || fstat(fd, &after) < 0 || after.st_mtim.tv_sec != statbuf.st_mtim.tv_sec ||
+            after.st_mtim.tv_nsec != statbuf.st_mtim.tv_nsec || after.st_size != statbuf.st_size) {
+            mtx.unlock();
+            return;
+        }
+        if (make_room(needed, count)) {
+            RamFile &file = files[path];
+            file.size = data.size();
+            file.mtime = statbuf.st_mtim;
+            for (size_t i = 0; i < needed; ++i) {
+                uint32_t slab = take_slab();
+                size_t n = data.size() - i * RAM_SLAB_LEN;
+                memcpy(slabs[slab], data.data() + i * RAM_SLAB_LEN, n < RAM_SLAB_LEN ? n : RAM_SLAB_LEN);
+                file.slabs.push_back(slab);
+            }
+            stats.bytes += needed * RAM_SLAB_LEN;
+            ++stats.files;
+            ++stats.promotions;
+        }
+        mtx.unlock();
+    }
+
+    void validate(const std::string &path, off_t size, const struct timespec &mtime) {
+        mtx.lock();
+        changed(path);
+        auto it = files.find(path);
+        if (it != files.end() && (it->second.size != size || it->second.mtime.tv_sec != mtime.tv_sec ||
+                                  it->second.mtime.tv_nsec != mtime.tv_nsec)) {
+            release(it);
+        }
+        mtx.unlock();
+    }
+
+    void drop(const std::string &path) {
+        mtx.lock();
+        changed(path);
+        auto it = files.find(path);
+        if (it != files.end()) release(it);
+        mtx.unlock();
+    }
+
+    RamCacheStats snapshot() {
+        mtx.lock();
+        RamCacheStats copy = stats;
+        mtx.unlock();
+        return copy;
+    }
+};
+
+static RamCache ram;
+
+void ramCacheInit() {
+    const char *env = getenv("WATDFS_RAM_CACHE_BYTES");
+    ram.init(env ? atol(env) : RAM_DEFAULT_BYTES);
+}
+
+long ramCacheRead(const char *path, char *buf, size_t size, off_t offset) {
+    return ram.read(path, buf, size, offset);
+}
+
+void ramCacheNoteRead(const char *path, int fd) { ram.note_read(path, fd); }
+
+void ramCacheValidate(const char *path, off_t size, const struct timespec &mtime) {
+    ram.validate(path, size, mtime);
+}
+
+void ramCacheDrop(const char *path) { ram.drop(path); }
+
+RamCacheStats ramCacheStats() { return ram.snapshot(); }
@@ -0,0 +1,38 @@
+#ifndef RAM_CACHE_H
+#define RAM_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+
+// In-memory tier in front of the cache directory for small files that are read often. File
+// contents are held in fixed size slabs out of a pool with a byte budget; a file is promoted
+// once it has been read RAM_PROMOTE_READS times and, when the pool is full, pushes out files
+// that are read less often than it is. The cache files on disk stay the backing copy.
+//
+// WATDFS_RAM_CACHE_BYTES sets the budget, 0 disables the tier.
+
+void ramCacheInit();
+
+// Serves a read of the file from memory, returns the bytes read or -1 if it is not held.
+long ramCacheRead(const char *path, char *buf, size_t size, off_t offset);
+// Counts a read that went to the cache file `fd`, promoting the file when it has become hot.
+void ramCacheNoteRead(const char *path, int fd);
+
+// The cache file now holds the server version (size, mtime), any other version is dropped.
+void ramCacheValidate(const char *path, off_t size, const struct timespec &mtime);
+// The cache file is being changed locally.
+void ramCacheDrop(const char *path);
+
+struct RamCacheStats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t promotions;
+    uint64_t demotions;
+    uint64_t bytes; // held in slabs
+    uint64_t files;
+};
+RamCacheStats ramCacheStats();
+
+#endif
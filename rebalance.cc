@@ -0,0 +1,187 @@
+// Moves the files of a namespace split over several servers (see shard_ring.h) to the server
+// that owns them now, e.g. after a server was added to WATDFS_SERVERS. Every server is given as
+// its WATDFS_SERVERS entry and its directory, in the order of WATDFS_SERVERS, and the tool works
+// on the directories directly, so it runs on a host that sees all of them while no client is
+// using the servers.
+//
+// A file is copied to a temporary name next to its new place, synced, renamed over it and only
+// then removed from the old server, so a crash leaves at most a copy on both. When both servers
+// already hold the path the newer copy is kept.
+//
+// Results are printed as one JSON object: the files and bytes looked at and moved, by server.
+//
+// Usage: ./watdfs_rebalance [--dry-run] [--vnodes N] host:port=DIR host:port=DIR ...
+
+#include "shard_ring.h"
+
+#include <fcntl.h>
+#include <ftw.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#define COPY_BUF_LEN (1 << 20)
+#define TMP_SUFFIX ".rebalance.tmp"
+
+struct Shard {
+    std::string name;
+    std::string dir;
+    uint64_t files = 0;      // found here
+    uint64_t bytes = 0;
+    uint64_t moved_out = 0;  // files moved away
+    uint64_t moved_in = 0;
+    uint64_t bytes_out = 0;
+};
+
+static std::vector<Shard> shards;
+static ShardRing ring;
+static bool dry_run = false;
+static int errors = 0;
+
+// the paths found on each server, relative to its directory with a leading '/'
+static std::vector<std::vector<std::pair<std::string, off_t>>> found;
+static size_t walking = 0;
+
+static int collect(const char *path, const struct stat *statbuf, int type, struct FTW *) {
+    if (type != FTW_F || !S_ISREG(statbuf->st_mode)) return 0;
+    std::string rel = path + shards[walking].dir.size();
+    size_t suffix = strlen(TMP_SUFFIX);
+    if (rel.size() > suffix && rel.compare(rel.size() - suffix, suffix, TMP_SUFFIX) == 0) return 0;
+    found[walking].emplace_back(rel, statbuf->st_size);
+    return 0;
+}
+
+static int make_parents(const std::string &path) {
+    for (size_t slash = path.find('/', 1); slash != std::string::npos; slash = path.find('/', slash + 1)) {
+        if (mkdir(path.substr(0, slash).c_str(), 0755) < 0 && errno != EEXIST) return -errno;
+    }
+    return 0;
+}
+
+// Copies `from` to `to` through a temporary name, with its mode and times.
+static int copy_file(const std::string &from, const std::string &to) {
+    int in = open(from.c_str(), O_RDONLY);
+    if (in < 0) return -errno;
+    struct stat statbuf;
+    if (fstat(in, &statbuf) < 0) { int ret = -errno; close(in); return ret; }
+
+    int ret = make_parents(to);
+    std::string tmp = to + TMP_SUFFIX;
+    int out = ret < 0 ? -1 : open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, statbuf.st_mode & 07777);
+    if (out < 0) { if (ret == 0) ret = -errno; close(in); return ret; }
+
+    std::vector<char> buf(COPY_BUF_LEN);
+    while (ret == 0) {
+        ssize_t n = read(in, buf.data(), buf.size());
+        if (n < 0) { ret = -errno; break; }
+        if (n == 0) break;
+        if (write(out, buf.data(), n) != n) ret = -EIO;
+    }
+    struct timespec times[2] = {statbuf.st_atim, statbuf.st_mtim};
+    if (ret == 0 && (futimens(out, times) < 0 || fsync(out) < 0)) ret = -errno;
+    close(out);
+    close(in);
+    if (ret == 0 && rename(tmp.c_str(), to.c_str()) < 0) ret = -errno;
+    if (ret < 0) unlink(tmp.c_str());
+    return ret;
+}
+
+static bool newer(const struct stat &a, const struct stat &b) {
+    return a.st_mtim.tv_sec != b.st_mtim.tv_sec ? a.st_mtim.tv_sec > b.st_mtim.tv_sec
+                                                : a.st_mtim.tv_nsec > b.st_mtim.tv_nsec;
+}
+
+// Moves one file found on server `from` to server `to`.
+static void move(size_t from, size_t to, const std::string &rel, off_t size) {
+    std::string src = shards[from].dir + rel, dst = shards[to].dir + rel;
+    shards[from].moved_out++;
+    shards[from].bytes_out += size;
+    shards[to].moved_in++;
+    if (dry_run) return;
+
+    struct stat src_stat, dst_stat;
+    int ret = 0;
+    if (stat(src.c_str(), &src_stat) < 0) ret = -errno;
+    else if (stat(dst.c_str(), &dst_stat) < 0 || newer(src_stat, dst_stat)) ret = copy_file(src, dst);
+    if (ret == 0 && unlink(src.c_str()) < 0) ret = -errno;
+    if (ret < 0) {
+        fprintf(stderr, "unable to move %s to %s: %s\n", src.c_str(), dst.c_str(), strerror(-ret));
+        ++errors;
+    }
+}
+
+int main(int argc, char *argv[]) {
+    int vnodes = shardVnodes();
+    for (int i = 1; i < argc; ++i) {
+        const char *arg = argv[i];
+        if (strcmp(arg, "--dry-run") == 0) { dry_run = true; continue; }
+        if (strcmp(arg, "--vnodes") == 0 && i + 1 < argc) { vnodes = atoi(argv[++i]); continue; }
+        const char *eq = strchr(arg, '=');
+        if (strncmp(arg, "--", 2) == 0 || eq == nullptr || eq == arg || eq[1] == '\0') {
+            fprintf(stderr, "unknown option %s\n", arg);
+            return 1;
+        }
+        Shard shard;
+        shard.name = std::string(arg, eq - arg);
+        shard.dir = eq + 1;
+        while (shard.dir.size() > 1 && shard.dir.back() == '/') shard.dir.pop_back();
+        shards.push_back(shard);
+    }
+    if (shards.empty() || vnodes <= 0) {
+        fprintf(stderr, "usage: %s [--dry-run] [--vnodes N] host:port=DIR ...\n", argv[0]);
+        return 1;
+    }
+
+    std::vector<std::string> names;
+    for (Shard &shard: shards) names.push_back(shard.name);
+    shardRingBuild(names, vnodes, &ring);
+
+    found.resize(shards.size());
+    for (walking = 0; walking < shards.size(); ++walking) {
+        if (nftw(shards[walking].dir.c_str(), collect, 16, FTW_PHYS) < 0) {
+            perror(shards[walking].dir.c_str());
+            return 1;
+        }
+    }
+
+    uint64_t files = 0, bytes = 0, moved = 0, moved_bytes = 0;
+    for (size_t s = 0; s < shards.size(); ++s) {
+        for (auto &file: found[s]) {
+            shards[s].files++;
+            shards[s].bytes += file.second;
+            files++;
+            bytes += file.second;
+            size_t owner = shardRingLookup(ring, file.first.c_str());
+            if (owner == s) continue;
+            move(s, owner, file.first, file.second);
+            moved++;
+            moved_bytes += file.second;
+        }
+    }
+
+    printf("{\n");
+    printf("  \"dry_run\": %s,\n", dry_run ? "true" : "false");
+    printf("  \"vnodes\": %d,\n", vnodes);
+    printf("  \"files\": %lu,\n", files);
+    printf("  \"bytes\": %lu,\n", bytes);
+    printf("  \"moved\": %lu,\n", moved);
+    printf("  \"moved_bytes\": %lu,\n", moved_bytes);
+    printf("  \"moved_fraction\": %.4f,\n", files ? (double)moved / files : 0.0);
+    printf("  \"errors\": %d,\n", errors);
+    printf("  \"servers\": {");
+    for (size_t s = 0; s < shards.size(); ++s) {
+        Shard &shard = shards[s];
+        printf("%s\n    \"%s\": {\"files\": %lu, \"bytes\": %lu, \"moved_out\": %lu, \"moved_in\": %lu, "
+               "\"bytes_out\": %lu, \"files_after\": %lu}", s ? "," : "", shard.name.c_str(), shard.files,
+               shard.bytes, shard.moved_out, shard.moved_in, shard.bytes_out,
+               shard.files - shard.moved_out + shard.moved_in);
+    }
+    printf("\n  }\n}\n");
+
+    return errors ? 1 : 0;
+}
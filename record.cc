@@ -0,0 +1,159 @@
+#include "record.h"
+#include "stats.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include <mutex>
+#include <string>
+
+// buffered records are written out at this size
+#define RECORD_BUF_LEN (64 << 10)
+
+// FNV-1a
+uint64_t recordPathHash(const char *path) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (; *path != '\0'; ++path) hash = (hash ^ (unsigned char)*path) * 0x100000001b3ULL;
+    return hash;
+}
+
+static uint64_t zigzag(int64_t value) { return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63); }
+static int64_t unzigzag(uint64_t value) { return (int64_t)(value >> 1) ^ -(int64_t)(value & 1); }
+
+static void put_varint(std::string *out, uint64_t value) {
+    while (value >= 0x80) {
+        *out += (char)(value | 0x80);
+        value >>= 7;
+    }
+    *out += (char)value;
+}
+
+static bool get_varint(FILE *in, uint64_t *value) {
+    *value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        int c = fgetc(in);
+        if (c == EOF) return false;
+        *value |= (uint64_t)(c & 0x7f) << shift;
+        if ((c & 0x80) == 0) return true;
+    }
+    return false;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////
+
+// The recording of this process.
+class Recorder {
+    std::mutex mtx;
+    FILE *out = nullptr;
+    std::string buf;
+    uint64_t last_start = 0;
+    std::atomic<uint32_t> threads{0};
+
+  public:
+    uint64_t base = 0; // statsNow when the recording started
+
+    bool open(const char *path) {
+        out = fopen(path, "wb");
+        if (out == nullptr) return false;
+        fputs(RECORD_MAGIC, out);
+        base = statsNow();
+        return true;
+    }
+
+    bool enabled() const { return out != nullptr; }
+
+    uint32_t thread_id() {
+        static thread_local uint32_t id = 0;
+        if (id == 0) id = ++threads;
+        return id;
+    }
+
+    void add(const RecordEntry &entry) {
+        std::string record;
+        record += (char)entry.op;
+        put_varint(&record, entry.thread);
+        mtx.lock();
+        // records are added as calls end, so a start may come before the last one
+        put_varint(&record, zigzag(entry.start_ns - last_start));
+        last_start = entry.start_ns;
+        put_varint(&record, entry.duration_ns);
+        record.append((const char *)&entry.path, sizeof(entry.path));
+        put_varint(&record, entry.fh);
+        put_varint(&record, zigzag(entry.offset));
+        put_varint(&record, entry.size);
+        put_varint(&record, entry.flags);
+        put_varint(&record, zigzag(entry.ret));
+        buf += record;
+        if (buf.size() >= RECORD_BUF_LEN) flush_locked();
+        mtx.unlock();
+    }
+
+    void flush() {
+        mtx.lock();
+        flush_locked();
+        mtx.unlock();
+    }
+
+  private:
+    void flush_locked() {
+        if (out == nullptr || buf.empty()) return;
+        fwrite(buf.data(), 1, buf.size(), out);
+        fflush(out);
+        buf.clear();
+    }
+};
+
+static Recorder recorder;
+
+bool recordEnabled() { return recorder.enabled(); }
+
+void recordOp(RecordEntry *entry) {
+    if (!recorder.enabled()) return;
+    entry->thread = recorder.thread_id();
+    entry->start_ns = entry->start_ns > recorder.base ? entry->start_ns - recorder.base : 0;
+    recorder.add(*entry);
+}
+
+void recordFlush() { recorder.flush(); }
+
+////////////////////////////////////////////////////////////////////////////////////////////////
+
+bool recordReadStart(RecordReader *reader, FILE *in) {
+    char magic[sizeof(RECORD_MAGIC) - 1];
+    reader->in = in;
+    reader->start_ns = 0;
+    return fread(magic, 1, sizeof(magic), in) == sizeof(magic) && memcmp(magic, RECORD_MAGIC, sizeof(magic)) == 0;
+}
+
+bool recordRead(RecordReader *reader, RecordEntry *entry) {
+    int op = fgetc(reader->in);
+    if (op == EOF || op >= CLI_OPS) return false;
+    entry->op = (ClientOp)op;
+
+    uint64_t thread, start, offset, flags, ret;
+    if (!get_varint(reader->in, &thread) || !get_varint(reader->in, &start) ||
+        !get_varint(reader->in, &entry->duration_ns) ||
+        fread(&entry->path, sizeof(entry->path), 1, reader->in) != 1 ||
+        !get_varint(reader->in, &entry->fh) || !get_varint(reader->in, &offset) ||
+        !get_varint(reader->in, &entry->size) || !get_varint(reader->in, &flags) ||
+        !get_varint(reader->in, &ret)) {
+        return false;
+    }
+    entry->thread = thread;
+    reader->start_ns += unzigzag(start);
+    entry->start_ns = reader->start_ns;
+    entry->offset = unzigzag(offset);
+    entry->flags = flags;
+    entry->ret = unzigzag(ret);
+    return true;
+}
+
+// reads the environment before main
+static struct RecordSettings {
+    RecordSettings() {
+        const char *path = getenv("WATDFS_RECORD");
+        if (path != nullptr && !recorder.open(path)) {
+            fprintf(stderr, "watdfs: cannot write the recording %s\n", path);
+        }
+    }
+} settings;
@@ -0,0 +1,54 @@
+#ifndef RECORD_H
+#define RECORD_H
+
+// Recording of the client's FUSE operations, for watdfs_replay. With WATDFS_RECORD=<file> set on
+// the client every watdfs_cli_* call is appended to the file: its op, a hash of its path, the
+// arguments that shape the workload, when it started, how long it took and what it returned.
+// Paths themselves are not kept, so a recording can leave the machine it was made on.
+//
+// The file starts with RECORD_MAGIC and each record is the op byte followed by
+//   thread    varint, numbered in the order threads first record
+//   start     zigzag varint, ns after the start of the record before it
+//   duration  varint ns
+//   path      8 bytes, recordPathHash
+//   fh, offset (zigzag), size, flags, ret (zigzag)  varints, see RecordEntry
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "client_stats.h"
+
+#define RECORD_MAGIC "WATDFSREC1\n"
+
+struct RecordEntry {
+    ClientOp op;
+    uint32_t thread;
+    uint64_t start_ns;    // after the recording started
+    uint64_t duration_ns;
+    uint64_t path;
+    uint64_t fh;          // open (the handle it returned), release, read, write, fsync
+    int64_t offset;       // read, write
+    uint64_t size;        // read and write request, truncate length, file size found by getattr
+    uint32_t flags;       // open and release flags, mknod mode
+    int64_t ret;
+};
+
+uint64_t recordPathHash(const char *path);
+
+bool recordEnabled();
+// Appends the call, thread and start_ns are filled in from the calling thread and the statsNow
+// the call started at, given as start_ns.
+void recordOp(RecordEntry *entry);
+// Writes out what is buffered, done by watdfs_cli_destroy.
+void recordFlush();
+
+// Reading a recording: recordReadStart checks the magic, recordRead returns false at the end of
+// the file or at a damaged record.
+struct RecordReader {
+    FILE *in;
+    uint64_t start_ns = 0;
+};
+bool recordReadStart(RecordReader *reader, FILE *in);
+bool recordRead(RecordReader *reader, RecordEntry *entry);
+
+#endif
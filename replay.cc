@@ -0,0 +1,350 @@
+// Replays a recording of a client's FUSE operations (see record.h) against a ./watdfs_server of
+// its own, through the watdfs_cli_* calls of libwatdfs.a like bench. Every path of the recording
+// becomes /r_<hash>; the files the recording found on the server are created in the server's
+// directory first, as large as its getattrs and reads saw them, with the same contents for the
+// same recording.
+//
+// Results are printed as one JSON object: per op the recorded and replayed latency, the calls
+// whose success differs from the recording, and the bytes read, written and transferred.
+//
+// Usage: ./watdfs_replay [--speed X] [--cache-interval SEC]
+//                        [--rtt MS] [--jitter MS] [--bandwidth MBIT] [--stall-prob P] [--stall-ms MS]
+//                        <recording>
+//
+//   --speed   1 keeps the recorded timing, 10 replays ten times faster; each recorded thread is
+//             replayed by a thread of its own. 0 replays every call one after another in the
+//             order they started, which is deterministic (1)
+//   --rtt ... run the client through ./watdfs_wanproxy with these link settings
+
+#include "watdfs_client.h"
+#include "rpc_stub.h"
+#include "bench_harness.h"
+#include "bench_util.h"
+#include "record.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// the FUSE operations, the rest of ClientOp are not recorded
+#define REPLAY_OPS (CLI_UTIMENS + 1)
+
+struct Config {
+    double speed = 1;
+    time_t cache_interval = 3;
+    WanLink link;
+    const char *recording = nullptr;
+};
+
+struct Result {
+    std::vector<uint64_t> recorded_ns[REPLAY_OPS];
+    std::vector<uint64_t> replayed_ns[REPLAY_OPS];
+    uint64_t mismatches = 0;
+    uint64_t bytes_read = 0;
+    uint64_t bytes_written = 0;
+};
+
+static std::string replay_path(uint64_t hash) {
+    char path[32];
+    snprintf(path, sizeof(path), "/r_%016lx", hash);
+    return path;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////
+
+// A file the recording found on the server and the size it saw.
+struct Existing {
+    bool exists;
+    uint64_t size;
+};
+
+// Files whose first call did not create them or find them missing existed before the recording.
+static std::map<uint64_t, Existing> existing_files(const std::vector<RecordEntry> &entries) {
+    std::map<uint64_t, Existing> files;
+    for (const RecordEntry &entry: entries) {
+        auto it = files.find(entry.path);
+        if (it == files.end()) {
+            bool exists = entry.op != CLI_MKNOD && entry.ret != -ENOENT;
+            it = files.emplace(entry.path, Existing{exists, 0}).first;
+        }
+        uint64_t seen = 0;
+        if (entry.op == CLI_GETATTR && entry.ret == 0) seen = entry.size;
+        if (entry.op == CLI_READ && entry.ret > 0) seen = entry.offset + entry.ret;
+        it->second.size = std::max(it->second.size, seen);
+    }
+    return files;
+}
+
+static bool create_files(const char *dir, const std::map<uint64_t, Existing> &files) {
+    std::vector<char> buf(1 << 20);
+    for (auto &it: files) {
+        if (!it.second.exists) continue;
+        std::string path = dir + replay_path(it.first);
+        int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) { perror(path.c_str()); return false; }
+        // the same bytes for the same path, which do not compress
+        std::mt19937_64 rng(it.first);
+        for (uint64_t done = 0; done < it.second.size; done += buf.size()) {
+            for (size_t i = 0; i < buf.size(); i += 8) {
+                uint64_t word = rng();
+                memcpy(&buf[i], &word, 8);
+            }
+            size_t len = std::min((uint64_t)buf.size(), it.second.size - done);
+            if (write(fd, buf.data(), len) != (ssize_t)len) { perror(path.c_str()); close(fd); return false; }
+        }
+        close(fd);
+    }
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////
+
+// The handles of the replay by the handle recorded for them.
+class Handles {
+    std::mutex mtx;
+    std::unordered_map<uint64_t, struct fuse_file_info> open;
+
+  public:
+    void add(uint64_t recorded, const struct fuse_file_info &fi) {
+        mtx.lock();
+        open[recorded] = fi;
+        mtx.unlock();
+    }
+
+    bool find(uint64_t recorded, struct fuse_file_info *fi) {
+        mtx.lock();
+        auto it = open.find(recorded);
+        bool found = it != open.end();
+        if (found) *fi = it->second;
+        mtx.unlock();
+        return found;
+    }
+
+    void remove(uint64_t recorded) {
+        mtx.lock();
+        open.erase(recorded);
+        mtx.unlock();
+    }
+};
+
+static Handles handles;
+
+// Makes the recorded call, returns its result or a lost handle as -EBADF.
+static long replay(void *userdata, const RecordEntry &entry, std::vector<char> &buf, Result &result) {
+    std::string path = replay_path(entry.path);
+    struct fuse_file_info fi;
+    memset(&fi, 0, sizeof(fi));
+    bool with_handle = entry.op == CLI_RELEASE || entry.op == CLI_READ || entry.op == CLI_WRITE ||
+                       entry.op == CLI_FSYNC;
+    if (with_handle && !handles.find(entry.fh, &fi)) return -EBADF;
+    if ((entry.op == CLI_READ || entry.op == CLI_WRITE) && buf.size() < entry.size) buf.resize(entry.size, 'w');
+
+    long ret = 0;
+    switch (entry.op) {
+        case CLI_GETATTR: {
+            struct stat statbuf;
+            ret = watdfs_cli_getattr(userdata, path.c_str(), &statbuf);
+            break;
+        }
+        case CLI_MKNOD:
+            ret = watdfs_cli_mknod(userdata, path.c_str(), entry.flags, 0);
+            break;
+        case CLI_OPEN:
+            fi.flags = entry.flags;
+            ret = watdfs_cli_open(userdata, path.c_str(), &fi);
+            if (ret == 0) handles.add(entry.fh, fi);
+            break;
+        case CLI_RELEASE:
+            ret = watdfs_cli_release(userdata, path.c_str(), &fi);
+            handles.remove(entry.fh);
+            break;
+        case CLI_READ:
+            ret = watdfs_cli_read(userdata, path.c_str(), buf.data(), entry.size, entry.offset, &fi);
+            if (ret > 0) result.bytes_read += ret;
+            break;
+        case CLI_WRITE:
+            ret = watdfs_cli_write(userdata, path.c_str(), buf.data(), entry.size, entry.offset, &fi);
+            if (ret > 0) result.bytes_written += ret;
+            break;
+        case CLI_TRUNCATE:
+            ret = watdfs_cli_truncate(userdata, path.c_str(), entry.size);
+            break;
+        case CLI_FSYNC:
+            ret = watdfs_cli_fsync(userdata, path.c_str(), &fi);
+            break;
+        case CLI_UTIMENS: {
+            struct timespec ts[2];
+            clock_gettime(CLOCK_REALTIME, &ts[0]);
+            ts[1] = ts[0];
+            ret = watdfs_cli_utimens(userdata, path.c_str(), ts);
+            break;
+        }
+        default:
+            break;
+    }
+    return ret;
+}
+
+// Replays `entries` in order, each no earlier than its recorded start divided by the speed.
+static void run(void *userdata, const Config &config, const std::vector<const RecordEntry *> &entries,
+                uint64_t start, Result &result) {
+    std::vector<char> buf;
+    for (const RecordEntry *entry: entries) {
+        if (config.speed > 0) {
+            uint64_t due = start + entry->start_ns / config.speed, now = now_ns();
+            if (due > now) std::this_thread::sleep_for(std::chrono::nanoseconds(due - now));
+        }
+        uint64_t t = now_ns();
+        long ret = replay(userdata, *entry, buf, result);
+        result.replayed_ns[entry->op].push_back(now_ns() - t);
+        result.recorded_ns[entry->op].push_back(entry->duration_ns);
+        if ((ret < 0) != (entry->ret < 0)) ++result.mismatches;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////
+
+static double percentile(std::vector<uint64_t> &ns, double q) {
+    if (ns.empty()) return 0;
+    std::sort(ns.begin(), ns.end());
+    return ns[std::min(ns.size() - 1, (size_t)(q * ns.size()))] / 1e3;
+}
+
+static double mean(const std::vector<uint64_t> &ns) {
+    double sum = 0;
+    for (uint64_t n: ns) sum += n;
+    return ns.empty() ? 0 : sum / ns.size() / 1e3;
+}
+
+int main(int argc, char *argv[]) {
+    Config config;
+    for (int i = 1; i < argc; ++i) {
+        const char *arg = argv[i];
+        const char *value = (i + 1 < argc) ? argv[i + 1] : "";
+        bool used = true;
+        if (strcmp(arg, "--speed") == 0) config.speed = atof(value);
+        else if (strcmp(arg, "--cache-interval") == 0) config.cache_interval = atol(value);
+        else if (parseLinkOption(arg, value, &config.link)) {}
+        else if (strncmp(arg, "--", 2) != 0 && config.recording == nullptr) { config.recording = arg; used = false; }
+        else { fprintf(stderr, "unknown option %s\n", arg); return 1; }
+        if (used) ++i;
+    }
+    if (config.recording == nullptr || config.speed < 0) {
+        fprintf(stderr, "usage: %s [--speed X] [--cache-interval SEC] [link options] <recording>\n", argv[0]);
+        return 1;
+    }
+
+    FILE *in = fopen(config.recording, "rb");
+    if (in == nullptr) { perror(config.recording); return 1; }
+    RecordReader reader;
+    if (!recordReadStart(&reader, in)) { fprintf(stderr, "%s is not a watdfs recording\n", config.recording); return 1; }
+    std::vector<RecordEntry> entries;
+    RecordEntry entry;
+    while (recordRead(&reader, &entry)) {
+        if (entry.op < REPLAY_OPS) entries.push_back(entry);
+    }
+    if (!feof(in)) fprintf(stderr, "%s: damaged record, replaying the %zu before it\n", config.recording, entries.size());
+    fclose(in);
+    // recorded as the calls ended
+    std::stable_sort(entries.begin(), entries.end(),
+                     [](const RecordEntry &a, const RecordEntry &b) { return a.start_ns < b.start_ns; });
+
+    char server_dir[] = "/tmp/watdfs_replay_server.XXXXXX";
+    char cache_dir[] = "/tmp/watdfs_replay_cache.XXXXXX";
+    if (mkdtemp(server_dir) == nullptr || mkdtemp(cache_dir) == nullptr) { perror("mkdtemp"); return 1; }
+    if (!create_files(server_dir, existing_files(entries))) return 1;
+    BenchServer server;
+    if (!startServer(server_dir, config.link, &server)) return 1;
+
+    int ret = 0;
+    void *userdata = watdfs_cli_init(nullptr, cache_dir, config.cache_interval, &ret);
+    if (ret < 0) { fprintf(stderr, "watdfs_cli_init failed: %d\n", ret); return 1; }
+
+    // one sequence per recorded thread, or all of them in one
+    std::map<uint32_t, std::vector<const RecordEntry *>> sequences;
+    for (const RecordEntry &e: entries) sequences[config.speed > 0 ? e.thread : 0].push_back(&e);
+
+    std::unordered_map<std::string, uint64_t> rpcs_before = rpc_stub::call_count_snapshot();
+    Transfers transfers_before = transfers();
+    std::vector<Result> results(sequences.size());
+    std::vector<std::thread> workers;
+    uint64_t start = now_ns();
+    size_t t = 0;
+    for (auto &it: sequences) {
+        workers.emplace_back(run, userdata, std::cref(config), std::cref(it.second), start, std::ref(results[t++]));
+    }
+    for (std::thread &worker: workers) worker.join();
+    double seconds = (now_ns() - start) / 1e9;
+    std::unordered_map<std::string, uint64_t> rpcs = rpc_stub::call_count_snapshot();
+    Transfers transfers_after = transfers();
+
+    Result total;
+    for (Result &result: results) {
+        for (int op = 0; op < REPLAY_OPS; ++op) {
+            total.recorded_ns[op].insert(total.recorded_ns[op].end(), result.recorded_ns[op].begin(), result.recorded_ns[op].end());
+            total.replayed_ns[op].insert(total.replayed_ns[op].end(), result.replayed_ns[op].begin(), result.replayed_ns[op].end());
+        }
+        total.mismatches += result.mismatches;
+        total.bytes_read += result.bytes_read;
+        total.bytes_written += result.bytes_written;
+    }
+
+    std::map<uint32_t, int> threads;
+    for (const RecordEntry &e: entries) threads[e.thread] = 1;
+    double recorded_seconds = entries.empty() ? 0 : (entries.back().start_ns + entries.back().duration_ns) / 1e9;
+    printf("{\n");
+    printf("  \"recording\": {\"calls\": %zu, \"threads\": %zu, \"seconds\": %.3f},\n", entries.size(),
+           threads.size(), recorded_seconds);
+    printf("  \"speed\": %.2f,\n", config.speed);
+    if (config.link.enabled()) printf("  \"link\": %s,\n", linkJson(config.link).c_str());
+    printf("  \"seconds\": %.3f,\n", seconds);
+    printf("  \"mismatches\": %lu,\n", total.mismatches);
+    printf("  \"bytes_read\": %lu,\n", total.bytes_read);
+    printf("  \"bytes_written\": %lu,\n", total.bytes_written);
+    printf("  \"latency_us\": {\n");
+    bool first = true;
+    for (int op = 0; op < REPLAY_OPS; ++op) {
+        std::vector<uint64_t> &recorded = total.recorded_ns[op], &replayed = total.replayed_ns[op];
+        if (replayed.empty()) continue;
+        double recorded_mean = mean(recorded), replayed_mean = mean(replayed);
+        printf("%s    \"%s\": {\"count\": %zu, \"recorded\": {\"p50\": %.1f, \"p99\": %.1f, \"mean\": %.1f}, "
+               "\"replayed\": {\"p50\": %.1f, \"p99\": %.1f, \"mean\": %.1f}, \"mean_change\": %.3f}",
+               first ? "" : ",\n", clientOpName((ClientOp)op), replayed.size(),
+               percentile(recorded, 0.5), percentile(recorded, 0.99), recorded_mean,
+               percentile(replayed, 0.5), percentile(replayed, 0.99), replayed_mean,
+               recorded_mean > 0 ? replayed_mean / recorded_mean - 1 : 0.0);
+        first = false;
+    }
+    printf("\n  },\n");
+    printf("  \"rpcs\": {");
+    first = true;
+    for (auto &it: rpcs) {
+        uint64_t count = it.second - rpcs_before[it.first];
+        if (count == 0) continue;
+        printf("%s\"%s\": %lu", first ? "" : ", ", it.first.c_str(), count);
+        first = false;
+    }
+    printf("},\n");
+    printf("  \"transfers\": %s\n", transfersJson(transfers_before, transfers_after, config.link).c_str());
+    printf("}\n");
+
+    watdfs_cli_destroy(userdata);
+    stopServer(&server);
+    removeTree(server_dir);
+    removeTree(cache_dir);
+
+    return 0;
+}
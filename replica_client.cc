@@ -0,0 +1,192 @@
+#include "replica_client.h"
+#include "shard_ring.h"
+#include "shard_transport.h"
+#include "rpc.h"
+#include "rpc_stub.h"
+#include "watdfs_rpc.h"
+#include "debug.h"
+
+#include <fcntl.h>
+#include <errno.h>
+#include <stdint.h>
+#include <cstring>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Where replicaCall sends a call made from inside this file, instead of choosing.
+#define TARGET_CHOOSE -1
+#define TARGET_PRIMARY -2
+
+struct ReplicaState {
+    int server;  // shard transport index
+    uint64_t epoch;
+    uint64_t version; // the last log entry it applied, as far as we know
+};
+
+struct Binding {
+    int replica;
+    int opens;
+};
+
+static rpc_stub::call_fn primary_call = nullptr;
+static int first_server = 0;
+static std::vector<ReplicaState> replicas;
+static std::atomic<unsigned> next_replica(0);
+
+static std::mutex mtx;
+static std::unordered_map<std::string, Binding> bound; // paths opened read-only on a replica
+static bool dirty = true; // sent something to the primary since asking for its replstate, or never asked
+static uint64_t need_epoch = 0, need_version = 0;
+
+static thread_local int target = TARGET_CHOOSE;
+
+////////////////////////////////////////////helper//////////////////////////////////////////////////
+
+static int send_to(int replica, char *name, int *argTypes, void **args) {
+    if (replica < 0) return primary_call(name, argTypes, args);
+    return shardCallServer(replicas[replica].server, name, argTypes, args);
+}
+
+// The trailing retcode of a typed rpc.
+static int rpc_result(int *argTypes, void **args) {
+    int argc = 0;
+    while (argTypes[argc] != 0) ++argc;
+    return *(int *)args[argc - 1];
+}
+
+static bool state_of(int replica, uint64_t *epoch, uint64_t *version) {
+    target = replica < 0 ? TARGET_PRIMARY : replica;
+    int ret = watdfs_rpc::replstate::call(epoch, version);
+    target = TARGET_CHOOSE;
+    return ret == 0;
+}
+
+// A replica holding every write this client made, or -1 for the primary.
+static int choose_replica() {
+    mtx.lock();
+    bool ask = dirty;
+    dirty = false;
+    mtx.unlock();
+    if (ask) {
+        uint64_t epoch = 0, version = 0;
+        if (!state_of(-1, &epoch, &version)) {
+            mtx.lock();
+            dirty = true;
+            mtx.unlock();
+            return -1;
+        }
+        mtx.lock();
+        if (version >= need_version || epoch != need_epoch) { need_epoch = epoch; need_version = version; }
+        mtx.unlock();
+    }
+
+    mtx.lock();
+    uint64_t epoch = need_epoch, version = need_version;
+    mtx.unlock();
+    if (epoch == 0) return -1; // the primary's epoch is not known yet
+
+    // even with nothing written yet, a replica of another epoch or in a snapshot (epoch 0) may
+    // have files the primary does not, or only part of them
+    unsigned start = next_replica++;
+    for (size_t i = 0; i < replicas.size(); ++i) {
+        int replica = (start + i) % replicas.size();
+        mtx.lock();
+        bool known = replicas[replica].epoch == epoch && replicas[replica].version >= version;
+        mtx.unlock();
+        if (known) return replica;
+
+        uint64_t replica_epoch = 0, replica_version = 0;
+        if (!state_of(replica, &replica_epoch, &replica_version)) continue;
+        mtx.lock();
+        replicas[replica].epoch = replica_epoch;
+        replicas[replica].version = replica_version;
+        mtx.unlock();
+        if (replica_epoch == epoch && replica_version >= version) return replica;
+    }
+
+    DLOG("replica: none has caught up with %lu, reading from the primary", version);
+    return -1;
+}
+
+static bool read_only_open(const char *name, void **args) {
+    if (strcmp(name, "open") != 0 && strcmp(name, "openi") != 0) return false;
+    const struct fuse_file_info *fi = (const struct fuse_file_info *)args[1];
+    return (fi->flags & O_ACCMODE) == O_RDONLY;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+int replicaCall(char *name, int *argTypes, void **args) {
+    if (target != TARGET_CHOOSE) return send_to(target == TARGET_PRIMARY ? -1 : target, name, argTypes, args);
+
+    const char *path = shardCallPath(name, argTypes, args);
+    if (path != nullptr) {
+        mtx.lock();
+        auto it = bound.find(path);
+        int replica = it == bound.end() ? -1 : it->second.replica;
+        if (replica >= 0 && read_only_open(name, args)) ++it->second.opens;
+        if (replica >= 0 && strcmp(name, "release") == 0 && --it->second.opens == 0) bound.erase(it);
+        mtx.unlock();
+        if (replica >= 0) return send_to(replica, name, argTypes, args);
+    }
+
+    if (read_only_open(name, args) || strcmp(name, "getattr") == 0) {
+        int replica = choose_replica();
+        if (replica >= 0) {
+            int ret = send_to(replica, name, argTypes, args);
+            if (ret == OK && rpc_result(argTypes, args) >= 0) {
+                if (read_only_open(name, args)) {
+                    mtx.lock();
+                    Binding &binding = bound[path];
+                    if (binding.opens++ == 0) binding.replica = replica;
+                    mtx.unlock();
+                }
+                return ret;
+            }
+            // not there yet, created by another client or the replica is down
+            DLOG("replica: %s of %s on replica %d failed, asking the primary", name, path, replica);
+        }
+        return primary_call(name, argTypes, args);
+    }
+
+    int ret = primary_call(name, argTypes, args);
+    if (strcmp(name, "features") != 0 && strcmp(name, "stats") != 0) {
+        mtx.lock();
+        dirty = true;
+        mtx.unlock();
+    }
+    return ret;
+}
+
+int replicaClientInit(const char *list) {
+    std::vector<std::string> servers = shardServerList(list);
+    if (servers.empty()) return -EINVAL;
+
+    primary_call = rpc_stub::transport();
+    first_server = shardCount();
+    for (const std::string &server: servers) {
+        int index = shardAddServer(server.c_str());
+        if (index < 0) { DLOG("replica: cannot reach %s: %d", server.c_str(), index); continue; }
+        replicas.push_back({index, 0, 0});
+    }
+    DLOG("replica: reading from %lu of %lu replicas", replicas.size(), servers.size());
+    if (replicas.empty()) return 0; // the primary serves everything
+
+    rpc_stub::transport() = replicaCall;
+    return 0;
+}
+
+int replicaClientDestroy() {
+    if (primary_call == nullptr) return 0;
+    rpc_stub::transport() = primary_call;
+    shardDropServers(first_server);
+    replicas.clear();
+    bound.clear();
+    dirty = true;
+    need_epoch = need_version = 0;
+    primary_call = nullptr;
+    return 0;
+}
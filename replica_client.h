@@ -0,0 +1,21 @@
+#ifndef REPLICA_CLIENT_H
+#define REPLICA_CLIENT_H
+
+// Reading from the read replicas of a primary server, see replication.h. Given
+// WATDFS_REPLICAS=host:port,host:port,... (the replicas' WATDFS_SHARD_PORTs) on top of the
+// transport to the primary, the client sends getattr and the downloads of files opened read-only
+// to the replicas, round robin, and everything else to the primary.
+//
+// A file opened read-only on a replica stays with it until release, so its reads, read lock and
+// release reach the server holding its fh. Before its first read, and after it sent something to
+// the primary, the client asks the primary for its replstate once, and only uses replicas of the
+// same epoch that applied the log up to there, so it reads its own writes; a replica in the
+// middle of a snapshot reports epoch 0 and is skipped. Until one is ready, the reads go to the
+// primary too. Writes of other clients reach the replicas a little later.
+
+// Wraps the current transport, which talks to the primary.
+int replicaClientInit(const char *replicas);
+int replicaClientDestroy();
+int replicaCall(char *name, int *argTypes, void **args);
+
+#endif
@@ -0,0 +1,571 @@
+#include "replication.h"
+#include "lock_server.h"
+#include "shard_transport.h"
+#include "utility.h"
+#include "watdfs_rpc.h"
+#include "debug.h"
+
+#include <fcntl.h>
+#include <ftw.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Entries kept for replicas that are behind, WATDFS_REPL_LOG overrides it.
+#define REPL_LOG_LEN (1 << 20)
+// A pull with nothing new waits this long for the next entry.
+#define REPL_POLL_MS 500
+// Entries looked at by one pull.
+#define REPL_PULL_MAX 4096
+#define REPL_RETRY_SEC 1
+
+struct RegisterError {
+    int code;
+    RegisterError(int code) : code(code) {}
+};
+
+static std::string persist_dir;
+
+static std::string full_path(const std::string &path) { return persist_dir + path; }
+
+static size_t record_len(size_t path_len, size_t data_len) {
+    return sizeof(ReplRecord) + batchPad(path_len) + batchPad(data_len);
+}
+
+///////////////////////////////////////////primary//////////////////////////////////////////////////
+
+struct LogEntry {
+    uint64_t seq;
+    ReplOp op;
+    std::string path;
+    int64_t offset;
+    uint64_t end;
+    mode_t mode;
+    struct timespec ts[2];
+};
+
+class ReplLog {
+    std::mutex mtx;
+    std::condition_variable grown;
+    std::deque<LogEntry> entries;
+    size_t max_len = REPL_LOG_LEN;
+
+  public:
+    bool enabled = false;
+    uint64_t epoch = 0;
+    uint64_t head = 0; // seq of the last entry
+
+    void start() {
+        const char *env = getenv("WATDFS_REPL_LOG");
+        if (env && atol(env) > 0) max_len = atol(env);
+        epoch = std::random_device()() | ((uint64_t)std::random_device()() << 32) | 1;
+        enabled = true;
+    }
+
+    void append(LogEntry entry) {
+        mtx.lock();
+        entry.seq = ++head;
+        entries.push_back(std::move(entry));
+        if (entries.size() > max_len) entries.pop_front();
+        mtx.unlock();
+        grown.notify_all();
+    }
+
+    uint64_t last() {
+        mtx.lock();
+        uint64_t seq = head;
+        mtx.unlock();
+        return seq;
+    }
+
+    // Entries from `seq` on, waiting a while for one; false when `seq` is no longer kept.
+    bool from(uint64_t seq, std::vector<LogEntry> *out) {
+        std::unique_lock<std::mutex> lock(mtx);
+        uint64_t first = head - entries.size() + 1;
+        if (seq < first || seq > head + 1) return false;
+        grown.wait_for(lock, std::chrono::milliseconds(REPL_POLL_MS), [this, seq]() { return head >= seq; });
+        first = head - entries.size() + 1;
+        if (seq < first) return false;
+        for (uint64_t s = seq; s <= head && out->size() < REPL_PULL_MAX; ++s) out->push_back(entries[s - first]);
+        return true;
+    }
+};
+
+static ReplLog repl_log;
+
+bool replicationPrimary() { return repl_log.enabled; }
+
+static void log_entry(ReplOp op, const char *path, int64_t offset, uint64_t end, mode_t mode,
+                      const struct timespec *ts) {
+    if (!repl_log.enabled) return;
+    LogEntry entry = {0, op, path, offset, end, mode, {{0, 0}, {0, 0}}};
+    if (ts != nullptr) { entry.ts[0] = ts[0]; entry.ts[1] = ts[1]; }
+    repl_log.append(std::move(entry));
+}
+
+void replLogMknod(const char *path, mode_t mode) { log_entry(REPL_MKNOD, path, 0, 0, mode, nullptr); }
+void replLogWrite(const char *path, off_t offset, size_t size) {
+    if (size > 0) log_entry(REPL_WRITE, path, offset, offset + size, 0, nullptr);
+}
+void replLogTruncate(const char *path, off_t size) { log_entry(REPL_TRUNCATE, path, size, 0, 0, nullptr); }
+void replLogUtimens(const char *path, const struct timespec ts[2]) {
+    log_entry(REPL_UTIMENS, path, 0, 0, 0, ts);
+}
+
+// The files of a snapshot, for replicas that cannot continue from the log. There is no delete,
+// so a listing taken later holds the files of an earlier one in the same order, only with new
+// ones in between; a replica that moves on to a later listing at the same index sees some
+// files twice but skips none. One listing is kept and shared by the replicas that can use it.
+struct SnapshotList {
+    uint64_t taken = 0; // the log's next seq when it was taken
+    std::vector<std::string> paths;
+};
+
+static std::mutex snapshot_mtx;
+static std::shared_ptr<const SnapshotList> snapshot_list;
+static std::vector<std::string> *snapshot_paths;
+
+static int collect(const char *path, const struct stat *statbuf, int type, struct FTW *) {
+    if (type == FTW_F && S_ISREG(statbuf->st_mode)) snapshot_paths->push_back(path + persist_dir.size());
+    return 0;
+}
+
+// A listing with every file that existed before the log reached `start`.
+static std::shared_ptr<const SnapshotList> snapshot(uint64_t start) {
+    std::lock_guard<std::mutex> lock(snapshot_mtx);
+    if (snapshot_list && snapshot_list->taken >= start) return snapshot_list;
+
+    // a logged mknod comes after its file, so the listing has the files of every entry before
+    auto list = std::make_shared<SnapshotList>();
+    list->taken = repl_log.last() + 1;
+    snapshot_paths = &list->paths;
+    nftw(persist_dir.c_str(), collect, 16, FTW_PHYS);
+    std::sort(list->paths.begin(), list->paths.end());
+    DLOG("replication: snapshot of %lu files from %lu", list->paths.size(), list->taken);
+
+    snapshot_list = list;
+    return snapshot_list;
+}
+
+// Appends `entry` to the payload from data offset `offset`, as much as fits in `room`. Returns
+// the bytes used, 0 when not even the header fits, and sets `done` when the entry is complete.
+static size_t ship(const LogEntry &entry, uint64_t offset, void **segments, size_t pos, size_t room,
+                   bool *done) {
+    size_t path_len = entry.path.size() + 1;
+    if (record_len(path_len, 0) > room) return 0;
+
+    ReplRecord record;
+    memset(&record, 0, sizeof(record));
+    record.seq = entry.seq;
+    record.op = entry.op;
+    record.path_len = path_len;
+    record.offset = entry.offset;
+    record.end = entry.end;
+    record.mode = entry.mode;
+    record.ts[0] = entry.ts[0];
+    record.ts[1] = entry.ts[1];
+
+    std::vector<char> data;
+    *done = true;
+    if (entry.op == REPL_WRITE || entry.op == REPL_SYNC) {
+        // the bytes the file has now, a later entry brings anything that changes them; under the
+        // path's read lock, so not half of an upload
+        bool locked = lock(entry.path.c_str(), RW_READ_LOCK) == 0;
+        int fd = open(full_path(entry.path).c_str(), O_RDONLY);
+        struct stat statbuf;
+        if (fd >= 0 && fstat(fd, &statbuf) == 0) {
+            if (entry.op == REPL_SYNC) {
+                record.offset = offset;
+                record.end = statbuf.st_size;
+                record.mode = statbuf.st_mode;
+                record.ts[0] = statbuf.st_atim;
+                record.ts[1] = statbuf.st_mtim;
+            } else if (offset > (uint64_t)entry.offset) {
+                record.offset = offset;
+            }
+            size_t want = record.end > (uint64_t)record.offset ? record.end - record.offset : 0;
+            size_t fits = (room - record_len(path_len, 0)) & ~(size_t)7;
+            data.resize(want < fits ? want : fits);
+            ssize_t len = data.empty() ? 0 : pread(fd, data.data(), data.size(), record.offset);
+            data.resize(len > 0 ? len : 0);
+            // a file that shrank ends the entry where it ends now
+            if ((size_t)len < want && data.size() < fits) record.end = record.offset + data.size();
+            *done = record.offset + data.size() >= record.end;
+        } else {
+            record.end = record.offset; // gone, nothing to ship
+        }
+        if (fd >= 0) close(fd);
+        if (locked) unlock(entry.path.c_str(), RW_READ_LOCK);
+        if (!*done && data.empty()) return 0;
+    }
+    record.data_len = data.size();
+
+    char pad[8] = {0};
+    bulkCopyIn(segments, pos, (const char *)&record, sizeof(record));
+    pos += sizeof(record);
+    bulkCopyIn(segments, pos, entry.path.c_str(), path_len);
+    bulkCopyIn(segments, pos + path_len, pad, batchPad(path_len) - path_len);
+    pos += batchPad(path_len);
+    bulkCopyIn(segments, pos, data.data(), data.size());
+    bulkCopyIn(segments, pos + data.size(), pad, batchPad(data.size()) - data.size());
+    return record_len(path_len, data.size());
+}
+
+// Continues the transfer of entry `seq` at data offset `offset` from the log; the other
+// entries start at 0.
+static size_t pull_log(const std::vector<LogEntry> &entries, uint64_t seq, uint64_t offset,
+                       void **segments, size_t capacity, uint64_t *next_seq, uint64_t *next_offset) {
+    size_t pos = 0;
+    for (const LogEntry &entry: entries) {
+        bool done = false;
+        size_t used = ship(entry, entry.seq == seq ? offset : 0, segments, pos, capacity - pos, &done);
+        if (used == 0) break;
+        pos += used;
+        if (!done) {
+            // continue the entry where this part ends
+            ReplRecord shipped;
+            bulkCopyOut((char *)&shipped, segments, pos - used, sizeof(shipped));
+            *next_seq = entry.seq;
+            *next_offset = shipped.offset + shipped.data_len;
+            break;
+        }
+        *next_seq = entry.seq + 1;
+        *next_offset = 0;
+    }
+    return pos;
+}
+
+// Ships the snapshot files from the 1-based `file` on, continuing it at data offset `offset`.
+// `*next_file` is 0 once the snapshot is complete.
+static size_t pull_snapshot(uint64_t start, uint64_t file, uint64_t offset, void **segments,
+                            size_t capacity, uint64_t *next_file, uint64_t *next_offset) {
+    std::shared_ptr<const SnapshotList> list = snapshot(start);
+    size_t pos = 0;
+    for (uint64_t i = file - 1; i < list->paths.size(); ++i) {
+        LogEntry entry = {0, REPL_SYNC, list->paths[i], 0, 0, 0, {{0, 0}, {0, 0}}};
+        bool done = false;
+        size_t used = ship(entry, i == file - 1 ? offset : 0, segments, pos, capacity - pos, &done);
+        if (used == 0) return pos;
+        pos += used;
+        if (!done) {
+            ReplRecord shipped;
+            bulkCopyOut((char *)&shipped, segments, pos - used, sizeof(shipped));
+            *next_file = i + 1;
+            *next_offset = shipped.offset + shipped.data_len;
+            return pos;
+        }
+        *next_file = i + 2;
+        *next_offset = 0;
+    }
+    *next_file = 0;
+    *next_offset = 0;
+    return pos;
+}
+
+// A replica in a snapshot pulls with `file` > 0 and `seq` at where the log continues after it.
+int repl_pull(uint64_t epoch, uint64_t seq, uint64_t file, uint64_t offset, size_t capacity,
+              uint64_t *epoch_out, uint64_t *next_seq, uint64_t *next_file, uint64_t *next_offset,
+              rpc_stub::segments payload) {
+    if (!repl_log.enabled) return -ENOTSUP;
+    if (capacity > BULK_MAX_LEN || capacity > payload.len) return -EINVAL;
+    *epoch_out = repl_log.epoch;
+    *next_seq = seq;
+    *next_file = file;
+    *next_offset = offset;
+
+    if (epoch == repl_log.epoch && file > 0) {
+        return (int)pull_snapshot(seq, file, offset, payload.data, capacity, next_file, next_offset);
+    }
+
+    std::vector<LogEntry> entries;
+    if (epoch != repl_log.epoch || !repl_log.from(seq, &entries)) {
+        // the log from here on, after a copy of every file
+        *next_seq = repl_log.last() + 1;
+        *next_file = 1;
+        *next_offset = 0;
+        return 0;
+    }
+
+    return (int)pull_log(entries, seq, offset, payload.data, capacity, next_seq, next_offset);
+}
+
+///////////////////////////////////////////replica//////////////////////////////////////////////////
+
+static std::string primary;
+static std::atomic<uint64_t> replica_epoch(0);
+static std::atomic<uint64_t> applied(0);
+static std::atomic<bool> in_snapshot(false); // reported as epoch 0, readers go elsewhere
+
+bool replicationReplica() { return !primary.empty(); }
+
+static int apply(const ReplRecord &record, const char *path, const char *data) {
+    std::string full = full_path(path);
+    int ret = 0;
+    switch (record.op) {
+        case REPL_MKNOD:
+            if (mknod(full.c_str(), record.mode, 0) < 0 && errno != EEXIST) ret = -errno;
+            break;
+        case REPL_TRUNCATE:
+            if (truncate(full.c_str(), record.offset) < 0) ret = -errno;
+            break;
+        case REPL_UTIMENS:
+            if (utimensat(-1, full.c_str(), record.ts, 0) < 0) ret = -errno;
+            break;
+        case REPL_WRITE:
+        case REPL_SYNC: {
+            int fd = open(full.c_str(), O_WRONLY | O_CREAT, record.op == REPL_SYNC ? record.mode & 07777 : 0644);
+            if (fd < 0) { ret = -errno; break; }
+            bool last = (uint64_t)record.offset + record.data_len >= record.end;
+            if (record.op == REPL_SYNC && (record.offset == 0 || last)) {
+                if (ftruncate(fd, record.end) < 0) ret = -errno;
+                if (record.offset == 0) fchmod(fd, record.mode & 07777);
+            }
+            if (ret == 0 && record.data_len > 0 &&
+                pwrite(fd, data, record.data_len, record.offset) != (ssize_t)record.data_len) {
+                ret = -EIO;
+            }
+            if (ret == 0 && record.op == REPL_SYNC && last && futimens(fd, record.ts) < 0) ret = -errno;
+            close(fd);
+            break;
+        }
+        default:
+            ret = -EINVAL;
+    }
+    return ret;
+}
+
+// A WRITE or SYNC that comes in several parts is put together in a file of its own and renamed
+// over the path with its last part; a WRITE starts from a copy of the file.
+struct Staging {
+    int fd = -1;
+    uint64_t seq = 0;
+    int op = 0;
+    std::string path;
+};
+
+static Staging staging;
+
+static std::string staging_path() { return persist_dir + "/.watdfs_repl_part"; }
+
+static void drop_staging() {
+    if (staging.fd < 0) return;
+    close(staging.fd);
+    unlink(staging_path().c_str());
+    staging.fd = -1;
+}
+
+static bool is_part(const ReplRecord &record) {
+    return (record.op == REPL_WRITE || record.op == REPL_SYNC) &&
+           (uint64_t)record.offset + record.data_len < record.end;
+}
+
+static bool continues_staging(const ReplRecord &record, const char *path) {
+    return staging.fd >= 0 && staging.seq == record.seq && staging.op == record.op && staging.path == path;
+}
+
+static int copy_file(int from, int to) {
+    char buf[65536];
+    off_t offset = 0;
+    while (true) {
+        ssize_t n = pread(from, buf, sizeof(buf), offset);
+        if (n < 0) return -errno;
+        if (n == 0) return 0;
+        if (pwrite(to, buf, n, offset) != n) return -EIO;
+        offset += n;
+    }
+}
+
+static int start_staging(const ReplRecord &record, const char *path) {
+    drop_staging();
+    std::string full = full_path(path);
+    int fd = open(staging_path().c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) return -errno;
+
+    int ret = 0;
+    if (record.op == REPL_SYNC) {
+        if (ftruncate(fd, record.end) < 0 || fchmod(fd, record.mode & 07777) < 0) ret = -errno;
+    } else {
+        int old_fd = open(full.c_str(), O_RDONLY | O_CLOEXEC);
+        struct stat statbuf;
+        if (old_fd >= 0 && fstat(old_fd, &statbuf) == 0) {
+            ret = copy_file(old_fd, fd);
+            if (ret == 0 && fchmod(fd, statbuf.st_mode & 07777) < 0) ret = -errno;
+        } else if (fchmod(fd, 0644) < 0) {
+            ret = -errno;
+        }
+        if (old_fd >= 0) close(old_fd);
+    }
+
+    staging.fd = fd;
+    staging.seq = record.seq;
+    staging.op = record.op;
+    staging.path = path;
+    if (ret < 0) drop_staging();
+    return ret;
+}
+
+// One part of a multi-part entry, the last one replaces the file.
+static int apply_part(const ReplRecord &record, const char *path, const char *data) {
+    if (!continues_staging(record, path)) {
+        int ret = start_staging(record, path);
+        if (ret < 0) return ret;
+    }
+    if (record.data_len > 0 &&
+        pwrite(staging.fd, data, record.data_len, record.offset) != (ssize_t)record.data_len) {
+        drop_staging();
+        return -EIO;
+    }
+    if (is_part(record)) return 0;
+
+    int ret = 0;
+    if (record.op == REPL_SYNC && (ftruncate(staging.fd, record.end) < 0 || futimens(staging.fd, record.ts) < 0)) {
+        ret = -errno;
+    }
+    if (ret == 0) {
+        lock(path, RW_WRITE_LOCK);
+        if (rename(staging_path().c_str(), full_path(path).c_str()) < 0) ret = -errno;
+        unlock(path, RW_WRITE_LOCK);
+    }
+    if (ret == 0) { close(staging.fd); staging.fd = -1; }
+    else drop_staging();
+    return ret;
+}
+
+// Applies a replpull payload, returns false if it is damaged.
+static bool apply_payload(const std::vector<char> &payload, size_t len) {
+    size_t pos = 0;
+    while (pos < len) {
+        if (len - pos < sizeof(ReplRecord)) return false;
+        ReplRecord record;
+        memcpy(&record, payload.data() + pos, sizeof(record));
+        if (record.path_len == 0 || len - pos < record_len(record.path_len, record.data_len)) return false;
+        const char *path = payload.data() + pos + sizeof(record);
+        if (path[record.path_len - 1] != '\0') return false;
+        const char *data = path + batchPad(record.path_len);
+
+        // readers on this replica see a file before or after the entry
+        int ret = 0;
+        if (is_part(record) || continues_staging(record, path)) {
+            ret = apply_part(record, path, data);
+        } else {
+            lock(path, RW_WRITE_LOCK);
+            ret = apply(record, path, data);
+            unlock(path, RW_WRITE_LOCK);
+        }
+        if (ret < 0) DLOG("replication: entry %lu for %s failed: %d", record.seq, path, -ret);
+
+        // a snapshot's SYNCs have seq 0, follow sets `applied` once it is through
+        if (!is_part(record) && record.op != REPL_SYNC) applied = record.seq;
+        pos += record_len(record.path_len, record.data_len);
+    }
+    return true;
+}
+
+static void follow() {
+    while (shardClientInit(primary.c_str()) < 0) {
+        DLOG("replication: waiting for the primary %s", primary.c_str());
+        std::this_thread::sleep_for(std::chrono::seconds(REPL_RETRY_SEC));
+    }
+
+    std::vector<char> payload(BULK_MAX_LEN);
+    // the reply carries the whole capacity, so it only grows while the replica is behind
+    size_t capacity = MAX_ARRAY_LEN;
+    uint64_t seq = 0, file = 0, offset = 0;
+    while (true) {
+        uint64_t epoch = 0, next_seq = 0, next_file = 0, next_offset = 0;
+        int ret = watdfs_rpc::replpull::call(replica_epoch, seq, file, offset, capacity, &epoch, &next_seq,
+                                             &next_file, &next_offset,
+                                             rpc_stub::bytes{payload.data(), capacity});
+        if (ret < 0) {
+            DLOG("replication: pull from %s failed: %d", primary.c_str(), ret);
+            std::this_thread::sleep_for(std::chrono::seconds(REPL_RETRY_SEC));
+            continue;
+        }
+        // before the new epoch shows, so readers do not take the files for current
+        if (next_file > 0 && file == 0) {
+            in_snapshot = true;
+            applied = 0;
+        }
+        if (epoch != replica_epoch) {
+            // a new primary or one that restarted, the snapshot that follows brings every file
+            DLOG("replication: following epoch %lx from %lu", epoch, next_seq);
+            drop_staging();
+            applied = 0;
+            replica_epoch = epoch;
+        }
+        if (!apply_payload(payload, ret)) {
+            DLOG("replication: damaged payload from %s", primary.c_str());
+            drop_staging();
+            replica_epoch = 0; // start over with a snapshot
+            seq = file = offset = 0;
+            continue;
+        }
+        if (next_file == 0 && file > 0) {
+            // every file is as it was when the log stood at next_seq
+            applied = next_seq - 1;
+            in_snapshot = false;
+        }
+        seq = next_seq;
+        file = next_file;
+        offset = next_offset;
+        if ((size_t)ret > capacity / 2) capacity = std::min(capacity * 2, BULK_MAX_LEN);
+        else if ((size_t)ret < capacity / 8) capacity = std::max(capacity / 2, (size_t)MAX_ARRAY_LEN);
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+int repl_state(uint64_t *epoch, uint64_t *version) {
+    if (repl_log.enabled) {
+        *epoch = repl_log.epoch;
+        *version = repl_log.last();
+    } else {
+        *epoch = in_snapshot ? 0 : replica_epoch.load();
+        *version = applied;
+    }
+    return 0;
+}
+
+int replicationInit(const char *dir) {
+    persist_dir = dir;
+    while (persist_dir.size() > 1 && persist_dir.back() == '/') persist_dir.pop_back();
+
+    const char *env = getenv("WATDFS_PRIMARY");
+    if (env && strcmp(env, "0") != 0) repl_log.start();
+
+    env = getenv("WATDFS_REPLICA_OF");
+    if (env && env[0] != '\0') {
+        if (repl_log.enabled) return -EINVAL;
+        primary = env;
+        std::thread(follow).detach();
+    }
+    return 0;
+}
+
+int rpc_replication_register() {
+    int ret_code = 0;
+
+    try {
+        int ret = watdfs_rpc::replpull::bind<repl_pull>();
+        if (ret < 0) throw RegisterError(ret);
+
+        ret = watdfs_rpc::replstate::bind<repl_state>();
+        if (ret < 0) throw RegisterError(ret);
+    }
+    catch ( RegisterError& err) { ret_code = err.code; }
+
+    return ret_code;
+}
@@ -0,0 +1,55 @@
+#ifndef REPLICATION_H
+#define REPLICATION_H
+
+// Read replicas. A server started with WATDFS_PRIMARY=1 keeps an ordered log of the mutations
+// it makes (mknod, write, truncate, utimens); a server started with
+// WATDFS_REPLICA_OF=host:port, the primary's WATDFS_SHARD_PORT, follows it: it pulls the log
+// with the replpull rpc in the background and applies it to its own directory, and refuses
+// mutations from clients with -EROFS.
+//
+// The log holds no file data, a write is shipped with the bytes the file has when the replica
+// pulls it, so a replica that is behind converges on the primary's latest state. The log is
+// numbered within an epoch the primary picks when it starts; a replica that is new, follows
+// another epoch or fell further behind than WATDFS_REPL_LOG entries is sent a SYNC record for
+// every file instead, a page per pull, and then continues with the log from where it stood
+// when the snapshot started. Snapshots are not logged, so they only cost the replica that asked.
+// Uploads do not take the bulk channel on a primary, so every write goes through a logged rpc.
+//
+// replstate returns (epoch, version): the primary's last log entry, or the last one a replica
+// applied. Clients use it for read-your-writes, see replica_client.h.
+
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+
+enum ReplOp { REPL_MKNOD = 1, REPL_WRITE, REPL_TRUNCATE, REPL_UTIMENS, REPL_SYNC };
+
+// One entry in a replpull payload, followed by its path ('\0' included) and `data_len` bytes,
+// both padded to 8 bytes. A WRITE or SYNC that does not fit is continued in the next pull; the
+// part is the last one when offset + data_len reaches `end`. SYNC records have seq 0.
+struct ReplRecord {
+    uint64_t seq;
+    int32_t op;
+    uint32_t path_len;
+    int64_t offset;   // of the data, or the new size for TRUNCATE
+    uint64_t end;     // WRITE and SYNC: the end of the range, the file size for SYNC
+    uint32_t mode;    // MKNOD and SYNC
+    uint32_t data_len;
+    struct timespec ts[2]; // UTIMENS, and the times a SYNC leaves the file with
+};
+
+// Reads WATDFS_PRIMARY and WATDFS_REPLICA_OF for the server of `dir`; a replica starts
+// following its primary.
+int replicationInit(const char *dir);
+bool replicationPrimary();
+bool replicationReplica();
+
+// Called by the server after a mutation succeeded, nothing unless it is a primary.
+void replLogMknod(const char *path, mode_t mode);
+void replLogWrite(const char *path, off_t offset, size_t size);
+void replLogTruncate(const char *path, off_t size);
+void replLogUtimens(const char *path, const struct timespec ts[2]);
+
+int rpc_replication_register();
+
+#endif
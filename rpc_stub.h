@@ -0,0 +1,347 @@
+#ifndef RPC_STUB_H
+#define RPC_STUB_H
+
+// Typed rpc definitions. An rpc is declared once as a list of argument specs and that single
+// declaration yields both the client call and the server skeleton, so the two can no longer
+// drift apart. Every rpc carries two implicit trailing arguments: the TraceContext of the call
+// (trace.h), and an int retcode that the client call returns and the server handler's return
+// value is written into.
+//
+// Argument codes are computed at compile time and all marshalling state lives on the stack.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <errno.h>
+#include <iterator>
+#include <mutex>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+
+#include "rpc.h"
+#include "utility.h"
+#include "debug.h"
+#include "trace.h"
+
+namespace rpc_stub {
+
+constexpr int arg_code(bool input, bool output, bool array, unsigned int type) {
+    return (int)((input ? 1u << ARG_INPUT : 0u) | (output ? 1u << ARG_OUTPUT : 0u) |
+                 (array ? 1u << ARG_ARRAY : 0u) | (type << 16u));
+}
+
+template <class T> constexpr unsigned int scalar_type() {
+    static_assert(std::is_arithmetic<T>::value || std::is_enum<T>::value, "scalar rpc argument");
+    return std::is_same<T, double>::value ? ARG_DOUBLE
+         : std::is_same<T, float>::value ? ARG_FLOAT
+         : sizeof(T) == 1 ? ARG_CHAR
+         : sizeof(T) == 2 ? ARG_SHORT
+         : sizeof(T) == 4 ? ARG_INT
+         : ARG_LONG;
+}
+
+// A caller-owned buffer of runtime length.
+struct bytes {
+    char *data;
+    size_t len;
+};
+
+// Argument specs. Each one provides:
+//   param   the type the client passes
+//   server  the type the server handler receives
+//   slots   the number of rpc arguments it occupies
+//   code    its argTypes entry (array length excluded)
+//   fill    client side marshalling into types/args
+//   unpack  server side conversion from argTypes and args
+//   check   server side check of the lengths a call came with
+
+template <class T> struct in {
+    typedef T param;
+    typedef T server;
+    static constexpr int slots = 1;
+    static constexpr int code = arg_code(true, false, false, scalar_type<T>());
+    static void fill(const param &p, int *types, void **args) { types[0] = code; args[0] = (void *)&p; }
+    static server unpack(const int *, void **args) { return *(T *)args[0]; }
+    static bool check(const int *, void **) { return true; }
+};
+
+template <class T> struct out {
+    typedef T *param;
+    typedef T *server;
+    static constexpr int slots = 1;
+    static constexpr int code = arg_code(false, true, false, scalar_type<T>());
+    static void fill(param p, int *types, void **args) { types[0] = code; args[0] = (void *)p; }
+    static server unpack(const int *, void **args) { return (T *)args[0]; }
+    static bool check(const int *, void **) { return true; }
+};
+
+struct in_str {
+    typedef const char *param;
+    typedef const char *server;
+    static constexpr int slots = 1;
+    static constexpr int code = arg_code(true, false, true, ARG_CHAR);
+    static void fill(param p, int *types, void **args) {
+        types[0] = code | (int)(strlen(p) + 1); args[0] = (void *)p;
+    }
+    static server unpack(const int *, void **args) { return (const char *)args[0]; }
+    // the handler takes it for a C string
+    static bool check(const int *types, void **args) {
+        size_t len = types[0] & 0xffff;
+        return len > 0 && ((const char *)args[0])[len - 1] == '\0';
+    }
+};
+
+// N structs sent as a char array of N * sizeof(T).
+template <class T, bool IN, bool OUT, int N> struct obj {
+    typedef typename std::conditional<OUT, T *, const T *>::type param;
+    typedef param server;
+    static constexpr int slots = 1;
+    static constexpr int code = arg_code(IN, OUT, true, ARG_CHAR);
+    static void fill(param p, int *types, void **args) {
+        types[0] = code | (int)(N * sizeof(T)); args[0] = (void *)p;
+    }
+    static server unpack(const int *, void **args) { return (server)args[0]; }
+    static bool check(const int *types, void **) { return (size_t)(types[0] & 0xffff) == N * sizeof(T); }
+};
+template <class T, int N = 1> using in_obj = obj<T, true, false, N>;
+template <class T, int N = 1> using out_obj = obj<T, false, true, N>;
+template <class T, int N = 1> using inout_obj = obj<T, true, true, N>;
+
+// A single array of at most MAX_ARRAY_LEN bytes.
+template <bool IN> struct buf {
+    typedef bytes param;
+    typedef bytes server; // with the length it arrived with
+    static constexpr int slots = 1;
+    static constexpr int code = arg_code(IN, !IN, true, ARG_CHAR);
+    static void fill(const param &p, int *types, void **args) {
+        types[0] = code | (int)p.len; args[0] = (void *)p.data;
+    }
+    static server unpack(const int *types, void **args) {
+        return bytes{(char *)args[0], (size_t)(types[0] & 0xffff)};
+    }
+    static bool check(const int *, void **) { return true; }
+};
+typedef buf<true> in_buf;
+typedef buf<false> out_buf;
+
+// The arrays of a bulk argument and the bytes they hold laid out as bulkSegmentLen(len, i), which
+// stops at the first array that is not full.
+struct segments {
+    void **data;
+    size_t len;
+};
+
+// Up to BULK_MAX_LEN bytes spread over BULK_SEGMENTS arrays, see bulkSegmentLen.
+template <bool IN> struct bulk {
+    typedef bytes param;
+    typedef segments server;
+    static constexpr int slots = BULK_SEGMENTS;
+    static constexpr int code = arg_code(IN, !IN, true, ARG_CHAR);
+    static void fill(const param &p, int *types, void **args) {
+        for (int i = 0; i < BULK_SEGMENTS; ++i) {
+            types[i] = code | (int)bulkSegmentLen(p.len, i);
+            args[i] = (void *)(p.data + (size_t)i * MAX_ARRAY_LEN);
+        }
+    }
+    static server unpack(const int *types, void **args) {
+        size_t len = 0;
+        for (int i = 0; i < BULK_SEGMENTS; ++i) {
+            len += types[i] & 0xffff;
+            if ((types[i] & 0xffff) < MAX_ARRAY_LEN) break;
+        }
+        return segments{args, len};
+    }
+    static bool check(const int *, void **) { return true; }
+};
+typedef bulk<true> in_bulk;
+typedef bulk<false> out_bulk;
+
+// The function every typed call is sent through, rpcCall unless a transport replaces it.
+typedef int (*call_fn)(char *name, int *argTypes, void **args);
+inline call_fn &transport() { static call_fn fn = rpcCall; return fn; }
+
+// Every skeleton bound in this process by name, for transports other than librpc to dispatch to,
+// and the check of a call's argTypes against the declaration of each.
+inline std::unordered_map<std::string, skeleton> &skeletons() {
+    static std::unordered_map<std::string, skeleton> map;
+    return map;
+}
+typedef bool (*types_check)(const int *argTypes);
+inline std::unordered_map<std::string, types_check> &signatures() {
+    static std::unordered_map<std::string, types_check> map;
+    return map;
+}
+
+// The skeleton to run a call a transport other than librpc received with, which does not check
+// argTypes the way librpc does: OK with `fn` set, FUNCTION_NOT_FOUND, or BAD_TYPES unless
+// argTypes match the declaration exactly but for the lengths of arrays.
+inline int find_skeleton(const char *name, const int *argTypes, skeleton *fn) {
+    auto it = skeletons().find(name);
+    if (it == skeletons().end()) return FUNCTION_NOT_FOUND;
+    if (!signatures().at(name)(argTypes)) return BAD_TYPES;
+    *fn = it->second;
+    return OK;
+}
+
+// Calls made through each typed rpc in this process, by name.
+struct call_counts {
+    std::mutex mtx;
+    std::unordered_map<std::string, std::atomic<uint64_t>> map;
+};
+inline call_counts &counts() { static call_counts c; return c; }
+inline std::atomic<uint64_t> &call_count(const char *name) {
+    call_counts &c = counts();
+    c.mtx.lock();
+    std::atomic<uint64_t> &count = c.map[name]; // elements stay put when the map grows
+    c.mtx.unlock();
+    return count;
+}
+inline std::unordered_map<std::string, uint64_t> call_count_snapshot() {
+    call_counts &c = counts();
+    std::unordered_map<std::string, uint64_t> snapshot;
+    c.mtx.lock();
+    for (auto &it: c.map) snapshot[it.first] = it.second.load(std::memory_order_relaxed);
+    c.mtx.unlock();
+    return snapshot;
+}
+
+// Optional hooks around every bound handler, set by the server to keep per-rpc metrics.
+//   op    maps an rpc name to the index passed to done, asked once per rpc
+//   done  called after each handler with the bytes it moved, time taken and retcode
+struct handler_hooks {
+    int (*op)(const char *name) = nullptr;
+    void (*done)(int op, uint64_t bytes, uint64_t ns, int ret) = nullptr;
+};
+inline handler_hooks &hooks() { static handler_hooks h; return h; }
+
+template <class Def, class... Specs> struct rpc {
+    static constexpr int slot_offset(size_t k) {
+        const int slots[] = {Specs::slots..., 0};
+        int offset = 0;
+        for (size_t i = 0; i < k; ++i) offset += slots[i];
+        return offset;
+    }
+    // number of rpc arguments including the trailing trace context and retcode
+    static constexpr int argc = slot_offset(sizeof...(Specs)) + 2;
+    static constexpr int trace_code = arg_code(true, false, true, ARG_CHAR);
+    static constexpr int ret_code = arg_code(false, true, false, ARG_INT);
+
+    // the bytes a call moved given its retcode and arguments, see RPC_DATA_DEF
+    static uint64_t moved(int ret, void **args) { (void)ret; (void)args; return 0; }
+
+    static int call(typename Specs::param... p) {
+        int types[argc + 1];
+        void *args[argc];
+        int ret = 0;
+
+        TraceSpan span = traceBegin(Def::name(), TRACE_RPC);
+        TraceContext trace = traceContext(span);
+
+        int i = 0;
+        int expand[] = {0, (Specs::fill(p, types + i, args + i), i += Specs::slots)...};
+        (void)expand;
+        types[i] = trace_code | (int)sizeof(trace); args[i] = (void *)&trace;
+        types[i + 1] = ret_code; args[i + 1] = (void *)&ret;
+        types[i + 2] = 0; // the null terminator
+
+        static std::atomic<uint64_t> &calls = call_count(Def::name());
+        calls.fetch_add(1, std::memory_order_relaxed);
+
+        int rpc_ret = transport()((char *)Def::name(), types, args);
+        traceEnd(&span, rpc_ret < 0 ? rpc_ret : ret);
+        if (rpc_ret < 0) {
+            DLOG("%s rpc failed with error '%d'", Def::name(), rpc_ret);
+            return -EINVAL;
+        }
+        return ret;
+    }
+
+    template <int (*F)(typename Specs::server...), size_t... I>
+    static int invoke(const int *argTypes, void **args, std::index_sequence<I...>) {
+        return F(Specs::unpack(argTypes + slot_offset(I), args + slot_offset(I))...);
+    }
+
+    // arrays a handler relies on the length of, whichever transport the call came through
+    template <size_t... I>
+    static bool check_lengths(const int *argTypes, void **args, std::index_sequence<I...>) {
+        const bool ok[] = {true, Specs::check(argTypes + slot_offset(I), args + slot_offset(I))...};
+        return std::all_of(std::begin(ok), std::end(ok), [](bool b) { return b; });
+    }
+
+    template <int (*F)(typename Specs::server...)>
+    static int skeleton(int *argTypes, void **args) {
+        if (!check_lengths(argTypes, args, std::index_sequence_for<Specs...>()) ||
+            (size_t)(argTypes[argc - 2] & 0xffff) != sizeof(TraceContext)) {
+            DLOG("%s called with bad array lengths", Def::name());
+            return BAD_TYPES;
+        }
+        int *ret = (int *)args[argc - 1];
+        TraceSpan span = traceServe(Def::name(), *(TraceContext *)args[argc - 2]);
+        handler_hooks &h = hooks();
+        if (h.done == nullptr) {
+            *ret = invoke<F>(argTypes, args, std::index_sequence_for<Specs...>());
+        } else {
+            static const int op = h.op(Def::name());
+            auto start = std::chrono::steady_clock::now();
+            *ret = invoke<F>(argTypes, args, std::index_sequence_for<Specs...>());
+            h.done(op, Def::moved(*ret, args), std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                             std::chrono::steady_clock::now() - start).count(), *ret);
+        }
+        traceEnd(&span, *ret);
+        DLOG("%s returning code: %d", Def::name(), *ret);
+        return 0;
+    }
+
+    // argTypes as registered on the server, arrays are declared with length 1
+    static void register_types(int *types) {
+        int i = 0;
+        int expand[] = {0, (std::fill_n(types + i, Specs::slots,
+                                        Specs::code | ((Specs::code >> ARG_ARRAY) & 1)),
+                            i += Specs::slots)...};
+        (void)expand;
+        types[i] = trace_code | 1;
+        types[i + 1] = ret_code;
+        types[i + 2] = 0; // the null terminator
+    }
+
+    // the same argument count and codes as declared, arrays of any length
+    static bool matches(const int *argTypes) {
+        int types[argc + 1];
+        register_types(types);
+        for (int i = 0; i < argc; ++i) {
+            if (argTypes[i] == 0) return false;
+            int mask = ((types[i] >> ARG_ARRAY) & 1) ? ~0xffff : ~0;
+            if ((argTypes[i] & mask) != (types[i] & mask)) return false;
+        }
+        return argTypes[argc] == 0;
+    }
+
+    template <int (*F)(typename Specs::server...)>
+    static int bind() {
+        int types[argc + 1];
+        register_types(types);
+        skeletons()[Def::name()] = skeleton<F>;
+        signatures()[Def::name()] = matches;
+        return rpcRegister((char *)Def::name(), types, skeleton<F>);
+    }
+};
+
+} // namespace rpc_stub
+
+// Declares the rpc `op` with the given argument specs.
+#define RPC_DEF(op, ...)                                                       \
+    struct op : rpc_stub::rpc<op, __VA_ARGS__> {                               \
+        static const char *name() { return #op; }                              \
+    }
+
+// Declares the rpc `op` whose handler returns the bytes it moved.
+#define RPC_DATA_DEF(op, ...)                                                  \
+    struct op : rpc_stub::rpc<op, __VA_ARGS__> {                               \
+        static const char *name() { return #op; }                              \
+        static uint64_t moved(int ret, void **) { return ret > 0 ? ret : 0; }  \
+    }
+
+#endif
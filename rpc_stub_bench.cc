@@ -0,0 +1,125 @@
+// Microbenchmark for the per-call marshalling overhead of the typed rpc stubs against the
+// hand-built argTypes/args stubs they replaced.
+//
+// By default both stubs are sent through an in-process loopback transport that runs the
+// server skeleton directly, so only marshalling/unmarshalling is measured. With --remote the
+// calls go through rpcCall to a running watdfs_server (SERVER_ADDRESS/SERVER_PORT).
+//
+// Usage: ./rpc_stub_bench [--remote] [iterations]
+
+#include "rpc.h"
+#include "utility.h"
+#include "watdfs_rpc.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sys/stat.h>
+
+INIT_LOG
+
+////////////////////////////////////////////////////////////////////////////////////////////////
+
+// the server side of the loopback transport
+int handle_getattr(const char *path, struct stat *statbuf) {
+    statbuf->st_size = strlen(path);
+    return 0;
+}
+
+int legacy_getattr(int *argTypes, void **args) {
+    struct stat *statbuf = (struct stat *)args[1];
+    int *ret = (int *)args[3];
+    *ret = handle_getattr((const char *)args[0], statbuf);
+    return 0;
+}
+
+skeleton loopback_skeleton = nullptr;
+int loopback(char *name, int *argTypes, void **args) { return loopback_skeleton(argTypes, args); }
+
+rpc_stub::call_fn legacy_transport = loopback;
+
+////////////////////////////////////////////////////////////////////////////////////////////////
+
+// getattr_on_server as it was written before the typed stubs, with the trace context every rpc
+// carries now (trace.h), left untraced
+int legacy_getattr_on_server(const char *path, struct stat *statbuf) {
+    int ARG_COUNT = 4;
+    void **args = new void*[ARG_COUNT];
+    int arg_types[ARG_COUNT + 1];
+
+    int pathlen = strlen(path) + 1;
+    arg_types[0] = argTypeFrmtr(yes, no, yes, ARG_CHAR, (uint) pathlen); //path
+    args[0] = (void *)path;
+
+    arg_types[1] = argTypeFrmtr(no, yes, yes, ARG_CHAR, (uint) sizeof(struct stat)); //statbuf
+    args[1] = (void *)statbuf;
+
+    TraceContext trace = {0, 0};
+    arg_types[2] = argTypeFrmtr(yes, no, yes, ARG_CHAR, (uint) sizeof(trace)); //trace context
+    args[2] = (void *)&trace;
+
+    RAII<int> ret(0);
+    arg_types[3] = argTypeFrmtr(no, yes, no, ARG_INT); //retcode
+    args[3] = (void *)ret.ptr;
+
+    arg_types[4] = 0;
+
+    int rpc_ret = legacy_transport((char *)"getattr", arg_types, args);
+
+    int fxn_ret = 0;
+    if (rpc_ret < 0) fxn_ret = -EINVAL;
+    else fxn_ret = *ret;
+
+    if (fxn_ret < 0) memset(statbuf, 0, sizeof(struct stat));
+
+    delete []args;
+
+    return fxn_ret;
+}
+
+int typed_getattr_on_server(const char *path, struct stat *statbuf) {
+    int fxn_ret = watdfs_rpc::getattr::call(path, statbuf);
+    if (fxn_ret < 0) memset(statbuf, 0, sizeof(struct stat));
+    return fxn_ret;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////
+
+double ns_per_call(int (*stub)(const char *, struct stat *), long iterations) {
+    struct stat statbuf;
+    auto start = std::chrono::steady_clock::now();
+    for (long i = 0; i < iterations; ++i) {
+        if (stub("/", &statbuf) < 0) { fprintf(stderr, "call failed\n"); exit(1); }
+    }
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::nano>(end - start).count() / iterations;
+}
+
+int main(int argc, char *argv[]) {
+    bool remote = (argc > 1 && strcmp(argv[1], "--remote") == 0);
+    long iterations = (argc > 1 + remote) ? atol(argv[1 + remote]) : (remote ? 200 : 5000000);
+
+    if (remote) {
+        int ret = rpcClientInit();
+        if (ret < 0) { fprintf(stderr, "rpcClientInit failed: %d\n", ret); return 1; }
+        legacy_transport = rpcCall;
+    } else {
+        rpc_stub::transport() = loopback;
+    }
+
+    loopback_skeleton = legacy_getattr;
+    double legacy = ns_per_call(legacy_getattr_on_server, iterations);
+
+    loopback_skeleton = watdfs_rpc::getattr::skeleton<handle_getattr>;
+    double typed = ns_per_call(typed_getattr_on_server, iterations);
+
+    printf("getattr %s, %ld calls\n", remote ? "remote" : "loopback", iterations);
+    printf("  hand-built stub: %10.1f ns/call\n", legacy);
+    printf("  typed stub:      %10.1f ns/call\n", typed);
+    printf("  reduction:       %10.1f ns/call (%.1f%%)\n", legacy - typed,
+           100.0 * (legacy - typed) / legacy);
+
+    if (remote) rpcClientDestroy();
+    return 0;
+}
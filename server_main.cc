@@ -1,8 +1,17 @@
 #include "rpc.h"
 #include "watdfs_server.h"
 #include "lock_server.h"
+#include "local_transport.h"
+#include "bulk_channel.h"
+#include "shard_transport.h"
+#include "replication.h"
+#include "stats.h"
 #include "debug.h"
 
+#include <errno.h>
+#include <cstdio>
+#include <cstdlib>
+
 # ifdef PRINT_ERR
 #include <iostream>
 #endif
@@ -23,6 +32,11 @@ int main(int argc, char *argv[]) {
     // Store the directory in a global variable.
     set_server_persist_dir(argv[1]);
 
+#ifndef NDEBUG
+    // SIGUSR1/SIGUSR2 change how much the running server logs, see async_log.h
+    logHandleSignals();
+#endif
+
     DLOG("Initializing server...");
 
     int ret = 0;
@@ -31,6 +45,9 @@ int main(int argc, char *argv[]) {
     ret = rpcServerInit();
     if (ret < 0) { DLOG("RPC SERVER COULD NOT BE INITIALIZED"); return ret; }
 
+    // every handler registered below is timed, see stats.h
+    statsHookRpcs();
+
     // register functions with the RPC library
     ret = rpc_watdfs_server_register();
     if (ret < 0) { DLOG("WATDFS SERVER FUNCTIONS COULD NOT BE REGISTERED FOR RPC"); return ret; }
@@ -38,6 +55,38 @@ int main(int argc, char *argv[]) {
     ret = rpc_lock_server_register();
     if (ret < 0) { DLOG("LOCK SERVER FUNCTIONS COULD NOT BE REGISTERED FOR RPC"); return ret; }
 
+    // A primary logs its mutations for read replicas, a replica follows one, see replication.h.
+    ret = rpc_replication_register();
+    if (ret < 0) { DLOG("REPLICATION FUNCTIONS COULD NOT BE REGISTERED FOR RPC"); return ret; }
+
+    ret = replicationInit(argv[1]);
+    if (ret < 0) { DLOG("REPLICATION COULD NOT BE INITIALIZED"); return ret; }
+
+    ret = bulkServerInit();
+    if (ret < 0) { DLOG("BULK CHANNEL COULD NOT BE INITIALIZED"); return ret; }
+
+    // Clients of a namespace split over several servers and of read replicas call in on a port
+    // of their own, see shard_transport.h. A server on a ring keeps its place only on the same
+    // port, so that one has to be pinned.
+    const char *servers = getenv("WATDFS_SERVERS");
+    if (servers != nullptr || getenv("WATDFS_PRIMARY") != nullptr || getenv("WATDFS_REPLICA_OF") != nullptr) {
+        if (servers != nullptr && getenv("WATDFS_SHARD_PORT") == nullptr) {
+            DLOG("WATDFS_SERVERS NEEDS WATDFS_SHARD_PORT");
+            return -EINVAL;
+        }
+        ret = shardServerInit();
+        if (ret < 0) { DLOG("SHARD TRANSPORT COULD NOT BE INITIALIZED"); return ret; }
+        printf("export WATDFS_SHARD_PORT=%d\n", shardServerPort());
+        fflush(stdout);
+    }
+
+    // Clients on this host can connect through a unix socket instead, see local_transport.h.
+    const char *local_socket = getenv("WATDFS_LOCAL_SOCKET");
+    if (local_socket != nullptr) {
+        ret = localServerInit(local_socket);
+        if (ret < 0) { DLOG("LOCAL TRANSPORT COULD NOT BE INITIALIZED"); return ret; }
+    }
+
     ret = rpcExecute();
     if (ret < 0) { DLOG("RPC EXECUTE FAILED"); return ret; }
 
@@ -0,0 +1,23 @@
+#ifndef SHA256_H
+#define SHA256_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA256_LEN 32
+
+struct Sha256 {
+    uint32_t state[8];
+    uint64_t total;
+    uint8_t block[64];
+    size_t block_len;
+};
+
+void sha256Init(Sha256 *ctx);
+void sha256Update(Sha256 *ctx, const void *data, size_t len);
+void sha256Final(Sha256 *ctx, uint8_t digest[SHA256_LEN]);
+
+// One-shot digest of data[0, len).
+void sha256(const void *data, size_t len, uint8_t digest[SHA256_LEN]);
+
+#endif
@@ -0,0 +1,55 @@
+#include "shard_ring.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+
+// FNV-1a followed by the splitmix64 finalizer, FNV alone leaves nearby names close on the ring.
+static uint64_t ring_hash(const char *data, size_t len) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len; ++i) hash = (hash ^ (unsigned char)data[i]) * 0x100000001b3ULL;
+    hash = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    hash = (hash ^ (hash >> 27)) * 0x94d049bb133111ebULL;
+    return hash ^ (hash >> 31);
+}
+
+std::vector<std::string> shardServerList(const char *list) {
+    std::vector<std::string> servers;
+    std::string entry;
+    for (const char *p = list;; ++p) {
+        if (*p == ',' || *p == '\0') {
+            if (!entry.empty()) servers.push_back(entry);
+            entry.clear();
+            if (*p == '\0') break;
+        } else if (*p != ' ') {
+            entry += *p;
+        }
+    }
+    return servers;
+}
+
+int shardVnodes() {
+    const char *env = getenv("WATDFS_SHARD_VNODES");
+    int vnodes = env ? atoi(env) : SHARD_VNODES;
+    return vnodes > 0 ? vnodes : SHARD_VNODES;
+}
+
+void shardRingBuild(const std::vector<std::string> &servers, int vnodes, ShardRing *ring) {
+    ring->servers = servers;
+    ring->points.clear();
+    for (size_t s = 0; s < servers.size(); ++s) {
+        for (int v = 0; v < vnodes; ++v) {
+            std::string point = servers[s] + "#" + std::to_string(v);
+            ring->points.emplace_back(ring_hash(point.data(), point.size()), (int)s);
+        }
+    }
+    std::sort(ring->points.begin(), ring->points.end());
+}
+
+int shardRingLookup(const ShardRing &ring, const char *path) {
+    if (ring.points.empty()) return 0;
+    uint64_t hash = ring_hash(path, strlen(path));
+    auto it = std::lower_bound(ring.points.begin(), ring.points.end(), std::make_pair(hash, 0));
+    if (it == ring.points.end()) it = ring.points.begin();
+    return it->second;
+}
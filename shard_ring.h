@@ -0,0 +1,33 @@
+#ifndef SHARD_RING_H
+#define SHARD_RING_H
+
+// Consistent hashing of paths onto servers. Every server is placed on a 64 bit ring at `vnodes`
+// points hashed from its name, the entry as written in WATDFS_SERVERS, and a path belongs to the
+// server of the first point at or after the path's hash. Adding a server to N moves about
+// 1/(N+1) of the paths, all of them to the new server.
+//
+// The client (shard_transport.h) and watdfs_rebalance have to build the ring from the same
+// names in the same order and with the same vnodes to agree on where a path lives.
+
+#include <stdint.h>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Points per server, WATDFS_SHARD_VNODES overrides it.
+#define SHARD_VNODES 128
+
+struct ShardRing {
+    std::vector<std::string> servers;
+    std::vector<std::pair<uint64_t, int>> points; // sorted by hash
+};
+
+// Splits a comma separated server list, empty entries are dropped.
+std::vector<std::string> shardServerList(const char *list);
+int shardVnodes();
+
+void shardRingBuild(const std::vector<std::string> &servers, int vnodes, ShardRing *ring);
+// The index in ring.servers of the server owning `path`, 0 for an empty ring.
+int shardRingLookup(const ShardRing &ring, const char *path);
+
+#endif
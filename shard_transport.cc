@@ -0,0 +1,376 @@
+#include "shard_transport.h"
+#include "shard_ring.h"
+#include "rpc.h"
+#include "rpc_stub.h"
+#include "watdfs_rpc.h"
+#include "debug.h"
+
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Largest sum of array arguments in one call, enough for a full bulk transfer in both directions.
+#define SHARD_MAX_PAYLOAD (2 * BULK_MAX_LEN + (1 << 20))
+#define SHARD_MAX_ARGS (BULK_SEGMENTS + 32)
+#define SHARD_MAX_NAME 64
+
+// Wire format, one outstanding call per connection:
+//   request:  CallHeader, name, int argTypes[argc], uint64_t words[argc], the input arrays
+//   response: ReplyHeader, uint64_t words[argc], the output arrays if rpc_ret is OK
+// A word holds a scalar's value, arrays follow back to back in argument order.
+struct CallHeader {
+    uint32_t name_len;
+    uint32_t argc;
+};
+
+struct ReplyHeader {
+    int32_t rpc_ret;
+    uint32_t pad;
+};
+
+////////////////////////////////////////////helper//////////////////////////////////////////////////
+
+static int write_full(int fd, struct iovec *iov, int iovcnt) {
+    while (iovcnt > 0) {
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovcnt < IOV_MAX ? iovcnt : IOV_MAX;
+        ssize_t n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (n < 0) { if (errno == EINTR) continue; return -errno; }
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len) { n -= iov->iov_len; ++iov; --iovcnt; }
+        if (iovcnt > 0) { iov->iov_base = (char *)iov->iov_base + n; iov->iov_len -= n; }
+    }
+    return 0;
+}
+
+static int read_full(int fd, void *buf, size_t len) {
+    char *p = (char *)buf;
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n < 0) { if (errno == EINTR) continue; return -errno; }
+        if (n == 0) return -ECONNRESET;
+        p += n; len -= n;
+    }
+    return 0;
+}
+
+static void set_nodelay(int sock) {
+    int one = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+static bool is_input(int type) { return (type >> ARG_INPUT) & 1; }
+static bool is_output(int type) { return (type >> ARG_OUTPUT) & 1; }
+static bool is_array(int type) { return (type >> ARG_ARRAY) & 1; }
+
+static size_t elem_size(int type) {
+    switch ((type >> 16) & 0xff) {
+        case ARG_CHAR: return 1;
+        case ARG_SHORT: return 2;
+        case ARG_INT: case ARG_FLOAT: return 4;
+        case ARG_LONG: case ARG_DOUBLE: return 8;
+        default: return 0;
+    }
+}
+
+static size_t arg_bytes(int type) {
+    return is_array(type) ? elem_size(type) * (type & 0xffff) : elem_size(type);
+}
+
+///////////////////////////////////////////server///////////////////////////////////////////////////
+
+static int listen_port = 0;
+
+static void serve_connection(int sock) {
+    CallHeader header;
+    char name[SHARD_MAX_NAME + 1];
+    int types[SHARD_MAX_ARGS + 1];
+    uint64_t words[SHARD_MAX_ARGS];
+    void *args[SHARD_MAX_ARGS];
+    struct iovec reply[SHARD_MAX_ARGS + 2];
+    std::vector<char> arrays;
+
+    while (read_full(sock, &header, sizeof(header)) == 0) {
+        if (header.name_len > SHARD_MAX_NAME || header.argc > SHARD_MAX_ARGS) break;
+        if (read_full(sock, name, header.name_len) < 0) break;
+        if (read_full(sock, types, header.argc * sizeof(int)) < 0) break;
+        if (read_full(sock, words, header.argc * sizeof(uint64_t)) < 0) break;
+        name[header.name_len] = '\0';
+        types[header.argc] = 0;
+
+        // every array gets its own 8 byte aligned place in `arrays`
+        size_t total = 0;
+        for (uint32_t i = 0; i < header.argc; ++i) {
+            if (is_array(types[i])) total += (arg_bytes(types[i]) + 7) & ~(size_t)7;
+        }
+        if (total > SHARD_MAX_PAYLOAD) break;
+        if (arrays.size() < total) arrays.resize(total);
+        // output arrays go back in full, so nothing of an earlier call may be left in them
+        memset(arrays.data(), 0, total);
+
+        bool ok = true;
+        size_t cursor = 0;
+        for (uint32_t i = 0; ok && i < header.argc; ++i) {
+            if (!is_array(types[i])) { args[i] = &words[i]; continue; }
+            args[i] = arrays.data() + cursor;
+            if (is_input(types[i])) ok = read_full(sock, args[i], arg_bytes(types[i])) == 0;
+            cursor += (arg_bytes(types[i]) + 7) & ~(size_t)7;
+        }
+        if (!ok) break;
+
+        ReplyHeader reply_header = {OK, 0};
+        skeleton fn = nullptr;
+        reply_header.rpc_ret = rpc_stub::find_skeleton(name, types, &fn);
+        if (reply_header.rpc_ret == OK && fn(types, args) < 0) reply_header.rpc_ret = FUNCTION_FAILURE;
+
+        int iovcnt = 0;
+        reply[iovcnt++] = { &reply_header, sizeof(reply_header) };
+        reply[iovcnt++] = { words, header.argc * sizeof(uint64_t) };
+        for (uint32_t i = 0; reply_header.rpc_ret == OK && i < header.argc; ++i) {
+            if (is_array(types[i]) && is_output(types[i])) reply[iovcnt++] = { args[i], arg_bytes(types[i]) };
+        }
+        if (write_full(sock, reply, iovcnt) < 0) break;
+    }
+
+    close(sock);
+}
+
+int shardServerInit() {
+    int sock = socket(AF_INET6, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0) return -errno;
+
+    int zero = 0, one = 1;
+    setsockopt(sock, IPPROTO_IPV6, IPV6_V6ONLY, &zero, sizeof(zero));
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)); // a pinned port after a restart
+
+    const char *env = getenv("WATDFS_SHARD_PORT");
+    struct sockaddr_in6 addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin6_family = AF_INET6;
+    addr.sin6_addr = in6addr_any;
+    addr.sin6_port = htons(env ? atoi(env) : 0);
+    socklen_t addr_len = sizeof(addr);
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(sock, SOMAXCONN) < 0 ||
+        getsockname(sock, (struct sockaddr *)&addr, &addr_len) < 0) {
+        int ret = -errno;
+        close(sock);
+        return ret;
+    }
+    listen_port = ntohs(addr.sin6_port);
+    DLOG("shard: listening on port %d", listen_port);
+
+    std::thread([sock]() {
+        while (true) {
+            int conn = accept4(sock, nullptr, nullptr, SOCK_CLOEXEC);
+            if (conn < 0) { if (errno == EINTR || errno == ECONNABORTED) continue; break; }
+            set_nodelay(conn);
+            std::thread(serve_connection, conn).detach();
+        }
+        DLOG("shard: accept failed: %d", errno);
+    }).detach();
+
+    return 0;
+}
+
+int shardServerPort() { return listen_port; }
+
+///////////////////////////////////////////client///////////////////////////////////////////////////
+
+// Connections to one server, created on demand so concurrent callers each get their own.
+class ShardPool {
+    std::mutex mtx;
+    std::string host;
+    std::string port;
+    std::vector<int> idle;
+
+    int connect_server() {
+        struct addrinfo hints, *res = nullptr;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        if (getaddrinfo(host.c_str(), port.c_str(), &hints, &res) != 0) return -EHOSTUNREACH;
+
+        int sock = -ECONNREFUSED;
+        for (struct addrinfo *ai = res; ai != nullptr; ai = ai->ai_next) {
+            int fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+            if (fd < 0) continue;
+            if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) { sock = fd; break; }
+            close(fd);
+        }
+        freeaddrinfo(res);
+        if (sock >= 0) set_nodelay(sock);
+        else DLOG("shard: unable to connect to %s:%s: %d", host.c_str(), port.c_str(), -sock);
+        return sock;
+    }
+
+  public:
+    // host:port, [v6 host]:port
+    bool setServer(const std::string &server) {
+        size_t colon = server.rfind(':');
+        if (colon == std::string::npos || colon == 0) return false;
+        host = server.substr(0, colon);
+        port = server.substr(colon + 1);
+        if (host.front() == '[' && host.back() == ']') host = host.substr(1, host.size() - 2);
+        return true;
+    }
+
+    int get() {
+        mtx.lock();
+        if (!idle.empty()) {
+            int sock = idle.back();
+            idle.pop_back();
+            mtx.unlock();
+            return sock;
+        }
+        mtx.unlock();
+        return connect_server();
+    }
+
+    void put(int sock) {
+        mtx.lock();
+        idle.push_back(sock);
+        mtx.unlock();
+    }
+
+    void clear() {
+        mtx.lock();
+        for (int sock: idle) close(sock);
+        idle.clear();
+        mtx.unlock();
+    }
+};
+
+static ShardRing ring;
+static std::vector<ShardPool*> pools;
+
+const char *shardCallPath(const char *name, int *argTypes, void **args) {
+    if (strcmp(name, "batch") == 0) {
+        // flags, count, request_len, request, ...
+        return (const char *)args[3] + sizeof(BatchRequest);
+    }
+    if (argTypes[0] != 0 && is_array(argTypes[0]) && is_input(argTypes[0]) &&
+        ((argTypes[0] >> 16) & 0xff) == ARG_CHAR) {
+        return (const char *)args[0];
+    }
+    return nullptr;
+}
+
+int shardCallServer(int server, char *name, int *argTypes, void **args) {
+    if (server < 0 || server >= (int)pools.size()) return NOT_INIT;
+
+    CallHeader header;
+    header.name_len = strlen(name);
+    header.argc = 0;
+    while (argTypes[header.argc] != 0) ++header.argc;
+    if (header.name_len > SHARD_MAX_NAME || header.argc > SHARD_MAX_ARGS) return BAD_TYPES;
+
+    size_t total = 0;
+    uint64_t words[SHARD_MAX_ARGS];
+    struct iovec request[SHARD_MAX_ARGS + 4];
+    int iovcnt = 4;
+    for (uint32_t i = 0; i < header.argc; ++i) {
+        int type = argTypes[i];
+        words[i] = 0;
+        if (!is_array(type)) {
+            if (is_input(type)) memcpy(&words[i], args[i], arg_bytes(type));
+            continue;
+        }
+        total += (arg_bytes(type) + 7) & ~(size_t)7;
+        if (is_input(type)) request[iovcnt++] = { args[i], arg_bytes(type) };
+    }
+    if (total > SHARD_MAX_PAYLOAD) return ARRAY_LENS_TOO_LONG;
+    request[0] = { &header, sizeof(header) };
+    request[1] = { name, header.name_len };
+    request[2] = { argTypes, header.argc * sizeof(int) };
+    request[3] = { words, header.argc * sizeof(uint64_t) };
+
+    ShardPool *pool = pools[server];
+    int sock = pool->get();
+    if (sock < 0) return FAILED_TO_SEND;
+
+    ReplyHeader reply_header;
+    bool ok = write_full(sock, request, iovcnt) == 0 &&
+              read_full(sock, &reply_header, sizeof(reply_header)) == 0 &&
+              read_full(sock, words, header.argc * sizeof(uint64_t)) == 0;
+    for (uint32_t i = 0; ok && reply_header.rpc_ret == OK && i < header.argc; ++i) {
+        int type = argTypes[i];
+        if (!is_output(type)) continue;
+        if (is_array(type)) ok = read_full(sock, args[i], arg_bytes(type)) == 0;
+        else memcpy(args[i], &words[i], arg_bytes(type));
+    }
+    if (!ok) {
+        // a connection that failed mid-call is not reused
+        DLOG("shard: %s call failed: %d", name, errno);
+        close(sock);
+        return FAILED_TO_SEND;
+    }
+
+    pool->put(sock);
+    return reply_header.rpc_ret;
+}
+
+int shardCall(char *name, int *argTypes, void **args) {
+    const char *path = shardCallPath(name, argTypes, args);
+    return shardCallServer(path ? shardRingLookup(ring, path) : 0, name, argTypes, args);
+}
+
+int shardAddServer(const char *server) {
+    ShardPool *pool = new ShardPool;
+    if (!pool->setServer(server)) { delete pool; return -EINVAL; }
+
+    // fail early if the server is not there
+    int sock = pool->get();
+    if (sock < 0) { delete pool; return NOT_INIT; }
+    pool->put(sock);
+
+    pools.push_back(pool);
+    return pools.size() - 1;
+}
+
+void shardDropServers(int from) {
+    while ((int)pools.size() > from) {
+        pools.back()->clear();
+        delete pools.back();
+        pools.pop_back();
+    }
+}
+
+int shardClientInit(const char *servers) {
+    std::vector<std::string> list = shardServerList(servers);
+    if (list.empty()) return -EINVAL;
+    DLOG("shard: using %lu servers: %s", list.size(), servers);
+
+    for (const std::string &server: list) {
+        int ret = shardAddServer(server.c_str());
+        if (ret < 0) { shardClientDestroy(); return ret; }
+    }
+    shardRingBuild(list, shardVnodes(), &ring);
+
+    rpc_stub::transport() = shardCall;
+    return 0;
+}
+
+int shardClientDestroy() {
+    shardDropServers(0);
+    shardRingBuild({}, 0, &ring);
+    rpc_stub::transport() = rpcCall;
+    return 0;
+}
+
+int shardCount() { return ring.servers.size(); }
+
+int shardOf(const char *path) { return ring.servers.empty() ? 0 : shardRingLookup(ring, path); }
@@ -0,0 +1,37 @@
+#ifndef SHARD_TRANSPORT_H
+#define SHARD_TRANSPORT_H
+
+// Transport for a namespace split over several servers. librpc connects a process to one server,
+// so every server also takes calls on a plain TCP port of its own, and a client given
+// WATDFS_SERVERS=host:port,host:port,... sends each rpc to the server owning its path on a
+// ShardRing (shard_ring.h), over a pool of connections per server.
+//
+// The rpc's path is its first argument when that is an input string, or the path of the first
+// entry of a batch; batch_on_server only puts paths of one server in a batch. Rpcs without a
+// path, like features, go to the first server.
+
+// Server: take calls on WATDFS_SHARD_PORT or an ephemeral port in a background thread,
+// dispatching to the skeletons bound through rpc_stub. server_main only opens the port for
+// servers of a split namespace (WATDFS_SERVERS, with the port pinned) and of replication.
+int shardServerInit();
+int shardServerPort();
+
+// Client: route every typed rpc to the servers of the comma separated `servers` list.
+int shardClientInit(const char *servers);
+int shardClientDestroy();
+int shardCall(char *name, int *argTypes, void **args);
+
+// Servers the client is routed over, 0 without shardClientInit, and the one owning `path`.
+int shardCount();
+int shardOf(const char *path);
+
+// Connections to single servers, for other transports built on this one (replica_client.h).
+// shardAddServer returns the server's index for shardCallServer or -errno/NOT_INIT;
+// shardDropServers closes the servers from index `from` on.
+int shardAddServer(const char *server);
+int shardCallServer(int server, char *name, int *argTypes, void **args);
+void shardDropServers(int from);
+// The path a typed rpc is about, see above, nullptr for rpcs that have none.
+const char *shardCallPath(const char *name, int *argTypes, void **args);
+
+#endif
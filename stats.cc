@@ -0,0 +1,273 @@
+#include "stats.h"
+#include "rpc.h"
+#include "rpc_stub.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <sstream>
+#include <vector>
+
+// Prometheus histogram buckets are reported at 2^STATS_LE_FIRST .. 2^STATS_LE_LAST nanoseconds
+#define STATS_LE_FIRST 10
+#define STATS_LE_LAST 35
+
+struct OpCounters {
+    std::atomic<uint64_t> calls{0};
+    std::atomic<uint64_t> errors{0};
+    std::atomic<uint64_t> bytes{0};
+    std::atomic<uint64_t> sum_ns{0};
+    std::atomic<uint64_t> buckets[STATS_BUCKETS];
+
+    OpCounters() { for (auto &bucket: buckets) bucket.store(0, std::memory_order_relaxed); }
+};
+
+// The counters of one thread, handed to another thread once it exits. Only the owning thread
+// writes them, the readers see counters allocated with the release store.
+struct ThreadCounters {
+    std::atomic<OpCounters *> ops[STATS_MAX_OPS];
+
+    ThreadCounters() { for (auto &op: ops) op.store(nullptr, std::memory_order_relaxed); }
+};
+
+// only the owner writes, so a plain load and store is enough
+static void bump(std::atomic<uint64_t> &counter, uint64_t by) {
+    counter.store(counter.load(std::memory_order_relaxed) + by, std::memory_order_relaxed);
+}
+
+class StatsRegistry {
+    std::mutex mtx;
+    std::vector<std::string> names;
+    std::vector<ThreadCounters *> all;
+    std::vector<ThreadCounters *> unused;
+
+  public:
+    // counters are never freed, threads may still record while the process exits
+
+    int op(const char *name) {
+        mtx.lock();
+        int op = -1;
+        for (size_t i = 0; i < names.size(); ++i) {
+            if (names[i] == name) { op = i; break; }
+        }
+        if (op < 0 && names.size() < STATS_MAX_OPS) {
+            names.push_back(name);
+            op = names.size() - 1;
+        }
+        mtx.unlock();
+        return op;
+    }
+
+    ThreadCounters *take() {
+        mtx.lock();
+        ThreadCounters *counters;
+        if (unused.empty()) {
+            counters = new ThreadCounters();
+            all.push_back(counters);
+        } else {
+            counters = unused.back();
+            unused.pop_back();
+        }
+        mtx.unlock();
+        return counters;
+    }
+
+    void give(ThreadCounters *counters) {
+        mtx.lock();
+        unused.push_back(counters);
+        mtx.unlock();
+    }
+
+    std::string text() {
+        mtx.lock();
+        std::vector<std::string> op_names = names;
+        std::vector<ThreadCounters *> threads = all;
+        mtx.unlock();
+
+        std::string text;
+        char line[64];
+        std::vector<uint64_t> buckets(STATS_BUCKETS);
+        for (size_t op = 0; op < op_names.size(); ++op) {
+            uint64_t calls = 0, errors = 0, bytes = 0, sum_ns = 0;
+            std::fill(buckets.begin(), buckets.end(), 0);
+            for (ThreadCounters *thread: threads) {
+                OpCounters *counters = thread->ops[op].load(std::memory_order_acquire);
+                if (counters == nullptr) continue;
+                calls += counters->calls.load(std::memory_order_relaxed);
+                errors += counters->errors.load(std::memory_order_relaxed);
+                bytes += counters->bytes.load(std::memory_order_relaxed);
+                sum_ns += counters->sum_ns.load(std::memory_order_relaxed);
+                for (int i = 0; i < STATS_BUCKETS; ++i) buckets[i] += counters->buckets[i].load(std::memory_order_relaxed);
+            }
+
+            text += op_names[op];
+            snprintf(line, sizeof(line), " %lu %lu %lu %lu", calls, errors, bytes, sum_ns);
+            text += line;
+            for (int i = 0; i < STATS_BUCKETS; ++i) {
+                if (buckets[i] == 0) continue;
+                snprintf(line, sizeof(line), " %d:%lu", i, buckets[i]);
+                text += line;
+            }
+            text += '\n';
+        }
+        return text;
+    }
+};
+
+static StatsRegistry registry;
+
+// Returns this thread's counters to the pool when the thread exits.
+struct ThreadSlot {
+    ThreadCounters *counters = nullptr;
+    ~ThreadSlot() { if (counters != nullptr) registry.give(counters); }
+};
+static thread_local ThreadSlot slot;
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+int statsBucket(uint64_t ns) {
+    if (ns < STATS_SUB_BUCKETS) return (int)ns;
+    int exp = 63 - __builtin_clzll(ns);
+    if (exp >= STATS_MAX_EXP) return STATS_BUCKETS - 1;
+    int sub = (int)(ns >> (exp - STATS_SUB_BITS)) & (STATS_SUB_BUCKETS - 1);
+    return (exp - STATS_SUB_BITS + 1) * STATS_SUB_BUCKETS + sub;
+}
+
+uint64_t statsBucketLow(int bucket) {
+    if (bucket < STATS_SUB_BUCKETS) return bucket;
+    int exp = bucket / STATS_SUB_BUCKETS + STATS_SUB_BITS - 1;
+    return (uint64_t)(STATS_SUB_BUCKETS + bucket % STATS_SUB_BUCKETS) << (exp - STATS_SUB_BITS);
+}
+
+uint64_t statsNow() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+int statsOp(const char *name) { return registry.op(name); }
+
+void statsRecord(int op, uint64_t ns, uint64_t bytes, bool error) {
+    if (op < 0) return;
+    if (slot.counters == nullptr) slot.counters = registry.take();
+
+    OpCounters *counters = slot.counters->ops[op].load(std::memory_order_relaxed);
+    if (counters == nullptr) {
+        counters = new OpCounters();
+        slot.counters->ops[op].store(counters, std::memory_order_release);
+    }
+    bump(counters->calls, 1);
+    if (error) bump(counters->errors, 1);
+    bump(counters->bytes, bytes);
+    bump(counters->sum_ns, ns);
+    bump(counters->buckets[statsBucket(ns)], 1);
+}
+
+std::string statsText() { return registry.text(); }
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+struct OpStats {
+    std::string name;
+    uint64_t calls, errors, bytes, sum_ns;
+    std::vector<uint64_t> buckets;
+};
+
+static std::vector<OpStats> parse(const std::string &text) {
+    std::vector<OpStats> ops;
+    std::istringstream lines(text);
+    std::string line;
+    while (std::getline(lines, line)) {
+        std::istringstream fields(line);
+        OpStats op;
+        op.buckets.assign(STATS_BUCKETS, 0);
+        if (!(fields >> op.name >> op.calls >> op.errors >> op.bytes >> op.sum_ns)) continue;
+        std::string bucket;
+        while (fields >> bucket) {
+            int i = atoi(bucket.c_str());
+            size_t colon = bucket.find(':');
+            if (i < 0 || i >= STATS_BUCKETS || colon == std::string::npos) continue;
+            op.buckets[i] = strtoull(bucket.c_str() + colon + 1, nullptr, 10);
+        }
+        ops.push_back(op);
+    }
+    return ops;
+}
+
+// the middle of the bucket holding the q-th value, in seconds
+static double quantile(const OpStats &op, double q) {
+    if (op.calls == 0) return 0;
+    uint64_t rank = (uint64_t)(q * op.calls), seen = 0;
+    for (int i = 0; i < STATS_BUCKETS; ++i) {
+        seen += op.buckets[i];
+        if (seen > rank) {
+            uint64_t high = i + 1 < STATS_BUCKETS ? statsBucketLow(i + 1) : statsBucketLow(i) * 2;
+            return (statsBucketLow(i) + high) / 2 / 1e9;
+        }
+    }
+    return statsBucketLow(STATS_BUCKETS - 1) / 1e9;
+}
+
+static void appendf(std::string *out, const char *format, ...) {
+    char line[256];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+    *out += line;
+}
+
+static void counter(std::string *out, const std::vector<OpStats> &ops, const std::string &name,
+                    const char *help, uint64_t OpStats::*field) {
+    appendf(out, "# HELP %s %s\n# TYPE %s counter\n", name.c_str(), help, name.c_str());
+    for (const OpStats &op: ops) appendf(out, "%s{op=\"%s\"} %lu\n", name.c_str(), op.name.c_str(), op.*field);
+}
+
+std::string statsPrometheus(const std::string &text, const char *prefix) {
+    std::vector<OpStats> ops = parse(text);
+    std::string out, name(prefix);
+
+    counter(&out, ops, name + "_calls_total", "Calls of the operation.", &OpStats::calls);
+    counter(&out, ops, name + "_errors_total", "Calls that returned an error.", &OpStats::errors);
+    counter(&out, ops, name + "_bytes_total", "Bytes moved by the calls.", &OpStats::bytes);
+
+    std::string latency = name + "_latency_seconds";
+    const char *metric = latency.c_str();
+    appendf(&out, "# HELP %s Time spent in the operation.\n# TYPE %s histogram\n", metric, metric);
+    for (const OpStats &op: ops) {
+        uint64_t seen = 0;
+        int i = 0;
+        for (int exp = STATS_LE_FIRST; exp <= STATS_LE_LAST; ++exp) {
+            for (; i < STATS_BUCKETS && statsBucketLow(i) < (1ull << exp); ++i) seen += op.buckets[i];
+            appendf(&out, "%s_bucket{op=\"%s\",le=\"%.9g\"} %lu\n", metric, op.name.c_str(), (1ull << exp) / 1e9, seen);
+        }
+        appendf(&out, "%s_bucket{op=\"%s\",le=\"+Inf\"} %lu\n", metric, op.name.c_str(), op.calls);
+        appendf(&out, "%s_sum{op=\"%s\"} %.9f\n", metric, op.name.c_str(), op.sum_ns / 1e9);
+        appendf(&out, "%s_count{op=\"%s\"} %lu\n", metric, op.name.c_str(), op.calls);
+    }
+
+    std::string quantiles = name + "_latency_quantile_seconds";
+    metric = quantiles.c_str();
+    appendf(&out, "# HELP %s Latency percentiles, to within an eighth of the value.\n# TYPE %s gauge\n",
+            metric, metric);
+    for (const OpStats &op: ops) {
+        for (double q: {0.5, 0.99, 0.999}) {
+            appendf(&out, "%s{op=\"%s\",quantile=\"%.9g\"} %.9f\n", metric, op.name.c_str(), q, quantile(op, q));
+        }
+    }
+    return out;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+static void handler_done(int op, uint64_t bytes, uint64_t ns, int ret) {
+    statsRecord(op, ns, bytes, ret < 0);
+}
+
+void statsHookRpcs() {
+    rpc_stub::hooks().op = statsOp;
+    rpc_stub::hooks().done = handler_done;
+}
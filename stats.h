@@ -0,0 +1,48 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+// Per-operation metrics of this process: calls, failed calls, bytes moved and a latency
+// histogram for every named operation. On the server these are the bound rpcs plus the time
+// spent waiting for path locks as "lock_wait" and the transfers of the bulk channel as
+// "bulk_transfer", on the client the FUSE operations and cache
+// events, see client_stats.h. Each thread records into its own counters without taking a lock;
+// reading adds them up.
+//
+// The histograms are log-linear: STATS_SUB_BUCKETS buckets per power of two of nanoseconds, so
+// a recorded value is off by at most 1/STATS_SUB_BUCKETS of itself, up to about 18 minutes.
+
+#define STATS_SUB_BITS 3
+#define STATS_SUB_BUCKETS (1 << STATS_SUB_BITS)
+#define STATS_MAX_EXP 40
+#define STATS_BUCKETS ((STATS_MAX_EXP - STATS_SUB_BITS + 1) * STATS_SUB_BUCKETS)
+#define STATS_MAX_OPS 64
+
+int statsBucket(uint64_t ns);
+// The smallest value that falls in the bucket, the next bucket's is its upper bound.
+uint64_t statsBucketLow(int bucket);
+
+// A monotonic clock in nanoseconds.
+uint64_t statsNow();
+
+// Times every rpc skeleton of the server, before any rpc runs.
+void statsHookRpcs();
+
+// The index of the named operation, -1 once STATS_MAX_OPS are taken.
+int statsOp(const char *name);
+void statsRecord(int op, uint64_t ns, uint64_t bytes, bool error);
+
+// All operations as returned by the stats rpc, one line each:
+//   name calls errors bytes sum_ns bucket:count...
+// with only the non-empty buckets listed.
+std::string statsText();
+
+// statsText in the Prometheus text format, the metric names starting with `prefix`: calls,
+// errors and bytes as counters labelled with the op, the latency as a histogram with power of
+// two buckets from 1us, and p50/p99/p999 estimated from the finer buckets.
+std::string statsPrometheus(const std::string &text, const char *prefix);
+
+#endif
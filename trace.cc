@@ -0,0 +1,179 @@
+#include "trace.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#include <mutex>
+#include <string>
+
+// buffered spans are written out at this size, or when a top level span ends
+#define TRACE_BUF_LEN (64 << 10)
+
+static const char *kind_names[] = {"op", "rpc", "serve", "lock", "disk", "transfer"};
+
+static bool enabled;
+static double sample = 1;
+static const char *prefix;
+
+static thread_local TraceContext current;
+static thread_local uint64_t rand_state;
+static thread_local long tid;
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// xorshift64*, seeded per thread
+static uint64_t next_rand() {
+    if (rand_state == 0) {
+        tid = syscall(SYS_gettid);
+        rand_state = (now_ns() ^ ((uint64_t)tid << 32) ^ (uint64_t)getpid()) | 1;
+    }
+    rand_state ^= rand_state >> 12;
+    rand_state ^= rand_state << 25;
+    rand_state ^= rand_state >> 27;
+    return rand_state * 0x2545F4914F6CDD1DULL;
+}
+
+static uint64_t new_id() {
+    uint64_t id;
+    while ((id = next_rand()) == 0) {}
+    return id;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////
+
+// The trace file of this process. Never freed, other threads may trace while the process exits.
+struct TraceFile {
+    std::mutex mtx;
+    FILE *out = nullptr;
+    std::string buf;
+    int64_t realtime_offset = 0; // added to now_ns for the realtime clock
+};
+
+static TraceFile *trace_file() {
+    static TraceFile *f = []() {
+        TraceFile *f = new TraceFile();
+        struct timespec real;
+        clock_gettime(CLOCK_REALTIME, &real);
+        f->realtime_offset = (int64_t)((uint64_t)real.tv_sec * 1000000000 + real.tv_nsec) - (int64_t)now_ns();
+
+        std::string path = std::string(prefix) + "." + std::to_string(getpid()) + ".json";
+        f->out = fopen(path.c_str(), "w");
+        if (f->out == nullptr) {
+            fprintf(stderr, "watdfs: cannot write the trace file %s\n", path.c_str());
+            return f;
+        }
+        // the JSON array format, which may be left unterminated
+        fprintf(f->out, "[\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"%s\"}},\n",
+                getpid(), program_invocation_short_name);
+        fflush(f->out);
+        return f;
+    }();
+    return f;
+}
+
+static void append_escaped(std::string *out, const char *s) {
+    for (; *s != '\0'; ++s) {
+        if (*s == '"' || *s == '\\') {
+            *out += '\\';
+            *out += *s;
+        } else if ((unsigned char)*s < 0x20) {
+            char esc[8];
+            snprintf(esc, sizeof(esc), "\\u%04x", *s);
+            *out += esc;
+        } else {
+            *out += *s;
+        }
+    }
+}
+
+static void record(const TraceSpan &span, uint64_t end_ns, long ret) {
+    TraceFile *f = trace_file();
+    uint64_t ts = span.start_ns + f->realtime_offset;
+    uint64_t dur = end_ns - span.start_ns;
+    int pid = getpid();
+
+    char line[512];
+    std::string text;
+    snprintf(line, sizeof(line),
+             "{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%lu.%03lu,\"dur\":%lu.%03lu,\"pid\":%d,\"tid\":%ld,"
+             "\"args\":{\"trace\":\"%016lx\",\"span\":\"%016lx\",\"parent\":\"%016lx\",\"ret\":%ld",
+             span.name, kind_names[span.kind], ts / 1000, ts % 1000, dur / 1000, dur % 1000, pid, tid,
+             span.trace, span.id, span.parent, ret);
+    text += line;
+    if (span.path != nullptr) {
+        text += ",\"path\":\"";
+        append_escaped(&text, span.path);
+        text += '"';
+    }
+    text += "}},\n";
+
+    // flow arrows from an rpc to its handler in the server process
+    if (span.kind == TRACE_RPC || span.kind == TRACE_SERVE) {
+        snprintf(line, sizeof(line),
+                 "{\"name\":\"rpc\",\"cat\":\"rpc\",\"ph\":\"%s,\"id\":\"%016lx\",\"ts\":%lu.%03lu,\"pid\":%d,\"tid\":%ld},\n",
+                 span.kind == TRACE_RPC ? "s\"" : "f\",\"bp\":\"e\"",
+                 span.kind == TRACE_RPC ? span.id : span.parent, ts / 1000, ts % 1000, pid, tid);
+        text += line;
+    }
+
+    f->mtx.lock();
+    f->buf += text;
+    if (f->out != nullptr && (f->buf.size() >= TRACE_BUF_LEN || span.outer.trace == 0)) {
+        fwrite(f->buf.data(), 1, f->buf.size(), f->out);
+        fflush(f->out);
+        f->buf.clear();
+    }
+    f->mtx.unlock();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////
+
+static TraceSpan start(const char *name, const char *path, int kind, uint64_t trace, uint64_t parent) {
+    TraceSpan span = {name, path, kind, trace, new_id(), parent, now_ns(), current};
+    current = {span.trace, span.id};
+    return span;
+}
+
+TraceSpan traceRoot(const char *name, const char *path) {
+    if (current.trace != 0) return start(name, path, TRACE_OP, current.trace, current.span);
+    if (!enabled || (sample < 1 && next_rand() >= sample * 18446744073709551616.0)) {
+        return {name, path, TRACE_OP, 0, 0, 0, 0, current};
+    }
+    return start(name, path, TRACE_OP, new_id(), 0);
+}
+
+TraceSpan traceBegin(const char *name, TraceKind kind) {
+    if (current.trace == 0) return {name, nullptr, kind, 0, 0, 0, 0, current};
+    return start(name, nullptr, kind, current.trace, current.span);
+}
+
+TraceSpan traceServe(const char *name, const TraceContext &remote) {
+    if (!enabled || remote.trace == 0) return {name, nullptr, TRACE_SERVE, 0, 0, 0, 0, current};
+    return start(name, nullptr, TRACE_SERVE, remote.trace, remote.span);
+}
+
+void traceEnd(TraceSpan *span, long ret) {
+    if (span->trace == 0) return;
+    uint64_t end_ns = now_ns();
+    current = span->outer;
+    int saved_errno = errno; // callers look at it after
+    record(*span, end_ns, ret);
+    errno = saved_errno;
+}
+
+// reads the environment before main
+static struct TraceSettings {
+    TraceSettings() {
+        prefix = getenv("WATDFS_TRACE");
+        enabled = prefix != nullptr && *prefix != '\0';
+        const char *env = getenv("WATDFS_TRACE_SAMPLE");
+        if (env != nullptr) sample = atof(env);
+    }
+} settings;
@@ -0,0 +1,51 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+// Span tracing in the Chrome trace event format. A sampled FUSE operation on the client starts a
+// trace, the rpcs it makes are child spans whose context travels with each call (rpc_stub.h),
+// and on the server the handler, its lock waits and its disk I/O are spans under the call. Each
+// process appends its spans to <WATDFS_TRACE>.<pid>.json, which Perfetto and chrome://tracing
+// open; the files of a client and server are merged into one trace with
+//     (echo '['; grep -h '^{' <WATDFS_TRACE>.*.json) > trace.json
+//
+//   WATDFS_TRACE         the file prefix, unset for no tracing
+//   WATDFS_TRACE_SAMPLE  the fraction of client operations traced (1)
+//
+// A server traces the calls of sampled operations whenever its own WATDFS_TRACE is set. Between
+// the span of an rpc on the client and that of its handler on the server is the network.
+
+#include <stdint.h>
+
+enum TraceKind { TRACE_OP, TRACE_RPC, TRACE_SERVE, TRACE_LOCK, TRACE_DISK, TRACE_TRANSFER };
+
+// Sent with every rpc, trace is 0 when the operation is not sampled.
+struct TraceContext {
+    uint64_t trace;
+    uint64_t span; // of the rpc on the caller's side
+};
+
+struct TraceSpan {
+    const char *name;
+    const char *path; // shown with the span when set
+    int kind;
+    uint64_t trace;   // 0 when the span is not recorded
+    uint64_t id;
+    uint64_t parent;
+    uint64_t start_ns;
+    TraceContext outer; // this thread's current span before this one
+};
+
+// The span of a client operation on `path`, sampled or not. Spans begun on this thread until it
+// ends are its children.
+TraceSpan traceRoot(const char *name, const char *path);
+// A child of this thread's current span, recorded if that one is.
+TraceSpan traceBegin(const char *name, TraceKind kind);
+// The span of a call made by another process in its span `remote`.
+TraceSpan traceServe(const char *name, const TraceContext &remote);
+// Ends the span with the result `ret`, its parent becomes current again. Keeps errno.
+void traceEnd(TraceSpan *span, long ret);
+
+// The context to send with an rpc made in `span`.
+inline TraceContext traceContext(const TraceSpan &span) { return {span.trace, span.id}; }
+
+#endif
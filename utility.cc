@@ -21,6 +21,31 @@ int argTypeFrmtr(bool input, bool output, bool array, unsigned int type, unsigne
     return code;
 }
 
+unsigned int bulkSegmentLen(size_t size, int segment) {
+    size_t start = (size_t)segment * MAX_ARRAY_LEN;
+    if (size <= start) return 0;
+    if (size - start > MAX_ARRAY_LEN) return MAX_ARRAY_LEN;
+    return (unsigned int)(size - start);
+}
+
+void bulkCopyIn(void **segments, size_t offset, const char *src, size_t len) {
+    while (len > 0) {
+        size_t segment = offset / MAX_ARRAY_LEN, skip = offset % MAX_ARRAY_LEN;
+        size_t n = (len < MAX_ARRAY_LEN - skip) ? len : MAX_ARRAY_LEN - skip;
+        memcpy((char *)segments[segment] + skip, src, n);
+        offset += n; src += n; len -= n;
+    }
+}
+
+void bulkCopyOut(char *dst, void **segments, size_t offset, size_t len) {
+    while (len > 0) {
+        size_t segment = offset / MAX_ARRAY_LEN, skip = offset % MAX_ARRAY_LEN;
+        size_t n = (len < MAX_ARRAY_LEN - skip) ? len : MAX_ARRAY_LEN - skip;
+        memcpy(dst, (char *)segments[segment] + skip, n);
+        offset += n; dst += n; len -= n;
+    }
+}
+
 void FileUtil::setDir(const char *curr_dir) {
     FileUtil::curr_dir = curr_dir;
 }
@@ -46,7 +71,9 @@ void FileUtil::addClientFileData(const char* file, int fh, int server_fh, int fl
     AccessType accessType = processAccessType(flags);
     struct timespec t; clock_gettime(CLOCK_REALTIME, &t);
 
+    mtx.lock();
     map[key] = new FileData(fh, server_fh, accessType, flags, t.tv_sec);
+    mtx.unlock();
 }
 
 void FileUtil::updateTc(const char* file) {
@@ -56,7 +83,22 @@ void FileUtil::updateTc(const char* file) {
     struct timespec t;
     clock_gettime(CLOCK_REALTIME, &t);
 
-    if (map.find(key) != map.end()) map.at(key)->tc = t.tv_sec;
+    mtx.lock();
+    if (map.find(key) != map.end()) {
+        map.at(key)->tc = t.tv_sec;
+        map.at(key)->stale = false;
+    }
+    mtx.unlock();
+}
+
+time_t FileUtil::getTc(const char* file) {
+    std::string key(file);
+
+    mtx.lock();
+    time_t tc = (map.find(key) != map.end()) ? map.at(key)->tc : 0;
+    mtx.unlock();
+
+    return tc;
 }
 
 FileData* FileUtil::getClientFileData(const char* file) {
@@ -64,11 +106,40 @@ FileData* FileUtil::getClientFileData(const char* file) {
     std::string key(file);
     FileData *fileData = nullptr;
 
+    mtx.lock();
     if (map.find(key) != map.end()) fileData = map.at(key);
+    mtx.unlock();
 
     return fileData;
 }
 
+void FileUtil::getReadFiles(std::vector<std::pair<std::string, time_t>> *files) {
+    mtx.lock();
+    for (auto& it: map) {
+        if (READ == it.second->accessType && !it.second->stale) files->emplace_back(it.first, it.second->tc);
+    }
+    mtx.unlock();
+}
+
+void FileUtil::markStale(const char* file) {
+    DLOG("markStale for %s", file);
+    std::string key(file);
+
+    mtx.lock();
+    if (map.find(key) != map.end()) map.at(key)->stale = true;
+    mtx.unlock();
+}
+
+bool FileUtil::isStale(const char* file) {
+    std::string key(file);
+
+    mtx.lock();
+    bool stale = (map.find(key) != map.end() && map.at(key)->stale);
+    mtx.unlock();
+
+    return stale;
+}
+
 void FileUtil::addServerFile(const char* file) {
     DLOG("addServerFile for %s", file);
     std::string key(file);
@@ -4,6 +4,7 @@
 #include <mutex>
 #include <unordered_map>
 #include <unordered_set>
+#include <vector>
 #include <time.h>
 
 #include "debug.h"
@@ -26,15 +27,25 @@ struct FileData {
     AccessType accessType;
     int flags;
     time_t tc;
+    bool stale; // the background validator saw the file change on the server
 
     FileData(int fh, int server_fh, AccessType accessType, int flags, time_t tc): 
-        fh(fh), server_fh(server_fh), accessType(accessType), flags(flags), tc(tc) {}
+        fh(fh), server_fh(server_fh), accessType(accessType), flags(flags), tc(tc), stale(false) {}
 };
 
 #define yes true
 #define no false
 int argTypeFrmtr(bool input, bool output, bool array, unsigned int type, unsigned int length = 0);
 
+// A bulk transfer is split over BULK_SEGMENTS array arguments of at most MAX_ARRAY_LEN bytes,
+// so a single readv/writev rpc can move up to BULK_MAX_LEN bytes.
+#define BULK_SEGMENTS 64
+#define BULK_MAX_LEN ((size_t)BULK_SEGMENTS * MAX_ARRAY_LEN)
+unsigned int bulkSegmentLen(size_t size, int segment);
+// Copy between a contiguous buffer and [offset, offset + len) of a bulk payload.
+void bulkCopyIn(void **segments, size_t offset, const char *src, size_t len);
+void bulkCopyOut(char *dst, void **segments, size_t offset, size_t len);
+
 class FileUtil {
     const char *curr_dir;
 
@@ -51,8 +62,15 @@ class FileUtil {
 	
     void addClientFileData(const char* file, int fh, int server_fh, int flags);
     void updateTc(const char* file);
+    // tc and stale change under the validator, they are read through these and not the FileData
+    time_t getTc(const char* file);
     FileData* getClientFileData(const char* file);
 
+    // For the background validator, which runs next to the file system calls.
+    void getReadFiles(std::vector<std::pair<std::string, time_t>> *files);
+    void markStale(const char* file);
+    bool isStale(const char* file);
+
     void addServerFile(const char* file);
     bool serverFilePresent(const char* file);
 
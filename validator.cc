@@ -0,0 +1,89 @@
+#include "validator.h"
+#include "cache_index.h"
+#include "freshness.h"
+#include "watdfs_client_utility.h"
+#include "debug.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define VALIDATOR_TICK_SEC 1
+
+static std::mutex mtx;
+static std::condition_variable wake;
+static std::thread validator;
+static bool stop = false;
+
+static void validate(FileUtil *fileUtil) {
+    std::vector<std::pair<std::string, time_t>> files;
+    fileUtil->getReadFiles(&files);
+
+    struct timespec tp;
+    clock_gettime(CLOCK_REALTIME, &tp);
+
+    // due files, with the version that was downloaded; a 0 interval is checked on every access anyway
+    std::vector<std::string> paths;
+    std::vector<IndexEntry> cached;
+    for (auto &file: files) {
+        time_t interval = freshnessInterval(file.first.c_str());
+        if (interval == 0 || tp.tv_sec + VALIDATOR_TICK_SEC - file.second < interval) continue;
+        IndexEntry entry;
+        if (!cacheIndexGet(file.first.c_str(), &entry)) continue;
+        paths.push_back(file.first);
+        cached.push_back(entry);
+    }
+    if (paths.empty()) return;
+
+    std::vector<struct stat> stats(paths.size());
+    std::vector<BatchOp> ops;
+    for (size_t i = 0; i < paths.size(); ++i) ops.push_back(batchGetattr(paths[i].c_str(), &stats[i]));
+    int ret = batch_on_server(ops.data(), ops.size(), no);
+    if (ret < 0) {
+        DLOG("validator: batch failed: %d", -ret);
+        return;
+    }
+
+    for (size_t i = 0; i < paths.size(); ++i) {
+        if (ops[i].ret < 0) continue; // left to the check on access
+        const struct timespec &mtime = stats[i].st_mtim;
+        if (stats[i].st_size == cached[i].size && mtime.tv_sec == cached[i].mtime.tv_sec &&
+            mtime.tv_nsec == cached[i].mtime.tv_nsec) {
+            freshnessUnchanged(paths[i].c_str());
+            fileUtil->updateTc(paths[i].c_str());
+        } else {
+            fileUtil->markStale(paths[i].c_str());
+        }
+    }
+    DLOG("validator: checked %lu files", paths.size());
+}
+
+void validatorStart(FileUtil *fileUtil) {
+    const char *env = getenv("WATDFS_VALIDATOR");
+    if (env && strcmp(env, "0") == 0) return;
+
+    stop = false;
+    validator = std::thread([fileUtil]() {
+        std::unique_lock<std::mutex> lock(mtx);
+        while (!wake.wait_for(lock, std::chrono::seconds(VALIDATOR_TICK_SEC), []() { return stop; })) {
+            lock.unlock();
+            validate(fileUtil);
+            lock.lock();
+        }
+    });
+}
+
+void validatorStop() {
+    if (!validator.joinable()) return;
+    mtx.lock();
+    stop = true;
+    mtx.unlock();
+    wake.notify_all();
+    validator.join();
+}
@@ -0,0 +1,17 @@
+#ifndef VALIDATOR_H
+#define VALIDATOR_H
+
+#include "utility.h"
+
+// Revalidates the cached copies of files open for reading in the background. Once a second it
+// gathers every file whose freshness interval runs out within the next second and checks them
+// all against the server in one batch rpc; unchanged files get a new Tc and changed ones are
+// marked stale, so the next access downloads without asking the server first. A client with
+// many open files then pays one round trip per second instead of one getattr per file.
+//
+// WATDFS_VALIDATOR=0 turns it off, the files are then checked on access as before.
+
+void validatorStart(FileUtil *fileUtil);
+void validatorStop();
+
+#endif
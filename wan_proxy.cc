@@ -0,0 +1,320 @@
+// A TCP proxy that makes a local connection behave like a WAN link, for benchmarks. Every
+// direction of every connection is a link of its own: data is cut into packets, serialized at
+// the bandwidth cap, delayed by half the round trip plus jitter, and now and then the link
+// stalls the way a congested queue does. Packets keep their order, and a link holds at most
+// PROXY_QUEUE_LEN bytes so a fast sender is slowed down as by TCP flow control.
+//
+// Usage: ./watdfs_wanproxy [--rtt MS] [--jitter MS] [--bandwidth MBIT] [--stall-prob P]
+//                          [--stall-ms MS] [--packet BYTES] LISTEN_PORT HOST PORT [...]
+//
+//   --rtt         round trip time added, half of it each way (0)
+//   --jitter      up to this much more per packet, uniformly drawn (0)
+//   --bandwidth   rate of each direction in Mbit/s, 0 for no cap (0)
+//   --stall-prob  chance that a packet stalls the link (0)
+//   --stall-ms    how long a stall holds the link (100)
+//   --packet      the most bytes in a packet (1448)
+//
+// Each LISTEN_PORT, 0 for any, forwards to HOST:PORT, and "PROXY <listen port> <host>:<port>" is
+// printed once it listens. A client goes through it by pointing SERVER_PORT at the proxy of the
+// rpc port and WATDFS_BULK_PORT at the proxy of the server's WATDFS_BULK_PORT.
+
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define PROXY_QUEUE_LEN (16 << 20)
+#define PROXY_MAX_IOV 64
+
+struct Config {
+    double rtt_ms = 0;
+    double jitter_ms = 0;
+    double bandwidth_mbit = 0;
+    double stall_prob = 0;
+    double stall_ms = 100;
+    size_t packet = 1448;
+};
+
+static Config config;
+
+static uint64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////
+
+struct Packet {
+    std::vector<char> data;
+    uint64_t release_ns; // when it reaches the far end
+};
+
+// One direction of a connection. The reader thread times the packets in, the writer sends them
+// on when they are due.
+class Link {
+    std::mutex mtx;
+    std::condition_variable changed;
+    std::deque<Packet> queue;
+    size_t queued = 0;
+    bool closed = false; // no more packets
+    bool broken = false; // the far end is gone
+
+    // owned by the reader
+    std::mt19937_64 rng{std::random_device()()};
+    uint64_t link_free_ns = 0;
+    uint64_t last_release_ns = 0;
+
+  public:
+    int from, to;
+
+    Link(int from, int to) : from(from), to(to) {}
+
+    // returns false once the writer gave up
+    bool push(std::vector<char> data) {
+        std::uniform_real_distribution<double> unit(0, 1);
+        uint64_t now = now_ns();
+        uint64_t start = std::max(now, link_free_ns);
+        if (config.stall_prob > 0 && unit(rng) < config.stall_prob) start += config.stall_ms * 1e6;
+        link_free_ns = start;
+        if (config.bandwidth_mbit > 0) link_free_ns += data.size() * 8 * 1e3 / config.bandwidth_mbit;
+        uint64_t release = link_free_ns + config.rtt_ms * 1e6 / 2 + config.jitter_ms * 1e6 * unit(rng);
+        last_release_ns = release = std::max(release, last_release_ns);
+
+        std::unique_lock<std::mutex> lock(mtx);
+        changed.wait(lock, [this]() { return broken || queued < PROXY_QUEUE_LEN; });
+        if (broken) return false;
+        queued += data.size();
+        queue.push_back(Packet{std::move(data), release});
+        changed.notify_all();
+        return true;
+    }
+
+    void close() {
+        mtx.lock();
+        closed = true;
+        changed.notify_all();
+        mtx.unlock();
+    }
+
+    // Sends every packet that is due in one writev, returns false when done.
+    bool send_due() {
+        std::unique_lock<std::mutex> lock(mtx);
+        changed.wait(lock, [this]() { return closed || !queue.empty(); });
+        if (queue.empty()) return false;
+
+        uint64_t due = queue.front().release_ns;
+        lock.unlock();
+        uint64_t now = now_ns();
+        if (due > now) std::this_thread::sleep_for(std::chrono::nanoseconds(due - now));
+        lock.lock();
+
+        now = now_ns();
+        struct iovec iov[PROXY_MAX_IOV];
+        int iovcnt = 0;
+        for (auto it = queue.begin(); it != queue.end() && iovcnt < PROXY_MAX_IOV && it->release_ns <= now; ++it) {
+            iov[iovcnt].iov_base = it->data.data();
+            iov[iovcnt].iov_len = it->data.size();
+            ++iovcnt;
+        }
+        lock.unlock();
+
+        // only this thread removes packets, so the front ones stay put while sending
+        for (int i = 0; i < iovcnt; ++i) {
+            const char *p = (const char *)iov[i].iov_base;
+            size_t len = iov[i].iov_len;
+            while (len > 0) {
+                ssize_t n = send(to, p, len, MSG_NOSIGNAL);
+                if (n < 0 && errno == EINTR) continue;
+                if (n < 0) return fail();
+                p += n;
+                len -= n;
+            }
+        }
+
+        lock.lock();
+        for (int i = 0; i < iovcnt; ++i) {
+            queued -= queue.front().data.size();
+            queue.pop_front();
+        }
+        changed.notify_all();
+        return true;
+    }
+
+    bool fail() {
+        mtx.lock();
+        broken = true;
+        changed.notify_all();
+        mtx.unlock();
+        // wakes the reader, and the peer's
+        shutdown(from, SHUT_RD);
+        shutdown(to, SHUT_RDWR);
+        return false;
+    }
+};
+
+// A proxied connection, freed by the last of its four threads.
+struct Conn {
+    int client, server;
+    Link up, down;
+    std::atomic<int> threads{4};
+
+    Conn(int client, int server) : client(client), server(server), up(client, server), down(server, client) {}
+
+    void exit_thread() {
+        if (--threads > 0) return;
+        ::close(client);
+        ::close(server);
+        delete this;
+    }
+};
+
+static void reader(Conn *conn, Link *link) {
+    while (true) {
+        std::vector<char> data(config.packet);
+        ssize_t n = read(link->from, data.data(), data.size());
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        // acked at once, so a sender holding back small writes for the ack (Nagle) is not
+        // slowed by the delayed acks of this hop on top of the emulated link
+        int one = 1;
+        setsockopt(link->from, IPPROTO_TCP, TCP_QUICKACK, &one, sizeof(one));
+        data.resize(n);
+        if (!link->push(std::move(data))) break;
+    }
+    link->close();
+    conn->exit_thread();
+}
+
+static void writer(Conn *conn, Link *link) {
+    while (link->send_due()) {}
+    shutdown(link->to, SHUT_WR);
+    conn->exit_thread();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////
+
+static void set_nodelay(int sock) {
+    int one = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+static int connect_to(const char *host, const char *port) {
+    struct addrinfo hints, *res = nullptr;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, port, &hints, &res) != 0) return -EHOSTUNREACH;
+
+    int sock = -ECONNREFUSED;
+    for (struct addrinfo *ai = res; ai != nullptr; ai = ai->ai_next) {
+        int fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+        if (fd < 0) continue;
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) { sock = fd; break; }
+        close(fd);
+    }
+    freeaddrinfo(res);
+    if (sock >= 0) set_nodelay(sock);
+    return sock;
+}
+
+// Listens on `port`, returns the socket and sets `port` to the one bound.
+static int listen_on(int *port) {
+    int sock = socket(AF_INET6, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0) return -errno;
+
+    int zero = 0, one = 1;
+    setsockopt(sock, IPPROTO_IPV6, IPV6_V6ONLY, &zero, sizeof(zero));
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    struct sockaddr_in6 addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin6_family = AF_INET6;
+    addr.sin6_addr = in6addr_any;
+    addr.sin6_port = htons(*port);
+    socklen_t addr_len = sizeof(addr);
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(sock, SOMAXCONN) < 0 ||
+        getsockname(sock, (struct sockaddr *)&addr, &addr_len) < 0) {
+        int ret = -errno;
+        close(sock);
+        return ret;
+    }
+    *port = ntohs(addr.sin6_port);
+    return sock;
+}
+
+static void serve(int sock, std::string host, std::string port) {
+    while (true) {
+        int client = accept4(sock, nullptr, nullptr, SOCK_CLOEXEC);
+        if (client < 0) { if (errno == EINTR || errno == ECONNABORTED) continue; break; }
+        int server = connect_to(host.c_str(), port.c_str());
+        if (server < 0) {
+            fprintf(stderr, "unable to connect to %s:%s: %s\n", host.c_str(), port.c_str(), strerror(-server));
+            close(client);
+            continue;
+        }
+        set_nodelay(client);
+
+        Conn *conn = new Conn(client, server);
+        std::thread(reader, conn, &conn->up).detach();
+        std::thread(writer, conn, &conn->up).detach();
+        std::thread(reader, conn, &conn->down).detach();
+        std::thread(writer, conn, &conn->down).detach();
+    }
+    perror("accept");
+}
+
+int main(int argc, char *argv[]) {
+    std::vector<std::string> forwards;
+    for (int i = 1; i < argc; ++i) {
+        const char *arg = argv[i];
+        const char *value = (i + 1 < argc) ? argv[i + 1] : "";
+        if (strncmp(arg, "--", 2) != 0) { forwards.push_back(arg); continue; }
+        if (strcmp(arg, "--rtt") == 0) config.rtt_ms = atof(value);
+        else if (strcmp(arg, "--jitter") == 0) config.jitter_ms = atof(value);
+        else if (strcmp(arg, "--bandwidth") == 0) config.bandwidth_mbit = atof(value);
+        else if (strcmp(arg, "--stall-prob") == 0) config.stall_prob = atof(value);
+        else if (strcmp(arg, "--stall-ms") == 0) config.stall_ms = atof(value);
+        else if (strcmp(arg, "--packet") == 0) config.packet = atol(value);
+        else { fprintf(stderr, "unknown option %s\n", arg); return 1; }
+        ++i;
+    }
+    if (forwards.empty() || forwards.size() % 3 != 0 || config.packet == 0) {
+        fprintf(stderr, "usage: %s [options] LISTEN_PORT HOST PORT [LISTEN_PORT HOST PORT ...]\n", argv[0]);
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    std::vector<std::thread> listeners;
+    for (size_t i = 0; i < forwards.size(); i += 3) {
+        int port = atoi(forwards[i].c_str());
+        int sock = listen_on(&port);
+        if (sock < 0) {
+            fprintf(stderr, "unable to listen on port %s: %s\n", forwards[i].c_str(), strerror(-sock));
+            return 1;
+        }
+        printf("PROXY %d %s:%s\n", port, forwards[i + 1].c_str(), forwards[i + 2].c_str());
+        listeners.emplace_back(serve, sock, forwards[i + 1], forwards[i + 2]);
+    }
+    fflush(stdout);
+
+    for (std::thread &listener: listeners) listener.join();
+    return 1;
+}
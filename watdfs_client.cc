@@ -1,6 +1,7 @@
 #include "watdfs_client.h"
 #include "rpc.h"
 #include "utility.h"
+#include "watdfs_rpc.h"
 
 #include "debug.h"
 INIT_LOG
@@ -10,6 +11,23 @@ INIT_LOG
 #endif
 
 #include "watdfs_client_utility.h"
+#include "local_transport.h"
+#include "shard_transport.h"
+#include "replica_client.h"
+#include "bulk_channel.h"
+#include "compress.h"
+#include "chunk_store.h"
+#include "cache_manager.h"
+#include "cache_index.h"
+#include "ram_cache.h"
+#include "freshness.h"
+#include "validator.h"
+#include "client_stats.h"
+#include "stats.h"
+#include "trace.h"
+#include "record.h"
+
+#include <vector>
 
 // SETUP AND TEARDOWN
 void *watdfs_cli_init(struct fuse_conn_info *conn, const char *path_to_cache,
@@ -18,7 +36,17 @@ void *watdfs_cli_init(struct fuse_conn_info *conn, const char *path_to_cache,
     *ret_code = 0;
 
     int ret = 0;
-    ret = rpcClientInit(); // RPC library setup
+    // WATDFS_SERVERS splits the namespace over several servers, a SERVER_ADDRESS that is a path
+    // names the unix socket of a server on this host.
+    const char *servers = getenv("WATDFS_SERVERS");
+    const char *server_address = getenv("SERVER_ADDRESS");
+    if (servers != nullptr) ret = shardClientInit(servers);
+    else if (server_address != nullptr && server_address[0] == '/') ret = localClientInit(server_address);
+    else ret = rpcClientInit(); // RPC library setup
+    // WATDFS_REPLICAS reads from read replicas of the one server, see replica_client.h
+    const char *replicas = getenv("WATDFS_REPLICAS");
+    if (ret == 0 && replicas != nullptr && shardCount() <= 1) ret = replicaClientInit(replicas);
+    if (ret == 0) negotiate_on_server();
 
     if (ret < 0) {
         *ret_code = ret;
@@ -31,6 +59,20 @@ void *watdfs_cli_init(struct fuse_conn_info *conn, const char *path_to_cache,
 
     userdata->setDir(path_to_cache);
     userdata->cacheInterval = cache_interval;
+    freshnessInit(cache_interval);
+
+    ret = chunkStoreInit(path_to_cache);
+    if (ret < 0) DLOG("chunk store could not be created, downloads will not use it: %d", -ret);
+
+    ret = cacheIndexInit(path_to_cache);
+    if (ret < 0) DLOG("cache index could not be loaded, every file is downloaded again: %d", -ret);
+
+    ret = cacheManagerInit(path_to_cache);
+    if (ret < 0) DLOG("cache manager could not scan the cache, it starts empty: %d", -ret);
+
+    ramCacheInit();
+
+    validatorStart(userdata);
 
     // TODO Initialize any global state that you require for the assignment and return it.
     // The value that you return here will be passed as userdata in other functions.
@@ -48,10 +90,26 @@ void *watdfs_cli_init(struct fuse_conn_info *conn, const char *path_to_cache,
 void watdfs_cli_destroy(void *userdata) {
     // TODO: clean up your userdata state.
 
+    validatorStop();
     delete (FileUtil*)userdata;
+    recordFlush();
+
+# ifndef NDEBUG
+    ZStats zstats = zStats();
+    DLOG("compression: %lu raw bytes as %lu wire bytes, %lu/%lu frames stored, %lu ns cpu",
+         zstats.raw_bytes, zstats.wire_bytes, zstats.stored_frames, zstats.frames, zstats.cpu_ns);
+#endif
 
+    replicaClientDestroy();
     int ret = 0;
-    ret = rpcClientDestroy();
+    const char *servers = getenv("WATDFS_SERVERS");
+    const char *server_address = getenv("SERVER_ADDRESS");
+    if (servers != nullptr) ret = shardClientDestroy();
+    else if (server_address != nullptr && server_address[0] == '/') ret = localClientDestroy();
+    else ret = rpcClientDestroy();
+    bulkClientDestroy();
+    cacheManagerDestroy();
+    cacheIndexDestroy();
 
     if (ret < 0) {
 # ifdef PRINT_ERR
@@ -60,8 +118,13 @@ void watdfs_cli_destroy(void *userdata) {
     }
 }
 
+// The FUSE operations below are timed by the watdfs_cli_* wrappers at the end of the file, the
+// ones used from within call each other directly.
+static int cli_open(void *userdata, const char *path, struct fuse_file_info *fi);
+static int cli_release(void *userdata, const char *path, struct fuse_file_info *fi);
+
 // GET FILE ATTRIBUTES
-int watdfs_cli_getattr(void *userdata, const char *path, struct stat *statbuf) {
+static int cli_getattr(void *userdata, const char *path, struct stat *statbuf) {
     DLOG("watdfs_cli_getattr called for '%s'", path);
     FileUtil* fileUtil = (FileUtil *)userdata;
     FileData* clientFileData = fileUtil->getClientFileData(path);
@@ -73,7 +136,7 @@ int watdfs_cli_getattr(void *userdata, const char *path, struct stat *statbuf) {
 
     if (!isOpen) {
         fi->flags = O_RDONLY;
-        ret = watdfs_cli_open(userdata, path, fi.ptr);
+        ret = cli_open(userdata, path, fi.ptr);
         if (ret < 0) {
             DLOG("getAttr: file could not be opened due to error: %d", -ret);
             memset(statbuf, 0, sizeof(struct stat));
@@ -118,7 +181,7 @@ int watdfs_cli_getattr(void *userdata, const char *path, struct stat *statbuf) {
     }
 
     if (!isOpen) {
-        ret = watdfs_cli_release(userdata, path, fi.ptr);
+        ret = cli_release(userdata, path, fi.ptr);
         if (ret < 0) {
             DLOG("getAttr: file could not be released due to error: %d", -ret);
             return ret;
@@ -129,37 +192,11 @@ int watdfs_cli_getattr(void *userdata, const char *path, struct stat *statbuf) {
 }
 
 // CREATE, OPEN AND CLOSE
-int watdfs_cli_mknod(void *userdata, const char *path, mode_t mode, dev_t dev) {
+static int cli_mknod(void *userdata, const char *path, mode_t mode, dev_t dev) {
     DLOG("watdfs_cli_mknod called for '%s'", path);
     FileUtil* fileUtil = (FileUtil *)userdata;
 
-    int ARG_COUNT = 4;
-    void **args = new void*[ARG_COUNT];
-    int arg_types[ARG_COUNT + 1];
-
-    int pathlen = strlen(path) + 1;
-    arg_types[0] = argTypeFrmtr(yes, no, yes, ARG_CHAR, (uint) pathlen); //path
-    args[0] = (void *)path;
-
-    arg_types[1] = argTypeFrmtr(yes, no, no, ARG_INT); //mode
-    args[1] = (void *)(&mode);
-
-    arg_types[2] = argTypeFrmtr(yes, no, no, ARG_LONG); //dev
-    args[2] = (void *)(&dev);
-
-    RAII<int> ret(0);
-    arg_types[3] = argTypeFrmtr(no, yes, no, ARG_INT); //retcode
-    args[3] = (void *)ret.ptr;
-
-    arg_types[4] = 0;
-
-    int rpc_ret = rpcCall((char *)"mknod", arg_types, args);
-
-    int fxn_ret = 0;
-    if (rpc_ret < 0) { DLOG("mknod rpc failed with error '%d'", rpc_ret); fxn_ret = -EINVAL; }
-    else fxn_ret = *ret;
-
-    delete []args;
+    int fxn_ret = watdfs_rpc::mknod::call(path, mode, dev);
 
     int sys_ret = mknod(fileUtil->getAbsolutePath(path), mode, dev);
     if (sys_ret < 0) { DLOG("mknod failed for cache with error: %d", errno); fxn_ret = -errno; }
@@ -167,7 +204,7 @@ int watdfs_cli_mknod(void *userdata, const char *path, mode_t mode, dev_t dev) {
     return fxn_ret;
 }
 
-int watdfs_cli_open(void *userdata, const char *path, struct fuse_file_info *fi) {
+static int cli_open(void *userdata, const char *path, struct fuse_file_info *fi) {
     DLOG("watdfs_cli_open called for '%s'", path);
     FileUtil* fileUtil = (FileUtil *)userdata;
 
@@ -176,38 +213,55 @@ int watdfs_cli_open(void *userdata, const char *path, struct fuse_file_info *fi)
 
     int ret = 0;
 
-    RAII<struct stat> statbuf;
-    ret = getattr_on_server(path, statbuf.ptr);
-    if (ret < 0) {
-        DLOG("Failed to get the attributes due to error: %d\n", -ret);
-        return ret;
-    }
-
     int temp_flags = fi->flags;
     if((fi->flags&O_ACCMODE) == O_WRONLY) fi->flags = O_RDWR;
-    ret = open_on_server(path, fi);
+
+    // a small file comes back with the open, otherwise it is downloaded after it
+    RAII<struct stat> statbuf;
+    static thread_local std::vector<char> data(MAX_ARRAY_LEN); // reused by every open on the thread
+    int inlined = 0;
+    ret = open_inline_on_server(path, fi, statbuf.ptr, data.data(), &inlined);
+    if (ret == -ENOTSUP) {
+        ret = getattr_on_server(path, statbuf.ptr);
+        if (ret < 0) {
+            DLOG("Failed to get the attributes due to error: %d\n", -ret);
+            fi->flags = temp_flags;
+            return ret;
+        }
+
+        ret = open_on_server(path, fi);
+    }
     if (ret < 0) {
         DLOG("Failed to open file on server due to error: %d\n", -ret);
+        fi->flags = temp_flags;
         return ret;
     }
     fi->flags = temp_flags;
     DLOG("File Descriptor On Server: %ld\n", fi->fh);
 
-    ret = open(fileUtil->getAbsolutePath(path), O_CREAT|O_RDWR, statbuf->st_mode);
+    // pinned before the cache file is created so it cannot be evicted while open
+    const char *cache_path = fileUtil->getAbsolutePath(path);
+    cachePin(cache_path);
+    ret = open(cache_path, O_CREAT|O_RDWR, statbuf->st_mode);
     if (ret < 0) {
         DLOG("Unable to open corresponding to given flags: %d\n", errno);
-        return -errno;
+        ret = -errno;
+        cacheUnpin(cache_path, 0);
+        free((void *)cache_path);
+        return ret;
     }
+    free((void *)cache_path);
     int fd_client = ret;
 
     fileUtil->addClientFileData(path, fd_client, fi->fh, fi->flags);
 
-    ret = download_file(fileUtil, path, fi);
+    if (inlined) ret = download_inline(fileUtil, path, statbuf.ptr, data.data());
+    else ret = download_file(fileUtil, path, fi);
 
     return ret;
 }
 
-int watdfs_cli_release(void *userdata, const char *path, struct fuse_file_info *fi) {
+static int cli_release(void *userdata, const char *path, struct fuse_file_info *fi) {
     DLOG("watdfs_cli_release called for '%s'", path);
     FileUtil* fileUtil = (FileUtil *)userdata;
 
@@ -236,6 +290,15 @@ int watdfs_cli_release(void *userdata, const char *path, struct fuse_file_info *
         return ret;
     }
 
+    // a copy that was only read and can be rebuilt from the chunk store is not kept twice
+    IndexEntry entry;
+    if (READ == clientFileData->accessType && cacheIndexGet(path, &entry) && !entry.chunks.empty()) {
+        ftruncate(fd_client, 0);
+    }
+
+    struct stat statbuf;
+    size_t cache_size = (fstat(fd_client, &statbuf) == 0) ? statbuf.st_size : 0;
+
     //close on client
     ret = close(fd_client);
     if (ret < 0) {
@@ -243,13 +306,17 @@ int watdfs_cli_release(void *userdata, const char *path, struct fuse_file_info *
         return -errno;
     }
 
+    const char *cache_path = fileUtil->getAbsolutePath(path);
+    cacheUnpin(cache_path, cache_size);
+    free((void *)cache_path);
+
     fileUtil->removeFile(path);
 
     return 0;
 }
 
 // READ AND WRITE DATA
-int watdfs_cli_read(void *userdata, const char *path, char *buf, size_t size,
+static int cli_read(void *userdata, const char *path, char *buf, size_t size,
                     off_t offset, struct fuse_file_info *fi) {
     DLOG("watdfs_cli_read called for '%s'", path);
     FileUtil* fileUtil = (FileUtil *)userdata;
@@ -273,17 +340,24 @@ int watdfs_cli_read(void *userdata, const char *path, char *buf, size_t size,
         }
     } else DLOG("read: its fresh");
 
+    //small hot files are served from memory
+    if (READ == clientFileData->accessType) {
+        long len = ramCacheRead(path, buf, size, offset);
+        if (len >= 0) return len;
+    }
+
     //read from file on cache
     ret = pread(fd_client, buf, size, offset);
     if (ret < 0) {
         DLOG("read: failed to read from cache due to error: %d\n", errno);
         return -errno;
     }
+    if (READ == clientFileData->accessType) ramCacheNoteRead(path, fd_client);
 
     return ret;
 }
 
-int watdfs_cli_write(void *userdata, const char *path, const char *buf,
+static int cli_write(void *userdata, const char *path, const char *buf,
                      size_t size, off_t offset, struct fuse_file_info *fi) {
     DLOG("watdfs_cli_write called for '%s'", path);
     FileUtil* fileUtil = (FileUtil *)userdata;
@@ -299,6 +373,7 @@ int watdfs_cli_write(void *userdata, const char *path, const char *buf,
     DLOG("File Descriptor: %d\n", fd_client);
 
     //write to file on cache
+    ramCacheDrop(path);
     ret = pwrite(fd_client, buf, size, offset);
     if (ret < 0) {
         DLOG("write: failed to write to cache due to error: %d\n", errno);
@@ -317,7 +392,7 @@ int watdfs_cli_write(void *userdata, const char *path, const char *buf,
     return ret;
 }
 
-int watdfs_cli_truncate(void *userdata, const char *path, off_t newsize) {
+static int cli_truncate(void *userdata, const char *path, off_t newsize) {
     DLOG("watdfs_cli_truncate called for '%s'", path);
     FileUtil* fileUtil = (FileUtil *)userdata;
 
@@ -326,21 +401,11 @@ int watdfs_cli_truncate(void *userdata, const char *path, off_t newsize) {
 
     int ret = 0;
 
-    RAII<struct fuse_file_info> fi;
-    if (!isOpen) {
-        fi->flags = O_RDWR;
-        ret = watdfs_cli_open(userdata, path, fi.ptr);
-        if (ret < 0) {
-            DLOG("truncate: file could not be opened due to error: %d", -ret);
-            return ret;
-        }
+    // a closed file is changed on the server, it does not have to be downloaded for that
+    if (!isOpen) return change_closed_file(fileUtil, path, batchTruncate(path, newsize));
 
-        clientFileData = fileUtil->getClientFileData(path);
-        if (clientFileData == nullptr) {
-            DLOG("truncate: file could not found in cache");
-            return -1;
-        }
-    } else if (isOpen && READ==clientFileData->accessType) {
+    RAII<struct fuse_file_info> fi;
+    if (READ==clientFileData->accessType) {
         DLOG("File is open in read mode");
         return -EMFILE;
     }
@@ -351,19 +416,14 @@ int watdfs_cli_truncate(void *userdata, const char *path, off_t newsize) {
     int fd_client = clientFileData->fh;
     DLOG("File Descriptor: %d\n", fd_client);
 
+    ramCacheDrop(path);
     ret = ftruncate(fd_client, newsize);
     if (ret < 0) {
         DLOG("truncate failed on cache file with error: %d\n", errno);
         return -errno;
     }
 
-    if (!isOpen) {
-        ret = watdfs_cli_release(userdata, path, fi.ptr);
-        if (ret < 0) {
-            DLOG("truncate: file could not be released due to error: %d", -ret);
-            return ret;
-        }
-    } else if (!isFresh(fileUtil, path, fi.ptr)) {
+    if (!isFresh(fileUtil, path, fi.ptr)) {
         ret = upload_file(fileUtil, path, fi.ptr);
         if (ret < 0) {
             DLOG("truncate: upload to update data failed");
@@ -374,7 +434,7 @@ int watdfs_cli_truncate(void *userdata, const char *path, off_t newsize) {
     return 0;
 }
 
-int watdfs_cli_fsync(void *userdata, const char *path,
+static int cli_fsync(void *userdata, const char *path,
                      struct fuse_file_info *fi) {
     DLOG("watdfs_cli_fsync called for '%s'", path);
     FileUtil* fileUtil = (FileUtil *)userdata;
@@ -396,7 +456,7 @@ int watdfs_cli_fsync(void *userdata, const char *path,
 }
 
 // CHANGE METADATA
-int watdfs_cli_utimens(void *userdata, const char *path, const struct timespec ts[2]) {
+static int cli_utimens(void *userdata, const char *path, const struct timespec ts[2]) {
     DLOG("watdfs_cli_utimens called for '%s'", path);
     FileUtil* fileUtil = (FileUtil *)userdata;
 
@@ -405,21 +465,11 @@ int watdfs_cli_utimens(void *userdata, const char *path, const struct timespec t
 
     int ret = 0;
 
-    RAII<struct fuse_file_info> fi;
-    if (!isOpen) {
-        fi->flags = O_RDWR;
-        ret = watdfs_cli_open(userdata, path, fi.ptr);
-        if (ret < 0) {
-            DLOG("utimens: file could not be opened due to error: %d", -ret);
-            return ret;
-        }
+    // a closed file is changed on the server, it does not have to be downloaded for that
+    if (!isOpen) return change_closed_file(fileUtil, path, batchUtimens(path, ts));
 
-        clientFileData = fileUtil->getClientFileData(path);
-        if (clientFileData == nullptr) {
-            DLOG("utimens: file could not found in cache");
-            return -1;
-        }
-    } else if (isOpen && READ==clientFileData->accessType) {
+    RAII<struct fuse_file_info> fi;
+    if (READ==clientFileData->accessType) {
         DLOG("File is open in read mode");
         return -EMFILE;
     }
@@ -436,13 +486,7 @@ int watdfs_cli_utimens(void *userdata, const char *path, const struct timespec t
         return -errno;
     }
 
-    if (!isOpen) {
-        ret = watdfs_cli_release(userdata, path, fi.ptr);
-        if (ret < 0) {
-            DLOG("utimens: file could not be released due to error: %d", -ret);
-            return ret;
-        }
-    } else if (!isFresh(fileUtil, path, fi.ptr)) {
+    if (!isFresh(fileUtil, path, fi.ptr)) {
         ret = upload_file(fileUtil, path, fi.ptr);
         if (ret < 0) {
             DLOG("utimens: upload to update data failed");
@@ -452,3 +496,110 @@ int watdfs_cli_utimens(void *userdata, const char *path, const struct timespec t
 
     return 0;
 }
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+// The stats control file (client_stats.h) is served here, everything else is timed, traced and
+// recorded.
+
+// a FUSE operation in progress
+struct OpScope {
+    ClientOp op;
+    const char *path;
+    uint64_t start;
+    TraceSpan span;
+    // for the recording, see RecordEntry
+    uint64_t fh = 0;
+    int64_t offset = 0;
+    uint64_t size = 0;
+    uint32_t flags = 0;
+};
+
+static OpScope op_begin(ClientOp op, const char *path) {
+    return {op, path, statsNow(), traceRoot(clientOpName(op), path)};
+}
+
+static int op_end(OpScope *scope, uint64_t bytes, int ret) {
+    traceEnd(&scope->span, ret);
+    if (recordEnabled()) {
+        RecordEntry entry = {scope->op, 0, scope->start, statsNow() - scope->start, recordPathHash(scope->path),
+                             scope->fh, scope->offset, scope->size, scope->flags, ret};
+        recordOp(&entry);
+    }
+    return clientStatsDone(scope->op, scope->start, bytes, ret);
+}
+
+int watdfs_cli_getattr(void *userdata, const char *path, struct stat *statbuf) {
+    if (isStatsPath(path)) return statsFileGetattr(path, statbuf);
+    OpScope op = op_begin(CLI_GETATTR, path);
+    int ret = cli_getattr(userdata, path, statbuf);
+    if (ret == 0) op.size = statbuf->st_size;
+    return op_end(&op, 0, ret);
+}
+
+int watdfs_cli_mknod(void *userdata, const char *path, mode_t mode, dev_t dev) {
+    if (isStatsPath(path)) return -EACCES;
+    OpScope op = op_begin(CLI_MKNOD, path);
+    op.flags = mode;
+    return op_end(&op, 0, cli_mknod(userdata, path, mode, dev));
+}
+
+int watdfs_cli_open(void *userdata, const char *path, struct fuse_file_info *fi) {
+    if (isStatsPath(path)) return statsFileOpen(path, fi);
+    OpScope op = op_begin(CLI_OPEN, path);
+    int ret = cli_open(userdata, path, fi);
+    op.fh = fi->fh;
+    op.flags = fi->flags;
+    return op_end(&op, 0, ret);
+}
+
+int watdfs_cli_release(void *userdata, const char *path, struct fuse_file_info *fi) {
+    if (isStatsPath(path)) return statsFileRelease(fi);
+    OpScope op = op_begin(CLI_RELEASE, path);
+    op.fh = fi->fh;
+    op.flags = fi->flags;
+    return op_end(&op, 0, cli_release(userdata, path, fi));
+}
+
+int watdfs_cli_read(void *userdata, const char *path, char *buf, size_t size,
+                    off_t offset, struct fuse_file_info *fi) {
+    if (isStatsPath(path)) return statsFileRead(buf, size, offset, fi);
+    OpScope op = op_begin(CLI_READ, path);
+    op.fh = fi->fh;
+    op.offset = offset;
+    op.size = size;
+    int ret = cli_read(userdata, path, buf, size, offset, fi);
+    return op_end(&op, ret > 0 ? ret : 0, ret);
+}
+
+int watdfs_cli_write(void *userdata, const char *path, const char *buf,
+                     size_t size, off_t offset, struct fuse_file_info *fi) {
+    if (isStatsPath(path)) return -EACCES;
+    OpScope op = op_begin(CLI_WRITE, path);
+    op.fh = fi->fh;
+    op.offset = offset;
+    op.size = size;
+    int ret = cli_write(userdata, path, buf, size, offset, fi);
+    return op_end(&op, ret > 0 ? ret : 0, ret);
+}
+
+int watdfs_cli_truncate(void *userdata, const char *path, off_t newsize) {
+    if (isStatsPath(path)) return -EACCES;
+    OpScope op = op_begin(CLI_TRUNCATE, path);
+    op.size = newsize;
+    return op_end(&op, 0, cli_truncate(userdata, path, newsize));
+}
+
+int watdfs_cli_fsync(void *userdata, const char *path,
+                     struct fuse_file_info *fi) {
+    if (isStatsPath(path)) return 0;
+    OpScope op = op_begin(CLI_FSYNC, path);
+    op.fh = fi->fh;
+    return op_end(&op, 0, cli_fsync(userdata, path, fi));
+}
+
+int watdfs_cli_utimens(void *userdata, const char *path, const struct timespec ts[2]) {
+    if (isStatsPath(path)) return -EACCES;
+    OpScope op = op_begin(CLI_UTIMENS, path);
+    return op_end(&op, 0, cli_utimens(userdata, path, ts));
+}
@@ -11,16 +11,34 @@
 #include <sys/types.h>
 #include <time.h>
 #include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
 #include "rpc.h"
 #include "rw_lock.h"
+#include "watdfs_rpc.h"
+#include "bulk_channel.h"
+#include "shard_transport.h"
+#include "replica_client.h"
+#include "compress.h"
+#include "chunking.h"
+#include "chunk_store.h"
+#include "cache_index.h"
+#include "cache_manager.h"
+#include "ram_cache.h"
+#include "freshness.h"
+#include "client_stats.h"
+#include "stats.h"
+#include "trace.h"
 #include "watdfs_client_utility.h"
 
 #include "debug.h"
 
 ////////////////////////////////////////////////////////////////////////////////////////////////
-int read_on_server(const char *path, char *buf, size_t size, struct fuse_file_info *fi);
-int truncate_on_server(const char *path);
-int write_to_server(const char *path, const char *buf, size_t size, struct fuse_file_info *fi);
+int read_on_server(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi);
+int truncate_on_server(const char *path, off_t newsize);
+int write_to_server(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi);
 int close_on_server(const char *path, struct fuse_file_info *fi);
 int fsync_on_server(const char *path, struct fuse_file_info *fi);
 int utimens_on_server(const char *path, const struct timespec ts[2]);
@@ -29,7 +47,241 @@ int lock_on_server(const char *path, rw_lock_mode_t mode);
 int unlock_on_server(const char *path, rw_lock_mode_t mode);
 ////////////////////////////////////////////////////////////////////////////////////////////////
 
-int download_file(FileUtil* fileUtil, const char *path, struct fuse_file_info* fi) {
+// Set by negotiate_on_server when compression is asked for and the server supports it.
+static bool server_compresses = false;
+// Set by negotiate_on_server when the server can return small files with the open.
+static bool server_inlines = false;
+
+// Files of at least this many bytes are split into WATDFS_STRIPES ranges that are moved in
+// parallel, each over its own connection. WATDFS_STRIPE_MIN overrides the threshold.
+#define STRIPE_MIN (64 << 20)
+#define STRIPE_COUNT 4
+// Each worker moves its range through a buffer of this size.
+#define STRIPE_PIECE (4 * BULK_MAX_LEN)
+
+// librpc, the shard transport or replicas, where transfers cross the network; not the local
+// transport.
+static bool remote_transport() {
+    return rpc_stub::transport() == rpcCall || rpc_stub::transport() == shardCall ||
+           rpc_stub::transport() == replicaCall;
+}
+
+static long env_or(const char *name, long value) {
+    const char *env = getenv(name);
+    return env ? atol(env) : value;
+}
+
+// Moves [offset, offset + size) between the cache file and the server, returns 0 or -errno.
+// Every piece has to be moved in full, a short transfer fails with -EIO.
+static int transfer_range(const char *path, int fd_client, BulkDirection direction, off_t offset,
+                          size_t size, struct fuse_file_info *fi) {
+    std::vector<char> buf(size < STRIPE_PIECE ? size : STRIPE_PIECE);
+
+    while (size > 0) {
+        size_t len = size < buf.size() ? size : buf.size();
+        if (direction == BULK_READ) {
+            int ret = read_on_server(path, buf.data(), len, offset, fi);
+            if (ret < 0) return ret;
+            if ((size_t)ret != len) return -EIO;
+            ssize_t done = pwrite(fd_client, buf.data(), len, offset);
+            if (done < 0) return -errno;
+            if ((size_t)done != len) return -EIO;
+        } else {
+            ssize_t done = pread(fd_client, buf.data(), len, offset);
+            if (done < 0) return -errno;
+            if ((size_t)done != len) return -EIO;
+            int ret = write_to_server(path, buf.data(), len, offset, fi);
+            if (ret < 0) return ret;
+            if ((size_t)ret != len) return -EIO;
+        }
+
+        offset += len;
+        size -= len;
+    }
+
+    return 0;
+}
+
+static long stripe_count() {
+    static long count = env_or("WATDFS_STRIPES", STRIPE_COUNT);
+    return count;
+}
+
+static int transfer_file(const char *path, int fd_client, BulkDirection direction, size_t size,
+                         struct fuse_file_info *fi) {
+    static long stripe_min = env_or("WATDFS_STRIPE_MIN", STRIPE_MIN);
+
+    if (size < (size_t)stripe_min || stripe_count() <= 1) {
+        return transfer_range(path, fd_client, direction, 0, size, fi);
+    }
+
+    // stripes are whole pieces so every rpc but the last one is full sized
+    size_t pieces = (size + STRIPE_PIECE - 1) / STRIPE_PIECE;
+    size_t stripes = ((size_t)stripe_count() < pieces) ? stripe_count() : pieces;
+    size_t stripe_len = ((pieces + stripes - 1) / stripes) * STRIPE_PIECE;
+    DLOG("striping %zu bytes over %zu workers", size, stripes);
+
+    std::vector<int> rets(stripes, 0);
+    std::vector<std::thread> workers;
+    for (size_t i = 0; i < stripes; ++i) {
+        off_t offset = i * stripe_len;
+        if ((size_t)offset >= size) break;
+        size_t len = (size - offset < stripe_len) ? size - offset : stripe_len;
+        workers.emplace_back([=, &rets]() {
+            rets[i] = transfer_range(path, fd_client, direction, offset, len, fi);
+        });
+    }
+    for (std::thread &worker: workers) worker.join();
+
+    for (int ret: rets) if (ret < 0) return ret;
+    return 0;
+}
+
+// Downloads of at least this many bytes go through the chunk store, see chunk_store.h.
+// WATDFS_CHUNK_MIN overrides it.
+#define CHUNKED_DOWNLOAD_MIN (1 << 20)
+
+static bool use_chunk_store(size_t size) {
+    static long min = env_or("WATDFS_CHUNK_MIN", CHUNKED_DOWNLOAD_MIN);
+    return chunkStoreEnabled() && size >= (size_t)min && remote_transport();
+}
+
+// Fetches the chunk manifest of the file, the chunks have to cover [0, size) in order.
+static int manifest_on_server(const char *path, size_t size, struct fuse_file_info *fi,
+                              std::vector<ChunkRef> *refs) {
+    std::vector<ChunkRef> page;
+
+    uint64_t from = 0;
+    while (from < size) {
+        size_t count = (size - from) / CDC_AVG + 16;
+        if (count > BULK_MAX_LEN / sizeof(ChunkRef)) count = BULK_MAX_LEN / sizeof(ChunkRef);
+        page.resize(count);
+
+        int ret = watdfs_rpc::manifest::call(path, fi, (off_t)from, count * sizeof(ChunkRef),
+                                             rpc_stub::bytes{(char *)page.data(), count * sizeof(ChunkRef)});
+        if (ret < 0) return ret;
+        if (ret == 0) return -EIO;
+
+        for (int i = 0; i < ret; ++i) {
+            if (page[i].offset != from || page[i].len == 0) return -EIO;
+            refs->push_back(page[i]);
+            from += page[i].len;
+        }
+    }
+
+    return from == size ? 0 : -EIO;
+}
+
+// Builds the cache file from the chunks already in the store and fetches the missing ones,
+// runs of adjacent missing chunks in one transfer each, spread over the stripe workers.
+static int download_chunks(const char *path, int fd_client, size_t size, struct fuse_file_info *fi,
+                           std::vector<ChunkRef> &refs, size_t *fetched) {
+    int ret = manifest_on_server(path, size, fi, &refs);
+    if (ret < 0) return ret;
+
+    // [first, last) indices of missing runs
+    std::vector<std::pair<size_t, size_t>> runs;
+    size_t run_len = 0;
+    for (size_t i = 0; i < refs.size(); ++i) {
+        if (chunkStoreCopy(refs[i].hash, fd_client, refs[i].offset, refs[i].len) == 0) continue;
+
+        if (!runs.empty() && runs.back().second == i && run_len + refs[i].len <= STRIPE_PIECE) {
+            runs.back().second = i + 1;
+            run_len += refs[i].len;
+        } else {
+            runs.push_back(std::make_pair(i, i + 1));
+            run_len = refs[i].len;
+        }
+        *fetched += refs[i].len;
+    }
+    DLOG("%zu chunks, %zu missing runs", refs.size(), runs.size());
+
+    std::atomic<size_t> next(0);
+    std::atomic<int> failed(0);
+    auto worker = [&]() {
+        std::vector<char> buf;
+        for (size_t r = next++; r < runs.size() && failed == 0; r = next++) {
+            const ChunkRef &first = refs[runs[r].first], &last = refs[runs[r].second - 1];
+            size_t len = last.offset + last.len - first.offset;
+            buf.resize(len);
+
+            int ret = read_on_server(path, buf.data(), len, first.offset, fi);
+            if (ret >= 0 && (size_t)ret != len) ret = -EIO;
+            for (size_t i = runs[r].first; ret >= 0 && i < runs[r].second; ++i) {
+                // a store that cannot take the chunk only costs a download next time
+                int put = chunkStorePut(refs[i].hash, buf.data() + (refs[i].offset - first.offset), refs[i].len);
+                if (put == -EBADMSG) ret = -EIO;
+            }
+            if (ret >= 0 && pwrite(fd_client, buf.data(), len, first.offset) != (ssize_t)len) ret = -EIO;
+            if (ret < 0) failed = ret;
+        }
+    };
+
+    std::vector<std::thread> workers;
+    size_t count = ((size_t)stripe_count() < runs.size()) ? stripe_count() : runs.size();
+    for (size_t i = 1; i < count; ++i) workers.emplace_back(worker);
+    worker();
+    for (std::thread &thread: workers) thread.join();
+
+    return failed;
+}
+
+// Brings the cache file up to date without a transfer when the index says the cached content is
+// still the server's `current` version, from the flat copy or from the chunk store. The chunks
+// of the cached entry carry over to `current`.
+static bool warm_copy(const char *path, int fd_client, IndexEntry &current) {
+    IndexEntry cached;
+    if (!cacheIndexGet(path, &cached)) return false;
+    if (cached.size != current.size || cached.mtime.tv_sec != current.mtime.tv_sec ||
+        cached.mtime.tv_nsec != current.mtime.tv_nsec) return false;
+
+    if (cached.chunks.empty()) {
+        // the copy carries the server's mtime, anything else means it was changed or evicted
+        struct stat statbuf;
+        if (fstat(fd_client, &statbuf) < 0) return false;
+        return statbuf.st_size == cached.size && statbuf.st_mtim.tv_sec == cached.mtime.tv_sec &&
+               statbuf.st_mtim.tv_nsec == cached.mtime.tv_nsec;
+    }
+
+    if (ftruncate(fd_client, 0) < 0) return false;
+    off_t offset = 0;
+    for (const IndexChunk &chunk: cached.chunks) {
+        if (chunkStoreCopy(chunk.hash, fd_client, offset, chunk.len) < 0) return false;
+        offset += chunk.len;
+    }
+    if (offset != cached.size) return false;
+
+    current.chunks.swap(cached.chunks);
+    return true;
+}
+
+// The cache file holds the server's version described by statbuf, records it as current.
+static int finish_download(FileUtil* fileUtil, const char *path, int fd_client, const struct stat *statbuf,
+                           const IndexEntry &entry) {
+    //make sure the whole file landed before the cache entry is trusted
+    RAII<struct stat> cachebuf;
+    int ret = fstat(fd_client, cachebuf.ptr);
+    if (ret < 0 || cachebuf->st_size != statbuf->st_size) {
+        DLOG("Cache file is incomplete after download\n");
+        return ret < 0 ? -errno : -EIO;
+    }
+
+    //update file metadata in client cache
+    struct timespec times[] {statbuf->st_atim, statbuf->st_mtim};
+    ret = futimens(fd_client, times);
+    if (ret < 0) {
+        DLOG("Unable to update file time metadata in client cache due to error: %d\n", errno);
+        return -errno;
+    }
+
+    cacheIndexPut(path, entry);
+    ramCacheValidate(path, entry.size, entry.mtime);
+    fileUtil->updateTc(path);
+
+    return 0;
+}
+
+static int download(FileUtil* fileUtil, const char *path, struct fuse_file_info* fi, size_t *fetched) {
     DLOG("Download file: %s\n", path);
 
     FileData* clientFileData = fileUtil->getClientFileData(path);
@@ -42,76 +294,124 @@ int download_file(FileUtil* fileUtil, const char *path, struct fuse_file_info* f
 
     int ret = 0;
 
-    ret = ftruncate(fd_client, 0);
-    if (ret < 0) {
-        DLOG("Unable to truncate the file: %d\n", errno);
-        return -errno;
-    }
-
-    ret = fsync_on_server(path, fi);
-    if (ret < 0) {
-        DLOG("Failed to fsync on server due to error: %d\n", -ret);
-        return ret;
-    }
-
-    // getattr of file from server
+    // fsync, getattr and read lock the file on the server in one round trip
     RAII<struct stat> statbuf;
     statbuf->st_size = 0; //set it to 0 before making the call
-    ret = getattr_on_server(path, statbuf.ptr);
+    BatchOp ops[] = { batchFsync(path, fi), batchGetattr(path, statbuf.ptr), batchLock(path, RW_READ_LOCK) };
+    ret = batch_on_server(ops, 3, yes);
     if (ret < 0) {
-        DLOG("Failed to get the attributes due to error: %d\n", -ret);
+        DLOG("Failed to batch on server due to error: %d\n", -ret);
         return ret;
     }
+    for (BatchOp &op: ops) {
+        if (op.ret < 0) {
+            DLOG("Failed to prepare the download due to error: %d\n", -op.ret);
+            return op.ret;
+        }
+    }
     DLOG("Size: %ld\n", statbuf->st_size);
 
-    ret = lock_on_server(path, RW_READ_LOCK);
-    if (ret < 0) {
-        DLOG("Failed to accquire lock on server: %d\n", -ret);
-        return ret;
-    }
+    IndexEntry entry;
+    entry.size = statbuf->st_size;
+    entry.mtime = statbuf->st_mtim;
+
+    if (warm_copy(path, fd_client, entry)) {
+        DLOG("cached copy is current, nothing to download\n");
+        freshnessUnchanged(path);
+        clientStatsCount(CLI_CACHE_HIT, entry.size);
+    } else {
+        clientStatsCount(CLI_CACHE_MISS, entry.size);
+        cacheIndexRemove(path);
+        ramCacheDrop(path);
+        freshnessChanged(path);
+
+        ret = ftruncate(fd_client, 0);
+        if (ret < 0) {
+            DLOG("Unable to truncate the file: %d\n", errno);
+            ret = -errno;
+            unlock_on_server(path, RW_READ_LOCK);
+            return ret;
+        }
 
-    char *buf = new char[statbuf->st_size];
-    //read file from server
-    ret = read_on_server(path, buf, statbuf->st_size, fi);
-    if (ret < 0) {
-        DLOG("Failed to read from server due to error: %d\n", -ret);
-        delete []buf;
-        unlock_on_server(path, RW_READ_LOCK);
-        return ret;
+        //read file from server into the client cache
+        std::vector<ChunkRef> refs;
+        if (use_chunk_store(statbuf->st_size)) {
+            ret = download_chunks(path, fd_client, statbuf->st_size, fi, refs, fetched);
+        } else {
+            ret = transfer_file(path, fd_client, BULK_READ, statbuf->st_size, fi);
+            *fetched = statbuf->st_size;
+        }
+        if (ret < 0) {
+            DLOG("Failed to read from server due to error: %d\n", -ret);
+            unlock_on_server(path, RW_READ_LOCK);
+            return ret;
+        }
+
+        for (const ChunkRef &ref: refs) {
+            IndexChunk chunk;
+            chunk.len = ref.len;
+            memcpy(chunk.hash, ref.hash, SHA256_LEN);
+            entry.chunks.push_back(chunk);
+        }
     }
-    DLOG("Buffer: %s\n", buf);
 
     ret = unlock_on_server(path, RW_READ_LOCK);
     if (ret < 0) {
-        delete []buf;
         DLOG("Unable to unlock it on server: %d\n", -ret);
         return ret;
     }
 
-    //write the file in client cache
-    ret = pwrite(fd_client, buf, statbuf->st_size, 0);
-    if (ret < 0) {
-        DLOG("Unable to write in client cache due to error: %d\n", errno);
-        delete []buf;
-        return -errno;
-    }
-    delete []buf;
+    return finish_download(fileUtil, path, fd_client, statbuf.ptr, entry);
+}
 
-    //update file metadata in client cache
-    struct timespec times[] {statbuf->st_atim, statbuf->st_mtim};
-    ret = futimens(fd_client, times);
-    if (ret < 0) {
-        DLOG("Unable to update file time metadata in client cache due to error: %d\n", errno);
-        return -errno;
+int download_file(FileUtil* fileUtil, const char *path, struct fuse_file_info* fi) {
+    uint64_t start = statsNow();
+    TraceSpan span = traceBegin("download", TRACE_TRANSFER);
+    size_t fetched = 0;
+    int ret = download(fileUtil, path, fi, &fetched);
+    traceEnd(&span, ret < 0 ? ret : (long)fetched);
+    return clientStatsDone(CLI_DOWNLOAD, start, fetched, ret);
+}
+
+int download_inline(FileUtil* fileUtil, const char *path, const struct stat *statbuf, const char *data) {
+    DLOG("Download inline: %s\n", path);
+
+    FileData* clientFileData = fileUtil->getClientFileData(path);
+    if (clientFileData == nullptr) {
+        DLOG("cannot find file in cache");
+        return -EBADF; // not open
     }
+    int fd_client = clientFileData->fh;
 
-    fileUtil->updateTc(path);
+    // the data came with the open, this only times filling the cache file
+    uint64_t start = statsNow();
+
+    IndexEntry entry;
+    entry.size = statbuf->st_size;
+    entry.mtime = statbuf->st_mtim;
+
+    if (warm_copy(path, fd_client, entry)) {
+        DLOG("cached copy is current, the inline data is not needed\n");
+        freshnessUnchanged(path);
+        clientStatsCount(CLI_CACHE_HIT, entry.size);
+    } else {
+        clientStatsCount(CLI_CACHE_MISS, entry.size);
+        cacheIndexRemove(path);
+        ramCacheDrop(path);
+        freshnessChanged(path);
+
+        if (ftruncate(fd_client, 0) < 0 || pwrite(fd_client, data, statbuf->st_size, 0) != statbuf->st_size) {
+            DLOG("Unable to write the inline data to the cache: %d\n", errno);
+            return clientStatsDone(CLI_DOWNLOAD, start, statbuf->st_size, errno ? -errno : -EIO);
+        }
+    }
 
-    return 0;
+    int ret = finish_download(fileUtil, path, fd_client, statbuf, entry);
+    return clientStatsDone(CLI_DOWNLOAD, start, statbuf->st_size, ret);
 }
 
 
-int upload_file(FileUtil* fileUtil, const char *path, struct fuse_file_info *fi) {
+static int upload(FileUtil* fileUtil, const char *path, struct fuse_file_info *fi, size_t *sent) {
     DLOG("Upload file: %s\n", path);
 
     FileData* clientFileData = fileUtil->getClientFileData(path);
@@ -141,57 +441,125 @@ int upload_file(FileUtil* fileUtil, const char *path, struct fuse_file_info *fi)
     }
     DLOG("Size: %ld\n", statbuf->st_size);
 
-    char *buf = new char[statbuf->st_size];
-    // read file from cache
-    ret = pread(fd_client, buf, statbuf->st_size, 0);
+    //truncate and write lock on server in one round trip
+    BatchOp ops[] = { batchTruncate(path, 0), batchLock(path, RW_WRITE_LOCK) };
+    ret = batch_on_server(ops, 2, yes);
+    if (ret == 0 && ops[0].ret < 0) ret = ops[0].ret;
+    if (ret == 0 && ops[1].ret < 0) ret = ops[1].ret;
     if (ret < 0) {
-        DLOG("Failed to read from cache due to error: %d\n", errno);
-        delete []buf;
-        return -errno;
+        DLOG("Failed to truncate and lock on server due to error: %d\n", -ret);
+        return ret;
     }
-    DLOG("Buffer: %s\n", buf);
 
-    //truncate on server
-    ret = truncate_on_server(path);
+    //write the file from client cache to server
+    ret = transfer_file(path, fd_client, BULK_WRITE, statbuf->st_size, fi);
     if (ret < 0) {
-        DLOG("Failed to truncate on server due to error: %d\n", -ret);
-        delete []buf;
+        DLOG("Unable to write to server due to error: %d\n", -ret);
+        unlock_on_server(path, RW_WRITE_LOCK);
         return ret;
     }
+    *sent = statbuf->st_size;
 
-    ret = lock_on_server(path, RW_WRITE_LOCK);
+    //unlock and update metadata on server in one round trip
+    struct timespec times[] {statbuf->st_atim, statbuf->st_mtim};
+    BatchOp done_ops[] = { batchUnlock(path, RW_WRITE_LOCK), batchUtimens(path, times) };
+    ret = batch_on_server(done_ops, 2, yes);
+    if (ret == 0 && done_ops[0].ret < 0) ret = done_ops[0].ret;
+    if (ret == 0 && done_ops[1].ret < 0) ret = done_ops[1].ret;
     if (ret < 0) {
-        DLOG("Failed to accquire lock on server: %d\n", -ret);
-        delete []buf;
+        DLOG("Unable to unlock and update time on server due to error: %d\n", -ret);
         return ret;
     }
 
-    //write the file to server
-    ret = write_to_server(path, buf, statbuf->st_size, fi);
-    if (ret < 0) {
-        DLOG("Unable to write in client cache due to error: %d\n", -ret);
-        delete []buf;
-        unlock_on_server(path, RW_WRITE_LOCK);
-        return ret;
+    // the server now holds what the cache file holds
+    IndexEntry entry;
+    entry.size = statbuf->st_size;
+    entry.mtime = statbuf->st_mtim;
+    cacheIndexPut(path, entry);
+    freshnessChanged(path);
+
+    fileUtil->updateTc(path);
+
+    return 0;
+}
+
+int upload_file(FileUtil* fileUtil, const char *path, struct fuse_file_info *fi) {
+    uint64_t start = statsNow();
+    TraceSpan span = traceBegin("upload", TRACE_TRANSFER);
+    size_t sent = 0;
+    int ret = upload(fileUtil, path, fi, &sent);
+    traceEnd(&span, ret < 0 ? ret : (long)sent);
+    return clientStatsDone(CLI_UPLOAD, start, sent, ret);
+}
+
+static bool same_version(const IndexEntry &entry, const struct stat *statbuf) {
+    return entry.size == statbuf->st_size && entry.mtime.tv_sec == statbuf->st_mtim.tv_sec &&
+           entry.mtime.tv_nsec == statbuf->st_mtim.tv_nsec;
+}
+
+// Brings a cached copy that held the `before` version up to `after` the change, returns false
+// when there is no such copy or it cannot be changed in place.
+static bool update_closed_copy(FileUtil* fileUtil, const char *path, const BatchOp &change,
+                               const struct stat *before, const struct stat *after) {
+    IndexEntry entry;
+    if (!cacheIndexGet(path, &entry) || !same_version(entry, before)) return false;
+    // the chunks describe the old content
+    if (change.code == BATCH_TRUNCATE && !entry.chunks.empty()) return false;
+
+    const char *cache_path = fileUtil->getAbsolutePath(path);
+    cachePin(cache_path);
+    int fd_client = open(cache_path, O_RDWR);
+    bool updated = (fd_client >= 0);
+
+    struct stat statbuf;
+    if (updated && entry.chunks.empty()) {
+        // the flat copy carries the server's mtime, anything else means it was changed or evicted
+        updated = fstat(fd_client, &statbuf) == 0 && statbuf.st_size == entry.size &&
+                  statbuf.st_mtim.tv_sec == entry.mtime.tv_sec && statbuf.st_mtim.tv_nsec == entry.mtime.tv_nsec;
+        if (updated && change.code == BATCH_TRUNCATE) updated = (ftruncate(fd_client, change.args.newsize) == 0);
+        struct timespec times[] {after->st_atim, after->st_mtim};
+        if (updated) updated = (futimens(fd_client, times) == 0);
     }
 
-    delete []buf;
+    size_t cache_size = 0;
+    if (fd_client >= 0) {
+        cache_size = (fstat(fd_client, &statbuf) == 0) ? statbuf.st_size : 0;
+        close(fd_client);
+    }
+    cacheUnpin(cache_path, cache_size);
+    free((void *)cache_path);
 
-    ret = unlock_on_server(path, RW_WRITE_LOCK);
-    if (ret < 0) {
-        DLOG("Unable to unlock it on server: %d\n", -ret);
-        return ret;
+    if (updated) {
+        entry.size = after->st_size;
+        entry.mtime = after->st_mtim;
+        cacheIndexPut(path, entry);
     }
+    return updated;
+}
 
-    //update metadata on server
-    struct timespec times[] {statbuf->st_atim, statbuf->st_mtim};
-    ret = utimens_on_server(path, times);
+int change_closed_file(FileUtil* fileUtil, const char *path, BatchOp change) {
+    DLOG("change closed file: %s\n", path);
+
+    // the change and the attributes around it in one round trip, under the write lock
+    RAII<struct stat> before, after;
+    BatchOp ops[] = { batchLock(path, RW_WRITE_LOCK), batchGetattr(path, before.ptr), change,
+                      batchGetattr(path, after.ptr), batchUnlock(path, RW_WRITE_LOCK) };
+    int ret = batch_on_server(ops, 5, yes);
     if (ret < 0) {
-        DLOG("Unable to update time on server due to error: %d\n", -ret);
+        DLOG("Failed to batch on server due to error: %d\n", -ret);
         return ret;
     }
+    if (ops[0].ret < 0) return ops[0].ret;
+    // a failure stopped the batch before the unlock
+    if (ops[4].ret == -ECANCELED) unlock_on_server(path, RW_WRITE_LOCK);
+    if (ops[1].ret < 0) return ops[1].ret;
+    if (ops[2].ret < 0) return ops[2].ret;
 
-    fileUtil->updateTc(path);
+    ramCacheDrop(path);
+    freshnessChanged(path);
+
+    bool updated = (ops[3].ret == 0 && update_closed_copy(fileUtil, path, change, before.ptr, after.ptr));
+    if (!updated) cacheIndexRemove(path);
 
     return 0;
 }
@@ -209,6 +577,11 @@ bool isFresh(FileUtil* fileUtil, const char *path, struct fuse_file_info *fi) {
 
     int ret = 0;
 
+    if (fileUtil->isStale(path)) {
+        clientStatsCount(CLI_FRESH_STALE, 0);
+        return false;
+    }
+
     struct timespec tp;
     ret = clock_gettime(CLOCK_REALTIME, &tp);
     if (ret < 0) {
@@ -217,8 +590,13 @@ bool isFresh(FileUtil* fileUtil, const char *path, struct fuse_file_info *fi) {
     }
     time_t t = tp.tv_sec;
 
-    // [T - Tc < t]
-    if (t - clientFileData->tc < fileUtil->cacheInterval) return true;
+    // [T - Tc < t], reads use the file's adaptive interval and writes go back on the fixed one
+    const bool reading = (READ == clientFileData->accessType);
+    time_t interval = reading ? freshnessInterval(path) : fileUtil->cacheInterval;
+    if (t - fileUtil->getTc(path) < interval) {
+        clientStatsCount(CLI_FRESH_LOCAL, 0);
+        return true;
+    }
 
     // getattr of file from cache
     RAII<struct stat> statbuf;
@@ -232,6 +610,7 @@ bool isFresh(FileUtil* fileUtil, const char *path, struct fuse_file_info *fi) {
     memset(statbuf.ptr, 0, sizeof(struct stat));
 
     // getattr of file on server
+    uint64_t start = statsNow();
     ret = getattr_on_server(path, statbuf.ptr);
     if (ret < 0) {
         DLOG("isFresh: Failed to get the attributes from server due to error: %d\n", -ret);
@@ -239,8 +618,16 @@ bool isFresh(FileUtil* fileUtil, const char *path, struct fuse_file_info *fi) {
     }
     time_t t_server = statbuf->st_mtim.tv_sec;
 
-    if (t_client == t_server) return true;
+    if (t_client == t_server) {
+        if (reading) {
+            freshnessUnchanged(path);
+            fileUtil->updateTc(path);
+        }
+        clientStatsDone(CLI_FRESH_VALIDATED, start, 0, 0);
+        return true;
+    }
 
+    clientStatsDone(CLI_FRESH_STALE, start, 0, 0);
     return false;
 }
 
@@ -248,381 +635,328 @@ bool isFresh(FileUtil* fileUtil, const char *path, struct fuse_file_info *fi) {
 
 int getattr_on_server(const char *path, struct stat *statbuf) {
     DLOG("download getattr called for '%s'", path);
-    
-    int ARG_COUNT = 3;
-    void **args = new void*[ARG_COUNT];
-    int arg_types[ARG_COUNT + 1];
-
-    int pathlen = strlen(path) + 1;
-    arg_types[0] = argTypeFrmtr(yes, no, yes, ARG_CHAR, (uint) pathlen); //path
-    args[0] = (void *)path;
-
-    arg_types[1] = argTypeFrmtr(no, yes, yes, ARG_CHAR, (uint) sizeof(struct stat)); //statbuf
-    args[1] = (void *)statbuf;
-
-    RAII<int> ret(0);
-    arg_types[2] = argTypeFrmtr(no, yes, no, ARG_INT); //retcode
-    args[2] = (void *)ret.ptr;
-
-    arg_types[3] = 0;
-
-    int rpc_ret = rpcCall((char *)"getattr", arg_types, args);
-
-    int fxn_ret = 0;
-    if (rpc_ret < 0) {
-        DLOG("getattr rpc failed with error '%d'", rpc_ret);
-        fxn_ret = -EINVAL;
-    } else fxn_ret = *ret;
 
+    int fxn_ret = watdfs_rpc::getattr::call(path, statbuf);
     if (fxn_ret < 0) memset(statbuf, 0, sizeof(struct stat));
 
-    delete []args;
-
     return fxn_ret;
 }
 
-int open_on_server(const char *path, struct fuse_file_info *fi) {
-    DLOG("download open called for '%s'", path);
-
-    int ARG_COUNT = 3;
-    void **args = new void*[ARG_COUNT];
-    int arg_types[ARG_COUNT + 1];
-
-    int pathlen = strlen(path) + 1;
-    arg_types[0] = argTypeFrmtr(yes, no, yes, ARG_CHAR, (uint) pathlen); //path
-    args[0] = (void *)path;
+int negotiate_on_server() {
+    int features = 0;
+    int ret = watdfs_rpc::features::call(&features);
+    if (ret < 0) features = 0; //an older server, plain transfers only
 
-    arg_types[1] = argTypeFrmtr(yes, yes, yes, ARG_CHAR, (uint) sizeof(struct fuse_file_info)); //fi
-    args[1] = (void *)(fi);
+    // compression costs cpu that only pays off on slow links, so the client opts in
+    const char *env = getenv("WATDFS_COMPRESS");
+    server_compresses = (features & WATDFS_FEATURE_COMPRESS) && env && strcmp(env, "0") != 0;
+    DLOG("server features: %x, compression %s", features, server_compresses ? "on" : "off");
+    server_inlines = (features & WATDFS_FEATURE_INLINE_OPEN);
 
-    RAII<int> ret(0);
-    arg_types[2] = argTypeFrmtr(no, yes, no, ARG_INT); //retcode
-    args[2] = (void *)ret.ptr;
+    return 0;
+}
 
-    arg_types[3] = 0;
+int open_on_server(const char *path, struct fuse_file_info *fi) {
+    DLOG("download open called for '%s'", path);
+    return watdfs_rpc::open::call(path, fi);
+}
 
-    int rpc_ret = rpcCall((char *)"open", arg_types, args);
+int open_inline_on_server(const char *path, struct fuse_file_info *fi, struct stat *statbuf,
+                          char *buf, int *inlined) {
+    DLOG("open inline called for '%s'", path);
+    if (!server_inlines) return -ENOTSUP;
 
-    int fxn_ret = 0;
-    if (rpc_ret < 0) { DLOG("open rpc failed with error '%d'", rpc_ret); fxn_ret = -EINVAL; }
-    else fxn_ret = *ret;
+    // the buffer goes over the wire whole, so it is left out for a file last seen too large
+    IndexEntry cached;
+    size_t capacity = MAX_ARRAY_LEN;
+    if (cacheIndexGet(path, &cached) && cached.size > MAX_ARRAY_LEN) capacity = 0;
 
-    delete []args;
+    *inlined = 0;
+    int fxn_ret = watdfs_rpc::openi::call(path, fi, statbuf, capacity, rpc_stub::bytes{buf, capacity}, inlined);
+    if (fxn_ret < 0) memset(statbuf, 0, sizeof(struct stat));
 
     return fxn_ret;
 }
 
-int read_on_server(const char *path, char *buf, size_t size, struct fuse_file_info *fi) {
-    DLOG("download read called for '%s'", path);
-
-    int ARG_COUNT = 6;
-    void **args = new void*[ARG_COUNT];
-    int arg_types[ARG_COUNT + 1];
-
-    int pathlen = strlen(path) + 1;
-    arg_types[0] = argTypeFrmtr(yes, no, yes, ARG_CHAR, (uint) pathlen); //path
-    args[0] = (void *)path;
-
-    arg_types[1] = argTypeFrmtr(no, yes, yes, ARG_CHAR, MAX_ARRAY_LEN); //buf
-    args[1] = (void *)buf;
-
-    RAII<size_t> m_size((size_t)MAX_ARRAY_LEN);
-    arg_types[2] = argTypeFrmtr(yes, no, no, ARG_LONG); //size
-    args[2] = (void *)m_size.ptr;
-
-    RAII<off_t> offset((off_t)0);
-    arg_types[3] = argTypeFrmtr(yes, no, no, ARG_LONG); //offset
-    args[3] = (void *)offset.ptr;
-
-    arg_types[4] = argTypeFrmtr(yes, no, yes, ARG_CHAR, (uint) sizeof(struct fuse_file_info)); //fi
-    args[4] = (void *)(fi);
-
-    RAII<int> ret(0);
-    arg_types[5] = argTypeFrmtr(no, yes, no, ARG_INT); //retcode
-    args[5] = (void *)ret.ptr;
-    
-    arg_types[6] = 0; // the null terminator
-
-    // Remember that size may be greater then the maximum array size of the RPC library
+// Moves `size` bytes between `buf` and the file in rpcs of up to BULK_MAX_LEN bytes. Every call
+// scatters the payload over BULK_SEGMENTS array arguments that point straight into `buf`.
+template <class Rpc>
+long bulk_on_server(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
     long fxn_ret = 0;
-    try {
-
-        while (size > MAX_ARRAY_LEN) {
-            int rpc_ret = rpcCall((char *)"read", arg_types, args);
-            if (rpc_ret < 0) { DLOG("read rpc failed with error '%d'", rpc_ret); fxn_ret = -EINVAL; throw 1;}
-            else if (*ret < 0) { fxn_ret = *ret; throw 1; } //trouble in reading at server
-            else fxn_ret += *ret;
+    while (true) {
+        size_t chunk = (size > BULK_MAX_LEN) ? BULK_MAX_LEN : size;
 
-            if (*ret < MAX_ARRAY_LEN) throw 1; //EOF
-
-            size -= MAX_ARRAY_LEN;
-            *offset += MAX_ARRAY_LEN;
-            args[1] = (void *)(buf+MAX_ARRAY_LEN);
-        }
+        int ret = Rpc::call(path, chunk, offset, fi, rpc_stub::bytes{buf, chunk});
+        if (ret < 0) { fxn_ret = ret; break; } //trouble at server
 
-        arg_types[1] = argTypeFrmtr(no, yes, yes, ARG_CHAR, size); //buf
-        *m_size = size;
+        fxn_ret += ret;
+        if ((size_t)ret < chunk) break; //EOF
 
-        int rpc_ret = rpcCall((char *)"read", arg_types, args);
-        if (rpc_ret < 0) { DLOG("read rpc failed with error '%d'", rpc_ret); fxn_ret = -EINVAL; }
-        else if (*ret < 0) fxn_ret = *ret;
-        else fxn_ret += *ret;
+        size -= chunk;
+        if (size == 0) break;
+        offset += chunk;
+        buf += chunk;
     }
-    catch (...) {}
-
-    delete []args;
 
     return fxn_ret;
 }
 
-int truncate_on_server(const char *path) {
-    DLOG("upload truncate called for '%s'", path);
-
-    int ARG_COUNT = 3;
-    void **args = new void*[ARG_COUNT];
-    int arg_types[ARG_COUNT + 1];
-
-    int pathlen = strlen(path) + 1;
-    arg_types[0] = argTypeFrmtr(yes, no, yes, ARG_CHAR, (uint) pathlen); //path
-    args[0] = (void *)path;
-
-    RAII<off_t> newsize((off_t)0);
-    arg_types[1] = argTypeFrmtr(yes, no, no, ARG_LONG); //newsize
-    args[1] = (void *)newsize.ptr;
-
-    RAII<int> ret(0);
-    arg_types[2] = argTypeFrmtr(no, yes, no, ARG_INT); //retcode
-    args[2] = (void *)ret.ptr;
-
-    arg_types[3] = 0;
-
-    int rpc_ret = rpcCall((char *)"truncate", arg_types, args);
-
-    int fxn_ret = 0;
-    if (rpc_ret < 0) { DLOG("truncate rpc failed with error '%d'", rpc_ret); fxn_ret = -EINVAL; }
-    else fxn_ret = *ret;
-
-    delete []args;
-
-    return fxn_ret;
+static bool use_compression() {
+    return server_compresses && remote_transport();
 }
 
-int write_to_server(const char *path, const char *buf, size_t size, struct fuse_file_info *fi) {
-    DLOG("upload write called for '%s'", path);
-
-    int ARG_COUNT = 6;
-    void **args = new void*[ARG_COUNT];
-    int arg_types[ARG_COUNT + 1];
-
-    int pathlen = strlen(path) + 1;
-    arg_types[0] = argTypeFrmtr(yes, no, yes, ARG_CHAR, (uint) pathlen); //path
-    args[0] = (void *)path;
-
-    arg_types[1] = argTypeFrmtr(yes, no, yes, ARG_CHAR, MAX_ARRAY_LEN); //buf
-    args[1] = (void *)buf;
-
-    RAII<size_t> m_size((size_t)MAX_ARRAY_LEN);
-    arg_types[2] = argTypeFrmtr(yes, no, no, ARG_LONG); //size
-    args[2] = (void *)m_size.ptr;
+// Wire bytes per raw byte seen on the last compressed download, used to size the next payload
+// so the fixed size rpc arrays do not carry much slack.
+static std::atomic<double> last_ratio(1.0);
+
+static long readz_on_server(const char *path, char *buf, size_t size, off_t offset,
+                            struct fuse_file_info *fi) {
+    std::vector<char> wire(BULK_MAX_LEN);
+
+    size_t done = 0;
+    while (done < size) {
+        size_t frames = (size - done + ZCHUNK_LEN - 1) / ZCHUNK_LEN;
+        size_t capacity = (size_t)((size - done) * last_ratio * 1.25) + frames * sizeof(ZFrame);
+        if (capacity < zFrameBound(ZCHUNK_LEN)) capacity = zFrameBound(ZCHUNK_LEN);
+        if (capacity > BULK_MAX_LEN) capacity = BULK_MAX_LEN;
+
+        size_t raw_len = 0;
+        int ret = watdfs_rpc::readz::call(path, size - done, offset + done, fi, capacity, &raw_len,
+                                          rpc_stub::bytes{wire.data(), capacity});
+        if (ret < 0) return ret;
+        if (raw_len == 0) break; //EOF
+
+        size_t pos = 0, got = 0;
+        while (pos < (size_t)ret) {
+            size_t consumed = 0;
+            long len = zUnpackFrame(wire.data() + pos, ret - pos, buf + done + got, size - done - got,
+                                    &consumed);
+            if (len < 0) return -EIO;
+            pos += consumed;
+            got += len;
+        }
+        if (got != raw_len) return -EIO;
 
-    RAII<off_t> offset((off_t)0);
-    arg_types[3] = argTypeFrmtr(yes, no, no, ARG_LONG); //offset
-    args[3] = (void *)offset.ptr;
+        last_ratio = (double)ret / raw_len;
+        done += got;
+    }
 
-    arg_types[4] = argTypeFrmtr(yes, no, yes, ARG_CHAR, (uint) sizeof(struct fuse_file_info)); //fi
-    args[4] = (void *)(fi);
+    return done;
+}
 
-    RAII<int> ret(0);
-    arg_types[5] = argTypeFrmtr(no, yes, no, ARG_INT); //retcode
-    args[5] = (void *)ret.ptr;
-    
-    arg_types[6] = 0; // the null terminator
+static long writez_on_server(const char *path, const char *buf, size_t size, off_t offset,
+                             struct fuse_file_info *fi) {
+    std::vector<char> wire(BULK_MAX_LEN);
+
+    size_t done = 0;
+    while (done < size) {
+        // pack chunks while the next one is sure to fit
+        size_t wire_len = 0, raw_len = 0;
+        while (done + raw_len < size && BULK_MAX_LEN - wire_len >= zFrameBound(ZCHUNK_LEN)) {
+            size_t len = (size - done - raw_len < ZCHUNK_LEN) ? size - done - raw_len : ZCHUNK_LEN;
+            long used = zPackFrame(buf + done + raw_len, len, wire.data() + wire_len, BULK_MAX_LEN - wire_len);
+            if (used < 0) return -EIO;
+            wire_len += used;
+            raw_len += len;
+        }
 
-    // Remember that size may be greater then the maximum array size of the RPC library
-    long fxn_ret = 0;
-    try {
+        int ret = watdfs_rpc::writez::call(path, wire_len, offset + done, fi,
+                                           rpc_stub::bytes{wire.data(), wire_len});
+        if (ret < 0) return ret;
+        if ((size_t)ret != raw_len) return -EIO;
+        done += raw_len;
+    }
 
-        while (size > MAX_ARRAY_LEN) {
-            int rpc_ret = rpcCall((char *)"write", arg_types, args);
-            if (rpc_ret < 0) { DLOG("write rpc failed with error '%d'", rpc_ret); fxn_ret = -EINVAL; throw 1;}
-            else if (*ret < 0) { fxn_ret = *ret; throw 1; } //trouble in writing at server
-            else fxn_ret += *ret;
+    return done;
+}
 
-            if (*ret < MAX_ARRAY_LEN) throw 1; //EOF
+// Transfers of at least this many bytes go over the bulk channel when talking to the server
+// through librpc. WATDFS_BULK_CHANNEL_MIN overrides it, 0 disables the channel.
+#define BULK_CHANNEL_MIN (1 << 20)
 
-            size -= MAX_ARRAY_LEN;
-            *offset += MAX_ARRAY_LEN;
-            args[1] = (void *)(buf+MAX_ARRAY_LEN);
-        }
+static bool use_bulk_channel(size_t size) {
+    static long min = getenv("WATDFS_BULK_CHANNEL_MIN") ? atol(getenv("WATDFS_BULK_CHANNEL_MIN"))
+                                                        : BULK_CHANNEL_MIN;
+    return min > 0 && size >= (size_t)min && rpc_stub::transport() == rpcCall;
+}
 
-        arg_types[1] = argTypeFrmtr(yes, no, yes, ARG_CHAR, size); //buf
-        *m_size = size;
+// Returns -ENOTSUP when the server cannot set up the transfer, so the caller can fall back.
+static long bulk_channel_on_server(const char *path, BulkDirection direction, char *buf, size_t size,
+                                   off_t offset, struct fuse_file_info *fi) {
+    uint64_t token = 0;
+    int port = 0;
+    int ret = watdfs_rpc::bulk::call(path, fi, (int)direction, offset, size, &token, &port);
+    if (ret < 0) {
+        DLOG("bulk rpc failed with error '%d'", ret);
+        return -ENOTSUP;
+    }
+    return bulkClientTransfer(token, port, direction, buf, size);
+}
 
-        int rpc_ret = rpcCall((char *)"write", arg_types, args);
-        if (rpc_ret < 0) { DLOG("write rpc failed with error '%d'", rpc_ret); fxn_ret = -EINVAL; }
-        else if (*ret < 0) fxn_ret = *ret;
-        else fxn_ret += *ret;
+int read_on_server(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+    DLOG("download read called for '%s'", path);
+    if (use_compression()) return readz_on_server(path, buf, size, offset, fi);
+    if (use_bulk_channel(size)) {
+        long ret = bulk_channel_on_server(path, BULK_READ, buf, size, offset, fi);
+        if (ret != -ENOTSUP) return ret;
     }
-    catch (...) {}
+    return bulk_on_server<watdfs_rpc::readv>(path, buf, size, offset, fi);
+}
 
-    delete []args;
+int truncate_on_server(const char *path, off_t newsize) {
+    DLOG("upload truncate called for '%s'", path);
+    return watdfs_rpc::truncate::call(path, newsize);
+}
 
-    return fxn_ret;
+int write_to_server(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+    DLOG("upload write called for '%s'", path);
+    if (use_compression()) return writez_on_server(path, buf, size, offset, fi);
+    if (use_bulk_channel(size)) {
+        long ret = bulk_channel_on_server(path, BULK_WRITE, (char *)buf, size, offset, fi);
+        if (ret != -ENOTSUP) return ret;
+    }
+    return bulk_on_server<watdfs_rpc::writev>(path, (char *)buf, size, offset, fi);
 }
 
 int close_on_server(const char *path, struct fuse_file_info *fi) {
     DLOG("upload release called for '%s'", path);
-
-    int ARG_COUNT = 3;
-    void **args = new void*[ARG_COUNT];
-    int arg_types[ARG_COUNT + 1];
-
-    int pathlen = strlen(path) + 1;
-    arg_types[0] = argTypeFrmtr(yes, no, yes, ARG_CHAR, (uint) pathlen); //path
-    args[0] = (void *)path;
-
-    arg_types[1] = argTypeFrmtr(yes, no, yes, ARG_CHAR, (uint) sizeof(struct fuse_file_info)); //fi
-    args[1] = (void *)(fi);
-
-    RAII<int> ret(0);
-    arg_types[2] = argTypeFrmtr(no, yes, no, ARG_INT); //retcode
-    args[2] = (void *)ret.ptr;
-
-    arg_types[3] = 0;
-
-    int rpc_ret = rpcCall((char *)"release", arg_types, args);
-
-    int fxn_ret = 0;
-    if (rpc_ret < 0) { DLOG("release rpc failed with error '%d'", rpc_ret); fxn_ret = -EINVAL; }
-    else fxn_ret = *ret;
-
-    delete []args;
-
-    return fxn_ret;
+    return watdfs_rpc::release::call(path, fi);
 }
 
 int fsync_on_server(const char *path, struct fuse_file_info *fi) {
     DLOG("fsync called for '%s'", path);
+    return watdfs_rpc::fsync::call(path, fi);
+}
 
-    int ARG_COUNT = 3;
-    void **args = new void*[ARG_COUNT];
-    int arg_types[ARG_COUNT + 1];
-
-    int pathlen = strlen(path) + 1;
-    arg_types[0] = argTypeFrmtr(yes, no, yes, ARG_CHAR, (uint) pathlen); //path
-    args[0] = (void *)path;
-
-    arg_types[1] = argTypeFrmtr(yes, no, yes, ARG_CHAR, (uint) sizeof(struct fuse_file_info)); //fi
-    args[1] = (void *)(fi);
-
-    RAII<int> ret(0);
-    arg_types[2] = argTypeFrmtr(no, yes, no, ARG_INT); //retcode
-    args[2] = (void *)ret.ptr;
-
-    arg_types[3] = 0;
+int utimens_on_server(const char *path, const struct timespec ts[2]) {
+    DLOG("upload utimens called for '%s'", path);
+    return watdfs_rpc::utimens::call(path, ts);
+}
 
-    int rpc_ret = rpcCall((char *)"fsync", arg_types, args);
+///////////////////////////////////////////////////////////////////////////////////////////////////////
 
-    int fxn_ret = 0;
-    if (rpc_ret < 0) { DLOG("fsync rpc failed with error '%d'", rpc_ret); fxn_ret = -EINVAL; }
-    else fxn_ret = *ret;
+static BatchOp batchOp(BatchOpCode code, const char *path) {
+    BatchOp op;
+    memset(&op, 0, sizeof(op));
+    op.code = code;
+    op.path = path;
+    return op;
+}
 
-    delete []args;
+BatchOp batchGetattr(const char *path, struct stat *statbuf) {
+    BatchOp op = batchOp(BATCH_GETATTR, path);
+    op.statbuf = statbuf;
+    return op;
+}
 
-    return fxn_ret;
+BatchOp batchUtimens(const char *path, const struct timespec ts[2]) {
+    BatchOp op = batchOp(BATCH_UTIMENS, path);
+    op.args.ts[0] = ts[0];
+    op.args.ts[1] = ts[1];
+    return op;
 }
 
-int utimens_on_server(const char *path, const struct timespec ts[2]) {
-    DLOG("upload utimens called for '%s'", path);
+BatchOp batchTruncate(const char *path, off_t newsize) {
+    BatchOp op = batchOp(BATCH_TRUNCATE, path);
+    op.args.newsize = newsize;
+    return op;
+}
 
-    int ARG_COUNT = 3;
-    void **args = new void*[ARG_COUNT];
-    int arg_types[ARG_COUNT + 1];
+BatchOp batchFsync(const char *path, struct fuse_file_info *fi) {
+    BatchOp op = batchOp(BATCH_FSYNC, path);
+    op.args.fi = *fi;
+    return op;
+}
 
-    int pathlen = strlen(path) + 1;
-    arg_types[0] = argTypeFrmtr(yes, no, yes, ARG_CHAR, (uint) pathlen); //path
-    args[0] = (void *)path;
+BatchOp batchLock(const char *path, rw_lock_mode_t mode) {
+    BatchOp op = batchOp(BATCH_LOCK, path);
+    op.args.mode = mode;
+    return op;
+}
 
-    arg_types[1] = argTypeFrmtr(yes, no, yes, ARG_CHAR, (uint) (sizeof(struct timespec)*2)); //ts
-    args[1] = (void *)(ts);
+BatchOp batchUnlock(const char *path, rw_lock_mode_t mode) {
+    BatchOp op = batchOp(BATCH_UNLOCK, path);
+    op.args.mode = mode;
+    return op;
+}
 
-    RAII<int> ret(0);
-    arg_types[2] = argTypeFrmtr(no, yes, no, ARG_INT); //retcode
-    args[2] = (void *)ret.ptr;
+int batch_on_server(BatchOp *ops, int count, bool stop_on_error) {
+    DLOG("batch called for %d operations", count);
 
-    arg_types[3] = 0;
+    std::vector<char> request(MAX_ARRAY_LEN), reply(MAX_ARRAY_LEN);
+    int flags = stop_on_error ? BATCH_STOP_ON_ERROR : 0;
 
-    int rpc_ret = rpcCall((char *)"utimens", arg_types, args);
+    // with the namespace split over servers a batch only holds paths of one server, so
+    // independent operations are sent grouped by server
+    std::vector<int> order(count);
+    for (int i = 0; i < count; ++i) order[i] = i;
+    if (shardCount() > 1 && !stop_on_error) {
+        std::vector<int> shards(count);
+        for (int i = 0; i < count; ++i) shards[i] = shardOf(ops[i].path);
+        std::stable_sort(order.begin(), order.end(), [&shards](int a, int b) { return shards[a] < shards[b]; });
+    }
 
-    int fxn_ret = 0;
-    if (rpc_ret < 0) { DLOG("utimens rpc failed with error '%d'", rpc_ret); fxn_ret = -EINVAL; }
-    else fxn_ret = *ret;
+    int done = 0;
+    while (done < count) {
+        // pack as many operations as the request and reply arrays can hold
+        size_t request_len = 0, reply_len = 0;
+        int n = 0;
+        for (; done + n < count && n < BATCH_MAX_COUNT; ++n) {
+            BatchOp &op = ops[order[done + n]];
+            if (n > 0 && shardCount() > 1 && shardOf(op.path) != shardOf(ops[order[done]].path)) break;
+            size_t path_len = strlen(op.path) + 1;
+            size_t entry_len = sizeof(BatchRequest) + batchPad(path_len);
+            if (request_len + entry_len > MAX_ARRAY_LEN) break;
+            if (reply_len + batchReplyLen(op.code) > MAX_ARRAY_LEN) break;
+
+            BatchRequest *req = (BatchRequest *)(request.data() + request_len);
+            *req = op.args;
+            req->code = op.code;
+            req->path_len = path_len;
+            memset(request.data() + request_len + sizeof(BatchRequest), 0, batchPad(path_len));
+            memcpy(request.data() + request_len + sizeof(BatchRequest), op.path, path_len);
+
+            request_len += entry_len;
+            reply_len += batchReplyLen(op.code);
+        }
+        if (n == 0) return -ENAMETOOLONG;
+
+        int ret = watdfs_rpc::batch::call(flags, n, request_len, rpc_stub::bytes{request.data(), request_len},
+                                          reply_len, rpc_stub::bytes{reply.data(), reply_len});
+        if (ret < 0) return ret;
+
+        bool failed = false;
+        size_t reply_off = 0;
+        for (int i = done; i < done + n; ++i) {
+            BatchOp &op = ops[order[i]];
+            BatchReply *entry = (BatchReply *)(reply.data() + reply_off);
+            op.ret = entry->ret;
+            if (op.code == BATCH_GETATTR) {
+                if (entry->ret < 0) memset(op.statbuf, 0, sizeof(struct stat));
+                else memcpy(op.statbuf, entry + 1, sizeof(struct stat));
+            }
+            if (entry->ret < 0) failed = true;
+            reply_off += batchReplyLen(op.code);
+        }
+        done += n;
 
-    delete []args;
+        if (failed && stop_on_error) {
+            for (int i = done; i < count; ++i) ops[order[i]].ret = -ECANCELED;
+            break;
+        }
+    }
 
-    return fxn_ret;
+    return 0;
 }
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////////
 
 int lock_on_server(const char *path, rw_lock_mode_t mode) {
     DLOG("lock called for '%s'", path);
-
-    int ARG_COUNT = 3;
-    void **args = new void*[ARG_COUNT];
-    int arg_types[ARG_COUNT + 1];
-
-    int pathlen = strlen(path) + 1;
-    arg_types[0] = argTypeFrmtr(yes, no, yes, ARG_CHAR, (uint) pathlen); //path
-    args[0] = (void *)path;
-
-    arg_types[1] = argTypeFrmtr(yes, no, no, ARG_INT); //mode
-    args[1] = (void *)(&mode);
-
-    RAII<int> ret(0);
-    arg_types[2] = argTypeFrmtr(no, yes, no, ARG_INT); //retcode
-    args[2] = (void *)ret.ptr;
-
-    arg_types[3] = 0;
-
-    int rpc_ret = rpcCall((char *)"lock", arg_types, args);
-
-    int fxn_ret = 0;
-    if (rpc_ret < 0) { DLOG("lock rpc failed with error '%d'", rpc_ret); fxn_ret = -EINVAL; }
-    else fxn_ret = *ret;
-
-    delete []args;
-
-    return fxn_ret;
+    return watdfs_rpc::lock::call(path, mode);
 }
 
 int unlock_on_server(const char *path, rw_lock_mode_t mode) {
     DLOG("unlock called for '%s'", path);
-
-    int ARG_COUNT = 3;
-    void **args = new void*[ARG_COUNT];
-    int arg_types[ARG_COUNT + 1];
-
-    int pathlen = strlen(path) + 1;
-    arg_types[0] = argTypeFrmtr(yes, no, yes, ARG_CHAR, (uint) pathlen); //path
-    args[0] = (void *)path;
-
-    arg_types[1] = argTypeFrmtr(yes, no, no, ARG_INT); //mode
-    args[1] = (void *)(&mode);
-
-    RAII<int> ret(0);
-    arg_types[2] = argTypeFrmtr(no, yes, no, ARG_INT); //retcode
-    args[2] = (void *)ret.ptr;
-
-    arg_types[3] = 0;
-
-    int rpc_ret = rpcCall((char *)"unlock", arg_types, args);
-
-    int fxn_ret = 0;
-    if (rpc_ret < 0) { DLOG("unlock rpc failed with error '%d'", rpc_ret); fxn_ret = -EINVAL; }
-    else fxn_ret = *ret;
-
-    delete []args;
-
-    return fxn_ret;
+    return watdfs_rpc::unlock::call(path, mode);
 }
@@ -1,17 +1,54 @@
 #ifndef WATDFS_CLIENT_UTILITY_H
 #define WATDFS_CLIENT_UTILITY_H
 #include "utility.h"
+#include "watdfs_rpc.h"
+
+// Asks the server which optional features it supports, once after connecting.
+int negotiate_on_server();
 
 int getattr_on_server(const char *path, struct stat *statbuf);
 
 int open_on_server(const char *path, struct fuse_file_info *fi);
 
+// Opens the file and gets its attributes in one round trip; a small file comes back in `buf`
+// (MAX_ARRAY_LEN bytes) with `inlined` set. -ENOTSUP when the server cannot do it.
+int open_inline_on_server(const char *path, struct fuse_file_info *fi, struct stat *statbuf,
+                          char *buf, int *inlined);
+
 int close_on_server(const char *path, struct fuse_file_info *fi);
 
 int download_file(FileUtil *fileUtil, const char *path, struct fuse_file_info *fi);
 
+// Fills the cache file from the data returned by open_inline_on_server.
+int download_inline(FileUtil *fileUtil, const char *path, const struct stat *statbuf, const char *data);
+
 int upload_file(FileUtil *fileUtil, const char *path, struct fuse_file_info *fi);
 
 bool isFresh(FileUtil *fileUtil, const char *path, struct fuse_file_info *fi);
 
+// One sub-operation of a batch rpc, `ret` is filled in by batch_on_server.
+struct BatchOp {
+    BatchOpCode code;
+    const char *path;
+    BatchRequest args;
+    struct stat *statbuf;
+    int ret;
+};
+
+BatchOp batchGetattr(const char *path, struct stat *statbuf);
+BatchOp batchUtimens(const char *path, const struct timespec ts[2]);
+BatchOp batchTruncate(const char *path, off_t newsize);
+BatchOp batchFsync(const char *path, struct fuse_file_info *fi);
+BatchOp batchLock(const char *path, rw_lock_mode_t mode);
+BatchOp batchUnlock(const char *path, rw_lock_mode_t mode);
+
+// Runs `count` operations in as few round trips as fit in the rpc arrays. With stop_on_error
+// the operations after the first failure are not run and report -ECANCELED.
+int batch_on_server(BatchOp *ops, int count, bool stop_on_error);
+
+// Runs a batchTruncate or batchUtimens on a file this client does not have open straight on the
+// server, under the write lock and without a download/upload; a current cached copy is updated
+// in place and any other is dropped.
+int change_closed_file(FileUtil *fileUtil, const char *path, BatchOp change);
+
 #endif
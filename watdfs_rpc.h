@@ -0,0 +1,108 @@
+#ifndef WATDFS_RPC_H
+#define WATDFS_RPC_H
+
+// The rpcs shared by the watdfs client and server. The trailing int retcode is implicit.
+
+#include <fuse.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "rpc_stub.h"
+#include "rw_lock.h"
+
+// Many sub-operations in one batch rpc. The request is `count` BatchRequest entries, each
+// followed by its path ('\0' included) padded to 8 bytes. The reply holds a BatchReply per
+// entry, followed by a struct stat for BATCH_GETATTR. Entries run in order; with
+// BATCH_STOP_ON_ERROR the ones after the first failure are not run and report -ECANCELED. A batch
+// holds at most BATCH_MAX_COUNT entries.
+enum BatchOpCode { BATCH_GETATTR = 1, BATCH_UTIMENS, BATCH_TRUNCATE, BATCH_FSYNC, BATCH_LOCK, BATCH_UNLOCK };
+
+#define BATCH_STOP_ON_ERROR 1
+#define BATCH_MAX_COUNT 1024
+
+struct BatchRequest {
+    int32_t code;
+    uint32_t path_len;
+    union {
+        struct timespec ts[2];
+        off_t newsize;
+        rw_lock_mode_t mode;
+        struct fuse_file_info fi;
+    };
+};
+
+struct BatchReply {
+    int32_t ret;
+    int32_t pad;
+};
+
+inline size_t batchPad(size_t len) { return (len + 7) & ~(size_t)7; }
+inline size_t batchReplyLen(int32_t code) {
+    return sizeof(BatchReply) + (code == BATCH_GETATTR ? sizeof(struct stat) : 0);
+}
+
+namespace watdfs_rpc {
+
+using namespace rpc_stub;
+
+RPC_DEF(getattr, in_str, out_obj<struct stat>);
+RPC_DEF(mknod, in_str, in<mode_t>, in<dev_t>);
+RPC_DEF(open, in_str, inout_obj<struct fuse_file_info>);
+RPC_DEF(release, in_str, in_obj<struct fuse_file_info>);
+RPC_DATA_DEF(read, in_str, out_buf, in<size_t>, in<off_t>, in_obj<struct fuse_file_info>);
+RPC_DATA_DEF(write, in_str, in_buf, in<size_t>, in<off_t>, in_obj<struct fuse_file_info>);
+RPC_DATA_DEF(readv, in_str, in<size_t>, in<off_t>, in_obj<struct fuse_file_info>, out_bulk);
+RPC_DATA_DEF(writev, in_str, in<size_t>, in<off_t>, in_obj<struct fuse_file_info>, in_bulk);
+// Compressed transfers, see compress.h. readz fills the payload with frames for up to `size`
+// raw bytes and `capacity` wire bytes, returns the wire bytes and sets the raw bytes covered.
+// writez takes `wire_len` bytes of frames and returns the raw bytes written.
+RPC_DATA_DEF(readz, in_str, in<size_t>, in<off_t>, in_obj<struct fuse_file_info>, in<size_t>, out<size_t>, out_bulk);
+RPC_DATA_DEF(writez, in_str, in<size_t>, in<off_t>, in_obj<struct fuse_file_info>, in_bulk);
+RPC_DEF(truncate, in_str, in<off_t>);
+RPC_DEF(fsync, in_str, in_obj<struct fuse_file_info>);
+RPC_DEF(utimens, in_str, in_obj<struct timespec, 2>);
+
+RPC_DEF(lock, in_str, in<rw_lock_mode_t>);
+RPC_DEF(unlock, in_str, in<rw_lock_mode_t>);
+
+// ChunkRefs of the file starting with the chunk at `from`, as many as `capacity` bytes hold;
+// returns their count. See chunking.h.
+RPC_DEF(manifest, in_str, in_obj<struct fuse_file_info>, in<off_t>, in<size_t>, out_bulk);
+
+// WATDFS_FEATURE_* bits the server supports, asked once when the client connects.
+RPC_DEF(features, out<int>);
+#define WATDFS_FEATURE_INLINE_OPEN 0x2
+
+// open and getattr in one call. A regular file that fits in `capacity` (and the server's
+// WATDFS_INLINE_MAX) is read under the read lock and returned in the buffer with inlined set.
+// path, fi, statbuf, capacity, data, inlined.
+struct openi : rpc_stub::rpc<openi, in_str, inout_obj<struct fuse_file_info>, out_obj<struct stat>, in<size_t>,
+                             out_buf, out<int>> {
+    static const char *name() { return "openi"; }
+    static uint64_t moved(int ret, void **args) {
+        if (ret < 0 || *(int *)args[slot_offset(5)] == 0) return 0;
+        return ((struct stat *)args[slot_offset(2)])->st_size;
+    }
+};
+
+// path, fi, BulkDirection, offset, size, token, port; see bulk_channel.h.
+RPC_DEF(bulk, in_str, in_obj<struct fuse_file_info>, in<int>, in<off_t>, in<size_t>, out<uint64_t>, out<int>);
+
+// The server's per-rpc metrics as text of up to `capacity` bytes, returns its length or -E2BIG.
+// See stats.h.
+RPC_DATA_DEF(stats, in<size_t>, out_bulk);
+
+// flags, count, request_len, request, reply_len, reply; see BatchRequest.
+RPC_DEF(batch, in<int>, in<int>, in<size_t>, in_buf, in<size_t>, out_buf);
+
+// Replication, see replication.h. replpull takes the epoch, seq, snapshot file and data offset
+// to continue from and up to `capacity` bytes of ReplRecords; returns their length and sets the
+// epoch, seq, file and offset to continue from next. replstate sets the epoch and version.
+RPC_DATA_DEF(replpull, in<uint64_t>, in<uint64_t>, in<uint64_t>, in<uint64_t>, in<size_t>, out<uint64_t>,
+        out<uint64_t>, out<uint64_t>, out<uint64_t>, out_bulk);
+RPC_DEF(replstate, out<uint64_t>, out<uint64_t>);
+
+} // namespace watdfs_rpc
+
+#endif
@@ -1,16 +1,35 @@
 #include "watdfs_server.h"
 #include "rpc.h"
 #include "utility.h"
+#include "watdfs_rpc.h"
 #include "lock_server.h"
+#include "bulk_channel.h"
+#include "compress.h"
+#include "chunking.h"
+#include "stats.h"
+#include "replication.h"
+#include "trace.h"
 #include "debug.h"
 
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
 #include <fuse.h>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <cstdlib>
 #include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
 // Important: the server needs to handle multiple concurrent client requests.
 // You have to be carefuly in handling global variables, esp. for updating them.
@@ -26,324 +45,580 @@ void set_server_persist_dir(char *dir) { fileUtil.setDir(dir); }
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////
 
-int watdfs_getattr(int *argTypes, void **args) {
-    const char* short_path = (const char*)args[0]; //the path relative to the mountpoint
+int watdfs_getattr(const char *short_path, struct stat *statbuf) { //the path relative to the mountpoint
     const char* full_path = fileUtil.getAbsolutePath(short_path);
 
-    struct stat *statbuf = (struct stat *)args[1]; //stat structure
-
-    int *ret = (int *)args[2]; //return code, which should be set be 0 or -errno.
-    *ret = 0; // initially set the return code to be 0.
+    int ret = 0; //return code, which should be set be 0 or -errno.
 
     int sys_ret = 0; // sys_ret the return code from the stat system call
     sys_ret = stat(full_path, statbuf);
-    if (sys_ret < 0) *ret = -errno;
+    if (sys_ret < 0) ret = -errno;
 
-    DLOG("Returning code: %d", *ret);
-    return 0;
-}
-
-void watdfs_getattr_register() {
-    int argTypes[4];
-    argTypes[0] = argTypeFrmtr(yes, no, yes, ARG_CHAR, 1); // path
-    argTypes[1] = argTypeFrmtr(no, yes, yes, ARG_CHAR, 1); // statbuf
-    argTypes[2] = argTypeFrmtr(no, yes, no, ARG_INT); // retcode
-    argTypes[3] = 0; // the null terminator
-
-    int ret = 0;
-    ret = rpcRegister((char *)"getattr", argTypes, watdfs_getattr);
-    if (ret < 0) throw RegisterError(ret);
+    return ret;
 }
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////
 
-int watdfs_mknod(int *argTypes, void **args) {
-    const char* short_path = (const char*)args[0];
+int watdfs_mknod(const char *short_path, mode_t mode, dev_t dev) {
     const char* full_path = fileUtil.getAbsolutePath(short_path);
 
-    mode_t* mode = (mode_t *)args[1];
-
-    dev_t* dev = (dev_t *)args[2];
-
-    int *ret = (int *)args[3];
-    *ret = 0;
+    int ret = 0;
+    if (replicationReplica()) return -EROFS;
 
     int sys_ret = 0;
-    sys_ret = mknod(full_path, *mode, *dev);
-    if (sys_ret < 0) *ret = -errno;
-
-    DLOG("Returning code: %d", *ret);
-    return 0;
-}
-
-void watdfs_mknod_register() {
-    int argTypes[5];
-    argTypes[0] = argTypeFrmtr(yes, no, yes, ARG_CHAR, 1); //path
-    argTypes[1] = argTypeFrmtr(yes, no, no, ARG_INT); //mode
-    argTypes[2] = argTypeFrmtr(yes, no, no, ARG_LONG); //dev
-    argTypes[3] = argTypeFrmtr(no, yes, no, ARG_INT); //retcode
-    argTypes[4] = 0; // the null terminator
+    sys_ret = mknod(full_path, mode, dev);
+    if (sys_ret < 0) ret = -errno;
+    else replLogMknod(short_path, mode);
 
-    int ret = 0;
-    ret = rpcRegister((char *)"mknod", argTypes, watdfs_mknod);
-    if (ret < 0) throw RegisterError(ret);
+    return ret;
 }
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////
 
-int watdfs_open(int *argTypes, void **args) {
-    const char* short_path = (const char*)args[0];
+int watdfs_open(const char *short_path, struct fuse_file_info *fi) {
     const char* full_path = fileUtil.getAbsolutePath(short_path);
 
-    struct fuse_file_info *fi = (struct fuse_file_info *)args[1];
-
-    int *ret = (int *)args[2];
-    *ret = 0;
+    int ret = 0;
 
     AccessType accessType = processAccessType(fi->flags);
+    if (accessType == WRITE && replicationReplica()) return -EROFS;
     if (accessType == WRITE && fileUtil.serverFilePresent(short_path)) {
-        *ret = -EACCES;
-        DLOG("File already opended in write mode: %d", *ret);
-        return 0;
+        DLOG("File already opended in write mode: %d", -EACCES);
+        return -EACCES;
     }
 
     int sys_ret = 0;
     sys_ret = open(full_path, fi->flags);
     if (sys_ret < 0) {
-        *ret = -errno;
+        ret = -errno;
     } else {
         fi->fh = sys_ret;
         if (accessType == WRITE) fileUtil.addServerFile(short_path);
+        if (fi->flags & O_TRUNC) replLogTruncate(short_path, 0);
     }
 
-    DLOG("Returning code: %d", *ret);
-    return 0;
-}
-
-void watdfs_open_register() {
-    int argTypes[4];
-    argTypes[0] = argTypeFrmtr(yes, no, yes, ARG_CHAR, 1); //path
-    argTypes[1] = argTypeFrmtr(yes, yes, yes, ARG_CHAR, 1); //fi
-    argTypes[2] = argTypeFrmtr(no, yes, no, ARG_INT); //retcode
-    argTypes[3] = 0; // the null terminator
-
-    int ret = 0;
-    ret = rpcRegister((char *)"open", argTypes, watdfs_open);
-    if (ret < 0) throw RegisterError(ret);
+    return ret;
 }
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////
 
-int watdfs_release(int *argTypes, void **args) {
-    const char* short_path = (const char*)args[0]; //path
-
-    struct fuse_file_info *fi = (struct fuse_file_info *)args[1]; //fi
-
-    int *ret = (int *)args[2];
-    *ret = 0;
+int watdfs_release(const char *short_path, const struct fuse_file_info *fi) {
+    int ret = 0;
 
     int sys_ret = 0;
     sys_ret = close(fi->fh);
     if (sys_ret < 0) {
-        *ret = -errno;
+        ret = -errno;
     } else {
         AccessType accessType = processAccessType(fi->flags);
         if (accessType == WRITE) fileUtil.removeFile(short_path);
     }
 
-    DLOG("Returning code: %d", *ret);
-    return 0;
+    return ret;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+static size_t inline_max() {
+    static size_t max = getenv("WATDFS_INLINE_MAX") ? atol(getenv("WATDFS_INLINE_MAX")) : MAX_ARRAY_LEN;
+    return max < MAX_ARRAY_LEN ? max : MAX_ARRAY_LEN;
 }
 
-void watdfs_release_register() {
-    int argTypes[4];
-    argTypes[0] = argTypeFrmtr(yes, no, yes, ARG_CHAR, 1); //path
-    argTypes[1] = argTypeFrmtr(yes, no, yes, ARG_CHAR, 1); //fi
-    argTypes[2] = argTypeFrmtr(no, yes, no, ARG_INT); //retcode
-    argTypes[3] = 0; // the null terminator
+int watdfs_openi(const char *short_path, struct fuse_file_info *fi, struct stat *statbuf,
+                 size_t capacity, rpc_stub::bytes buf, int *inlined) {
+    *inlined = 0;
+
+    int ret = watdfs_open(short_path, fi);
+    if (ret < 0) return ret;
+
+    // the same read lock a download takes, so the data and attributes belong together
+    ret = lock(short_path, RW_READ_LOCK);
+    if (ret == 0) {
+        if (fstat(fi->fh, statbuf) < 0) ret = -errno;
+        else if (S_ISREG(statbuf->st_mode) &&
+                 (size_t)statbuf->st_size <= std::min({capacity, buf.len, inline_max()})) {
+            TraceSpan span = traceBegin("pread", TRACE_DISK);
+            ssize_t len = pread(fi->fh, buf.data, statbuf->st_size, 0);
+            traceEnd(&span, len < 0 ? -errno : len);
+            if (len < 0) ret = -errno;
+            else *inlined = (len == statbuf->st_size); // a short read leaves it to the download
+        }
+        unlock(short_path, RW_READ_LOCK);
+    }
 
-    int ret = 0;
-    ret = rpcRegister((char *)"release", argTypes, watdfs_release);
-    if (ret < 0) throw RegisterError(ret);
+    if (ret < 0) watdfs_release(short_path, fi);
+    return ret;
 }
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////
 
-int watdfs_read(int *argTypes, void **args) {
-    void *buf = args[1];
+int watdfs_read(const char *short_path, rpc_stub::bytes buf, size_t size, off_t offset,
+                const struct fuse_file_info *fi) {
+    if (size > buf.len) return -EINVAL;
 
-    size_t *size = (size_t *)args[2];
+    int sys_ret = 0;
+    TraceSpan span = traceBegin("pread", TRACE_DISK);
+    sys_ret = pread(fi->fh, buf.data, size, offset);
+    traceEnd(&span, sys_ret < 0 ? -errno : sys_ret);
+    if (sys_ret < 0) return -errno;
 
-    off_t *offset = (off_t *)args[3];
+    return sys_ret; //the bytes read
+}
 
-    struct fuse_file_info *fi = (struct fuse_file_info *)args[4];
+///////////////////////////////////////////////////////////////////////////////////////////////////
 
-    int *ret = (int *)args[5];
+int watdfs_write(const char *short_path, rpc_stub::bytes buf, size_t size, off_t offset,
+                 const struct fuse_file_info *fi) {
+    if (size > buf.len) return -EINVAL;
 
     int sys_ret = 0;
-    sys_ret = pread(fi->fh, buf, *size, *offset);
-    if (sys_ret < 0) *ret = -errno; else *ret = sys_ret; //update the bytes read
+    TraceSpan span = traceBegin("pwrite", TRACE_DISK);
+    sys_ret = pwrite(fi->fh, buf.data, size, offset);
+    traceEnd(&span, sys_ret < 0 ? -errno : sys_ret);
+    if (sys_ret < 0) return -errno;
+    replLogWrite(short_path, offset, sys_ret);
 
-    DLOG("Returning code: %d", *ret);
-    return 0;
+    return sys_ret; //the bytes written
 }
 
-void watdfs_read_register() {
-    int argTypes[7];
-    argTypes[0] = argTypeFrmtr(yes, no, yes, ARG_CHAR, 1); //path
-    argTypes[1] = argTypeFrmtr(no, yes, yes, ARG_CHAR, 1); //buf
-    argTypes[2] = argTypeFrmtr(yes, no, no, ARG_LONG); //size
-    argTypes[3] = argTypeFrmtr(yes, no, no, ARG_LONG); //offset
-    argTypes[4] = argTypeFrmtr(yes, no, yes, ARG_CHAR, 1); //fi
-    argTypes[5] = argTypeFrmtr(no, yes, no, ARG_INT); //retcode
-    argTypes[6] = 0; // the null terminator
+///////////////////////////////////////////////////////////////////////////////////////////////////
 
-    int ret = 0;
-    ret = rpcRegister((char *)"read", argTypes, watdfs_read);
-    if (ret < 0) throw RegisterError(ret);
+// Vectored transfers: the payload is spread over BULK_SEGMENTS array arguments, the i-th one
+// holding bulkSegmentLen(size, i) bytes, and moved with preadv/pwritev. `done` bytes at the
+// front of the payload are skipped so short transfers can be resumed.
+int bulk_iovec(void **segments, size_t size, size_t done, struct iovec *iov) {
+    int iovcnt = 0;
+    for (int i = 0; i < BULK_SEGMENTS; ++i) {
+        size_t len = bulkSegmentLen(size, i);
+        if (len == 0) break;
+        if (done >= len) { done -= len; continue; }
+        iov[iovcnt].iov_base = (char *)segments[i] + done;
+        iov[iovcnt].iov_len = len - done;
+        done = 0;
+        ++iovcnt;
+    }
+    return iovcnt;
 }
 
-///////////////////////////////////////////////////////////////////////////////////////////////////
+int watdfs_readv(const char *short_path, size_t size, off_t offset,
+                 const struct fuse_file_info *fi, rpc_stub::segments payload) {
+    if (size > BULK_MAX_LEN || size > payload.len) return -EINVAL;
+
+    struct iovec iov[BULK_SEGMENTS];
+    size_t total = 0;
+    while (total < size) {
+        int iovcnt = bulk_iovec(payload.data, size, total, iov);
+        TraceSpan span = traceBegin("preadv", TRACE_DISK);
+        ssize_t sys_ret = preadv(fi->fh, iov, iovcnt, offset + total);
+        traceEnd(&span, sys_ret < 0 ? -errno : sys_ret);
+        if (sys_ret < 0) return -errno;
+        if (sys_ret == 0) break; //EOF
+        total += sys_ret;
+    }
 
-int watdfs_write(int *argTypes, void **args) {
-    void *buf = args[1];
+    return (int)total; //the bytes read
+}
 
-    size_t *size = (size_t *)args[2];
+///////////////////////////////////////////////////////////////////////////////////////////////////
 
-    off_t *offset = (off_t *)args[3];
+int watdfs_writev(const char *short_path, size_t size, off_t offset,
+                  const struct fuse_file_info *fi, rpc_stub::segments payload) {
+    if (size > BULK_MAX_LEN || size > payload.len) return -EINVAL;
+
+    struct iovec iov[BULK_SEGMENTS];
+    size_t total = 0;
+    while (total < size) {
+        int iovcnt = bulk_iovec(payload.data, size, total, iov);
+        TraceSpan span = traceBegin("pwritev", TRACE_DISK);
+        ssize_t sys_ret = pwritev(fi->fh, iov, iovcnt, offset + total);
+        traceEnd(&span, sys_ret < 0 ? -errno : sys_ret);
+        if (sys_ret < 0) return -errno;
+        total += sys_ret;
+    }
+    replLogWrite(short_path, offset, total);
 
-    struct fuse_file_info *fi = (struct fuse_file_info *)args[4];
+    return (int)total; //the bytes written
+}
 
-    int *ret = (int *)args[5];
+///////////////////////////////////////////////////////////////////////////////////////////////////
 
-    int sys_ret = 0;
-    sys_ret = pwrite(fi->fh, buf, *size, *offset);
-    if (sys_ret < 0) *ret = -errno; else *ret = sys_ret; //update the bytes read
+int watdfs_readz(const char *short_path, size_t size, off_t offset, const struct fuse_file_info *fi,
+                 size_t capacity, size_t *raw_len, rpc_stub::segments payload) {
+    if (capacity > BULK_MAX_LEN || capacity > payload.len) return -EINVAL;
+
+    // one chunk at a time, so memory stays bounded whatever the transfer size
+    std::vector<char> raw(ZCHUNK_LEN), frame(zFrameBound(ZCHUNK_LEN));
+    size_t wire = 0;
+    *raw_len = 0;
+    while (*raw_len < size) {
+        size_t len = (size - *raw_len < ZCHUNK_LEN) ? size - *raw_len : ZCHUNK_LEN;
+        TraceSpan span = traceBegin("pread", TRACE_DISK);
+        ssize_t sys_ret = pread(fi->fh, raw.data(), len, offset + *raw_len);
+        traceEnd(&span, sys_ret < 0 ? -errno : sys_ret);
+        if (sys_ret < 0) return -errno;
+        if (sys_ret == 0) break; //EOF
+
+        size_t room = (capacity - wire < frame.size()) ? capacity - wire : frame.size();
+        long used = zPackFrame(raw.data(), sys_ret, frame.data(), room);
+        if (used < 0) break; //payload is full
+
+        bulkCopyIn(payload.data, wire, frame.data(), used);
+        wire += used;
+        *raw_len += sys_ret;
+    }
 
-    DLOG("Returning code: %d", *ret);
-    return 0;
+    return (int)wire;
 }
 
-void watdfs_write_register() {
-    int argTypes[7];
-    argTypes[0] = argTypeFrmtr(yes, no, yes, ARG_CHAR, 1); //path
-    argTypes[1] = argTypeFrmtr(yes, no, yes, ARG_CHAR, 1); //buf
-    argTypes[2] = argTypeFrmtr(yes, no, no, ARG_LONG); //size
-    argTypes[3] = argTypeFrmtr(yes, no, no, ARG_LONG); //offset
-    argTypes[4] = argTypeFrmtr(yes, no, yes, ARG_CHAR, 1); //fi
-    argTypes[5] = argTypeFrmtr(no, yes, no, ARG_INT); //retcode
-    argTypes[6] = 0; // the null terminator
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+int watdfs_writez(const char *short_path, size_t wire_len, off_t offset,
+                  const struct fuse_file_info *fi, rpc_stub::segments payload) {
+    if (wire_len > BULK_MAX_LEN || wire_len > payload.len) return -EINVAL;
+
+    std::vector<char> raw(ZCHUNK_LEN), frame(zFrameBound(ZCHUNK_LEN));
+    size_t wire = 0, total = 0;
+    while (wire < wire_len) {
+        ZFrame header;
+        if (wire_len - wire < sizeof(header)) return -EINVAL;
+        bulkCopyOut((char *)&header, payload.data, wire, sizeof(header));
+
+        size_t frame_len = sizeof(header) + (header.wire_len & ~ZFRAME_STORED);
+        if (frame_len > frame.size() || frame_len > wire_len - wire) return -EINVAL;
+        bulkCopyOut(frame.data(), payload.data, wire, frame_len);
+
+        size_t consumed = 0;
+        long len = zUnpackFrame(frame.data(), frame_len, raw.data(), raw.size(), &consumed);
+        if (len < 0) return -EINVAL;
+
+        TraceSpan span = traceBegin("pwrite", TRACE_DISK);
+        ssize_t sys_ret = pwrite(fi->fh, raw.data(), len, offset + total);
+        traceEnd(&span, sys_ret < 0 ? -errno : sys_ret);
+        if (sys_ret < 0) return -errno;
+        if (sys_ret != len) return -EIO;
+        wire += consumed;
+        total += len;
+    }
+    replLogWrite(short_path, offset, total);
 
-    int ret = 0;
-    ret = rpcRegister((char *)"write", argTypes, watdfs_write);
-    if (ret < 0) throw RegisterError(ret);
+    return (int)total; //the raw bytes written
 }
 
-///////////////////////////////////////////////////////////////////////////////////////////////////
+// Manifests are expensive to compute, so the last MANIFEST_CACHE_LEN are kept until the file
+// changes.
+#define MANIFEST_CACHE_LEN 64
+
+struct Manifest {
+    off_t size;
+    struct timespec mtime;
+    std::vector<ChunkRef> refs;
+};
 
-int watdfs_truncate(int *argTypes, void **args) {
-    const char* short_path = (const char*)args[0];
+class ManifestCache {
+    std::mutex mtx;
+    std::unordered_map<std::string, std::shared_ptr<Manifest>> map;
+
+  public:
+    // returns the manifest of `fd` as of `statbuf`, computing it if needed
+    std::shared_ptr<Manifest> get(const std::string &path, int fd, const struct stat &statbuf) {
+        mtx.lock();
+        auto it = map.find(path);
+        if (it != map.end() && it->second->size == statbuf.st_size &&
+            it->second->mtime.tv_sec == statbuf.st_mtim.tv_sec &&
+            it->second->mtime.tv_nsec == statbuf.st_mtim.tv_nsec) {
+            std::shared_ptr<Manifest> manifest = it->second;
+            mtx.unlock();
+            return manifest;
+        }
+        mtx.unlock();
+
+        std::shared_ptr<Manifest> manifest(new Manifest{statbuf.st_size, statbuf.st_mtim, {}});
+        if (chunkFile(fd, &manifest->refs) < 0) return nullptr;
+
+        mtx.lock();
+        if (map.size() >= MANIFEST_CACHE_LEN && map.find(path) == map.end()) map.erase(map.begin());
+        map[path] = manifest;
+        mtx.unlock();
+        return manifest;
+    }
+} manifests;
+
+int watdfs_manifest(const char *short_path, const struct fuse_file_info *fi, off_t from,
+                    size_t capacity, rpc_stub::segments payload) {
+    if (capacity > BULK_MAX_LEN || capacity > payload.len) return -EINVAL;
     const char* full_path = fileUtil.getAbsolutePath(short_path);
 
-    off_t *newsize = (off_t *)args[1];
+    struct stat statbuf;
+    if (fstat(fi->fh, &statbuf) < 0) return -errno;
 
-    int *ret = (int *)args[2];
-    *ret = 0;
+    std::shared_ptr<Manifest> manifest = manifests.get(full_path, fi->fh, statbuf);
+    if (manifest == nullptr) return -EIO;
 
-    int sys_ret = 0;
-    sys_ret = truncate(full_path, *newsize);
-    if (sys_ret < 0) *ret = -errno;
+    auto it = std::lower_bound(manifest->refs.begin(), manifest->refs.end(), from,
+                               [](const ChunkRef &ref, off_t from) { return (off_t)ref.offset < from; });
+    size_t count = 0, max = capacity / sizeof(ChunkRef);
+    for (; it != manifest->refs.end() && count < max; ++it, ++count) {
+        bulkCopyIn(payload.data, count * sizeof(ChunkRef), (const char *)&*it, sizeof(ChunkRef));
+    }
 
-    DLOG("Returning code: %d", *ret);
+    return (int)count;
+}
+
+int watdfs_features(int *features) {
+    *features = WATDFS_FEATURE_COMPRESS;
+    if (inline_max() > 0) *features |= WATDFS_FEATURE_INLINE_OPEN;
     return 0;
 }
 
-void watdfs_truncate_register() {
-    int argTypes[4];
-    argTypes[0] = argTypeFrmtr(yes, no, yes, ARG_CHAR, 1); //path
-    argTypes[1] = argTypeFrmtr(yes, no, no, ARG_LONG); //newsize
-    argTypes[2] = argTypeFrmtr(no, yes, no, ARG_INT); //retcode
-    argTypes[3] = 0; // the null terminator
+int watdfs_stats(size_t capacity, rpc_stub::segments payload) {
+    if (capacity > BULK_MAX_LEN || capacity > payload.len) return -EINVAL;
+    std::string text = statsText();
+    if (text.size() > capacity) return -E2BIG;
+    bulkCopyIn(payload.data, 0, text.data(), text.size());
+    return (int)text.size();
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
 
-    int ret = 0;
-    ret = rpcRegister((char *)"truncate", argTypes, watdfs_truncate);
-    if (ret < 0) throw RegisterError(ret);
+int watdfs_bulk(const char *short_path, const struct fuse_file_info *fi, int direction,
+                off_t offset, size_t size, uint64_t *token, int *port) {
+    if (bulkServerPort() < 0) return -ENOTSUP;
+    if (direction != BULK_READ && direction != BULK_WRITE) return -EINVAL;
+    // the upload would bypass the replication log, so the client falls back to writev
+    if (direction == BULK_WRITE && replicationPrimary()) return -ENOTSUP;
+
+    *token = bulkServerRegister(fi->fh, (BulkDirection)direction, offset, size);
+    if (*token == 0) return -errno;
+    *port = bulkServerPort();
+
+    return 0;
 }
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////
 
-int watdfs_fsync(int *argTypes, void **args) {
-    struct fuse_file_info *fi = (struct fuse_file_info *)args[1];
+int watdfs_truncate(const char *short_path, off_t newsize) {
+    const char* full_path = fileUtil.getAbsolutePath(short_path);
 
-    int *ret = (int *)args[2];
-    *ret = 0;
+    int ret = 0;
+    if (replicationReplica()) return -EROFS;
 
     int sys_ret = 0;
-    sys_ret = fsync(fi->fh);
-    if (sys_ret < 0) *ret = -errno;
+    sys_ret = truncate(full_path, newsize);
+    if (sys_ret < 0) ret = -errno;
+    else replLogTruncate(short_path, newsize);
 
-    DLOG("Returning code: %d", *ret);
-    return 0;
+    return ret;
 }
 
-void watdfs_fsync_register() {
-    int argTypes[4];
-    argTypes[0] = argTypeFrmtr(yes, no, yes, ARG_CHAR, 1); //path
-    argTypes[1] = argTypeFrmtr(yes, no, yes, ARG_CHAR, 1); //fi
-    argTypes[2] = argTypeFrmtr(no, yes, no, ARG_INT); //retcode
-    argTypes[3] = 0; // the null terminator
+///////////////////////////////////////////////////////////////////////////////////////////////////
 
+int watdfs_fsync(const char *short_path, const struct fuse_file_info *fi) {
     int ret = 0;
-    ret = rpcRegister((char *)"fsync", argTypes, watdfs_fsync);
-    if (ret < 0) throw RegisterError(ret);
+
+    int sys_ret = 0;
+    TraceSpan span = traceBegin("fsync", TRACE_DISK);
+    sys_ret = fsync(fi->fh);
+    if (sys_ret < 0) ret = -errno;
+    traceEnd(&span, ret);
+
+    return ret;
 }
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////
 
-int watdfs_utimens(int *argTypes, void **args) {
-    const char* short_path = (const char*)args[0];
+int watdfs_utimens(const char *short_path, const struct timespec *ts) {
     const char* full_path = fileUtil.getAbsolutePath(short_path);
 
-    struct timespec *ts = (struct timespec *)args[1];
-
-    int *ret = (int *)args[2];
-    *ret = 0;
+    int ret = 0;
+    if (replicationReplica()) return -EROFS;
 
     int sys_ret = 0;
     sys_ret = utimensat(-1, full_path, ts, 0);
-    if (sys_ret < 0) *ret = -errno;
+    if (sys_ret < 0) ret = -errno;
+    else replLogUtimens(short_path, ts);
 
-    DLOG("Returning code: %d", *ret);
-    return 0;
+    return ret;
 }
 
-void watdfs_utimens_register() {
-    int argTypes[4];
-    argTypes[0] = argTypeFrmtr(yes, no, yes, ARG_CHAR, 1); //path
-    argTypes[1] = argTypeFrmtr(yes, no, yes, ARG_CHAR, 1); //ts
-    argTypes[2] = argTypeFrmtr(no, yes, no, ARG_INT); //retcode
-    argTypes[3] = 0; // the null terminator
+///////////////////////////////////////////////////////////////////////////////////////////////////
 
-    int ret = 0;
-    ret = rpcRegister((char *)"utimens", argTypes, watdfs_utimens);
-    if (ret < 0) throw RegisterError(ret);
+// Runs of at least this many getattrs in a batch are spread over BATCH_THREADS threads shared by
+// every batch.
+#define BATCH_PARALLEL_MIN 16
+#define BATCH_THREADS 4
+
+struct BatchEntry {
+    const BatchRequest *req;
+    const char *path;
+    BatchReply *reply;
+};
+
+int run_batch_entry(const BatchEntry &entry);
+
+// A run of entries being worked on by the caller and the pool.
+struct BatchRun {
+    BatchEntry *entries;
+    int count;
+    std::atomic<int> next;
+    int left;    // entries not done yet, under the pool's mutex
+    int workers; // pool threads working on it, under the pool's mutex
+};
+
+class BatchPool {
+    std::mutex mtx;
+    std::condition_variable queued, finished;
+    std::deque<BatchRun*> runs;
+    bool started = false;
+
+    // Runs entries of `run` until none is left to take, returns how many it ran.
+    static int work_on(BatchRun *run) {
+        int done = 0;
+        for (int j = run->next++; j < run->count; j = run->next++, ++done) {
+            run->entries[j].reply->ret = run_batch_entry(run->entries[j]);
+        }
+        return done;
+    }
+
+    void worker() {
+        std::unique_lock<std::mutex> lock(mtx);
+        while (true) {
+            queued.wait(lock, [this]() { return !runs.empty(); });
+            BatchRun *run = runs.front();
+            if (run->next >= run->count) { runs.pop_front(); continue; }
+            ++run->workers;
+            lock.unlock();
+            int done = work_on(run);
+            lock.lock();
+            --run->workers;
+            run->left -= done;
+            if (run->left == 0 && run->workers == 0) finished.notify_all();
+        }
+    }
+
+  public:
+    // Runs every entry, on the calling thread and the pool.
+    void run(BatchEntry *entries, int count) {
+        BatchRun run;
+        run.entries = entries;
+        run.count = count;
+        run.next = 0;
+        run.left = count;
+        run.workers = 0;
+
+        std::unique_lock<std::mutex> lock(mtx);
+        if (!started) {
+            for (int t = 0; t < BATCH_THREADS; ++t) std::thread(&BatchPool::worker, this).detach();
+            started = true;
+        }
+        runs.push_back(&run);
+        queued.notify_all();
+        lock.unlock();
+
+        int done = work_on(&run);
+
+        lock.lock();
+        run.left -= done;
+        // no pool thread may still hold the run once it is gone
+        finished.wait(lock, [&run]() { return run.left == 0 && run.workers == 0; });
+        auto it = std::find(runs.begin(), runs.end(), &run);
+        if (it != runs.end()) runs.erase(it);
+    }
+};
+
+static BatchPool batch_pool;
+
+int run_batch_entry(const BatchEntry &entry) {
+    const BatchRequest *req = entry.req;
+    switch (req->code) {
+        case BATCH_GETATTR: return watdfs_getattr(entry.path, (struct stat *)(entry.reply + 1));
+        case BATCH_UTIMENS: return watdfs_utimens(entry.path, req->ts);
+        case BATCH_TRUNCATE: return watdfs_truncate(entry.path, req->newsize);
+        case BATCH_FSYNC: return watdfs_fsync(entry.path, &req->fi);
+        case BATCH_LOCK: return lock(entry.path, req->mode);
+        case BATCH_UNLOCK: return unlock(entry.path, req->mode);
+        default: return -EINVAL;
+    }
+}
+
+int watdfs_batch(int flags, int count, size_t request_len, rpc_stub::bytes request_buf,
+                 size_t reply_len, rpc_stub::bytes reply_buf) {
+    if (count < 0 || count > BATCH_MAX_COUNT) return -EINVAL;
+    if (request_len > request_buf.len || reply_len > reply_buf.len) return -EINVAL;
+    const char *request = request_buf.data;
+    char *reply = reply_buf.data;
+
+    // validate and index every entry before running any of them
+    std::vector<BatchEntry> entries(count);
+    size_t req_off = 0, reply_off = 0;
+    for (int i = 0; i < count; ++i) {
+        if (request_len - req_off < sizeof(BatchRequest)) return -EINVAL;
+        const BatchRequest *req = (const BatchRequest *)(request + req_off);
+        req_off += sizeof(BatchRequest);
+
+        size_t path_len = batchPad(req->path_len);
+        if (req->path_len == 0 || request_len - req_off < path_len) return -EINVAL;
+        const char *path = request + req_off;
+        if (path[req->path_len - 1] != '\0') return -EINVAL;
+        req_off += path_len;
+
+        if (reply_len - reply_off < batchReplyLen(req->code)) return -EINVAL;
+        entries[i] = BatchEntry{req, path, (BatchReply *)(reply + reply_off)};
+        reply_off += batchReplyLen(req->code);
+    }
+
+    int i = 0;
+    bool failed = false;
+    while (i < count) {
+        if (failed) { entries[i++].reply->ret = -ECANCELED; continue; }
+
+        int run = 0;
+        while (i + run < count && entries[i + run].req->code == BATCH_GETATTR) ++run;
+
+        if (run >= BATCH_PARALLEL_MIN) {
+            // getattrs do not depend on each other, stat them concurrently
+            batch_pool.run(entries.data() + i, run);
+        } else {
+            run = 1;
+            entries[i].reply->ret = run_batch_entry(entries[i]);
+        }
+
+        for (int j = i; j < i + run; ++j) {
+            if (failed) entries[j].reply->ret = -ECANCELED;
+            else if (entries[j].reply->ret < 0 && (flags & BATCH_STOP_ON_ERROR)) failed = true;
+        }
+        i += run;
+    }
+
+    return 0;
 }
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////
 
+void check_register(int ret) { if (ret < 0) throw RegisterError(ret); }
+
 int rpc_watdfs_server_register() {
     int ret_code = 0;
 
     try {
-        watdfs_getattr_register();
-        watdfs_mknod_register();
-        watdfs_open_register();
-        watdfs_release_register();
-        watdfs_read_register();
-        watdfs_write_register();
-        watdfs_truncate_register();
-        watdfs_fsync_register();
-        watdfs_utimens_register();
+        check_register(watdfs_rpc::getattr::bind<watdfs_getattr>());
+        check_register(watdfs_rpc::mknod::bind<watdfs_mknod>());
+        check_register(watdfs_rpc::open::bind<watdfs_open>());
+        check_register(watdfs_rpc::openi::bind<watdfs_openi>());
+        check_register(watdfs_rpc::release::bind<watdfs_release>());
+        check_register(watdfs_rpc::read::bind<watdfs_read>());
+        check_register(watdfs_rpc::write::bind<watdfs_write>());
+        check_register(watdfs_rpc::readv::bind<watdfs_readv>());
+        check_register(watdfs_rpc::writev::bind<watdfs_writev>());
+        check_register(watdfs_rpc::readz::bind<watdfs_readz>());
+        check_register(watdfs_rpc::writez::bind<watdfs_writez>());
+        check_register(watdfs_rpc::features::bind<watdfs_features>());
+        check_register(watdfs_rpc::manifest::bind<watdfs_manifest>());
+        check_register(watdfs_rpc::bulk::bind<watdfs_bulk>());
+        check_register(watdfs_rpc::truncate::bind<watdfs_truncate>());
+        check_register(watdfs_rpc::fsync::bind<watdfs_fsync>());
+        check_register(watdfs_rpc::utimens::bind<watdfs_utimens>());
+        check_register(watdfs_rpc::batch::bind<watdfs_batch>());
+        check_register(watdfs_rpc::stats::bind<watdfs_stats>());
     } 
     catch ( RegisterError& err) { ret_code = err.code; }
 
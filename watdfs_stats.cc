@@ -0,0 +1,41 @@
+// Dumps the metrics of a running watdfs_server (SERVER_ADDRESS/SERVER_PORT) in the Prometheus
+// text format, see statsPrometheus. The lock_wait operation is the time lock rpcs spent waiting
+// for the path lock, bulk_transfer the transfers of the bulk channel.
+//
+// Usage: ./watdfs_stats 2>/dev/null
+
+#include "rpc.h"
+#include "stats.h"
+#include "utility.h"
+#include "watdfs_rpc.h"
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+INIT_LOG
+
+static int fetch(std::string *text) {
+    for (size_t capacity = 256 << 10; capacity <= BULK_MAX_LEN; capacity *= 2) {
+        std::vector<char> buf(capacity);
+        int ret = watdfs_rpc::stats::call(capacity, rpc_stub::bytes{buf.data(), capacity});
+        if (ret == -E2BIG) continue;
+        if (ret < 0) return ret;
+        text->assign(buf.data(), ret);
+        return 0;
+    }
+    return -E2BIG;
+}
+
+int main() {
+    int ret = rpcClientInit();
+    if (ret < 0) { fprintf(stderr, "rpcClientInit failed: %d\n", ret); return 1; }
+
+    std::string text;
+    ret = fetch(&text);
+    rpcClientDestroy();
+    if (ret < 0) { fprintf(stderr, "stats rpc failed: %d\n", ret); return 1; }
+
+    fputs(statsPrometheus(text, "watdfs_server").c_str(), stdout);
+    return 0;
+}